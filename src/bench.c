@@ -0,0 +1,461 @@
+/*
+  Copyright (c) 2024, Arka Mondal. All rights reserved.
+  Use of this source code is governed by a BSD-style license that
+  can be found in the LICENSE file.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "cpu.h"
+#include "bus.h"
+#include "dram.h"
+#include "util.h"
+
+#define BENCH_MEM_SIZE (16UL << 20)
+#define BENCH_BUFFER (DRAM_BASE + (1UL << 20))   // scratch memory handed to the kernels in a1
+#define BENCH_BATCH (1UL << 24)
+
+/*
+ * Guest kernels, pre-assembled RV64IMD so that no cross toolchain is needed.
+ * Each one runs a0 iterations over the scratch memory at a1 and ends with an
+ * ecall, the checksum of its work in a0.
+ */
+
+// integer ALU chain
+static const uint32_t bench_alu[] = {
+  0xfff3c2b7,   //   0: lui t0, 1048380
+  0x6ef2829b,   //   4: addiw t0, t0, 1775
+  0x00c29293,   //   8: slli t0, t0, 12
+  0x37328293,   //   c: addi t0, t0, 883
+  0x01029293,   //  10: slli t0, t0, 16
+  0xe9528293,   //  14: addi t0, t0, -363
+  0x00f29293,   //  18: slli t0, t0, 15
+  0xc1528293,   //  1c: addi t0, t0, -1003
+  0x00000313,   //  20: li t1, 0
+  0x00530333,   //  24: add t1, t1, t0
+  0x00a343b3,   //  28: xor t2, t1, a0
+  0x00d39e13,   //  2c: slli t3, t2, 13
+  0x0073de93,   //  30: srli t4, t2, 7
+  0x01de4333,   //  34: xor t1, t3, t4
+  0x04d30f1b,   //  38: addiw t5, t1, 77
+  0x41e30333,   //  3c: sub t1, t1, t5
+  0x00536fb3,   //  40: or t6, t1, t0
+  0x007fffb3,   //  44: and t6, t6, t2
+  0x01f30333,   //  48: add t1, t1, t6
+  0xfff50513,   //  4c: addi a0, a0, -1
+  0xfc051ae3,   //  50: bnez a0, 0x24
+  0x00030513,   //  54: mv a0, t1
+  0x00000073,   //  58: ecall
+};
+
+// 64 KiB copy with 64-bit loads and stores
+static const uint32_t bench_memcpy[] = {
+  0x00058413,   //   0: mv s0, a1
+  0x000102b7,   //   4: lui t0, 16
+  0x005584b3,   //   8: add s1, a1, t0
+  0x00002337,   //   c: lui t1, 2
+  0x00040393,   //  10: mv t2, s0
+  0x00012e37,   //  14: lui t3, 18
+  0x01c3b023,   //  18: sd t3, 0(t2)
+  0x005e1e93,   //  1c: slli t4, t3, 5
+  0x01de4e33,   //  20: xor t3, t3, t4
+  0x001e0e13,   //  24: addi t3, t3, 1
+  0x00838393,   //  28: addi t2, t2, 8
+  0xfff30313,   //  2c: addi t1, t1, -1
+  0xfe0314e3,   //  30: bnez t1, 0x18
+  0x00000613,   //  34: li a2, 0
+  0x00040393,   //  38: mv t2, s0
+  0x00048e13,   //  3c: mv t3, s1
+  0x00540eb3,   //  40: add t4, s0, t0
+  0x0003bf03,   //  44: ld t5, 0(t2)
+  0x0083bf83,   //  48: ld t6, 8(t2)
+  0x0103b683,   //  4c: ld a3, 16(t2)
+  0x0183b703,   //  50: ld a4, 24(t2)
+  0x01ee3023,   //  54: sd t5, 0(t3)
+  0x01fe3423,   //  58: sd t6, 8(t3)
+  0x00de3823,   //  5c: sd a3, 16(t3)
+  0x00ee3c23,   //  60: sd a4, 24(t3)
+  0x02038393,   //  64: addi t2, t2, 32
+  0x020e0e13,   //  68: addi t3, t3, 32
+  0xfdd3ece3,   //  6c: bltu t2, t4, 0x44
+  0xff8e3f03,   //  70: ld t5, -8(t3)
+  0x01e60633,   //  74: add a2, a2, t5
+  0x00c43023,   //  78: sd a2, 0(s0)
+  0xfff50513,   //  7c: addi a0, a0, -1
+  0xfa051ce3,   //  80: bnez a0, 0x38
+  0x00060513,   //  84: mv a0, a2
+  0x00000073,   //  88: ecall
+};
+
+// pointer chasing through a 512 KiB ring, four dependent loads per iteration
+static const uint32_t bench_pchase[] = {
+  0x000102b7,   //   0: lui t0, 16
+  0xfff28313,   //   4: addi t1, t0, -1
+  0x00001937,   //   8: lui s2, 1
+  0x0039091b,   //   c: addiw s2, s2, 3
+  0x00000e13,   //  10: li t3, 0
+  0x012e0eb3,   //  14: add t4, t3, s2
+  0x006efeb3,   //  18: and t4, t4, t1
+  0x003e9e93,   //  1c: slli t4, t4, 3
+  0x00be8eb3,   //  20: add t4, t4, a1
+  0x003e1f13,   //  24: slli t5, t3, 3
+  0x00bf0f33,   //  28: add t5, t5, a1
+  0x01df3023,   //  2c: sd t4, 0(t5)
+  0x001e0e13,   //  30: addi t3, t3, 1
+  0xfe5e10e3,   //  34: bne t3, t0, 0x14
+  0x00058393,   //  38: mv t2, a1
+  0x0003b383,   //  3c: ld t2, 0(t2)
+  0x0003b383,   //  40: ld t2, 0(t2)
+  0x0003b383,   //  44: ld t2, 0(t2)
+  0x0003b383,   //  48: ld t2, 0(t2)
+  0xfff50513,   //  4c: addi a0, a0, -1
+  0xfe0516e3,   //  50: bnez a0, 0x3c
+  0x40b38533,   //  54: sub a0, t2, a1
+  0x00000073,   //  58: ecall
+};
+
+// data-dependent branches driven by a xorshift generator
+static const uint32_t bench_branchy[] = {
+  0x002542b7,   //   0: lui t0, 596
+  0x5f52829b,   //   4: addiw t0, t0, 1525
+  0x00c29293,   //   8: slli t0, t0, 12
+  0x91528293,   //   c: addi t0, t0, -1771
+  0x00f29293,   //  10: slli t0, t0, 15
+  0xb6728293,   //  14: addi t0, t0, -1177
+  0x00d29293,   //  18: slli t0, t0, 13
+  0xd1d28293,   //  1c: addi t0, t0, -739
+  0x00000613,   //  20: li a2, 0
+  0x00800e13,   //  24: li t3, 8
+  0x00d29313,   //  28: slli t1, t0, 13
+  0x0062c2b3,   //  2c: xor t0, t0, t1
+  0x0072d313,   //  30: srli t1, t0, 7
+  0x0062c2b3,   //  34: xor t0, t0, t1
+  0x01129313,   //  38: slli t1, t0, 17
+  0x0062c2b3,   //  3c: xor t0, t0, t1
+  0x0012f393,   //  40: andi t2, t0, 1
+  0x00038463,   //  44: beqz t2, 0x4c
+  0x00360613,   //  48: addi a2, a2, 3
+  0x0022f393,   //  4c: andi t2, t0, 2
+  0x00039463,   //  50: bnez t2, 0x58
+  0x05564613,   //  54: xori a2, a2, 85
+  0x00c2f393,   //  58: andi t2, t0, 12
+  0x01c3e463,   //  5c: bltu t2, t3, 0x64
+  0x00161613,   //  60: slli a2, a2, 1
+  0x0002d463,   //  64: bgez t0, 0x6c
+  0x00165613,   //  68: srli a2, a2, 1
+  0xfff50513,   //  6c: addi a0, a0, -1
+  0xfa051ce3,   //  70: bnez a0, 0x28
+  0x00060513,   //  74: mv a0, a2
+  0x00000073,   //  78: ecall
+};
+
+// CoreMark-like mix: fill, insertion sort and CRC-16 of a 64-word array
+static const uint32_t bench_mix[] = {
+  0x00d412b7,   //   0: lui t0, 3393
+  0x3cd2829b,   //   4: addiw t0, t0, 973
+  0x00d29293,   //   8: slli t0, t0, 13
+  0x9fd28293,   //   c: addi t0, t0, -1539
+  0x00e29293,   //  10: slli t0, t0, 14
+  0xbcd28293,   //  14: addi t0, t0, -1075
+  0x00c29293,   //  18: slli t0, t0, 12
+  0x90928293,   //  1c: addi t0, t0, -1783
+  0x00010637,   //  20: lui a2, 16
+  0xfff60613,   //  24: addi a2, a2, -1
+  0x00001937,   //  28: lui s2, 1
+  0x02190913,   //  2c: addi s2, s2, 33
+  0x04000f93,   //  30: li t6, 64
+  0x00058313,   //  34: mv t1, a1
+  0x04000393,   //  38: li t2, 64
+  0x00d29e13,   //  3c: slli t3, t0, 13
+  0x01c2c2b3,   //  40: xor t0, t0, t3
+  0x0072de13,   //  44: srli t3, t0, 7
+  0x01c2c2b3,   //  48: xor t0, t0, t3
+  0x01129e13,   //  4c: slli t3, t0, 17
+  0x01c2c2b3,   //  50: xor t0, t0, t3
+  0x00532023,   //  54: sw t0, 0(t1)
+  0x00430313,   //  58: addi t1, t1, 4
+  0xfff38393,   //  5c: addi t2, t2, -1
+  0xfc039ee3,   //  60: bnez t2, 0x3c
+  0x00100313,   //  64: li t1, 1
+  0x00231393,   //  68: slli t2, t1, 2
+  0x00b383b3,   //  6c: add t2, t2, a1
+  0x0003ae03,   //  70: lw t3, 0(t2)
+  0x00038e93,   //  74: mv t4, t2
+  0x00be8c63,   //  78: beq t4, a1, 0x90
+  0xffceaf03,   //  7c: lw t5, -4(t4)
+  0x01ee5863,   //  80: bge t3, t5, 0x90
+  0x01eea023,   //  84: sw t5, 0(t4)
+  0xffce8e93,   //  88: addi t4, t4, -4
+  0xfedff06f,   //  8c: j 0x78
+  0x01cea023,   //  90: sw t3, 0(t4)
+  0x00130313,   //  94: addi t1, t1, 1
+  0xfdf318e3,   //  98: bne t1, t6, 0x68
+  0x00058313,   //  9c: mv t1, a1
+  0x04000393,   //  a0: li t2, 64
+  0x00034e03,   //  a4: lbu t3, 0(t1)
+  0x008e1e13,   //  a8: slli t3, t3, 8
+  0x01c64633,   //  ac: xor a2, a2, t3
+  0x00800e93,   //  b0: li t4, 8
+  0x00161613,   //  b4: slli a2, a2, 1
+  0x01065f13,   //  b8: srli t5, a2, 16
+  0x000f0863,   //  bc: beqz t5, 0xcc
+  0x01264633,   //  c0: xor a2, a2, s2
+  0x03061613,   //  c4: slli a2, a2, 48
+  0x03065613,   //  c8: srli a2, a2, 48
+  0xfffe8e93,   //  cc: addi t4, t4, -1
+  0xfe0e92e3,   //  d0: bnez t4, 0xb4
+  0x00430313,   //  d4: addi t1, t1, 4
+  0xfff38393,   //  d8: addi t2, t2, -1
+  0xfc0394e3,   //  dc: bnez t2, 0xa4
+  0xfff50513,   //  e0: addi a0, a0, -1
+  0xf40518e3,   //  e4: bnez a0, 0x34
+  0x00060513,   //  e8: mv a0, a2
+  0x00000073,   //  ec: ecall
+};
+
+// multiplicative hash: full 128-bit products and a remainder per round
+static const uint32_t bench_mulhash[] = {
+  0xfff3c2b7,   //   0: lui t0, 1048380
+  0x6ef2829b,   //   4: addiw t0, t0, 1775
+  0x00c29293,   //   8: slli t0, t0, 12
+  0x37328293,   //   c: addi t0, t0, 883
+  0x01029293,   //  10: slli t0, t0, 16
+  0xe9528293,   //  14: addi t0, t0, -363
+  0x00f29293,   //  18: slli t0, t0, 15
+  0xc1528293,   //  1c: addi t0, t0, -1003
+  0xff40f337,   //  20: lui t1, 1045519
+  0xc3b3031b,   //  24: addiw t1, t1, -965
+  0x00c31313,   //  28: slli t1, t1, 12
+  0xc8f30313,   //  2c: addi t1, t1, -881
+  0x00e31313,   //  30: slli t1, t1, 14
+  0x5eb30313,   //  34: addi t1, t1, 1515
+  0x00d31313,   //  38: slli t1, t1, 13
+  0x42f30313,   //  3c: addi t1, t1, 1071
+  0x00000613,   //  40: li a2, 0
+  0x00a643b3,   //  44: xor t2, a2, a0
+  0x0263be33,   //  48: mulhu t3, t2, t1
+  0x02638eb3,   //  4c: mul t4, t2, t1
+  0x01de4633,   //  50: xor a2, t3, t4
+  0x02561f33,   //  54: mulh t5, a2, t0
+  0x01e60633,   //  58: add a2, a2, t5
+  0x02a67fb3,   //  5c: remu t6, a2, a0
+  0x01f60633,   //  60: add a2, a2, t6
+  0xfff50513,   //  64: addi a0, a0, -1
+  0xfc051ee3,   //  68: bnez a0, 0x44
+  0x00060513,   //  6c: mv a0, a2
+  0x00000073,   //  70: ecall
+};
+
+// floating point: a fused multiply-add, a square root and a conversion per round
+static const uint32_t bench_fpsum[] = {
+  0x3ff00293,   //   0: li t0, 1023
+  0x03429293,   //   4: slli t0, t0, 52
+  0xf2028053,   //   8: fmv.d.x f0, t0
+  0x00300313,   //   c: li t1, 3
+  0xd2237153,   //  10: fcvt.d.l f2, t1
+  0x1a2071d3,   //  14: fdiv.d f3, f0, f2
+  0xf2000253,   //  18: fmv.d.x f4, zero
+  0x00000e13,   //  1c: li t3, 0
+  0xd22572d3,   //  20: fcvt.d.l f5, a0
+  0x2232f243,   //  24: fmadd.d f4, f5, f3, f4
+  0x12327353,   //  28: fmul.d f6, f4, f3
+  0x5a037353,   //  2c: fsqrt.d f6, f6
+  0x02627253,   //  30: fadd.d f4, f4, f6
+  0xc22313d3,   //  34: fcvt.l.d t2, f6, rtz
+  0x007e0e33,   //  38: add t3, t3, t2
+  0xfff50513,   //  3c: addi a0, a0, -1
+  0xfe0510e3,   //  40: bnez a0, 0x20
+  0xe2020553,   //  44: fmv.x.d a0, f4
+  0x01c54533,   //  48: xor a0, a0, t3
+  0x00000073,   //  4c: ecall
+};
+
+struct bench_kernel {
+  const char * name;
+  const uint32_t * code;
+  size_t size;                        // in words
+  uint64_t iterations;                // at scale 1, about 50 million instructions
+};
+
+#define BENCH_KERNEL(name, iterations) { #name, bench_##name, sizeof(bench_##name) / 4, iterations }
+
+static const struct bench_kernel bench_kernels[] = {
+  BENCH_KERNEL(alu, 4000000),
+  BENCH_KERNEL(memcpy, 2000),
+  BENCH_KERNEL(pchase, 8000000),
+  BENCH_KERNEL(branchy, 2500000),
+  BENCH_KERNEL(mix, 4000),
+  BENCH_KERNEL(mulhash, 5000000),
+  BENCH_KERNEL(fpsum, 5000000)
+};
+
+#define BENCH_NKERNELS (sizeof(bench_kernels) / sizeof(bench_kernels[0]))
+
+struct bench_result {
+  uint64_t instructions;
+  uint64_t checksum;
+  double seconds;
+  uint64_t cycles;                    // host timestamp counter ticks, 0 if there is none
+};
+
+static inline uint64_t bench_cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+  return __builtin_ia32_rdtsc();
+#else
+  return 0;
+#endif
+}
+
+static inline double bench_seconds(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+ * Run a kernel once on a fresh hart. Returns -1 if it does not end with the
+ * expected ecall.
+ */
+static int bench_run(const struct bench_kernel * const restrict kernel, uint64_t iterations,
+                     struct bus * const restrict bus, struct bench_result * const restrict result)
+{
+  struct riscv_cpu cpu;
+  uint64_t cycles;
+  double start;
+  size_t i;
+  int status;
+
+  for (i = 0; i < kernel->size; i++)
+    dram_store32(bus->dram, DRAM_BASE + 4 * i, kernel->code[i]);
+
+  if (riscv_cpu_init(&cpu, bus) != 0)
+    return -1;
+
+  cpu.registers[x10] = iterations;
+  cpu.registers[x11] = BENCH_BUFFER;
+
+  start = bench_seconds();
+  cycles = bench_cycles();
+
+  do
+    status = riscv_cpu_run(&cpu, BENCH_BATCH);
+  while (status == RISCV_RUN_BUDGET || status == RISCV_RUN_WFI);
+
+  result->cycles = bench_cycles() - cycles;
+  result->seconds = bench_seconds() - start;
+  result->instructions = cpu.instret;
+  result->checksum = cpu.registers[x10];
+
+  riscv_cpu_deinit(&cpu);
+
+  return (status == RISCV_RUN_TRAP && cpu.trap_cause == RISCV_EXC_ECALL_M) ? 0 : -1;
+}
+
+/*
+ * Print one CSV line per kernel: the guest instruction count, the best
+ * host time of the runs, guest MIPS, host timestamp ticks per guest
+ * instruction and the kernel's checksum, which has to be the same for every
+ * build.
+ */
+int main(int argc, char * argv[])
+{
+  const struct bench_kernel * kernel;
+  struct bench_result result, best;
+  struct bus bus;
+  struct dram mem;
+  uint64_t runs = 3, scale = 1, run;
+  size_t i;
+  int opt, arg, status = EXIT_SUCCESS;
+
+  while ((opt = getopt(argc, argv, "r:s:")) != -1)
+  {
+    switch (opt)
+    {
+      case 'r':
+        if (parse_size(optarg, &runs) != 0 || runs == 0)
+          goto usage;
+        break;
+
+      case 's':
+        if (parse_size(optarg, &scale) != 0 || scale == 0)
+          goto usage;
+        break;
+
+      default:
+        goto usage;
+    }
+  }
+
+  for (arg = optind; arg < argc; arg++)
+  {
+    for (i = 0; i < BENCH_NKERNELS && strcmp(argv[arg], bench_kernels[i].name) != 0; i++)
+      ;
+
+    if (i == BENCH_NKERNELS)
+    {
+      fprintf(stderr, "unknown kernel %s\n", argv[arg]);
+      goto usage;
+    }
+  }
+
+  if (dram_init(&mem, NULL, BENCH_MEM_SIZE, DRAM_BACKING_DEFAULT) != 0)
+  {
+    fprintf(stderr, "cannot reserve %lu bytes of guest memory\n", BENCH_MEM_SIZE);
+    return EXIT_FAILURE;
+  }
+
+  bus_init(&bus, &mem);
+
+  printf("kernel,instructions,seconds,mips,cycles_per_inst,checksum\n");
+
+  for (i = 0; i < BENCH_NKERNELS; i++)
+  {
+    kernel = &bench_kernels[i];
+
+    // only the kernels named on the command line, all of them by default
+    for (arg = optind; arg < argc && strcmp(argv[arg], kernel->name) != 0; arg++)
+      ;
+    if (optind < argc && arg == argc)
+      continue;
+
+    memset(&best, 0x0, sizeof(best));
+
+    for (run = 0; run < runs; run++)
+    {
+      if (bench_run(kernel, kernel->iterations * scale, &bus, &result) != 0)
+      {
+        fprintf(stderr, "%s: the kernel did not finish with an ecall\n", kernel->name);
+        status = EXIT_FAILURE;
+        break;
+      }
+
+      if (run == 0 || result.seconds < best.seconds)
+        best = result;
+    }
+
+    if (run != runs)
+      continue;
+
+    printf("%s,%lu,%.6f,%.2f,", kernel->name, best.instructions, best.seconds,
+           best.instructions / best.seconds / 1e6);
+    if (best.cycles != 0)
+      printf("%.3f", (double) best.cycles / best.instructions);
+    printf(",%#lx\n", best.checksum);
+    fflush(stdout);
+  }
+
+  bus_deinit(&bus);
+  dram_deinit(&mem);
+
+  return status;
+
+usage:
+  fprintf(stderr, "usage: %s [-r runs] [-s scale] [kernel...]\n", argv[0]);
+  return EXIT_FAILURE;
+}
@@ -0,0 +1,344 @@
+/*
+  Copyright (c) 2024, Arka Mondal. All rights reserved.
+  Use of this source code is governed by a BSD-style license that
+  can be found in the LICENSE file.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include "cpu.h"
+#include "bus.h"
+#include "block.h"
+#include "csr.h"
+
+// dram_size is the size of guest memory, whose pages are tracked for decoded code
+int riscv_block_cache_init(struct riscv_block_cache * const restrict cache, uint64_t dram_size)
+{
+  if (cache == NULL)
+    return -1;
+
+  memset(cache, 0x0, sizeof(struct riscv_block_cache));
+
+  cache->npages = dram_size >> RISCV_PAGE_SHIFT;
+  cache->code = calloc((cache->npages + 63) / 64, sizeof(uint64_t));
+  if (cache->code == NULL)
+    return -1;
+
+#ifdef RISCV_JIT
+  // without a code cache every block is interpreted
+  riscv_jit_init(&cache->jit);
+#endif
+
+  return 0;
+}
+
+int riscv_block_cache_deinit(struct riscv_block_cache * const restrict cache)
+{
+  if (cache == NULL)
+    return -1;
+
+#ifdef RISCV_JIT
+  riscv_jit_deinit(&cache->jit);
+#endif
+
+  free(cache->code);
+  cache->code = NULL;
+
+  return 0;
+}
+
+int riscv_block_cache_flush(struct riscv_block_cache * const restrict cache)
+{
+  size_t i;
+
+  if (cache == NULL)
+    return -1;
+
+  for (i = 0; i < RISCV_BLOCK_CACHE_SIZE; i++)
+    cache->blocks[i].count = 0;
+
+  memset(cache->code, 0x0, (cache->npages + 63) / 64 * sizeof(uint64_t));
+
+#ifdef RISCV_JIT
+  riscv_jit_flush(&cache->jit);
+#endif
+
+  return 0;
+}
+
+/*
+ * Drop the blocks decoded from the DRAM page, which is about to be written,
+ * along with their compiled code. The other pages keep theirs; this one is
+ * no code page any more until a block is decoded from it again.
+ */
+void riscv_block_cache_drop_page(struct riscv_block_cache * const restrict cache, uint64_t page)
+{
+  struct riscv_block * block;
+  size_t i;
+
+  for (i = 0; i < RISCV_BLOCK_CACHE_SIZE; i++)
+  {
+    block = &cache->blocks[i];
+    if (block->page[0] == page || block->page[1] == page)
+      block->count = 0;
+  }
+
+  cache->code[page >> 6] &= ~(1UL << (page & 63));
+
+#ifdef RISCV_JIT
+  riscv_jit_drop_page(&cache->jit, page);
+#endif
+}
+
+/*
+ * The translations may have changed. Nothing is thrown away, every block has
+ * its pages checked before it runs again (riscv_block_current), and compiled
+ * blocks are unchained since their jumps to each other skip that check.
+ * Once the epoch wraps around, the blocks are flushed instead.
+ */
+void riscv_block_cache_remap(struct riscv_block_cache * const restrict cache)
+{
+  if (++cache->epoch == 0)
+  {
+    riscv_block_cache_flush(cache);
+    return;
+  }
+
+#ifdef RISCV_JIT
+  riscv_jit_unchain(&cache->jit);
+#endif
+}
+
+// the DRAM page vaddr is fetched from with the current translations, filling the TLB
+static uint64_t riscv_block_fetch_page(struct riscv_cpu * const restrict cpu, uint64_t vaddr)
+{
+  uint64_t inst, page;
+
+  if (riscv_mmu_fetch(cpu, vaddr, &inst) != 0 || riscv_mmu_fetch_page(cpu, vaddr, &page) != 0)
+    return RISCV_BLOCK_NO_PAGE;
+
+  return page;
+}
+
+#ifdef RISCV_JIT
+// take the code compiled from the pages of the block, current from now on like the block
+void riscv_block_link(struct riscv_block_cache * const restrict cache,
+                      struct riscv_block * const restrict block)
+{
+  struct riscv_jit_entry * entry;
+
+  entry = riscv_jit_lookup(&cache->jit, block->pc, block->mode, block->page);
+  if (entry == NULL)
+    return;
+
+  entry->epoch = cache->epoch;
+  block->code = entry->code;
+}
+#endif
+
+// mark the DRAM page of vaddr as holding the block, returns the page or RISCV_BLOCK_NO_PAGE
+static uint32_t riscv_block_page(struct riscv_block_cache * const restrict cache,
+                                 struct riscv_cpu * const restrict cpu, uint64_t vaddr)
+{
+  uint64_t page;
+
+  if (riscv_mmu_fetch_page(cpu, vaddr, &page) != 0 || page >= cache->npages)
+    return RISCV_BLOCK_NO_PAGE;
+
+  if (!riscv_block_cache_has_code(cache, page))
+  {
+    cache->code[page >> 6] |= 1UL << (page & 63);
+    riscv_mmu_protect(cpu, page);
+  }
+
+  return (uint32_t) page;
+}
+
+/*
+ * Whether the block is a loop that can only be waiting for something: it
+ * branches back to its own start, writes nothing but registers, and every
+ * register it reads was either set before the loop or already written in
+ * the same iteration. Nothing carries over from one iteration to the next,
+ * so it goes around until a load or a counter read gives something new:
+ *
+ *   1: lw t0, 0(a0)              1: csrr t0, time
+ *      beqz t0, 1b                  bltu t0, t1, 1b
+ */
+static uint8_t riscv_block_idle(const struct riscv_block * const restrict block)
+{
+  const struct riscv_uop * uop, * last = &block->uops[block->count - 1];
+  uint32_t written = 0, defined = 0, sources;
+  uint64_t offset = 0;
+
+  if (!(last->op >= RISCV_UOP_beq && last->op <= RISCV_UOP_bgeu)
+      && !(last->op == RISCV_UOP_jal && last->rd == 0))
+    return 0;
+
+  // the rd field of a branch is part of its offset
+  for (uop = block->uops; uop < last; uop++)
+  {
+    written |= 1U << uop->rd;
+    offset += uop->len;
+
+    // a fused AUIPC+load writes the AUIPC's register as well
+    if (uop->op >= RISCV_UOP_auipc_lb && uop->op <= RISCV_UOP_auipc_lwu)
+      written |= 1U << uop->rs1;
+  }
+
+  if (offset + last->imm != 0)
+    return 0;
+
+  for (uop = block->uops; uop <= last; uop++)
+  {
+    if ((uop->op >= RISCV_UOP_addi && uop->op <= RISCV_UOP_sraiw)
+        || (uop->op >= RISCV_UOP_lb && uop->op <= RISCV_UOP_lwu) || uop->op == RISCV_UOP_slli_srli)
+      sources = 1U << uop->rs1;
+    else if ((uop->op >= RISCV_UOP_add && uop->op <= RISCV_UOP_remuw)
+             || (uop->op >= RISCV_UOP_beq && uop->op <= RISCV_UOP_bgeu))
+      sources = (1U << uop->rs1) | (1U << uop->rs2);
+    else if (uop->op == RISCV_UOP_lui || uop->op == RISCV_UOP_auipc || uop->op == RISCV_UOP_jal
+             || uop->op == RISCV_UOP_fence || uop->op == RISCV_UOP_lui_addi
+             || (uop->op >= RISCV_UOP_auipc_lb && uop->op <= RISCV_UOP_auipc_lwu))
+      sources = 0;
+    else if ((uop->op == RISCV_UOP_csrrs || uop->op == RISCV_UOP_csrrc || uop->op == RISCV_UOP_csrrsi
+              || uop->op == RISCV_UOP_csrrci) && uop->rs1 == 0)
+      sources = 0;                      // csr reads: counters, status
+    else
+      return 0;
+
+    if (sources & written & ~defined & ~0x1U)
+      return 0;
+
+    if (uop != last)
+      defined |= (1U << uop->rd) | ((uop->op >= RISCV_UOP_auipc_lb && uop->op <= RISCV_UOP_auipc_lwu)
+                                    ? 1U << uop->rs1 : 0);
+  }
+
+  return 1;
+}
+
+/*
+ * Whether the micro-op reads or writes a counter. The hart only adds the
+ * instructions of a block to instret once the block is done, and compiled
+ * code only once it returns to the dispatcher, so an access to a counter
+ * comes first in a block that stays interpreted: everything before it has
+ * been counted by then.
+ */
+static int riscv_block_counter(const struct riscv_uop * const restrict uop)
+{
+  if (uop->op < RISCV_UOP_csrrw || uop->op > RISCV_UOP_csrrci)
+    return 0;
+
+  return uop->imm == CSR_CYCLE || uop->imm == CSR_TIME || uop->imm == CSR_INSTRET
+         || uop->imm == CSR_MCYCLE || uop->imm == CSR_MINSTRET;
+}
+
+/*
+ * Decode the straight-line run starting at pc into its cache slot. The block
+ * ends after the first instruction that may change the control flow, before
+ * an access to a counter, at the end of the page, or once RISCV_BLOCK_MAX
+ * micro-ops have been decoded. An instruction the decoder fuses with the one
+ * before it takes no micro-op of its own, except in trace builds, which log
+ * every instruction on its own.
+ */
+struct riscv_block * riscv_block_translate(struct riscv_block_cache * const restrict cache,
+                                            struct riscv_cpu * const restrict cpu, uint64_t pc)
+{
+  struct riscv_block * block;
+  struct riscv_uop * uop;
+  uint64_t addr, inst;
+  int cause, end;
+
+  if (cache == NULL || cpu == NULL)
+    return NULL;
+
+  block = &cache->blocks[riscv_block_index(pc)];
+  block->pc = pc;
+  block->mode = cpu->fetch_mode;
+  block->count = 0;
+  block->insts = 0;
+  block->hits = 0;
+  block->epoch = cache->epoch;
+  block->code = NULL;
+
+  for (addr = pc; block->count < RISCV_BLOCK_MAX; )
+  {
+    cause = riscv_mmu_fetch(cpu, addr, &inst);
+    if (cause != 0)
+    {
+      // inst is the address that faulted, the second half of an instruction crossing a page
+      if (block->count == 0)
+      {
+        riscv_decode_exception(cause, inst, &block->uops[block->count++]);
+        block->insts++;
+      }
+
+      break;                        // leave the faulting fetch to its own block
+    }
+
+    uop = &block->uops[block->count++];
+    end = riscv_decode(inst, uop);
+
+    if (block->count >= 2 && riscv_block_counter(uop))
+    {
+      block->count--;
+      break;                        // the counter access starts the next block
+    }
+
+    addr += uop->len;
+    block->insts++;
+
+#ifndef RISCV_TRACE
+    if (block->count >= 2 && riscv_decode_fuse(uop - 1, uop))
+      block->count--;
+#endif
+
+    // an instruction may cross into the next page, the one after it starts a new block
+    if (end || ((addr ^ pc) & ~(RISCV_PAGE_SIZE - 1)) != 0)
+      break;
+  }
+
+  block->idle = riscv_block_idle(block);
+  block->counter = riscv_block_counter(&block->uops[0]);
+
+  // nothing was fetched if the block only raises the fault of its first instruction
+  block->page[0] = block->page[1] = RISCV_BLOCK_NO_PAGE;
+  block->cross = ((addr - 1) ^ pc) >= RISCV_PAGE_SIZE;
+  if (addr != pc)
+  {
+    block->page[0] = riscv_block_page(cache, cpu, pc);
+    block->page[1] = riscv_block_page(cache, cpu, addr - 1);
+  }
+
+#ifdef RISCV_JIT
+  riscv_block_link(cache, block);
+#endif
+
+  return block;
+}
+
+/*
+ * Whether the block, from an earlier epoch, still holds what its pc fetches:
+ * its first and last byte translate to the pages it was decoded from. If so
+ * it and its compiled code count as current again. A block that faulted or
+ * came from outside DRAM is decoded anew.
+ */
+int riscv_block_current(struct riscv_block_cache * const restrict cache,
+                        struct riscv_cpu * const restrict cpu, struct riscv_block * const restrict block)
+{
+  uint64_t next = (block->pc | (RISCV_PAGE_SIZE - 1)) + 1;
+
+  if (block->page[0] == RISCV_BLOCK_NO_PAGE || block->page[1] == RISCV_BLOCK_NO_PAGE)
+    return 0;
+
+  if (riscv_block_fetch_page(cpu, block->pc) != block->page[0]
+      || riscv_block_fetch_page(cpu, block->cross ? next : block->pc) != block->page[1])
+    return 0;
+
+  block->epoch = cache->epoch;
+#ifdef RISCV_JIT
+  riscv_block_link(cache, block);
+#endif
+
+  return 1;
+}
@@ -0,0 +1,137 @@
+/*
+  Copyright (c) 2024, Arka Mondal. All rights reserved.
+  Use of this source code is governed by a BSD-style license that
+  can be found in the LICENSE file.
+*/
+
+#ifndef _RISCVEMU_BLOCK_H
+#define _RISCVEMU_BLOCK_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "decode.h"
+#include "jit.h"
+
+#define RISCV_BLOCK_MAX 32                // max instructions in a block
+#define RISCV_BLOCK_CACHE_SIZE 1024       // number of blocks, power of 2
+#define RISCV_BLOCK_NO_PAGE UINT32_MAX    // code fetched from outside guest DRAM
+
+struct riscv_cpu;
+
+// a straight-line run of decoded instructions starting at pc
+struct riscv_block {
+  uint64_t pc;
+  uint32_t count;                         // micro-ops, 0 if the slot is empty
+  uint32_t insts;                         // instructions, more than count if pairs were fused
+  uint8_t mode;                           // translation context pc was fetched in
+  uint8_t idle;                           // a loop that only waits, see riscv_block_translate
+  uint8_t counter;                        // starts with a counter access, never compiled
+  uint8_t cross;                          // its last instruction reaches into the next page
+  uint32_t epoch;                         // of the cache its pages were last found current in
+  uint32_t hits;                          // runs so far, counts towards compilation
+  uint32_t page[2];                       // DRAM pages of its first and last byte
+  const uint8_t * code;                   // compiled block, NULL if not compiled
+  struct riscv_uop uops[RISCV_BLOCK_MAX];
+};
+
+// direct-mapped cache of decoded blocks, keyed by guest pc
+struct riscv_block_cache {
+  struct riscv_block blocks[RISCV_BLOCK_CACHE_SIZE];
+
+  /*
+   * DRAM pages blocks were decoded from, one bit per page. Stores to them
+   * never get a store TLB entry (riscv_mmu_protect), so the slow path sees
+   * each one and drops the blocks of the page before it is written.
+   */
+  uint64_t * code;
+  uint64_t npages;
+
+  /*
+   * Bumped whenever the translations may have changed (sfence.vma, a satp
+   * write). Blocks are keyed by virtual pc, one from an earlier epoch has
+   * its pages checked against the translations before it runs again.
+   */
+  uint32_t epoch;
+
+  struct riscv_jit jit;                   // host code of the hot blocks, unused without RISCV_JIT
+};
+
+int riscv_block_cache_init(struct riscv_block_cache * const restrict, uint64_t);
+int riscv_block_cache_deinit(struct riscv_block_cache * const restrict);
+int riscv_block_cache_flush(struct riscv_block_cache * const restrict);
+void riscv_block_cache_drop_page(struct riscv_block_cache * const restrict, uint64_t);
+void riscv_block_cache_remap(struct riscv_block_cache * const restrict);
+void riscv_block_link(struct riscv_block_cache * const restrict, struct riscv_block * const restrict);
+int riscv_block_current(struct riscv_block_cache * const restrict, struct riscv_cpu * const restrict,
+                        struct riscv_block * const restrict);
+struct riscv_block * riscv_block_translate(struct riscv_block_cache * const restrict,
+                                            struct riscv_cpu * const restrict, uint64_t);
+
+static inline int riscv_block_cache_has_code(const struct riscv_block_cache * const restrict cache,
+                                             uint64_t page)
+{
+  return (cache->code[page >> 6] >> (page & 63)) & 0x1;
+}
+
+// drop the blocks decoded from the DRAM page, about to be written, if there are any
+static inline void riscv_block_cache_invalidate(struct riscv_block_cache * const restrict cache,
+                                                uint64_t page)
+{
+  if (riscv_block_cache_has_code(cache, page))
+    riscv_block_cache_drop_page(cache, page);
+}
+
+/*
+ * The cache slot of a block. 4-byte aligned starts are spread over every
+ * slot, bit 1 of a 2-byte aligned one only flips the lowest bit of the index.
+ */
+static inline uint64_t riscv_block_index(uint64_t pc)
+{
+  return ((pc >> 2) ^ (pc >> 1)) & (RISCV_BLOCK_CACHE_SIZE - 1);
+}
+
+static inline struct riscv_block * riscv_block_lookup(struct riscv_block_cache * const restrict cache,
+                                                      uint64_t pc, uint8_t mode)
+{
+  struct riscv_block * block = &cache->blocks[riscv_block_index(pc)];
+
+  return (block->pc == pc && block->mode == mode && block->count != 0) ? block : NULL;
+}
+
+// instructions the first n micro-ops of the block stand for
+static inline uint64_t riscv_block_insts(const struct riscv_block * const restrict block, uint64_t n)
+{
+  uint64_t i, insts = n;
+
+  if (n == block->count)
+    return block->insts;
+
+  if (block->insts != block->count)
+    for (i = 0; i < n; i++)
+      insts += riscv_uop_fused(block->uops[i].op);
+
+  return insts;
+}
+
+/*
+ * The micro-ops from the start of the block that run in budget instructions.
+ * At least one, a fused pair may run on the last instruction of the budget.
+ */
+static inline uint64_t riscv_block_fit(const struct riscv_block * const restrict block, uint64_t budget)
+{
+  uint64_t n, insts;
+
+  if (block->insts <= budget)
+    return block->count;
+
+  for (n = 0, insts = 0; n < block->count; n++)
+  {
+    insts += 1 + riscv_uop_fused(block->uops[n].op);
+    if (insts > budget)
+      break;
+  }
+
+  return (n != 0) ? n : 1;
+}
+
+#endif /* _RISCVEMU_BLOCK_H */
@@ -4,6 +4,8 @@
   can be found in the LICENSE file.
 */
 
+#include <stdlib.h>
+#include <string.h>
 #include "cpu.h"
 #include "bus.h"
 #include "dram.h"
@@ -13,14 +15,99 @@ int bus_init(struct bus * const restrict bus, struct dram * const dram)
   if (bus == NULL || dram == NULL)
     return -1;
 
+  memset(bus, 0x0, sizeof(struct bus));
   bus->dram = dram;
 
   return 0;
 }
 
+// the device covering addr, or NULL
+static inline const struct bus_device * bus_device_at(const struct bus * const restrict bus,
+                                                        uint64_t addr)
+{
+  const uint8_t * chunk;
+  uint8_t index;
+
+  if (addr >= DRAM_BASE)
+    return NULL;
+
+  chunk = bus->mmio[addr >> BUS_CHUNK_SHIFT];
+  if (chunk == NULL)
+    return NULL;
+
+  index = chunk[(addr >> BUS_PAGE_SHIFT) & (BUS_CHUNK_PAGES - 1)];
+  if (index == 0)
+    return NULL;
+
+  return &bus->devices[index - 1];
+}
+
+/*
+ * Attach a device to the bus. Its range is rounded up to whole pages and
+ * must not overlap DRAM or any device registered before.
+ */
+int bus_register(struct bus * const restrict bus, const struct bus_device * device)
+{
+  uint64_t addr, end;
+  uint8_t ** chunk;
+
+  if (bus == NULL || device == NULL || bus->ndevices == BUS_MAX_DEVICES
+      || device->size == 0 || (device->base & ((1UL << BUS_PAGE_SHIFT) - 1)) != 0
+      || device->base >= DRAM_BASE || device->size > DRAM_BASE - device->base)
+    return -1;
+
+  end = device->base + device->size;
+
+  for (addr = device->base; addr < end; addr += 1UL << BUS_PAGE_SHIFT)
+  {
+    if (bus_device_at(bus, addr) != NULL)
+      return -1;
+  }
+
+  for (addr = device->base; addr < end; addr += 1UL << BUS_PAGE_SHIFT)
+  {
+    chunk = &bus->mmio[addr >> BUS_CHUNK_SHIFT];
+    if (*chunk == NULL)
+    {
+      *chunk = calloc(BUS_CHUNK_PAGES, sizeof(uint8_t));
+      if (*chunk == NULL)
+        return -1;
+    }
+
+    (*chunk)[(addr >> BUS_PAGE_SHIFT) & (BUS_CHUNK_PAGES - 1)] = bus->ndevices + 1;
+  }
+
+  bus->devices[bus->ndevices++] = *device;
+
+  return 0;
+}
+
+// device access with the width in bytes, returns -1 if nothing handles addr
+int bus_mmio_load(const struct bus * const restrict bus, uint64_t addr, uint64_t size,
+                  uint64_t * const restrict value)
+{
+  const struct bus_device * device = bus_device_at(bus, addr);
+
+  if (device == NULL || device->load == NULL || addr - device->base > device->size - size)
+    return -1;
+
+  return device->load(device->opaque, addr - device->base, size, value);
+}
+
+int bus_mmio_store(const struct bus * const restrict bus, uint64_t addr, uint64_t size,
+                    uint64_t value)
+{
+  const struct bus_device * device = bus_device_at(bus, addr);
+
+  if (device == NULL || device->store == NULL || addr - device->base > device->size - size)
+    return -1;
+
+  return device->store(device->opaque, addr - device->base, size, value);
+}
+
 uint64_t bus_load(const struct bus * const restrict bus, uint64_t addr, uint64_t size)
 {
-  extern struct riscv_cpu * this_cpu;
+  uint64_t value;
 
   if (bus == NULL)
   {
@@ -28,6 +115,17 @@ uint64_t bus_load(const struct bus * const restrict bus, uint64_t addr, uint64_t
     return (uint64_t) -1;
   }
 
+  if (addr < DRAM_BASE)
+  {
+    if (bus_mmio_load(bus, addr, size / 8, &value) != 0)
+    {
+      this_cpu->panic = 0x1;
+      return (uint64_t) -1;
+    }
+
+    return value;
+  }
+
   return dram_load(bus->dram, addr, size);
 }
 
@@ -36,15 +134,27 @@ int bus_store(struct bus * const restrict bus, uint64_t addr, uint64_t size, uin
   if (bus == NULL)
     return -1;
 
+  if (addr < DRAM_BASE)
+    return bus_mmio_store(bus, addr, size / 8, value);
+
   return dram_store(bus->dram, addr, size, value);
 }
 
 int bus_deinit(struct bus * const restrict bus)
 {
+  size_t i;
+
   if (bus == NULL)
     return -1;
 
+  for (i = 0; i < BUS_DIR_SIZE; i++)
+  {
+    free(bus->mmio[i]);
+    bus->mmio[i] = NULL;
+  }
+
   bus->dram = NULL;
+  bus->ndevices = 0;
 
   return 0;
 }
@@ -9,14 +9,126 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include "dram.h"
+
+/*
+ * Devices live below DRAM_BASE. Their address space is looked up one page at
+ * a time through a two-level table: a directory of 2 MiB chunks, each one
+ * pointing at a lazily allocated array that gives the device of every page.
+ */
+#define BUS_PAGE_SHIFT 12
+#define BUS_CHUNK_SHIFT 21
+#define BUS_CHUNK_PAGES (1UL << (BUS_CHUNK_SHIFT - BUS_PAGE_SHIFT))
+#define BUS_DIR_SIZE (DRAM_BASE >> BUS_CHUNK_SHIFT)
+#define BUS_MAX_DEVICES 32
+
+/*
+ * A memory-mapped device. offset is relative to base and size is the access
+ * width in bytes. The callbacks return -1 to make the access fault.
+ * A device with state that snapshots have to capture sets state_size and
+ * copies that many bytes out with save and back in with restore.
+ */
+struct bus_device {
+  const char * name;
+  uint64_t base;                      // page aligned
+  uint64_t size;
+  void * opaque;
+  int (*load)(void *, uint64_t offset, uint64_t size, uint64_t * value);
+  int (*store)(void *, uint64_t offset, uint64_t size, uint64_t value);
+  size_t state_size;
+  void (*save)(void *, void * state);
+  void (*restore)(void *, const void * state);
+};
 
 struct bus {
   struct dram * dram;
+  uint8_t * mmio[BUS_DIR_SIZE];       // device index + 1 of each page, 0 if none
+  struct bus_device devices[BUS_MAX_DEVICES];
+  size_t ndevices;
+
+  // no hart on the bus reads its clock below this, see riscv_cpu_clock
+  uint64_t time_floor;
 };
 
 int bus_init(struct bus * const restrict, struct dram * const);
 int bus_deinit(struct bus * const restrict);
+int bus_register(struct bus * const restrict, const struct bus_device *);
 uint64_t bus_load(const struct bus * const restrict, uint64_t, uint64_t);
 int bus_store(struct bus * const restrict, uint64_t, uint64_t, uint64_t);
+int bus_mmio_load(const struct bus * const restrict, uint64_t, uint64_t, uint64_t * const restrict);
+int bus_mmio_store(const struct bus * const restrict, uint64_t, uint64_t, uint64_t);
+
+/*
+ * Width-specialized fast path, returns -1 if nothing is mapped at addr.
+ * DRAM is tried first and device dispatch is only reached when that fails,
+ * so ordinary memory accesses never look at the device table.
+ */
+static inline int bus_load8(const struct bus * const restrict bus, uint64_t addr,
+                            uint64_t * const restrict value)
+{
+  if (__builtin_expect(dram_load8(bus->dram, addr, value) == 0, 1))
+    return 0;
+
+  return bus_mmio_load(bus, addr, 1, value);
+}
+
+static inline int bus_load16(const struct bus * const restrict bus, uint64_t addr,
+                              uint64_t * const restrict value)
+{
+  if (__builtin_expect(dram_load16(bus->dram, addr, value) == 0, 1))
+    return 0;
+
+  return bus_mmio_load(bus, addr, 2, value);
+}
+
+static inline int bus_load32(const struct bus * const restrict bus, uint64_t addr,
+                              uint64_t * const restrict value)
+{
+  if (__builtin_expect(dram_load32(bus->dram, addr, value) == 0, 1))
+    return 0;
+
+  return bus_mmio_load(bus, addr, 4, value);
+}
+
+static inline int bus_load64(const struct bus * const restrict bus, uint64_t addr,
+                              uint64_t * const restrict value)
+{
+  if (__builtin_expect(dram_load64(bus->dram, addr, value) == 0, 1))
+    return 0;
+
+  return bus_mmio_load(bus, addr, 8, value);
+}
+
+static inline int bus_store8(struct bus * const restrict bus, uint64_t addr, uint64_t value)
+{
+  if (__builtin_expect(dram_store8(bus->dram, addr, value) == 0, 1))
+    return 0;
+
+  return bus_mmio_store(bus, addr, 1, value);
+}
+
+static inline int bus_store16(struct bus * const restrict bus, uint64_t addr, uint64_t value)
+{
+  if (__builtin_expect(dram_store16(bus->dram, addr, value) == 0, 1))
+    return 0;
+
+  return bus_mmio_store(bus, addr, 2, value);
+}
+
+static inline int bus_store32(struct bus * const restrict bus, uint64_t addr, uint64_t value)
+{
+  if (__builtin_expect(dram_store32(bus->dram, addr, value) == 0, 1))
+    return 0;
+
+  return bus_mmio_store(bus, addr, 4, value);
+}
+
+static inline int bus_store64(struct bus * const restrict bus, uint64_t addr, uint64_t value)
+{
+  if (__builtin_expect(dram_store64(bus->dram, addr, value) == 0, 1))
+    return 0;
+
+  return bus_mmio_store(bus, addr, 8, value);
+}
 
 #endif /* _RISCVEMU_BUS_H */
@@ -0,0 +1,414 @@
+/*
+  Copyright (c) 2024, Arka Mondal. All rights reserved.
+  Use of this source code is governed by a BSD-style license that
+  can be found in the LICENSE file.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cpu.h"
+#include "bus.h"
+#include "dram.h"
+#include "mmu.h"
+#include "checkpoint.h"
+
+#define CHECKPOINT_PAGE_SIZE (1UL << DRAM_PAGE_SHIFT)
+#define CHECKPOINT_BUFFER (1UL << 20)   // stdio buffer of the checkpoint file
+
+// bytes of guest memory in the page at offset, the last page may be short
+static inline uint64_t checkpoint_page_size(const struct dram * const restrict dram, uint64_t offset)
+{
+  return (dram->size - offset < CHECKPOINT_PAGE_SIZE) ? dram->size - offset : CHECKPOINT_PAGE_SIZE;
+}
+
+static size_t checkpoint_devices_size(const struct bus * const restrict bus)
+{
+  size_t i, size = 0;
+
+  for (i = 0; i < bus->ndevices; i++)
+  {
+    if (bus->devices[i].save != NULL)
+      size += bus->devices[i].state_size;
+  }
+
+  return size;
+}
+
+static int checkpoint_add_page(void * arg, uint64_t offset)
+{
+  struct riscv_checkpoint * const ckpt = arg;
+  uint64_t * pages;
+
+  if (ckpt->npages == ckpt->capacity)
+  {
+    pages = realloc(ckpt->pages, 2 * ckpt->capacity * sizeof(uint64_t));
+    if (pages == NULL)
+      return -1;
+
+    ckpt->pages = pages;
+    ckpt->capacity *= 2;
+  }
+
+  ckpt->pages[ckpt->npages++] = offset;
+
+  return 0;
+}
+
+static int checkpoint_add_nonzero(struct riscv_checkpoint * const restrict ckpt)
+{
+  const struct dram * const dram = ckpt->bus->dram;
+  uint64_t offset, size, i, word;
+
+  for (offset = 0; offset < dram->size; offset += CHECKPOINT_PAGE_SIZE)
+  {
+    size = checkpoint_page_size(dram, offset);
+
+    for (i = 0; i + sizeof(word) <= size; i += sizeof(word))
+    {
+      memcpy(&word, dram->mem + offset + i, sizeof(word));
+      if (word != 0)
+        break;
+    }
+
+    if (i + sizeof(word) <= size && checkpoint_add_page(ckpt, offset) != 0)
+      return -1;
+  }
+
+  return 0;
+}
+
+/*
+ * Append a record with the current state of the harts and devices and the
+ * pages in ckpt->pages, then make it visible to readers.
+ */
+static int checkpoint_emit(struct riscv_checkpoint * const restrict ckpt)
+{
+  struct riscv_checkpoint_record record = {
+    .magic = RISCV_CHECKPOINT_RECORD,
+    .seq = ckpt->seq,
+    .npages = ckpt->npages
+  };
+  struct riscv_checkpoint_hart * const hart = (struct riscv_checkpoint_hart *) ckpt->scratch;
+  const struct dram * const dram = ckpt->bus->dram;
+  const struct bus_device * device;
+  const struct riscv_cpu * cpu;
+  size_t i, state;
+  FILE * const file = ckpt->file;
+
+  if (fwrite(&record, sizeof(record), 1, file) != 1)
+    return -1;
+
+  for (i = 0; i < ckpt->nharts; i++)
+  {
+    cpu = ckpt->harts[i];
+    memcpy(hart->registers, cpu->registers, sizeof(hart->registers));
+    memcpy(hart->fregs, cpu->fregs, sizeof(hart->fregs));
+    memcpy(hart->csrs, cpu->csrs, sizeof(hart->csrs));
+    hart->pc = cpu->pc;
+    hart->instret = cpu->instret;
+    hart->time_skip = cpu->time_skip;
+    hart->priv = cpu->priv;
+
+    if (fwrite(hart, sizeof(struct riscv_checkpoint_hart), 1, file) != 1)
+      return -1;
+  }
+
+  for (i = 0, state = 0; i < ckpt->bus->ndevices; i++)
+  {
+    device = &ckpt->bus->devices[i];
+    if (device->save == NULL)
+      continue;
+
+    device->save(device->opaque, ckpt->scratch + state);
+    state += device->state_size;
+  }
+
+  if (fwrite(ckpt->scratch, 1, ckpt->devices_size, file) != ckpt->devices_size)
+    return -1;
+
+  if (fwrite(ckpt->pages, sizeof(uint64_t), ckpt->npages, file) != ckpt->npages)
+    return -1;
+
+  for (i = 0; i < ckpt->npages; i++)
+  {
+    if (fwrite(dram->mem + ckpt->pages[i], 1, checkpoint_page_size(dram, ckpt->pages[i]), file)
+        != checkpoint_page_size(dram, ckpt->pages[i]))
+      return -1;
+  }
+
+  record.magic = RISCV_CHECKPOINT_END;
+  if (fwrite(&record, sizeof(record), 1, file) != 1 || fflush(file) != 0)
+    return -1;
+
+  ckpt->seq++;
+  ckpt->npages = 0;
+
+  return 0;
+}
+
+// stores through TLB entries made before the last drain would go unrecorded
+static void checkpoint_flush_harts(struct riscv_checkpoint * const restrict ckpt)
+{
+  size_t i;
+
+  for (i = 0; i < ckpt->nharts; i++)
+  {
+    riscv_mmu_flush(ckpt->harts[i]);
+    riscv_mmu_update_mode(ckpt->harts[i]);
+  }
+}
+
+/*
+ * Create the checkpoint file at path and write the first record, a full
+ * image of the machine. The harts must not run during this call or during
+ * riscv_checkpoint_write. The DRAM dirty page log is taken over by the
+ * checkpoint, so a snapshot of the same machine cannot be used alongside.
+ */
+int riscv_checkpoint_open(struct riscv_checkpoint * const restrict ckpt, const char * path,
+                          struct bus * const bus, struct riscv_cpu * const * harts, size_t nharts)
+{
+  struct riscv_checkpoint_header header;
+
+  if (ckpt == NULL || path == NULL || bus == NULL || bus->dram == NULL
+      || (harts == NULL && nharts != 0))
+    return -1;
+
+  memset(ckpt, 0x0, sizeof(struct riscv_checkpoint));
+  ckpt->bus = bus;
+  ckpt->harts = harts;
+  ckpt->nharts = nharts;
+  ckpt->devices_size = checkpoint_devices_size(bus);
+
+  ckpt->capacity = 1024;
+  ckpt->pages = malloc(ckpt->capacity * sizeof(uint64_t));
+  ckpt->scratch = malloc((ckpt->devices_size > sizeof(struct riscv_checkpoint_hart))
+                          ? ckpt->devices_size : sizeof(struct riscv_checkpoint_hart));
+  if (ckpt->pages == NULL || ckpt->scratch == NULL)
+    goto fail;
+
+  if (dram_track(bus->dram) != 0)
+    goto fail;
+
+  ckpt->file = fopen(path, "wb");
+  if (ckpt->file == NULL)
+    goto fail;
+
+  setvbuf(ckpt->file, NULL, _IOFBF, CHECKPOINT_BUFFER);
+
+  memcpy(header.magic, RISCV_CHECKPOINT_MAGIC, sizeof(header.magic));
+  header.page_size = CHECKPOINT_PAGE_SIZE;
+  header.dram_size = bus->dram->size;
+  header.nharts = nharts;
+  header.devices_size = ckpt->devices_size;
+
+  if (fwrite(&header, sizeof(header), 1, ckpt->file) != 1)
+    goto fail;
+
+  if (checkpoint_add_nonzero(ckpt) != 0 || checkpoint_emit(ckpt) != 0)
+    goto fail;
+
+  checkpoint_flush_harts(ckpt);
+
+  return 0;
+
+fail:
+  riscv_checkpoint_close(ckpt);
+  return -1;
+}
+
+/*
+ * Append a record with the pages written since the previous one. Its cost
+ * follows the number of those pages, not the size of guest memory.
+ */
+int riscv_checkpoint_write(struct riscv_checkpoint * const restrict ckpt)
+{
+  if (ckpt == NULL || ckpt->file == NULL)
+    return -1;
+
+  ckpt->npages = 0;
+  if (dram_drain_dirty(ckpt->bus->dram, checkpoint_add_page, ckpt) < 0)
+    return -1;
+
+  checkpoint_flush_harts(ckpt);
+
+  return checkpoint_emit(ckpt);
+}
+
+int riscv_checkpoint_close(struct riscv_checkpoint * const restrict ckpt)
+{
+  int status = 0;
+
+  if (ckpt == NULL)
+    return -1;
+
+  if (ckpt->file != NULL && fclose(ckpt->file) != 0)
+    status = -1;
+
+  free(ckpt->pages);
+  free(ckpt->scratch);
+  memset(ckpt, 0x0, sizeof(struct riscv_checkpoint));
+
+  return status;
+}
+
+/*
+ * Check that the record at the current position of file is complete.
+ * Leaves the position unchanged and returns its page count, or -1.
+ */
+static int64_t checkpoint_check_record(FILE * const restrict file,
+                                        const struct riscv_checkpoint_header * const restrict header)
+{
+  struct riscv_checkpoint_record record, end;
+  uint64_t i, offset, pages;
+  off_t start = ftello(file);
+
+  if (fread(&record, sizeof(record), 1, file) != 1 || record.magic != RISCV_CHECKPOINT_RECORD
+      || record.npages > (header->dram_size + header->page_size - 1) / header->page_size)
+    goto incomplete;
+
+  if (fseeko(file, header->nharts * sizeof(struct riscv_checkpoint_hart) + header->devices_size,
+              SEEK_CUR) != 0)
+    goto incomplete;
+
+  // pages are page_size bytes except for a short last page of guest memory
+  for (i = 0, pages = 0; i < record.npages; i++)
+  {
+    if (fread(&offset, sizeof(offset), 1, file) != 1 || offset >= header->dram_size)
+      goto incomplete;
+
+    pages += (header->dram_size - offset < header->page_size) ? header->dram_size - offset
+                                                              : header->page_size;
+  }
+
+  if (fseeko(file, pages, SEEK_CUR) != 0 || fread(&end, sizeof(end), 1, file) != 1
+      || end.magic != RISCV_CHECKPOINT_END || end.seq != record.seq)
+    goto incomplete;
+
+  fseeko(file, start, SEEK_SET);
+  return record.npages;
+
+incomplete:
+  fseeko(file, start, SEEK_SET);
+  return -1;
+}
+
+/*
+ * Replay the complete records of the checkpoint file at path onto a machine
+ * with freshly initialized (zeroed) DRAM and the same number of harts.
+ * Returns the number of records applied, or -1 if the file does not match
+ * the machine or holds no complete record.
+ */
+int riscv_checkpoint_load(const char * path, struct bus * const bus, struct riscv_cpu * const * harts,
+                          size_t nharts)
+{
+  struct riscv_checkpoint_header header;
+  struct riscv_checkpoint_record record;
+  struct riscv_checkpoint_hart * saved;
+  struct riscv_cpu * cpu;
+  const struct bus_device * device;
+  uint8_t * devices = NULL;
+  uint64_t * pages = NULL;
+  int64_t npages;
+  int records = 0;
+  size_t i, j, state;
+  FILE * file;
+
+  if (path == NULL || bus == NULL || bus->dram == NULL || (harts == NULL && nharts != 0))
+    return -1;
+
+  file = fopen(path, "rb");
+  if (file == NULL)
+    return -1;
+
+  if (fread(&header, sizeof(header), 1, file) != 1
+      || memcmp(header.magic, RISCV_CHECKPOINT_MAGIC, sizeof(header.magic)) != 0
+      || header.page_size != CHECKPOINT_PAGE_SIZE || header.dram_size != bus->dram->size
+      || header.nharts != nharts || header.devices_size != checkpoint_devices_size(bus))
+    goto out;
+
+  saved = malloc(nharts * sizeof(struct riscv_checkpoint_hart) + 1);
+  devices = malloc(header.devices_size + 1);
+  if (saved == NULL || devices == NULL)
+  {
+    free(saved);
+    goto out;
+  }
+
+  while ((npages = checkpoint_check_record(file, &header)) >= 0)
+  {
+    free(pages);
+    pages = malloc(npages * sizeof(uint64_t) + 1);
+    if (pages == NULL || fread(&record, sizeof(record), 1, file) != 1
+        || fread(saved, sizeof(struct riscv_checkpoint_hart), nharts, file) != nharts
+        || fread(devices, 1, header.devices_size, file) != header.devices_size
+        || fread(pages, sizeof(uint64_t), npages, file) != (size_t) npages)
+    {
+      records = 0;                    // the file changed under us
+      break;
+    }
+
+    for (j = 0; j < (size_t) npages; j++)
+    {
+      if (fread(bus->dram->mem + pages[j], 1, checkpoint_page_size(bus->dram, pages[j]), file)
+          != checkpoint_page_size(bus->dram, pages[j]))
+        break;
+    }
+
+    if (j != (size_t) npages || fread(&record, sizeof(record), 1, file) != 1)
+    {
+      records = 0;
+      break;
+    }
+
+    records++;
+  }
+
+  if (records == 0)
+  {
+    free(saved);
+    goto out;
+  }
+
+  // the harts and devices take the state of the last complete record
+  bus->time_floor = 0;
+  for (i = 0; i < nharts; i++)
+  {
+    cpu = harts[i];
+    memcpy(cpu->registers, saved[i].registers, sizeof(cpu->registers));
+    memcpy(cpu->fregs, saved[i].fregs, sizeof(cpu->fregs));
+    memcpy(cpu->csrs, saved[i].csrs, sizeof(cpu->csrs));
+    cpu->pc = saved[i].pc;
+    cpu->instret = saved[i].instret;
+    cpu->time_skip = saved[i].time_skip;
+    if (riscv_cpu_time(cpu) > bus->time_floor)
+      bus->time_floor = riscv_cpu_time(cpu);
+    cpu->priv = saved[i].priv;
+    cpu->reservation_size = 0;
+    cpu->kick = RISCV_KICK_EVENTS | RISCV_KICK_INTERRUPTS;
+
+    riscv_mmu_flush(cpu);
+    riscv_mmu_update_mode(cpu);
+    riscv_block_cache_flush(cpu->bcache);
+  }
+
+  for (i = 0, state = 0; i < bus->ndevices; i++)
+  {
+    device = &bus->devices[i];
+    if (device->save == NULL)
+      continue;
+
+    if (device->restore != NULL)
+      device->restore(device->opaque, devices + state);
+    state += device->state_size;
+  }
+
+  free(saved);
+
+out:
+  free(pages);
+  free(devices);
+  fclose(file);
+
+  return (records != 0) ? records : -1;
+}
@@ -0,0 +1,81 @@
+/*
+  Copyright (c) 2024, Arka Mondal. All rights reserved.
+  Use of this source code is governed by a BSD-style license that
+  can be found in the LICENSE file.
+*/
+
+#ifndef _RISCVEMU_CHECKPOINT_H
+#define _RISCVEMU_CHECKPOINT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "cpu.h"
+#include "bus.h"
+
+#define RISCV_CHECKPOINT_MAGIC "RVCKPT03"
+#define RISCV_CHECKPOINT_RECORD 0x44524f4345524b43UL    // "CKRECORD"
+#define RISCV_CHECKPOINT_END 0x444e45544e494f50UL       // "POINTEND"
+
+/*
+ * A checkpoint file is a header followed by records, only ever appended to.
+ * The first record holds every non-zero page of guest memory, each one after
+ * that only the pages written since the record before. A record is:
+ *
+ *   struct riscv_checkpoint_record
+ *   struct riscv_checkpoint_hart     x nharts
+ *   device states                    devices_size bytes, bus order
+ *   page index                       npages guest memory offsets (uint64_t)
+ *   pages                            npages x page_size bytes
+ *   struct riscv_checkpoint_record   again, with magic RISCV_CHECKPOINT_END
+ *
+ * A record cut short by a crash has no end marker and is ignored on load.
+ * Everything is stored in host byte order.
+ */
+struct riscv_checkpoint_header {
+  char magic[8];
+  uint64_t page_size;
+  uint64_t dram_size;
+  uint64_t nharts;
+  uint64_t devices_size;
+};
+
+struct riscv_checkpoint_record {
+  uint64_t magic;
+  uint64_t seq;
+  uint64_t npages;
+};
+
+// architectural state of a hart, what survives a checkpoint
+struct riscv_checkpoint_hart {
+  uint64_t registers[32];
+  uint64_t fregs[32];
+  uint64_t pc;
+  uint64_t instret;
+  uint64_t time_skip;
+  uint64_t priv;
+  uint64_t csrs[4096];
+};
+
+struct riscv_checkpoint {
+  FILE * file;
+  struct bus * bus;
+  struct riscv_cpu * const * harts;
+  size_t nharts;
+  size_t devices_size;
+  uint64_t seq;                       // records written so far
+
+  uint64_t * pages;                   // offsets of the pages of the record being written
+  size_t npages;
+  size_t capacity;
+
+  uint8_t * scratch;                  // room for one hart or the device states
+};
+
+int riscv_checkpoint_open(struct riscv_checkpoint * const restrict, const char *, struct bus * const,
+                          struct riscv_cpu * const *, size_t);
+int riscv_checkpoint_write(struct riscv_checkpoint * const restrict);
+int riscv_checkpoint_close(struct riscv_checkpoint * const restrict);
+int riscv_checkpoint_load(const char *, struct bus * const, struct riscv_cpu * const *, size_t);
+
+#endif /* _RISCVEMU_CHECKPOINT_H */
@@ -0,0 +1,190 @@
+/*
+  Copyright (c) 2024, Arka Mondal. All rights reserved.
+  Use of this source code is governed by a BSD-style license that
+  can be found in the LICENSE file.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include "clint.h"
+#include "csr.h"
+
+// the 32-bit half of a 64-bit register at offset, or all of it
+static inline uint64_t clint_read(uint64_t reg, uint64_t offset, uint64_t size)
+{
+  return (size == 8) ? reg : (uint32_t) (reg >> (8 * (offset & 0x4)));
+}
+
+static inline uint64_t clint_merge(uint64_t reg, uint64_t offset, uint64_t size, uint64_t value)
+{
+  uint64_t shift = 8 * (offset & 0x4);
+
+  if (size == 8)
+    return value;
+
+  return (reg & ~(0xffffffffUL << shift)) | ((value & 0xffffffffUL) << shift);
+}
+
+// event source of a hart: MTIP follows whether its clock has reached mtimecmp
+static uint64_t clint_timer(struct riscv_cpu * const restrict cpu, void * opaque, uint64_t now)
+{
+  struct clint * const clint = opaque;
+  uint64_t hart = cpu->csrs[CSR_MHARTID], mtimecmp;
+
+  if (hart >= clint->nharts)
+    return RISCV_EVENT_NONE;
+
+  mtimecmp = __atomic_load_n(&clint->mtimecmp[hart], __ATOMIC_ACQUIRE);
+
+  riscv_cpu_interrupt(cpu, MIP_MTIP, now >= mtimecmp);
+
+  return (now >= mtimecmp) ? RISCV_EVENT_NONE : mtimecmp;
+}
+
+static int clint_load(void * opaque, uint64_t offset, uint64_t size, uint64_t * value)
+{
+  struct clint * const clint = opaque;
+  uint64_t hart;
+
+  if (size != 4 && size != 8)
+    return -1;
+
+  *value = 0;
+
+  if (offset < CLINT_MTIMECMP)
+  {
+    hart = offset / 4;
+    if (size == 4 && hart < clint->nharts)
+      *value = (__atomic_load_n(&clint->harts[hart]->csrs[CSR_MIP], __ATOMIC_ACQUIRE) & MIP_MSIP) ? 1 : 0;
+  }
+  else if (offset < CLINT_MTIME)
+  {
+    hart = (offset - CLINT_MTIMECMP) / 8;
+    if (hart < clint->nharts)
+      *value = clint_read(__atomic_load_n(&clint->mtimecmp[hart], __ATOMIC_ACQUIRE), offset, size);
+  }
+  else if (this_cpu != NULL)
+  {
+    *value = clint_read(riscv_cpu_clock(this_cpu), offset, size);
+  }
+
+  return 0;
+}
+
+static int clint_store(void * opaque, uint64_t offset, uint64_t size, uint64_t value)
+{
+  struct clint * const clint = opaque;
+  uint64_t hart, mtimecmp, mtime;
+
+  if (size != 4 && size != 8)
+    return -1;
+
+  if (offset < CLINT_MTIMECMP)
+  {
+    hart = offset / 4;
+    if (size == 4 && hart < clint->nharts)
+      riscv_cpu_interrupt(clint->harts[hart], MIP_MSIP, value & 0x1);
+  }
+  else if (offset < CLINT_MTIME)
+  {
+    hart = (offset - CLINT_MTIMECMP) / 8;
+    if (hart >= clint->nharts)
+      return 0;
+
+    // a half written by another hart at the same time is lost, as it would be on hardware
+    mtimecmp = clint_merge(__atomic_load_n(&clint->mtimecmp[hart], __ATOMIC_ACQUIRE), offset, size, value);
+    __atomic_store_n(&clint->mtimecmp[hart], mtimecmp, __ATOMIC_RELEASE);
+
+    riscv_cpu_kick(clint->harts[hart], RISCV_KICK_EVENTS);
+  }
+  else if (this_cpu != NULL)
+  {
+    // mtime is one register for all harts, each of them takes the new value
+    mtime = clint_merge(riscv_cpu_clock(this_cpu), offset, size, value);
+    __atomic_store_n(&this_cpu->bus->time_floor, mtime, __ATOMIC_RELEASE);
+    for (hart = 0; hart < clint->nharts; hart++)
+      riscv_cpu_set_time(clint->harts[hart], mtime);
+  }
+
+  return 0;
+}
+
+// the interrupt pending bits are part of the harts, only the compare values are saved
+static void clint_save(void * opaque, void * state)
+{
+  const struct clint * const clint = opaque;
+
+  memcpy(state, clint->mtimecmp, clint->nharts * sizeof(uint64_t));
+}
+
+static void clint_restore(void * opaque, const void * state)
+{
+  struct clint * const clint = opaque;
+
+  memcpy(clint->mtimecmp, state, clint->nharts * sizeof(uint64_t));
+}
+
+/*
+ * Attach a CLINT for the given harts to the bus and make it an event source
+ * of each of them. Must be done before the harts run.
+ */
+int clint_init(struct clint * const restrict clint, struct bus * const restrict bus,
+               struct riscv_cpu * const * harts, size_t nharts)
+{
+  struct bus_device device;
+  size_t i;
+
+  if (clint == NULL || bus == NULL || harts == NULL || nharts == 0 || nharts > CLINT_MAX_HARTS)
+    return -1;
+
+  clint->harts = harts;
+  clint->nharts = nharts;
+  clint->mtimecmp = malloc(nharts * sizeof(uint64_t));
+  if (clint->mtimecmp == NULL)
+    return -1;
+
+  // no timer interrupt until the guest asks for one
+  for (i = 0; i < nharts; i++)
+    clint->mtimecmp[i] = UINT64_MAX;
+
+  memset(&device, 0x0, sizeof(device));
+  device.name = "clint";
+  device.base = CLINT_BASE;
+  device.size = CLINT_SIZE;
+  device.opaque = clint;
+  device.load = clint_load;
+  device.store = clint_store;
+  device.state_size = nharts * sizeof(uint64_t);
+  device.save = clint_save;
+  device.restore = clint_restore;
+
+  if (bus_register(bus, &device) != 0)
+    goto fail;
+
+  for (i = 0; i < nharts; i++)
+  {
+    if (riscv_event_add(&harts[i]->events, clint_timer, clint) != 0)
+      goto fail;
+  }
+
+  return 0;
+
+fail:
+  free(clint->mtimecmp);
+  clint->mtimecmp = NULL;
+
+  return -1;
+}
+
+int clint_deinit(struct clint * const restrict clint)
+{
+  if (clint == NULL)
+    return -1;
+
+  free(clint->mtimecmp);
+  clint->mtimecmp = NULL;
+  clint->harts = NULL;
+  clint->nharts = 0;
+
+  return 0;
+}
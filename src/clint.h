@@ -0,0 +1,42 @@
+/*
+  Copyright (c) 2024, Arka Mondal. All rights reserved.
+  Use of this source code is governed by a BSD-style license that
+  can be found in the LICENSE file.
+*/
+
+#ifndef _RISCVEMU_CLINT_H
+#define _RISCVEMU_CLINT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "cpu.h"
+#include "bus.h"
+
+// SiFive compatible core-local interruptor, where QEMU's virt machine has it
+#define CLINT_BASE 0x2000000UL
+#define CLINT_SIZE 0x10000UL
+#define CLINT_MSIP 0x0                    // 32-bit per hart
+#define CLINT_MTIMECMP 0x4000             // 64-bit per hart
+#define CLINT_MTIME 0xbff8
+#define CLINT_MAX_HARTS 4095
+
+/*
+ * Software and timer interrupts of the harts. Nothing polls the timers: the
+ * CLINT is an event source of every hart (see event.h) that comes due when
+ * the hart's clock reaches its mtimecmp.
+ *
+ * mtime reads the clock of the hart doing the access, each hart has its own
+ * (see struct riscv_cpu) kept in step by riscv_cpu_clock. Writing it sets
+ * the clock of every hart.
+ */
+struct clint {
+  struct riscv_cpu * const * harts;
+  size_t nharts;
+  uint64_t * mtimecmp;
+};
+
+int clint_init(struct clint * const restrict, struct bus * const restrict, struct riscv_cpu * const *,
+               size_t);
+int clint_deinit(struct clint * const restrict);
+
+#endif /* _RISCVEMU_CLINT_H */
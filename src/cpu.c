@@ -4,35 +4,18 @@
   can be found in the LICENSE file.
 */
 
+#include <stdlib.h>
 #include <string.h>
 #include "cpu.h"
 #include "bus.h"
 #include "dram.h"
+#include "block.h"
+#include "csr.h"
+#include "fpu.h"
+#include "mmu.h"
 #include "util.h"
 
-// temporary
-struct riscv_cpu * this_cpu = NULL;       // later will be replaced by thread-local storage
-
-static uint64_t riscv_cpu_load(const struct riscv_cpu * const restrict cpu,
-                                uint64_t addr, uint64_t size)
-{
-  if (cpu == NULL)
-  {
-    this_cpu->panic = 0x1;
-    return (uint64_t) -1;
-  }
-
-  return (uint64_t) bus_load(cpu->bus, addr, size);
-}
-
-static int riscv_cpu_store(struct riscv_cpu * const restrict cpu,
-                            uint64_t addr, uint64_t size, uint64_t value)
-{
-  if (cpu == NULL)
-    return -1;
-
-  return bus_store(cpu->bus, addr, size, value);
-}
+_Thread_local struct riscv_cpu * this_cpu = NULL;
 
 int riscv_cpu_init(struct riscv_cpu * const restrict cpu, struct bus * const bus)
 {
@@ -43,61 +26,504 @@ int riscv_cpu_init(struct riscv_cpu * const restrict cpu, struct bus * const bus
 
   memset(cpu, 0x0, sizeof(struct riscv_cpu));   // initialize the registers to 0
 
-  cpu->registers[x2] = DRAM_BASE + DRAM_SIZE;   // initialize the stack pointer
+  cpu->registers[x2] = DRAM_BASE + bus->dram->size;   // initialize the stack pointer
   cpu->pc = DRAM_BASE;                          // set the program counter to the base address
 
   cpu->bus = bus;                               // connect the cpu to the bus
 
+  cpu->bcache = malloc(sizeof(struct riscv_block_cache));
+  if (cpu->bcache == NULL)
+    return -1;
+
+  if (riscv_block_cache_init(cpu->bcache, bus->dram->size) != 0)
+  {
+    free(cpu->bcache);
+    cpu->bcache = NULL;
+    return -1;
+  }
+
+#ifdef RISCV_PROFILE
+  cpu->profile = malloc(sizeof(struct riscv_profile));
+  if (cpu->profile == NULL)
+    return -1;
+
+  riscv_profile_init(cpu->profile);
+#endif
+
+  riscv_event_queue_init(&cpu->events);
+
+  // the hart starts in M-mode with translation off
+  cpu->priv = RISCV_PRIV_M;
+  cpu->csrs[CSR_MISA] = MISA_XLEN_64 | MISA_EXT('I') | MISA_EXT('M') | MISA_EXT('A') | MISA_EXT('F')
+    | MISA_EXT('D') | MISA_EXT('C') | MISA_EXT('S') | MISA_EXT('U');
+  cpu->csrs[CSR_MSTATUS] = (2UL << 32) | (2UL << 34);   // UXL = SXL = 64 bits
+  cpu->csrs[CSR_MSTATUS] |= 1UL << 13;                  // FS = Initial, FP code runs without setup
+
+  riscv_mmu_flush(cpu);
+  riscv_mmu_update_mode(cpu);
+
   return 0;
 }
 
-uint32_t riscv_cpu_fetch(const struct riscv_cpu * const restrict cpu)
+uint32_t riscv_cpu_fetch(struct riscv_cpu * const restrict cpu)
 {
+  uint64_t inst;
+
   if (cpu == NULL)
+    return (uint32_t) -1;
+
+  if (riscv_mmu_fetch(cpu, cpu->pc, &inst) != 0)
   {
-    this_cpu->panic = 0x1;
+    cpu->panic = 0x1;
     return (uint32_t) -1;
   }
 
-  return (uint32_t) bus_load(cpu->bus, cpu->pc, 32);
+  return (uint32_t) inst;
 }
 
 int riscv_cpu_exec(struct riscv_cpu * const restrict cpu, uint32_t inst)
 {
-  unsigned int opcode;
+  struct riscv_uop uop;
+  int status;
 
   if (cpu == NULL)
     return -1;
 
   cpu->registers[x0] = 0;
 
-  opcode = inst & 0x7f;
+  riscv_decode(inst, &uop);
+  RISCV_TRACE_BEGIN(cpu, &uop);
+
+  status = uop.handler(cpu, &uop);
+  RISCV_TRACE_END(cpu);
+
+  if (!status)
+    cpu->pc += uop.len;
+
+  cpu->registers[x0] = 0;
+
+  return 0;
+}
+
+/*
+ * Run the micro-ops in [uop, end) and return how many of them were executed.
+ * A handler returning non-zero has already set the pc (or raised a trap), so
+ * the rest of the block is skipped.
+ */
+static inline uint64_t riscv_cpu_exec_uops(struct riscv_cpu * const restrict cpu,
+                                            const struct riscv_uop * uop,
+                                            const struct riscv_uop * const end)
+{
+#ifdef RISCV_THREADED
+  return riscv_uop_exec_threaded(cpu, uop, end);
+#else
+  const struct riscv_uop * const start = uop;
 
-  switch (opcode)
+  for (; uop < end; uop++)
   {
-    case 0x13:
-    case 0x1b:
-      riscv_cpu_insti_exec(cpu, inst);
+    cpu->registers[x0] = 0;
+    RISCV_PROFILE_UOP(cpu, uop);
+    RISCV_TRACE_BEGIN(cpu, uop);
+
+    if (uop->handler(cpu, uop))
+    {
+      RISCV_TRACE_END(cpu);
+      uop++;
       break;
-    case 0x33:
-    case 0x3b:
-      riscv_cpu_instr_exec(cpu, inst);
-      break;
-    default:
-      hart_panic("not implemented! %#04x\n", opcode);
+    }
+
+    RISCV_TRACE_END(cpu);
+
+    cpu->pc += uop->len;
+  }
+
+  cpu->registers[x0] = 0;
+
+  return uop - start;
+#endif
+}
+
+static inline struct riscv_block * riscv_cpu_block(struct riscv_cpu * const restrict cpu)
+{
+  struct riscv_block * block;
+
+  block = riscv_block_lookup(cpu->bcache, cpu->pc, cpu->fetch_mode);
+  if (block == NULL || (block->epoch != cpu->bcache->epoch && !riscv_block_current(cpu->bcache, cpu, block)))
+    block = riscv_block_translate(cpu->bcache, cpu, cpu->pc);
+
+  return block;
+}
+
+// Execute the block starting at pc, decoding it first if it isn't cached.
+int riscv_cpu_exec_block(struct riscv_cpu * const restrict cpu)
+{
+  const struct riscv_block * block;
+  uint64_t count;
+
+  if (cpu == NULL)
+    return -1;
+
+  cpu->trap = 0;
+
+  block = riscv_cpu_block(cpu);
+  count = riscv_cpu_exec_uops(cpu, block->uops, block->uops + block->count);
+  cpu->instret += riscv_block_insts(block, count) - cpu->trap;
+
+  return 0;
+}
+
+/*
+ * Take a trap: the pending exception, or an interrupt if the top bit of
+ * cause is set. It goes to S-mode if it is delegated there and the hart is
+ * not in M-mode, otherwise to M-mode. Returns -1, leaving the hart as it is,
+ * if the target mode has no trap vector installed.
+ */
+int riscv_cpu_trap_enter(struct riscv_cpu * const restrict cpu, uint64_t cause, uint64_t value)
+{
+  uint64_t mstatus = cpu->csrs[CSR_MSTATUS];
+  uint64_t interrupt = cause >> 63;
+  uint64_t code = cause & ~(1UL << 63);
+  uint64_t deleg = cpu->csrs[interrupt ? CSR_MIDELEG : CSR_MEDELEG];
+  uint64_t tvec;
+
+  if (cpu->priv <= RISCV_PRIV_S && ((deleg >> code) & 0x1))
+  {
+    tvec = cpu->csrs[CSR_STVEC];
+    if (tvec == 0)
+      return -1;
+
+    cpu->csrs[CSR_SEPC] = cpu->pc;
+    cpu->csrs[CSR_SCAUSE] = cause;
+    cpu->csrs[CSR_STVAL] = value;
+
+    mstatus = (mstatus & ~MSTATUS_SPIE) | ((mstatus & MSTATUS_SIE) ? MSTATUS_SPIE : 0);
+    mstatus = (mstatus & ~MSTATUS_SPP) | ((cpu->priv == RISCV_PRIV_S) ? MSTATUS_SPP : 0);
+    mstatus &= ~MSTATUS_SIE;
+
+    cpu->priv = RISCV_PRIV_S;
+  }
+  else
+  {
+    tvec = cpu->csrs[CSR_MTVEC];
+    if (tvec == 0)
+      return -1;
+
+    cpu->csrs[CSR_MEPC] = cpu->pc;
+    cpu->csrs[CSR_MCAUSE] = cause;
+    cpu->csrs[CSR_MTVAL] = value;
+
+    mstatus = (mstatus & ~MSTATUS_MPIE) | ((mstatus & MSTATUS_MIE) ? MSTATUS_MPIE : 0);
+    mstatus = (mstatus & ~MSTATUS_MPP) | ((uint64_t) cpu->priv << MSTATUS_MPP_SHIFT);
+    mstatus &= ~MSTATUS_MIE;
+
+    cpu->priv = RISCV_PRIV_M;
+  }
+
+  cpu->csrs[CSR_MSTATUS] = mstatus;
+  cpu->reservation_size = 0;
+
+  // vectored mode only applies to interrupts
+  cpu->pc = (tvec & ~0x3UL) + (((tvec & 0x1) && interrupt) ? 4 * code : 0);
+
+  riscv_mmu_update_mode(cpu);
+
+  return 0;
+}
+
+/*
+ * Ask a hart to look at its interrupts (and events) at its next block
+ * boundary. Any thread can kick any hart; one waiting in RISCV_RUN_WFI is
+ * handed to its wake hook to be run again.
+ */
+void riscv_cpu_kick(struct riscv_cpu * const cpu, uint8_t why)
+{
+  __atomic_fetch_or(&cpu->kick, why, __ATOMIC_RELEASE);
+
+  if (cpu != this_cpu && cpu->wake != NULL)
+    cpu->wake(cpu);
+}
+
+// raise (level != 0) or clear interrupt bits of mip from any thread, devices call this
+void riscv_cpu_interrupt(struct riscv_cpu * const cpu, uint64_t bits, int level)
+{
+  uint64_t old;
+
+  if (level)
+    old = __atomic_fetch_or(&cpu->csrs[CSR_MIP], bits, __ATOMIC_RELEASE);
+  else
+    old = __atomic_fetch_and(&cpu->csrs[CSR_MIP], ~bits, __ATOMIC_RELEASE);
+
+  if ((old & bits) != (level ? bits : 0))
+    riscv_cpu_kick(cpu, RISCV_KICK_INTERRUPTS);
+}
+
+/*
+ * Set the clock of a hart from any thread. The hart running on the calling
+ * thread takes it at once, any other one at its next block boundary; its
+ * event sources are brought up to date in both cases.
+ */
+void riscv_cpu_set_time(struct riscv_cpu * const cpu, uint64_t time)
+{
+  if (cpu == this_cpu)
+  {
+    cpu->time_skip = time - cpu->instret;
+    riscv_cpu_kick(cpu, RISCV_KICK_EVENTS);
+    return;
+  }
+
+  __atomic_store_n(&cpu->time_set, time, __ATOMIC_RELAXED);
+  riscv_cpu_kick(cpu, RISCV_KICK_TIME | RISCV_KICK_EVENTS);
+}
+
+/*
+ * The clock of the hart as the guest reads it. A hart behind the floor of
+ * the machine (the most any hart has read or skipped to) takes it up first,
+ * one ahead raises it, so time never goes back from one hart to another.
+ * Events that come due meanwhile are run at the next block boundary.
+ */
+uint64_t riscv_cpu_clock(struct riscv_cpu * const restrict cpu)
+{
+  uint64_t * const floor = &cpu->bus->time_floor;
+  uint64_t now = riscv_cpu_time(cpu);
+  uint64_t seen = __atomic_load_n(floor, __ATOMIC_ACQUIRE);
+
+  while (seen < now)
+  {
+    if (__atomic_compare_exchange_n(floor, &seen, now, 1, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+      return now;
+  }
+
+  cpu->time_skip += seen - now;
+
+  return seen;
+}
+
+/*
+ * The interrupt to take now, 0 if none. Interrupts for M-mode are taken
+ * below M-mode or with mstatus.MIE set, the ones delegated to S-mode below
+ * S-mode or with mstatus.SIE set. Among several the priority order is
+ * external, software, timer, M-mode before S-mode.
+ */
+static uint64_t riscv_cpu_interrupt_pending(const struct riscv_cpu * const restrict cpu)
+{
+  static const uint64_t order[] = { 11, 3, 7, 9, 1, 5 };
+  uint64_t pending = __atomic_load_n(&cpu->csrs[CSR_MIP], __ATOMIC_ACQUIRE) & cpu->csrs[CSR_MIE];
+  uint64_t mstatus = cpu->csrs[CSR_MSTATUS];
+  uint64_t enabled = 0;
+  size_t i;
+
+  if (pending == 0)
+    return 0;
+
+  if (cpu->priv < RISCV_PRIV_M || (mstatus & MSTATUS_MIE))
+    enabled |= pending & ~cpu->csrs[CSR_MIDELEG];
+
+  if (cpu->priv < RISCV_PRIV_S || (cpu->priv == RISCV_PRIV_S && (mstatus & MSTATUS_SIE)))
+    enabled |= pending & cpu->csrs[CSR_MIDELEG];
+
+  for (i = 0; enabled != 0 && i < sizeof(order) / sizeof(order[0]); i++)
+  {
+    if ((enabled >> order[i]) & 0x1)
+      return (1UL << 63) | order[i];
   }
 
   return 0;
 }
 
+/*
+ * Slow path of the block boundary: the clock reached the next event or the
+ * hart was kicked. Update the event sources, then take an interrupt if one
+ * is pending and enabled.
+ */
+static void riscv_cpu_service(struct riscv_cpu * const restrict cpu)
+{
+  uint8_t kick = __atomic_exchange_n(&cpu->kick, 0, __ATOMIC_ACQUIRE);
+  uint64_t now, cause;
+
+  if (kick & RISCV_KICK_TIME)
+    cpu->time_skip = __atomic_load_n(&cpu->time_set, __ATOMIC_RELAXED) - cpu->instret;
+
+  now = riscv_cpu_time(cpu);
+
+  if ((kick & RISCV_KICK_EVENTS) || now >= cpu->events.next)
+    riscv_event_run(&cpu->events, cpu, now, kick & RISCV_KICK_EVENTS);
+
+  cause = riscv_cpu_interrupt_pending(cpu);
+  if (cause != 0)
+    riscv_cpu_trap_enter(cpu, cause, 0);
+}
+
+/*
+ * Nothing will happen before the next event, so move the clock there. Not
+ * if the hart was kicked meanwhile, it has something to look at already,
+ * nor without an event to move to: the clock runs on as it is then. The
+ * other harts take the new time up through the floor.
+ */
+static inline void riscv_cpu_skip(struct riscv_cpu * const restrict cpu)
+{
+  uint64_t now = riscv_cpu_time(cpu);
+
+  if (cpu->events.next == RISCV_EVENT_NONE || cpu->events.next <= now
+      || __atomic_load_n(&cpu->kick, __ATOMIC_ACQUIRE) != 0)
+    return;
+
+  cpu->time_skip += cpu->events.next - now;
+  riscv_cpu_clock(cpu);
+}
+
+/*
+ * Execute up to max_instructions instructions, one block at a time.
+ * Exceptions go to the guest's trap handler, interrupts are taken between
+ * blocks. Returns once the budget is used up, an instruction traps with no
+ * handler installed to take it (cpu->trap_cause and cpu->trap_value describe
+ * it and pc points at the faulting instruction), the hart waits in WFI with
+ * no event to wait for or cpu->halt is set.
+ *
+ * A hart waiting for an event, in WFI or in an idle loop (see
+ * riscv_block_idle), does not run until it happens: its clock jumps to the
+ * event instead.
+ */
+static int riscv_cpu_loop(struct riscv_cpu * const restrict cpu, uint64_t max_instructions)
+{
+  struct riscv_block * block;
+  uint64_t budget, count;
+#ifdef RISCV_JIT
+  uint64_t slice;
+#endif
+#ifdef RISCV_PROFILE
+  uint8_t priv;
+#endif
+
+  this_cpu = cpu;
+  cpu->trap = 0;
+
+  // a fused pair may have run on the last instruction of the budget, and gone one over
+  for (budget = max_instructions; budget != 0; budget -= (count < budget) ? count : budget)
+  {
+    if (__atomic_load_n(&cpu->halt, __ATOMIC_RELAXED) || cpu->panic)
+      return RISCV_RUN_HALT;
+
+    if (__builtin_expect(__atomic_load_n(&cpu->kick, __ATOMIC_RELAXED) != 0
+                         || riscv_cpu_time(cpu) >= cpu->events.next, 0))
+      riscv_cpu_service(cpu);
+
+#ifdef RISCV_JIT
+    if (riscv_jit_ready(&cpu->bcache->jit))
+      riscv_jit_install(cpu->bcache);
+#endif
+
+    block = riscv_cpu_block(cpu);
+
+#ifdef RISCV_PROFILE
+    priv = cpu->priv;
+#endif
+
+#ifdef RISCV_JIT
+    /*
+     * Cold blocks are interpreted, a hot one is compiled in the background
+     * and runs from host code once it is installed. Idle loops stay
+     * interpreted, compiled code would spin in them without a look at the
+     * clock, and so do the blocks that read or write a counter.
+     */
+    if (block->code == NULL && !block->idle && !block->counter && ++block->hits == cpu->bcache->jit.threshold)
+      riscv_jit_promote(&cpu->bcache->jit, block);
+
+    // compiled code follows chained blocks on its own until the budget runs low, or the next event
+    slice = budget;
+    if (cpu->events.next - riscv_cpu_time(cpu) < slice)
+      slice = cpu->events.next - riscv_cpu_time(cpu);
+
+    if (block->code != NULL && block->insts <= slice)
+      count = slice - riscv_jit_exec(&cpu->bcache->jit, cpu, block->code, slice);
+    else
+#endif
+    count = riscv_block_insts(block, riscv_cpu_exec_uops(cpu, block->uops,
+                                                         block->uops + riscv_block_fit(block, budget)));
+
+#ifdef RISCV_PROFILE
+    riscv_profile_block(cpu->profile, block->pc, priv, count);
+#endif
+
+    if (cpu->trap)
+    {
+      cpu->instret += count - 1;
+
+      if (riscv_cpu_trap_enter(cpu, cpu->trap_cause, cpu->trap_value) != 0)
+        return RISCV_RUN_TRAP;
+
+      cpu->trap = 0;
+      continue;
+    }
+
+    cpu->instret += count;
+
+    // an idle loop went around again without anything else happening
+    if (__builtin_expect(block->idle, 0) && cpu->pc == block->pc)
+    {
+      if (++cpu->spins == RISCV_SPIN_THRESHOLD)
+      {
+        cpu->spins = 0;
+        riscv_cpu_skip(cpu);
+      }
+    }
+    else
+    {
+      cpu->spins = 0;
+    }
+
+    // hand the host thread back rather than spin until an interrupt
+    if (cpu->idle)
+    {
+      cpu->idle = 0;
+
+      if (cpu->events.next == RISCV_EVENT_NONE && __atomic_load_n(&cpu->kick, __ATOMIC_ACQUIRE) == 0)
+        return RISCV_RUN_WFI;
+
+      riscv_cpu_skip(cpu);
+    }
+  }
+
+  return RISCV_RUN_BUDGET;
+}
+
+/*
+ * Run the hart, see riscv_cpu_loop. The host's FPU is the hart's meanwhile:
+ * it rounds in frm and accrues fflags, and is given back as it was after.
+ */
+int riscv_cpu_run(struct riscv_cpu * const restrict cpu, uint64_t max_instructions)
+{
+  uint32_t host;
+  int status;
+
+  if (cpu == NULL)
+    return -1;
+
+  host = riscv_fpu_enter(cpu);
+  status = riscv_cpu_loop(cpu, max_instructions);
+  riscv_fpu_leave(cpu, host);
+
+  return status;
+}
+
 int riscv_cpu_deinit(struct riscv_cpu * const restrict cpu)
 {
   if (cpu == NULL)
     return -1;
 
-  this_cpu = NULL;
+  if (this_cpu == cpu)
+    this_cpu = NULL;
+
   cpu->bus = NULL;                              // disconnects the bus from the cpu
 
+  riscv_block_cache_deinit(cpu->bcache);
+  free(cpu->bcache);
+  cpu->bcache = NULL;
+
+#ifdef RISCV_PROFILE
+  free(cpu->profile);
+  cpu->profile = NULL;
+#endif
+
   return 0;
 }
 
@@ -162,293 +588,3 @@ uint64_t riscv_instj_imm(uint32_t inst)
           | ((inst >> 9) & 0x800)
           | (inst & 0xff000);
 }
-
-// Execute I-type instructions.
-int riscv_cpu_insti_exec(struct riscv_cpu * const restrict cpu, uint32_t inst)
-{
-  uint32_t opcode = inst & 0x7f;
-  uint32_t rd = riscv_inst_rd(inst);
-  uint32_t funct3 = (inst >> 12) & 0x7;
-  uint32_t rs1 = riscv_inst_rs1(inst);
-  uint64_t imm = riscv_insti_imm(inst);
-
-  switch (opcode)
-  {
-    case 0x13:
-      switch (funct3) {
-        case 0x0: // ADDI
-          cpu->registers[rd] = cpu->registers[rs1] + imm;
-          break;
-
-        case 0x2: // SLTI
-          cpu->registers[rd] = (int64_t) cpu->registers[rs1] < (int64_t) imm;
-          break;
-
-        case 0x3: // SLTIU
-          cpu->registers[rd] = cpu->registers[rs1] < imm;
-          break;
-
-        case 0x4: // XORI
-          cpu->registers[rd] = cpu->registers[rs1] ^ imm;
-          break;
-
-        case 0x6: // ORI
-          cpu->registers[rd] = cpu->registers[rs1] | imm;
-          break;
-
-        case 0x7: // ANDI
-          cpu->registers[rd] = cpu->registers[rs1] & imm;
-          break;
-
-        case 0x1: {
-          uint64_t shift = imm & 0x3f;
-          switch (imm >> 6) {
-            case 0x00: // SLLI
-              cpu->registers[rd] = cpu->registers[rs1] << shift;
-              break;
-
-            default:
-              hart_panic("not implemented! 0b0010011(%#03x)\n", funct3);
-          }
-          break;
-        }
-
-        case 0x5: {
-          uint64_t shift = imm & 0x3f;
-          switch (imm >> 6) {
-            case 0x00: // SRLI
-              cpu->registers[rd] = cpu->registers[rs1] >> shift;
-              break;
-
-            case 0x10: // SRAI
-              cpu->registers[rd] = (uint64_t) ((int64_t) cpu->registers[rs1] >> (int64_t) shift);
-              break;
-
-            default:
-              hart_panic("not implemented! 0b0010011(%#03x)\n", funct3);
-          }
-          break;
-        }
-
-        default:
-          hart_panic("not implemented! 0b0010011(%#03x)\n", funct3);
-      }
-      break;
-
-    case 0x1b:
-      switch (funct3) {
-        case 0x0: // ADDIW
-          cpu->registers[rd] = (int64_t) (int32_t) ((uint32_t) cpu->registers[rs1] + (uint32_t) imm);
-          break;
-
-        case 0x1: { // SLLIW
-          uint64_t shift = imm & 0x1f;
-          switch (imm >> 5) {
-            case 0x00:
-              cpu->registers[rd] = (int64_t) (int32_t) ((uint32_t) cpu->registers[rs1] << (uint32_t) shift);
-              break;
-            default:
-              hart_panic("not implemented! 0b0011011(%#03x)\n", funct3);
-          }
-          break;
-        }
-
-        case 0x5: {
-          uint64_t shift = imm & 0x1f;
-          switch (imm >> 5) {
-            case 0x00: // SRLIW
-              cpu->registers[rd] = (int64_t) (int32_t) ((uint32_t) cpu->registers[rs1] >> (uint32_t) shift);
-              break;
-
-            case 0x20: // SRAIW
-              cpu->registers[rd] = (int64_t) (int32_t) ((int32_t) (uint32_t) cpu->registers[rs1] >> (int32_t) shift);
-              break;
-
-            default:
-              hart_panic("not implemented! 0b0011011(%#03x)\n", funct3);
-          }
-          break;
-        }
-
-        default:
-          hart_panic("not implemented! 0b0011011(%#03x)\n", funct3);
-      }
-      break;
-
-    default:
-      hart_panic("not implemented! %#04x\n", opcode);
-  }
-
-  return 0;
-}
-
-// Execute R-type instructions.
-int riscv_cpu_instr_exec(struct riscv_cpu * const restrict cpu, uint32_t inst)
-{
-  uint32_t opcode = inst & 0x7f;
-  uint32_t rd = riscv_inst_rd(inst);
-  uint32_t funct3 = (inst >> 12) & 0x7;
-  uint32_t rs1 = riscv_inst_rs1(inst);
-  uint32_t rs2 = riscv_inst_rs2(inst);
-  uint32_t funct7 = (inst >> 25) & 0x7f;
-
-  switch (opcode)
-  {
-    case 0x33:
-      switch (funct3)
-      {
-        case 0x0:
-          switch (funct7)
-          {
-            case 0x00: // ADD
-              cpu->registers[rd] = cpu->registers[rs1] + cpu->registers[rs2];
-              break;
-
-            case 0x20: // SUB
-              cpu->registers[rd] = cpu->registers[rs1] - cpu->registers[rs2];
-              break;
-
-            default:
-              hart_panic("not implemented! 0x0110011(%#03x:%#04x)\n", funct3, funct7);
-          }
-          break;
-
-        case 0x1: // SLL
-          (funct7 == 0x0) ? cpu->registers[rd] = cpu->registers[rs1] << (cpu->registers[rs2] & 0x3f)
-            : hart_panic("not implemented! 0x0110011(%#03x:%#04x)\n", funct3, funct7);
-          break;
-
-        case 0x2: // SLT
-          (funct7 == 0x0) ? cpu->registers[rd] = (int64_t) cpu->registers[rs1] < (int64_t) cpu->registers[rs2]
-            : hart_panic("not implemented! 0x0110011(%#03x:%#04x)\n", funct3, funct7);
-          break;
-
-        case 0x3: // SLTU
-          (funct7 == 0x0) ? cpu->registers[rd] = cpu->registers[rs1] < cpu->registers[rs2]
-            : hart_panic("not implemented! 0x0110011(%#03x:%#04x)\n", funct3, funct7);
-          break;
-
-        case 0x4: // XOR
-          (funct7 == 0x0) ? cpu->registers[rd] = cpu->registers[rs1] ^ cpu->registers[rs2]
-            : hart_panic("not implemented! 0x0110011(%#03x:%#04x)\n", funct3, funct7);
-          break;
-
-        case 0x5:
-          switch (funct7)
-          {
-            case 0x0: // SRL
-              cpu->registers[rd] = cpu->registers[rs1] >> (cpu->registers[rs2] & 0x3f);
-              break;
-
-            case 0x20: // SRA
-              cpu->registers[rd] = (int64_t) cpu->registers[rs1] >> (int64_t) (cpu->registers[rs2] & 0x3f);
-              break;
-
-            default:
-              hart_panic("not implemented! 0x0110011(%#03x:%#04x)\n", funct3, funct7);
-          }
-          break;
-
-        case 0x6: // OR
-          (funct7 == 0x0) ? cpu->registers[rd] = cpu->registers[rs1] | cpu->registers[rs2]
-            : hart_panic("not implemented! 0x0110011(%#03x:%#04x)\n", funct3, funct7);
-          break;
-
-        case 0x7: // AND
-          (funct7 == 0x0) ? cpu->registers[rd] = cpu->registers[rs1] & cpu->registers[rs2]
-            : hart_panic("not implemented! 0x0110011(%#03x:%#04x)\n", funct3, funct7);
-          break;
-
-        default:
-          hart_panic("not implemented! 0x0110011(%#03x)\n", funct3);
-      }
-      break;
-
-    case 0x3b:
-      switch (funct3)
-      {
-        case 0x0:
-          switch (funct7) {
-            case 0x0: // ADDW
-              cpu->registers[rd] = (int64_t) (int32_t) ((uint32_t) cpu->registers[rs1] + (uint32_t) cpu->registers[rs2]);
-              break;
-
-            case 0x20: // SUBW
-              cpu->registers[rd] = (int64_t) (int32_t) ((uint32_t) cpu->registers[rs1] - (uint32_t) cpu->registers[rs2]);
-              break;
-
-            default:
-              hart_panic("not implemented! 0x0111011(%#03x:%#04x)\n", funct3, funct7);
-          }
-          break;
-
-        case 0x1:
-          switch (funct7) {
-            case 0x00: { // SLLW
-              uint64_t shift = cpu->registers[rs2] & 0x1f;
-              cpu->registers[rd] = (int64_t) (int32_t) ((uint32_t) cpu->registers[rs1] << (uint32_t) shift);
-              break;
-            }
-
-            default:
-              hart_panic("not implemented! 0x0111011(%#03x:%#04x)\n", funct3, funct7);
-          }
-          break;
-
-        case 0x5:
-          switch (funct7) {
-            case 0x00: { // SRLW
-              uint64_t shift = cpu->registers[rs2] & 0x1f;
-              cpu->registers[rd] = (int64_t) (int32_t) ((uint32_t) cpu->registers[rs1] >> (uint32_t) shift);
-              break;
-            }
-
-            case 0x20: { // SRAW
-              uint64_t shift = cpu->registers[rs2] & 0x1f;
-              cpu->registers[rd] = (int64_t) (int32_t) ((int32_t) (uint32_t) cpu->registers[rs1] >> (int32_t) shift);
-              break;
-            }
-
-            default:
-              hart_panic("not implemented! 0x0111011(%#03x:%#04x)\n", funct3, funct7);
-          }
-          break;
-
-        default:
-          hart_panic("not implemented! 0x0111011(%#03x)\n", funct3);
-      }
-
-      break;
-
-    default:
-      hart_panic("not implemented! %#04x\n", opcode);
-  }
-
-  return 0;
-}
-
-// execute instruction - ADDI
-int riscv_cpu_addi_exec(struct riscv_cpu * const restrict cpu, uint32_t inst)
-{
-  uint64_t rd, rs1;
-
-  rd = riscv_inst_rd(inst);
-  rs1 = riscv_inst_rs1(inst);
-  cpu->registers[rd] = (int64_t) cpu->registers[rs1] + (int64_t) riscv_insti_imm(inst);
-
-  return 0;
-}
-
-// execute instruction - ADD
-int riscv_cpu_add_exec(struct riscv_cpu * const restrict cpu, uint32_t inst)
-{
-  uint64_t rd, rs1, rs2;
-
-  rd = riscv_inst_rd(inst);
-  rs1 = riscv_inst_rs1(inst);
-  rs2 = riscv_inst_rs2(inst);
-
-  cpu->registers[rd] = (int64_t) cpu->registers[rs1] + (int64_t) cpu->registers[rs2];
-
-  return 0;
-}
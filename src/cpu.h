@@ -9,12 +9,58 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include "bus.h"
+#include "block.h"
+#include "event.h"
+#include "mmu.h"
+#include "profile.h"
+#include "trace.h"
 
 enum register_names {
   x0,   x1,  x2,  x3,  x4,  x5,  x6,  x7,  x8,  x9, x10, x11, x12, x13, x14, x15,
   x16, x17, x18, x19, x20, x21, x22, x23, x24, x25, x26, x27, x28, x29, x30, x31
 };
 
+// exception causes, as reported in mcause/scause
+enum riscv_exception {
+  RISCV_EXC_INST_MISALIGNED   = 0,
+  RISCV_EXC_INST_ACCESS       = 1,
+  RISCV_EXC_ILLEGAL_INST      = 2,
+  RISCV_EXC_BREAKPOINT        = 3,
+  RISCV_EXC_LOAD_MISALIGNED   = 4,
+  RISCV_EXC_LOAD_ACCESS       = 5,
+  RISCV_EXC_STORE_MISALIGNED  = 6,
+  RISCV_EXC_STORE_ACCESS      = 7,
+  RISCV_EXC_ECALL_U           = 8,
+  RISCV_EXC_ECALL_S           = 9,
+  RISCV_EXC_ECALL_M           = 11,
+  RISCV_EXC_INST_PAGE_FAULT   = 12,
+  RISCV_EXC_LOAD_PAGE_FAULT   = 13,
+  RISCV_EXC_STORE_PAGE_FAULT  = 15
+};
+
+// privilege modes
+enum riscv_priv {
+  RISCV_PRIV_U = 0,
+  RISCV_PRIV_S = 1,
+  RISCV_PRIV_M = 3
+};
+
+// why riscv_cpu_run returned
+enum riscv_run_status {
+  RISCV_RUN_BUDGET,           // the instruction budget is used up
+  RISCV_RUN_TRAP,             // an instruction raised an exception
+  RISCV_RUN_HALT,             // the hart was asked to stop
+  RISCV_RUN_WFI               // the hart waits for an interrupt, it can be run again any time
+};
+
+// why a hart has to look at its interrupts and events at the next block boundary
+#define RISCV_KICK_INTERRUPTS 0x1   // mip, mie or what enables them changed
+#define RISCV_KICK_EVENTS     0x2   // the state of an event source changed, update them all
+#define RISCV_KICK_TIME       0x4   // another thread set the clock, see riscv_cpu_set_time
+
+#define RISCV_SPIN_THRESHOLD 16     // runs of an idle loop before the hart counts as waiting
+
 struct riscv_cpu {
 
   // 32 general purpose registers
@@ -23,16 +69,87 @@ struct riscv_cpu {
   // program counter
   uint64_t pc;
 
+  // 32 floating-point registers, a single is NaN-boxed in the low half
+  uint64_t fregs[32];
+
   // bust connector
   struct bus * bus;
 
+  // decoded blocks, keyed by pc
+  struct riscv_block_cache * bcache;
+
+  // privilege mode the hart runs in
+  uint8_t priv;
+
+  // control and status registers, indexed by csr number
+  uint64_t csrs[4096];
+
+  // software TLB, one set per translation context
+  struct riscv_tlb tlb[RISCV_TLB_MODES];
+  struct riscv_tlb * itlb;        // set used by instruction fetch
+  struct riscv_tlb * dtlb;        // set used by loads and stores (differs under MPRV)
+  uint8_t fetch_mode;             // index of itlb, blocks are cached per fetch mode
+
+  // rounding modes, a bit per rm field, the host's FPU runs in without being switched
+  uint8_t fpu_modes;
+
+  // retired instructions
+  uint64_t instret;
+
+  /*
+   * The clock of the hart (time, mtime) ticks once per retired instruction,
+   * plus what it skipped while waiting for an event. Every hart keeps its
+   * own, so one that sleeps can jump ahead without holding the others back;
+   * the floor on the bus (riscv_cpu_clock) keeps what the guest reads the
+   * same single mtime on all of them.
+   */
+  uint64_t time_skip;
+  uint64_t time_set;              // the clock to take with RISCV_KICK_TIME, written atomically
+  struct riscv_event_queue events;
+  uint32_t spins;                 // back to back runs of an idle loop
+
+  // LR/SC reservation: host address, size and the value LR read
+  uintptr_t reservation;
+  uint64_t reservation_value;
+  uint8_t reservation_size;       // 0 if no reservation is held
+
+  // pending exception, pc still points at the faulting instruction
+  uint64_t trap_cause;
+  uint64_t trap_value;
+  uint8_t trap;
+
   // cpu state
   uint8_t panic;
+  uint8_t halt;                   // stop riscv_cpu_run at the next block boundary, set atomically
+  uint8_t idle;                   // WFI executed, riscv_cpu_run returns RISCV_RUN_WFI
+  uint8_t kick;                   // RISCV_KICK_* bits, set atomically from any thread
+
+  // host side: gets the hart out of RISCV_RUN_WFI when another thread kicks it
+  void (*wake)(struct riscv_cpu *);
+  void * host;
+
+#ifdef RISCV_PROFILE
+  struct riscv_profile * profile;
+#endif
+
+#ifdef RISCV_TRACE
+  struct riscv_trace * trace;     // NULL unless this hart is being traced
+#endif
 };
 
+// the hart running on the calling thread
+extern _Thread_local struct riscv_cpu * this_cpu;
+
 int riscv_cpu_init(struct riscv_cpu * const restrict, struct bus * const);
-uint32_t riscv_cpu_fetch(const struct riscv_cpu * const restrict);
+uint32_t riscv_cpu_fetch(struct riscv_cpu * const restrict);
 int riscv_cpu_exec(struct riscv_cpu * const restrict, uint32_t);
+int riscv_cpu_exec_block(struct riscv_cpu * const restrict);
+int riscv_cpu_run(struct riscv_cpu * const restrict, uint64_t);
+int riscv_cpu_trap_enter(struct riscv_cpu * const restrict, uint64_t, uint64_t);
+void riscv_cpu_kick(struct riscv_cpu * const, uint8_t);
+void riscv_cpu_interrupt(struct riscv_cpu * const, uint64_t, int);
+void riscv_cpu_set_time(struct riscv_cpu * const, uint64_t);
+uint64_t riscv_cpu_clock(struct riscv_cpu * const restrict);
 int riscv_cpu_deinit(struct riscv_cpu * const restrict);
 
 uint64_t riscv_inst_rd(uint32_t);
@@ -44,10 +161,149 @@ uint64_t riscv_instb_imm(uint32_t);
 uint64_t riscv_instu_imm(uint32_t);
 uint64_t riscv_instj_imm(uint32_t);
 
-int riscv_cpu_insti_exec(struct riscv_cpu * const restrict, uint32_t);
-int riscv_cpu_instr_exec(struct riscv_cpu * const restrict, uint32_t);
+static inline uint64_t riscv_cpu_time(const struct riscv_cpu * const restrict cpu)
+{
+  return cpu->instret + cpu->time_skip;
+}
+
+// record an exception for the current instruction, returns 1 for the handlers
+static inline int riscv_cpu_raise(struct riscv_cpu * const restrict cpu,
+                                  uint64_t cause, uint64_t value)
+{
+  cpu->trap = 0x1;
+  cpu->trap_cause = cause;
+  cpu->trap_value = value;
+
+  return 1;
+}
+
+/*
+ * Width-specialized guest memory accessors used by the instruction handlers.
+ * A naturally aligned access to a page with a cached translation is a single
+ * host load or store; everything else (TLB miss, misaligned access, MMIO)
+ * goes through the MMU slow path, which raises the exception on failure.
+ * Stores to a page of decoded code never hit (riscv_mmu_protect), so the
+ * slow path drops its blocks before writing.
+ */
+
+static inline int riscv_cpu_load8(struct riscv_cpu * const restrict cpu, uint64_t addr,
+                                   uint64_t * const restrict value)
+{
+  const struct riscv_tlb_entry * entry = &cpu->dtlb->load[RISCV_TLB_INDEX(addr)];
+  uint8_t data;
+
+  if (entry->tag == RISCV_TLB_TAG(addr, 1))
+  {
+    memcpy(&data, (void *) (entry->addend + addr), sizeof(data));
+    *value = data;
+    return 0;
+  }
+
+  return riscv_mmu_load(cpu, addr, 1, value);
+}
+
+static inline int riscv_cpu_load16(struct riscv_cpu * const restrict cpu, uint64_t addr,
+                                    uint64_t * const restrict value)
+{
+  const struct riscv_tlb_entry * entry = &cpu->dtlb->load[RISCV_TLB_INDEX(addr)];
+  uint16_t data;
+
+  if (entry->tag == RISCV_TLB_TAG(addr, 2))
+  {
+    memcpy(&data, (void *) (entry->addend + addr), sizeof(data));
+    *value = DRAM_LE16(data);
+    return 0;
+  }
+
+  return riscv_mmu_load(cpu, addr, 2, value);
+}
+
+static inline int riscv_cpu_load32(struct riscv_cpu * const restrict cpu, uint64_t addr,
+                                    uint64_t * const restrict value)
+{
+  const struct riscv_tlb_entry * entry = &cpu->dtlb->load[RISCV_TLB_INDEX(addr)];
+  uint32_t data;
+
+  if (entry->tag == RISCV_TLB_TAG(addr, 4))
+  {
+    memcpy(&data, (void *) (entry->addend + addr), sizeof(data));
+    *value = DRAM_LE32(data);
+    return 0;
+  }
+
+  return riscv_mmu_load(cpu, addr, 4, value);
+}
+
+static inline int riscv_cpu_load64(struct riscv_cpu * const restrict cpu, uint64_t addr,
+                                    uint64_t * const restrict value)
+{
+  const struct riscv_tlb_entry * entry = &cpu->dtlb->load[RISCV_TLB_INDEX(addr)];
+  uint64_t data;
+
+  if (entry->tag == RISCV_TLB_TAG(addr, 8))
+  {
+    memcpy(&data, (void *) (entry->addend + addr), sizeof(data));
+    *value = DRAM_LE64(data);
+    return 0;
+  }
+
+  return riscv_mmu_load(cpu, addr, 8, value);
+}
+
+static inline int riscv_cpu_store8(struct riscv_cpu * const restrict cpu, uint64_t addr, uint64_t value)
+{
+  const struct riscv_tlb_entry * entry = &cpu->dtlb->store[RISCV_TLB_INDEX(addr)];
+  uint8_t data = (uint8_t) value;
+
+  if (entry->tag == RISCV_TLB_TAG(addr, 1))
+  {
+    memcpy((void *) (entry->addend + addr), &data, sizeof(data));
+    return 0;
+  }
+
+  return riscv_mmu_store(cpu, addr, 1, value);
+}
+
+static inline int riscv_cpu_store16(struct riscv_cpu * const restrict cpu, uint64_t addr, uint64_t value)
+{
+  const struct riscv_tlb_entry * entry = &cpu->dtlb->store[RISCV_TLB_INDEX(addr)];
+  uint16_t data = DRAM_LE16((uint16_t) value);
+
+  if (entry->tag == RISCV_TLB_TAG(addr, 2))
+  {
+    memcpy((void *) (entry->addend + addr), &data, sizeof(data));
+    return 0;
+  }
+
+  return riscv_mmu_store(cpu, addr, 2, value);
+}
+
+static inline int riscv_cpu_store32(struct riscv_cpu * const restrict cpu, uint64_t addr, uint64_t value)
+{
+  const struct riscv_tlb_entry * entry = &cpu->dtlb->store[RISCV_TLB_INDEX(addr)];
+  uint32_t data = DRAM_LE32((uint32_t) value);
+
+  if (entry->tag == RISCV_TLB_TAG(addr, 4))
+  {
+    memcpy((void *) (entry->addend + addr), &data, sizeof(data));
+    return 0;
+  }
+
+  return riscv_mmu_store(cpu, addr, 4, value);
+}
+
+static inline int riscv_cpu_store64(struct riscv_cpu * const restrict cpu, uint64_t addr, uint64_t value)
+{
+  const struct riscv_tlb_entry * entry = &cpu->dtlb->store[RISCV_TLB_INDEX(addr)];
+  uint64_t data = DRAM_LE64((uint64_t) value);
+
+  if (entry->tag == RISCV_TLB_TAG(addr, 8))
+  {
+    memcpy((void *) (entry->addend + addr), &data, sizeof(data));
+    return 0;
+  }
 
-int riscv_cpu_addi_exec(struct riscv_cpu * const restrict, uint32_t);
-int riscv_cpu_add_exec(struct riscv_cpu * const restrict, uint32_t);
+  return riscv_mmu_store(cpu, addr, 8, value);
+}
 
 #endif /* _RISCVEMU_CPU_H */
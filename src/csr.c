@@ -0,0 +1,260 @@
+/*
+  Copyright (c) 2024, Arka Mondal. All rights reserved.
+  Use of this source code is governed by a BSD-style license that
+  can be found in the LICENSE file.
+*/
+
+#include "cpu.h"
+#include "csr.h"
+#include "fpu.h"
+#include "mmu.h"
+
+#define MSTATUS_WRITABLE (MSTATUS_SIE | MSTATUS_MIE | MSTATUS_SPIE | MSTATUS_MPIE | MSTATUS_SPP \
+                          | MSTATUS_MPP | MSTATUS_FS | MSTATUS_MPRV | MSTATUS_SUM | MSTATUS_MXR \
+                          | MSTATUS_TVM | MSTATUS_TW | MSTATUS_TSR)
+
+#define MIP_WRITABLE (MIP_SSIP | MIP_STIP | MIP_SEIP)
+#define MIE_WRITABLE (MIP_SSIP | MIP_MSIP | MIP_STIP | MIP_MTIP | MIP_SEIP | MIP_MEIP)
+
+// exceptions that can be delegated to S-mode (everything but ecall from M-mode)
+#define MEDELEG_WRITABLE 0xb3ffUL
+
+static int riscv_csr_exists(uint32_t csr)
+{
+  switch (csr)
+  {
+    case CSR_FFLAGS: case CSR_FRM: case CSR_FCSR:
+    case CSR_SSTATUS: case CSR_SIE: case CSR_STVEC: case CSR_SCOUNTEREN:
+    case CSR_SSCRATCH: case CSR_SEPC: case CSR_SCAUSE: case CSR_STVAL: case CSR_SIP:
+    case CSR_SATP:
+    case CSR_MSTATUS: case CSR_MISA: case CSR_MEDELEG: case CSR_MIDELEG: case CSR_MIE:
+    case CSR_MTVEC: case CSR_MCOUNTEREN: case CSR_MSCRATCH: case CSR_MEPC: case CSR_MCAUSE:
+    case CSR_MTVAL: case CSR_MIP:
+    case CSR_MCYCLE: case CSR_MINSTRET: case CSR_CYCLE: case CSR_TIME: case CSR_INSTRET:
+    case CSR_MVENDORID: case CSR_MARCHID: case CSR_MIMPID: case CSR_MHARTID:
+      return 1;
+  }
+
+  // physical memory protection registers are accepted and ignored
+  return (csr >= CSR_PMPCFG0 && csr < CSR_PMPCFG0 + 16)
+          || (csr >= CSR_PMPADDR0 && csr < CSR_PMPADDR0 + 64);
+}
+
+// the counters are visible to lower privilege modes only if enabled for them
+static int riscv_csr_counter_enabled(const struct riscv_cpu * const restrict cpu, uint32_t csr)
+{
+  uint64_t bit = 1UL << (csr - CSR_CYCLE);
+
+  if (cpu->priv < RISCV_PRIV_M && !(cpu->csrs[CSR_MCOUNTEREN] & bit))
+    return 0;
+
+  if (cpu->priv < RISCV_PRIV_S && !(cpu->csrs[CSR_SCOUNTEREN] & bit))
+    return 0;
+
+  return 1;
+}
+
+// Read a CSR. Returns -1 if the access is illegal in the current mode.
+int riscv_csr_read(struct riscv_cpu * const restrict cpu, uint32_t csr, uint64_t * value)
+{
+  if (!riscv_csr_exists(csr) || ((csr >> 8) & 0x3) > cpu->priv)
+    return -1;
+
+  switch (csr)
+  {
+    // fflags accrue in the host's FPU until they are looked at
+    case CSR_FFLAGS:
+    case CSR_FRM:
+    case CSR_FCSR:
+      if (riscv_fpu_off(cpu))
+        return -1;
+      riscv_fpu_sync(cpu);
+      *value = cpu->csrs[CSR_FCSR];
+      if (csr == CSR_FFLAGS)
+        *value &= RISCV_FCSR_FFLAGS;
+      else if (csr == CSR_FRM)
+        *value >>= RISCV_FCSR_FRM_SHIFT;
+      break;
+
+    case CSR_SSTATUS:
+      *value = cpu->csrs[CSR_MSTATUS] & SSTATUS_MASK;
+      break;
+
+    case CSR_SIE:
+      *value = cpu->csrs[CSR_MIE] & cpu->csrs[CSR_MIDELEG];
+      break;
+
+    case CSR_MIP:
+      *value = __atomic_load_n(&cpu->csrs[CSR_MIP], __ATOMIC_ACQUIRE);
+      break;
+
+    case CSR_SIP:
+      *value = __atomic_load_n(&cpu->csrs[CSR_MIP], __ATOMIC_ACQUIRE) & cpu->csrs[CSR_MIDELEG];
+      break;
+
+    case CSR_SATP:
+      if (cpu->priv == RISCV_PRIV_S && (cpu->csrs[CSR_MSTATUS] & MSTATUS_TVM))
+        return -1;
+      *value = cpu->csrs[CSR_SATP];
+      break;
+
+    case CSR_TIME:
+      if (!riscv_csr_counter_enabled(cpu, csr))
+        return -1;
+      *value = riscv_cpu_clock(cpu);
+      break;
+
+    case CSR_CYCLE:
+    case CSR_INSTRET:
+      if (!riscv_csr_counter_enabled(cpu, csr))
+        return -1;
+      /* fall through */
+    case CSR_MCYCLE:
+    case CSR_MINSTRET:
+      *value = cpu->instret;
+      break;
+
+    default:
+      *value = cpu->csrs[csr];
+      break;
+  }
+
+  return 0;
+}
+
+static void riscv_csr_write_mstatus(struct riscv_cpu * const restrict cpu, uint64_t value)
+{
+  uint64_t old = cpu->csrs[CSR_MSTATUS];
+  uint64_t mstatus = (old & ~MSTATUS_WRITABLE) | (value & MSTATUS_WRITABLE);
+
+  // MPP is WARL, there is no hypervisor mode
+  if (((mstatus & MSTATUS_MPP) >> MSTATUS_MPP_SHIFT) == 2)
+    mstatus &= ~MSTATUS_MPP;
+
+  if ((mstatus & MSTATUS_FS) == MSTATUS_FS)
+    mstatus |= MSTATUS_SD;
+  else
+    mstatus &= ~MSTATUS_SD;
+
+  cpu->csrs[CSR_MSTATUS] = mstatus;
+
+  // cached translations include the SUM/MXR permission checks
+  if ((old ^ mstatus) & (MSTATUS_SUM | MSTATUS_MXR))
+    riscv_mmu_flush(cpu);
+
+  if ((old ^ mstatus) & (MSTATUS_MPRV | MSTATUS_MPP))
+    riscv_mmu_update_mode(cpu);
+}
+
+// the bits of mip in mask take their value from value
+static inline void riscv_csr_write_mip(struct riscv_cpu * const restrict cpu, uint64_t mask,
+                                       uint64_t value)
+{
+  riscv_cpu_interrupt(cpu, mask & value, 1);
+  riscv_cpu_interrupt(cpu, mask & ~value, 0);
+}
+
+// Write a CSR. Returns -1 if the access is illegal in the current mode.
+int riscv_csr_write(struct riscv_cpu * const restrict cpu, uint32_t csr, uint64_t value)
+{
+  uint64_t mask, mode;
+
+  if (!riscv_csr_exists(csr) || ((csr >> 8) & 0x3) > cpu->priv || (csr >> 10) == 0x3)
+    return -1;
+
+  switch (csr)
+  {
+    case CSR_FFLAGS:
+    case CSR_FRM:
+    case CSR_FCSR:
+      if (riscv_fpu_off(cpu))
+        return -1;
+      riscv_fpu_sync(cpu);
+      if (csr == CSR_FFLAGS)
+        value = (cpu->csrs[CSR_FCSR] & ~RISCV_FCSR_FFLAGS) | (value & RISCV_FCSR_FFLAGS);
+      else if (csr == CSR_FRM)
+        value = (cpu->csrs[CSR_FCSR] & RISCV_FCSR_FFLAGS) | (value & 0x7) << RISCV_FCSR_FRM_SHIFT;
+      riscv_fpu_write_fcsr(cpu, value);
+      break;
+
+    case CSR_SSTATUS:
+      riscv_csr_write_mstatus(cpu, (cpu->csrs[CSR_MSTATUS] & ~SSTATUS_MASK) | (value & SSTATUS_MASK));
+      riscv_cpu_kick(cpu, RISCV_KICK_INTERRUPTS);
+      break;
+
+    case CSR_MSTATUS:
+      riscv_csr_write_mstatus(cpu, value);
+      riscv_cpu_kick(cpu, RISCV_KICK_INTERRUPTS);
+      break;
+
+    case CSR_SIE:
+      mask = cpu->csrs[CSR_MIDELEG];
+      cpu->csrs[CSR_MIE] = (cpu->csrs[CSR_MIE] & ~mask) | (value & mask);
+      riscv_cpu_kick(cpu, RISCV_KICK_INTERRUPTS);
+      break;
+
+    case CSR_MIE:
+      cpu->csrs[CSR_MIE] = value & MIE_WRITABLE;
+      riscv_cpu_kick(cpu, RISCV_KICK_INTERRUPTS);
+      break;
+
+    // devices raise the other bits of mip from their own threads
+    case CSR_SIP:
+      mask = cpu->csrs[CSR_MIDELEG] & MIP_SSIP;
+      riscv_csr_write_mip(cpu, mask, value);
+      break;
+
+    case CSR_MIP:
+      riscv_csr_write_mip(cpu, MIP_WRITABLE, value);
+      break;
+
+    case CSR_MEDELEG:
+      cpu->csrs[CSR_MEDELEG] = value & MEDELEG_WRITABLE;
+      break;
+
+    case CSR_MIDELEG:
+      cpu->csrs[CSR_MIDELEG] = value & SIP_MASK;
+      riscv_cpu_kick(cpu, RISCV_KICK_INTERRUPTS);
+      break;
+
+    case CSR_STVEC:
+    case CSR_MTVEC:
+      cpu->csrs[csr] = value & ~0x2UL;            // direct or vectored
+      break;
+
+    case CSR_SEPC:
+    case CSR_MEPC:
+      cpu->csrs[csr] = value & ~0x1UL;           // IALIGN is 16 with the C extension
+      break;
+
+    case CSR_SATP:
+      if (cpu->priv == RISCV_PRIV_S && (cpu->csrs[CSR_MSTATUS] & MSTATUS_TVM))
+        return -1;
+
+      // unsupported modes leave satp unchanged
+      mode = value >> SATP_MODE_SHIFT;
+      if (mode != SATP_MODE_BARE && mode != SATP_MODE_SV39 && mode != SATP_MODE_SV48)
+        break;
+
+      cpu->csrs[CSR_SATP] = value;
+      riscv_mmu_flush(cpu);
+      riscv_block_cache_remap(cpu->bcache);
+      break;
+
+    // the clock of the hart runs on, time_skip takes up the difference
+    case CSR_MCYCLE:
+    case CSR_MINSTRET:
+      cpu->time_skip += cpu->instret - value;
+      cpu->instret = value;
+      break;
+
+    case CSR_MISA:
+      break;                                      // the extensions are fixed
+
+    default:
+      cpu->csrs[csr] = value;
+      break;
+  }
+
+  return 0;
+}
@@ -0,0 +1,105 @@
+/*
+  Copyright (c) 2024, Arka Mondal. All rights reserved.
+  Use of this source code is governed by a BSD-style license that
+  can be found in the LICENSE file.
+*/
+
+#ifndef _RISCVEMU_CSR_H
+#define _RISCVEMU_CSR_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// floating point
+#define CSR_FFLAGS      0x001
+#define CSR_FRM         0x002
+#define CSR_FCSR        0x003
+
+// supervisor
+#define CSR_SSTATUS     0x100
+#define CSR_SIE         0x104
+#define CSR_STVEC       0x105
+#define CSR_SCOUNTEREN  0x106
+#define CSR_SSCRATCH    0x140
+#define CSR_SEPC        0x141
+#define CSR_SCAUSE      0x142
+#define CSR_STVAL       0x143
+#define CSR_SIP         0x144
+#define CSR_SATP        0x180
+
+// machine
+#define CSR_MSTATUS     0x300
+#define CSR_MISA        0x301
+#define CSR_MEDELEG     0x302
+#define CSR_MIDELEG     0x303
+#define CSR_MIE         0x304
+#define CSR_MTVEC       0x305
+#define CSR_MCOUNTEREN  0x306
+#define CSR_MSCRATCH    0x340
+#define CSR_MEPC        0x341
+#define CSR_MCAUSE      0x342
+#define CSR_MTVAL       0x343
+#define CSR_MIP         0x344
+#define CSR_PMPCFG0     0x3a0
+#define CSR_PMPADDR0    0x3b0
+#define CSR_MCYCLE      0xb00
+#define CSR_MINSTRET    0xb02
+#define CSR_CYCLE       0xc00
+#define CSR_TIME        0xc01
+#define CSR_INSTRET     0xc02
+#define CSR_MVENDORID   0xf11
+#define CSR_MARCHID     0xf12
+#define CSR_MIMPID      0xf13
+#define CSR_MHARTID     0xf14
+
+// mstatus fields
+#define MSTATUS_SIE     (1UL << 1)
+#define MSTATUS_MIE     (1UL << 3)
+#define MSTATUS_SPIE    (1UL << 5)
+#define MSTATUS_MPIE    (1UL << 7)
+#define MSTATUS_SPP     (1UL << 8)
+#define MSTATUS_MPP     (3UL << 11)
+#define MSTATUS_FS      (3UL << 13)
+#define MSTATUS_MPRV    (1UL << 17)
+#define MSTATUS_SUM     (1UL << 18)
+#define MSTATUS_MXR     (1UL << 19)
+#define MSTATUS_TVM     (1UL << 20)
+#define MSTATUS_TW      (1UL << 21)
+#define MSTATUS_TSR     (1UL << 22)
+#define MSTATUS_UXL     (3UL << 32)
+#define MSTATUS_SXL     (3UL << 34)
+#define MSTATUS_SD      (1UL << 63)
+
+#define MSTATUS_MPP_SHIFT 11
+
+// the parts of mstatus visible through sstatus
+#define SSTATUS_MASK (MSTATUS_SIE | MSTATUS_SPIE | MSTATUS_SPP | MSTATUS_FS \
+                      | MSTATUS_SUM | MSTATUS_MXR | MSTATUS_UXL | MSTATUS_SD)
+
+// satp fields
+#define SATP_MODE_SHIFT 60
+#define SATP_MODE_BARE  0UL
+#define SATP_MODE_SV39  8UL
+#define SATP_MODE_SV48  9UL
+#define SATP_PPN_MASK   ((1UL << 44) - 1)
+
+// interrupt bits of mip/mie
+#define MIP_SSIP (1UL << 1)
+#define MIP_MSIP (1UL << 3)
+#define MIP_STIP (1UL << 5)
+#define MIP_MTIP (1UL << 7)
+#define MIP_SEIP (1UL << 9)
+#define MIP_MEIP (1UL << 11)
+
+#define SIP_MASK (MIP_SSIP | MIP_STIP | MIP_SEIP)
+
+// misa
+#define MISA_XLEN_64 (2UL << 62)
+#define MISA_EXT(letter) (1UL << ((letter) - 'A'))
+
+struct riscv_cpu;
+
+int riscv_csr_read(struct riscv_cpu * const restrict, uint32_t, uint64_t *);
+int riscv_csr_write(struct riscv_cpu * const restrict, uint32_t, uint64_t);
+
+#endif /* _RISCVEMU_CSR_H */
@@ -0,0 +1,2006 @@
+/*
+  Copyright (c) 2024, Arka Mondal. All rights reserved.
+  Use of this source code is governed by a BSD-style license that
+  can be found in the LICENSE file.
+*/
+
+#include <math.h>
+#include "cpu.h"
+#include "csr.h"
+#include "decode.h"
+#include "fpu.h"
+#include "mmu.h"
+
+#define UOP_HANDLER(name) \
+  static int riscv_uop_##name(struct riscv_cpu * const restrict cpu, \
+                              const struct riscv_uop * const restrict uop)
+
+/*
+ * Micro-op handlers. The operands have already been extracted by the
+ * decoder, shift amounts are pre-masked and immediates pre-sign-extended.
+ */
+
+UOP_HANDLER(unimpl)
+{
+  return riscv_cpu_raise(cpu, RISCV_EXC_ILLEGAL_INST, uop->inst);
+}
+
+// stands in for an instruction that could not be fetched, inst holds the cause
+UOP_HANDLER(exception)
+{
+  return riscv_cpu_raise(cpu, uop->inst, uop->imm);
+}
+
+// I-type
+UOP_HANDLER(addi)
+{
+  cpu->registers[uop->rd] = cpu->registers[uop->rs1] + uop->imm;
+  return 0;
+}
+
+UOP_HANDLER(slti)
+{
+  cpu->registers[uop->rd] = (int64_t) cpu->registers[uop->rs1] < (int64_t) uop->imm;
+  return 0;
+}
+
+UOP_HANDLER(sltiu)
+{
+  cpu->registers[uop->rd] = cpu->registers[uop->rs1] < uop->imm;
+  return 0;
+}
+
+UOP_HANDLER(xori)
+{
+  cpu->registers[uop->rd] = cpu->registers[uop->rs1] ^ uop->imm;
+  return 0;
+}
+
+UOP_HANDLER(ori)
+{
+  cpu->registers[uop->rd] = cpu->registers[uop->rs1] | uop->imm;
+  return 0;
+}
+
+UOP_HANDLER(andi)
+{
+  cpu->registers[uop->rd] = cpu->registers[uop->rs1] & uop->imm;
+  return 0;
+}
+
+UOP_HANDLER(slli)
+{
+  cpu->registers[uop->rd] = cpu->registers[uop->rs1] << uop->imm;
+  return 0;
+}
+
+UOP_HANDLER(srli)
+{
+  cpu->registers[uop->rd] = cpu->registers[uop->rs1] >> uop->imm;
+  return 0;
+}
+
+UOP_HANDLER(srai)
+{
+  cpu->registers[uop->rd] = (uint64_t) ((int64_t) cpu->registers[uop->rs1] >> uop->imm);
+  return 0;
+}
+
+UOP_HANDLER(addiw)
+{
+  cpu->registers[uop->rd] = (int64_t) (int32_t) ((uint32_t) cpu->registers[uop->rs1] + (uint32_t) uop->imm);
+  return 0;
+}
+
+UOP_HANDLER(slliw)
+{
+  cpu->registers[uop->rd] = (int64_t) (int32_t) ((uint32_t) cpu->registers[uop->rs1] << uop->imm);
+  return 0;
+}
+
+UOP_HANDLER(srliw)
+{
+  cpu->registers[uop->rd] = (int64_t) (int32_t) ((uint32_t) cpu->registers[uop->rs1] >> uop->imm);
+  return 0;
+}
+
+UOP_HANDLER(sraiw)
+{
+  cpu->registers[uop->rd] = (int64_t) ((int32_t) (uint32_t) cpu->registers[uop->rs1] >> uop->imm);
+  return 0;
+}
+
+// R-type
+UOP_HANDLER(add)
+{
+  cpu->registers[uop->rd] = cpu->registers[uop->rs1] + cpu->registers[uop->rs2];
+  return 0;
+}
+
+UOP_HANDLER(sub)
+{
+  cpu->registers[uop->rd] = cpu->registers[uop->rs1] - cpu->registers[uop->rs2];
+  return 0;
+}
+
+UOP_HANDLER(sll)
+{
+  cpu->registers[uop->rd] = cpu->registers[uop->rs1] << (cpu->registers[uop->rs2] & 0x3f);
+  return 0;
+}
+
+UOP_HANDLER(slt)
+{
+  cpu->registers[uop->rd] = (int64_t) cpu->registers[uop->rs1] < (int64_t) cpu->registers[uop->rs2];
+  return 0;
+}
+
+UOP_HANDLER(sltu)
+{
+  cpu->registers[uop->rd] = cpu->registers[uop->rs1] < cpu->registers[uop->rs2];
+  return 0;
+}
+
+UOP_HANDLER(xor)
+{
+  cpu->registers[uop->rd] = cpu->registers[uop->rs1] ^ cpu->registers[uop->rs2];
+  return 0;
+}
+
+UOP_HANDLER(srl)
+{
+  cpu->registers[uop->rd] = cpu->registers[uop->rs1] >> (cpu->registers[uop->rs2] & 0x3f);
+  return 0;
+}
+
+UOP_HANDLER(sra)
+{
+  cpu->registers[uop->rd] = (uint64_t) ((int64_t) cpu->registers[uop->rs1] >> (cpu->registers[uop->rs2] & 0x3f));
+  return 0;
+}
+
+UOP_HANDLER(or)
+{
+  cpu->registers[uop->rd] = cpu->registers[uop->rs1] | cpu->registers[uop->rs2];
+  return 0;
+}
+
+UOP_HANDLER(and)
+{
+  cpu->registers[uop->rd] = cpu->registers[uop->rs1] & cpu->registers[uop->rs2];
+  return 0;
+}
+
+UOP_HANDLER(addw)
+{
+  cpu->registers[uop->rd] = (int64_t) (int32_t) ((uint32_t) cpu->registers[uop->rs1] + (uint32_t) cpu->registers[uop->rs2]);
+  return 0;
+}
+
+UOP_HANDLER(subw)
+{
+  cpu->registers[uop->rd] = (int64_t) (int32_t) ((uint32_t) cpu->registers[uop->rs1] - (uint32_t) cpu->registers[uop->rs2]);
+  return 0;
+}
+
+UOP_HANDLER(sllw)
+{
+  cpu->registers[uop->rd] = (int64_t) (int32_t) ((uint32_t) cpu->registers[uop->rs1] << (cpu->registers[uop->rs2] & 0x1f));
+  return 0;
+}
+
+UOP_HANDLER(srlw)
+{
+  cpu->registers[uop->rd] = (int64_t) (int32_t) ((uint32_t) cpu->registers[uop->rs1] >> (cpu->registers[uop->rs2] & 0x1f));
+  return 0;
+}
+
+UOP_HANDLER(sraw)
+{
+  cpu->registers[uop->rd] = (int64_t) ((int32_t) (uint32_t) cpu->registers[uop->rs1] >> (cpu->registers[uop->rs2] & 0x1f));
+  return 0;
+}
+
+/*
+ * M extension. The high halves of a product come from a 128-bit multiply,
+ * a single widening mul on the host. Division by zero and INT_MIN / -1 have
+ * results instead of traps: dividing by 1 in their place gives the overflow
+ * result as it is and leaves the zero case an OR away, without a branch.
+ */
+
+// 1 if the divisor is zero
+#define RISCV_DIV_ZERO(b) ((b) == 0)
+// 1 if the signed division overflows
+#define RISCV_DIV_OVERFLOW(a, b, min) ((a) == (min) && (b) == -1)
+
+UOP_HANDLER(mul)
+{
+  cpu->registers[uop->rd] = cpu->registers[uop->rs1] * cpu->registers[uop->rs2];
+  return 0;
+}
+
+UOP_HANDLER(mulh)
+{
+  cpu->registers[uop->rd] = (uint64_t) (((__int128) (int64_t) cpu->registers[uop->rs1]
+                                         * (int64_t) cpu->registers[uop->rs2]) >> 64);
+  return 0;
+}
+
+UOP_HANDLER(mulhsu)
+{
+  cpu->registers[uop->rd] = (uint64_t) (((__int128) (int64_t) cpu->registers[uop->rs1]
+                                         * (__int128) cpu->registers[uop->rs2]) >> 64);
+  return 0;
+}
+
+UOP_HANDLER(mulhu)
+{
+  cpu->registers[uop->rd] = (uint64_t) (((unsigned __int128) cpu->registers[uop->rs1]
+                                         * cpu->registers[uop->rs2]) >> 64);
+  return 0;
+}
+
+UOP_HANDLER(div)
+{
+  int64_t a = cpu->registers[uop->rs1], b = cpu->registers[uop->rs2];
+  uint64_t zero = RISCV_DIV_ZERO(b);
+
+  b = (zero | RISCV_DIV_OVERFLOW(a, b, INT64_MIN)) ? 1 : b;
+  cpu->registers[uop->rd] = (uint64_t) (a / b) | -zero;
+  return 0;
+}
+
+UOP_HANDLER(divu)
+{
+  uint64_t a = cpu->registers[uop->rs1], b = cpu->registers[uop->rs2];
+  uint64_t zero = RISCV_DIV_ZERO(b);
+
+  cpu->registers[uop->rd] = a / (b | zero) | -zero;
+  return 0;
+}
+
+UOP_HANDLER(rem)
+{
+  int64_t a = cpu->registers[uop->rs1], b = cpu->registers[uop->rs2];
+  uint64_t zero = RISCV_DIV_ZERO(b);
+
+  b = (zero | RISCV_DIV_OVERFLOW(a, b, INT64_MIN)) ? 1 : b;
+  cpu->registers[uop->rd] = (uint64_t) (a % b) | (a & -zero);
+  return 0;
+}
+
+UOP_HANDLER(remu)
+{
+  uint64_t a = cpu->registers[uop->rs1], b = cpu->registers[uop->rs2];
+  uint64_t zero = RISCV_DIV_ZERO(b);
+
+  cpu->registers[uop->rd] = a % (b | zero) | (a & -zero);
+  return 0;
+}
+
+UOP_HANDLER(mulw)
+{
+  cpu->registers[uop->rd] = (int64_t) (int32_t) (cpu->registers[uop->rs1] * cpu->registers[uop->rs2]);
+  return 0;
+}
+
+UOP_HANDLER(divw)
+{
+  int32_t a = cpu->registers[uop->rs1], b = cpu->registers[uop->rs2];
+  uint32_t zero = RISCV_DIV_ZERO(b);
+
+  b = (zero | RISCV_DIV_OVERFLOW(a, b, INT32_MIN)) ? 1 : b;
+  cpu->registers[uop->rd] = (int64_t) (int32_t) ((uint32_t) (a / b) | -zero);
+  return 0;
+}
+
+UOP_HANDLER(divuw)
+{
+  uint32_t a = cpu->registers[uop->rs1], b = cpu->registers[uop->rs2];
+  uint32_t zero = RISCV_DIV_ZERO(b);
+
+  cpu->registers[uop->rd] = (int64_t) (int32_t) (a / (b | zero) | -zero);
+  return 0;
+}
+
+UOP_HANDLER(remw)
+{
+  int32_t a = cpu->registers[uop->rs1], b = cpu->registers[uop->rs2];
+  uint32_t zero = RISCV_DIV_ZERO(b);
+
+  b = (zero | RISCV_DIV_OVERFLOW(a, b, INT32_MIN)) ? 1 : b;
+  cpu->registers[uop->rd] = (int64_t) (int32_t) ((uint32_t) (a % b) | ((uint32_t) a & -zero));
+  return 0;
+}
+
+UOP_HANDLER(remuw)
+{
+  uint32_t a = cpu->registers[uop->rs1], b = cpu->registers[uop->rs2];
+  uint32_t zero = RISCV_DIV_ZERO(b);
+
+  cpu->registers[uop->rd] = (int64_t) (int32_t) (a % (b | zero) | (a & -zero));
+  return 0;
+}
+
+// loads
+UOP_HANDLER(lb)
+{
+  uint64_t value;
+
+  if (riscv_cpu_load8(cpu, cpu->registers[uop->rs1] + uop->imm, &value))
+    return 1;
+
+  cpu->registers[uop->rd] = (int64_t) (int8_t) value;
+  return 0;
+}
+
+UOP_HANDLER(lh)
+{
+  uint64_t value;
+
+  if (riscv_cpu_load16(cpu, cpu->registers[uop->rs1] + uop->imm, &value))
+    return 1;
+
+  cpu->registers[uop->rd] = (int64_t) (int16_t) value;
+  return 0;
+}
+
+UOP_HANDLER(lw)
+{
+  uint64_t value;
+
+  if (riscv_cpu_load32(cpu, cpu->registers[uop->rs1] + uop->imm, &value))
+    return 1;
+
+  cpu->registers[uop->rd] = (int64_t) (int32_t) value;
+  return 0;
+}
+
+UOP_HANDLER(ld)
+{
+  uint64_t value;
+
+  if (riscv_cpu_load64(cpu, cpu->registers[uop->rs1] + uop->imm, &value))
+    return 1;
+
+  cpu->registers[uop->rd] = value;
+  return 0;
+}
+
+UOP_HANDLER(lbu)
+{
+  uint64_t value;
+
+  if (riscv_cpu_load8(cpu, cpu->registers[uop->rs1] + uop->imm, &value))
+    return 1;
+
+  cpu->registers[uop->rd] = value;
+  return 0;
+}
+
+UOP_HANDLER(lhu)
+{
+  uint64_t value;
+
+  if (riscv_cpu_load16(cpu, cpu->registers[uop->rs1] + uop->imm, &value))
+    return 1;
+
+  cpu->registers[uop->rd] = value;
+  return 0;
+}
+
+UOP_HANDLER(lwu)
+{
+  uint64_t value;
+
+  if (riscv_cpu_load32(cpu, cpu->registers[uop->rs1] + uop->imm, &value))
+    return 1;
+
+  cpu->registers[uop->rd] = value;
+  return 0;
+}
+
+// stores
+UOP_HANDLER(sb)
+{
+  return riscv_cpu_store8(cpu, cpu->registers[uop->rs1] + uop->imm, cpu->registers[uop->rs2]) != 0;
+}
+
+UOP_HANDLER(sh)
+{
+  return riscv_cpu_store16(cpu, cpu->registers[uop->rs1] + uop->imm, cpu->registers[uop->rs2]) != 0;
+}
+
+UOP_HANDLER(sw)
+{
+  return riscv_cpu_store32(cpu, cpu->registers[uop->rs1] + uop->imm, cpu->registers[uop->rs2]) != 0;
+}
+
+UOP_HANDLER(sd)
+{
+  return riscv_cpu_store64(cpu, cpu->registers[uop->rs1] + uop->imm, cpu->registers[uop->rs2]) != 0;
+}
+
+/*
+ * A extension. Every atomic is done with a host atomic on the guest DRAM
+ * backing, so harts running on different threads see each other's updates.
+ * aq/rl are ignored, all of them are sequentially consistent. SC succeeds
+ * if memory still holds the value its LR read (compare-and-swap), which is
+ * the usual way of building LR/SC on top of CAS.
+ */
+
+#define LR_HANDLER(name, type, stype, le) \
+  UOP_HANDLER(name) \
+  { \
+    type * ptr = riscv_mmu_atomic(cpu, cpu->registers[uop->rs1], sizeof(type), RISCV_ACCESS_LOAD); \
+    type value; \
+  \
+    if (ptr == NULL) \
+      return 1; \
+  \
+    value = __atomic_load_n(ptr, __ATOMIC_SEQ_CST); \
+  \
+    cpu->reservation = (uintptr_t) ptr; \
+    cpu->reservation_value = value; \
+    cpu->reservation_size = sizeof(type); \
+    cpu->registers[uop->rd] = (int64_t) (stype) le(value); \
+    return 0; \
+  }
+
+#define SC_HANDLER(name, type, le) \
+  UOP_HANDLER(name) \
+  { \
+    type * ptr = riscv_mmu_atomic(cpu, cpu->registers[uop->rs1], sizeof(type), RISCV_ACCESS_STORE); \
+    type expected = (type) cpu->reservation_value; \
+    int success; \
+  \
+    if (ptr == NULL) \
+      return 1; \
+  \
+    success = cpu->reservation_size == sizeof(type) && cpu->reservation == (uintptr_t) ptr \
+              && __atomic_compare_exchange_n(ptr, &expected, le((type) cpu->registers[uop->rs2]), \
+                                             0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST); \
+  \
+    cpu->reservation_size = 0; \
+    cpu->registers[uop->rd] = !success; \
+    return 0; \
+  }
+
+// AMOs with a host read-modify-write builtin, the operand is passed in guest byte order
+#define AMO_FETCH_HANDLER(name, type, stype, le, fetch) \
+  UOP_HANDLER(name) \
+  { \
+    type * ptr = riscv_mmu_atomic(cpu, cpu->registers[uop->rs1], sizeof(type), RISCV_ACCESS_STORE); \
+    type old; \
+  \
+    if (ptr == NULL) \
+      return 1; \
+  \
+    old = fetch(ptr, le((type) cpu->registers[uop->rs2]), __ATOMIC_SEQ_CST); \
+    cpu->registers[uop->rd] = (int64_t) (stype) le(old); \
+    return 0; \
+  }
+
+// AMOs without a host builtin, a compare-and-swap loop computing op(old, src)
+#define AMO_CAS_HANDLER(name, type, stype, le, op) \
+  UOP_HANDLER(name) \
+  { \
+    type * ptr = riscv_mmu_atomic(cpu, cpu->registers[uop->rs1], sizeof(type), RISCV_ACCESS_STORE); \
+    type src = (type) cpu->registers[uop->rs2]; \
+    type old; \
+  \
+    if (ptr == NULL) \
+      return 1; \
+  \
+    old = __atomic_load_n(ptr, __ATOMIC_RELAXED); \
+    while (!__atomic_compare_exchange_n(ptr, &old, le((type) op(le(old), src)), \
+                                        1, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) \
+      ; \
+  \
+    cpu->registers[uop->rd] = (int64_t) (stype) le(old); \
+    return 0; \
+  }
+
+#define AMO_ADD(a, b) ((a) + (b))
+#define AMO_MIN32(a, b) (((int32_t) (a) < (int32_t) (b)) ? (a) : (b))
+#define AMO_MAX32(a, b) (((int32_t) (a) > (int32_t) (b)) ? (a) : (b))
+#define AMO_MIN64(a, b) (((int64_t) (a) < (int64_t) (b)) ? (a) : (b))
+#define AMO_MAX64(a, b) (((int64_t) (a) > (int64_t) (b)) ? (a) : (b))
+#define AMO_MINU(a, b) (((a) < (b)) ? (a) : (b))
+#define AMO_MAXU(a, b) (((a) > (b)) ? (a) : (b))
+
+LR_HANDLER(lr_w, uint32_t, int32_t, DRAM_LE32)
+LR_HANDLER(lr_d, uint64_t, int64_t, DRAM_LE64)
+SC_HANDLER(sc_w, uint32_t, DRAM_LE32)
+SC_HANDLER(sc_d, uint64_t, DRAM_LE64)
+
+// swap and the bitwise operations do not depend on the byte order, addition does
+AMO_FETCH_HANDLER(amoswap_w, uint32_t, int32_t, DRAM_LE32, __atomic_exchange_n)
+AMO_FETCH_HANDLER(amoxor_w, uint32_t, int32_t, DRAM_LE32, __atomic_fetch_xor)
+AMO_FETCH_HANDLER(amoand_w, uint32_t, int32_t, DRAM_LE32, __atomic_fetch_and)
+AMO_FETCH_HANDLER(amoor_w, uint32_t, int32_t, DRAM_LE32, __atomic_fetch_or)
+AMO_FETCH_HANDLER(amoswap_d, uint64_t, int64_t, DRAM_LE64, __atomic_exchange_n)
+AMO_FETCH_HANDLER(amoxor_d, uint64_t, int64_t, DRAM_LE64, __atomic_fetch_xor)
+AMO_FETCH_HANDLER(amoand_d, uint64_t, int64_t, DRAM_LE64, __atomic_fetch_and)
+AMO_FETCH_HANDLER(amoor_d, uint64_t, int64_t, DRAM_LE64, __atomic_fetch_or)
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+AMO_CAS_HANDLER(amoadd_w, uint32_t, int32_t, DRAM_LE32, AMO_ADD)
+AMO_CAS_HANDLER(amoadd_d, uint64_t, int64_t, DRAM_LE64, AMO_ADD)
+#else
+AMO_FETCH_HANDLER(amoadd_w, uint32_t, int32_t, DRAM_LE32, __atomic_fetch_add)
+AMO_FETCH_HANDLER(amoadd_d, uint64_t, int64_t, DRAM_LE64, __atomic_fetch_add)
+#endif
+
+AMO_CAS_HANDLER(amomin_w, uint32_t, int32_t, DRAM_LE32, AMO_MIN32)
+AMO_CAS_HANDLER(amomax_w, uint32_t, int32_t, DRAM_LE32, AMO_MAX32)
+AMO_CAS_HANDLER(amominu_w, uint32_t, int32_t, DRAM_LE32, AMO_MINU)
+AMO_CAS_HANDLER(amomaxu_w, uint32_t, int32_t, DRAM_LE32, AMO_MAXU)
+AMO_CAS_HANDLER(amomin_d, uint64_t, int64_t, DRAM_LE64, AMO_MIN64)
+AMO_CAS_HANDLER(amomax_d, uint64_t, int64_t, DRAM_LE64, AMO_MAX64)
+AMO_CAS_HANDLER(amominu_d, uint64_t, int64_t, DRAM_LE64, AMO_MINU)
+AMO_CAS_HANDLER(amomaxu_d, uint64_t, int64_t, DRAM_LE64, AMO_MAXU)
+
+// U-type
+UOP_HANDLER(lui)
+{
+  cpu->registers[uop->rd] = uop->imm;
+  return 0;
+}
+
+UOP_HANDLER(auipc)
+{
+  cpu->registers[uop->rd] = cpu->pc + uop->imm;
+  return 0;
+}
+
+/*
+ * Control transfer. These handlers set the pc themselves, so they always
+ * return 1 and end the block. With the C extension instructions are 2-byte
+ * aligned: every offset is even and JALR clears bit 0, so no target can be
+ * misaligned.
+ */
+static inline int riscv_cpu_branch(struct riscv_cpu * const restrict cpu,
+                                   const struct riscv_uop * const restrict uop, int taken)
+{
+  cpu->pc += taken ? uop->imm : uop->len;
+  return 1;
+}
+
+UOP_HANDLER(jal)
+{
+  cpu->registers[uop->rd] = cpu->pc + uop->len;
+  cpu->pc += uop->imm;
+  return 1;
+}
+
+UOP_HANDLER(jalr)
+{
+  uint64_t target = (cpu->registers[uop->rs1] + uop->imm) & ~(uint64_t) 1;
+
+  cpu->registers[uop->rd] = cpu->pc + uop->len;
+  cpu->pc = target;
+  return 1;
+}
+
+UOP_HANDLER(beq)
+{
+  return riscv_cpu_branch(cpu, uop, cpu->registers[uop->rs1] == cpu->registers[uop->rs2]);
+}
+
+UOP_HANDLER(bne)
+{
+  return riscv_cpu_branch(cpu, uop, cpu->registers[uop->rs1] != cpu->registers[uop->rs2]);
+}
+
+UOP_HANDLER(blt)
+{
+  return riscv_cpu_branch(cpu, uop, (int64_t) cpu->registers[uop->rs1] < (int64_t) cpu->registers[uop->rs2]);
+}
+
+UOP_HANDLER(bge)
+{
+  return riscv_cpu_branch(cpu, uop, (int64_t) cpu->registers[uop->rs1] >= (int64_t) cpu->registers[uop->rs2]);
+}
+
+UOP_HANDLER(bltu)
+{
+  return riscv_cpu_branch(cpu, uop, cpu->registers[uop->rs1] < cpu->registers[uop->rs2]);
+}
+
+UOP_HANDLER(bgeu)
+{
+  return riscv_cpu_branch(cpu, uop, cpu->registers[uop->rs1] >= cpu->registers[uop->rs2]);
+}
+
+// FENCE orders memory for the other harts, which run on other host threads
+UOP_HANDLER(fence)
+{
+  (void) cpu;
+  (void) uop;
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  return 0;
+}
+
+/*
+ * FENCE.I, instruction fetches after it must observe earlier stores. The
+ * stores of this hart have dropped the blocks they overwrote already
+ * (riscv_mmu_protect), those of the other harts and of devices have not,
+ * so all of them go.
+ */
+UOP_HANDLER(fence_i)
+{
+  riscv_block_cache_flush(cpu->bcache);
+  cpu->pc += uop->len;
+  return 1;
+}
+
+UOP_HANDLER(ecall)
+{
+  (void) uop;
+  return riscv_cpu_raise(cpu, RISCV_EXC_ECALL_U + cpu->priv, 0);
+}
+
+UOP_HANDLER(ebreak)
+{
+  (void) uop;
+  return riscv_cpu_raise(cpu, RISCV_EXC_BREAKPOINT, cpu->pc);
+}
+
+/*
+ * Privileged instructions. They may change the privilege mode or the
+ * translation, so they end the block like a jump.
+ */
+
+UOP_HANDLER(mret)
+{
+  uint64_t mstatus = cpu->csrs[CSR_MSTATUS];
+  unsigned int pp = (mstatus & MSTATUS_MPP) >> MSTATUS_MPP_SHIFT;
+
+  if (cpu->priv < RISCV_PRIV_M)
+    return riscv_cpu_raise(cpu, RISCV_EXC_ILLEGAL_INST, uop->inst);
+
+  mstatus = (mstatus & ~MSTATUS_MIE) | ((mstatus & MSTATUS_MPIE) ? MSTATUS_MIE : 0);
+  mstatus |= MSTATUS_MPIE;
+  mstatus &= ~MSTATUS_MPP;
+  if (pp != RISCV_PRIV_M)
+    mstatus &= ~MSTATUS_MPRV;
+
+  cpu->csrs[CSR_MSTATUS] = mstatus;
+  cpu->priv = pp;
+  cpu->pc = cpu->csrs[CSR_MEPC];
+  riscv_mmu_update_mode(cpu);
+
+  // the interrupts enabled may have changed with the mode
+  riscv_cpu_kick(cpu, RISCV_KICK_INTERRUPTS);
+
+  return 1;
+}
+
+UOP_HANDLER(sret)
+{
+  uint64_t mstatus = cpu->csrs[CSR_MSTATUS];
+  unsigned int pp = (mstatus & MSTATUS_SPP) ? RISCV_PRIV_S : RISCV_PRIV_U;
+
+  if (cpu->priv < RISCV_PRIV_S || (cpu->priv == RISCV_PRIV_S && (mstatus & MSTATUS_TSR)))
+    return riscv_cpu_raise(cpu, RISCV_EXC_ILLEGAL_INST, uop->inst);
+
+  mstatus = (mstatus & ~MSTATUS_SIE) | ((mstatus & MSTATUS_SPIE) ? MSTATUS_SIE : 0);
+  mstatus |= MSTATUS_SPIE;
+  mstatus &= ~MSTATUS_SPP;
+  mstatus &= ~MSTATUS_MPRV;
+
+  cpu->csrs[CSR_MSTATUS] = mstatus;
+  cpu->priv = pp;
+  cpu->pc = cpu->csrs[CSR_SEPC];
+  riscv_mmu_update_mode(cpu);
+
+  // the interrupts enabled may have changed with the mode
+  riscv_cpu_kick(cpu, RISCV_KICK_INTERRUPTS);
+
+  return 1;
+}
+
+UOP_HANDLER(wfi)
+{
+  if (cpu->priv == RISCV_PRIV_U
+      || (cpu->priv == RISCV_PRIV_S && (cpu->csrs[CSR_MSTATUS] & MSTATUS_TW)))
+    return riscv_cpu_raise(cpu, RISCV_EXC_ILLEGAL_INST, uop->inst);
+
+  // nothing to wait for if an interrupt is already pending
+  if ((__atomic_load_n(&cpu->csrs[CSR_MIP], __ATOMIC_ACQUIRE) & cpu->csrs[CSR_MIE]) == 0)
+    cpu->idle = 0x1;
+
+  cpu->pc += uop->len;
+  return 1;
+}
+
+UOP_HANDLER(sfence_vma)
+{
+  if (cpu->priv == RISCV_PRIV_U
+      || (cpu->priv == RISCV_PRIV_S && (cpu->csrs[CSR_MSTATUS] & MSTATUS_TVM)))
+    return riscv_cpu_raise(cpu, RISCV_EXC_ILLEGAL_INST, uop->inst);
+
+  if (uop->rs1 == 0)
+    riscv_mmu_flush(cpu);
+  else
+    riscv_mmu_flush_page(cpu, cpu->registers[uop->rs1]);
+
+  riscv_block_cache_remap(cpu->bcache);
+
+  cpu->pc += uop->len;
+  return 1;
+}
+
+/*
+ * Zicsr. The csr number is in imm, the immediate forms take their operand
+ * from the rs1 field.
+ */
+
+static inline int riscv_cpu_csr_op(struct riscv_cpu * const restrict cpu,
+                                    const struct riscv_uop * const restrict uop,
+                                    uint64_t operand, int op)
+{
+  uint64_t old = 0, value;
+
+  // CSRRW with rd = x0 does not read the csr, CSRRS/CSRRC with a zero operand do not write it
+  if ((op != 0 || uop->rd != 0) && riscv_csr_read(cpu, uop->imm, &old) != 0)
+    return riscv_cpu_raise(cpu, RISCV_EXC_ILLEGAL_INST, uop->inst);
+
+  switch (op)
+  {
+    case 0:
+      value = operand;
+      break;
+    case 1:
+      value = old | operand;
+      break;
+    default:
+      value = old & ~operand;
+      break;
+  }
+
+  if ((op == 0 || uop->rs1 != 0) && riscv_csr_write(cpu, uop->imm, value) != 0)
+    return riscv_cpu_raise(cpu, RISCV_EXC_ILLEGAL_INST, uop->inst);
+
+  cpu->registers[uop->rd] = old;
+
+  // plain reads do not end their block, see riscv_decode
+  if (op != 0 && uop->rs1 == 0)
+    return 0;
+
+  cpu->pc += uop->len;
+
+  return 1;
+}
+
+UOP_HANDLER(csrrw)
+{
+  return riscv_cpu_csr_op(cpu, uop, cpu->registers[uop->rs1], 0);
+}
+
+UOP_HANDLER(csrrs)
+{
+  return riscv_cpu_csr_op(cpu, uop, cpu->registers[uop->rs1], 1);
+}
+
+UOP_HANDLER(csrrc)
+{
+  return riscv_cpu_csr_op(cpu, uop, cpu->registers[uop->rs1], 2);
+}
+
+UOP_HANDLER(csrrwi)
+{
+  return riscv_cpu_csr_op(cpu, uop, uop->rs1, 0);
+}
+
+UOP_HANDLER(csrrsi)
+{
+  return riscv_cpu_csr_op(cpu, uop, uop->rs1, 1);
+}
+
+UOP_HANDLER(csrrci)
+{
+  return riscv_cpu_csr_op(cpu, uop, uop->rs1, 2);
+}
+
+/*
+ * F and D. The arithmetic is the host's, already rounding in frm and
+ * accruing fflags (see riscv_fpu_enter), so an instruction with the dynamic
+ * rounding mode is one host operation. A static mode the host is not in
+ * switches it for the one instruction, and RMM, which the host does not
+ * have, goes through long double (see riscv_fpu_rmm_begin).
+ */
+
+#define FPU_CHECK() \
+  do { \
+    if (riscv_fpu_off(cpu)) \
+      return riscv_cpu_raise(cpu, RISCV_EXC_ILLEGAL_INST, uop->inst); \
+  } while (0)
+
+/*
+ * r = expr in the instruction's rounding mode, s the suffix of its type and
+ * wide the same as expr in long double for RMM. The barriers keep the
+ * compiler from computing it on the wrong side of a switch, fence is for
+ * the operands.
+ */
+#define FPU_ROUND(r, s, expr, wide, fence) \
+  do { \
+    uint32_t swap; \
+    fenv_t env; \
+    long double w; \
+  \
+    if (__builtin_expect((cpu->fpu_modes >> riscv_fpu_rm(uop)) & 0x1, 1)) \
+    { \
+      r = (expr); \
+      break; \
+    } \
+  \
+    switch (riscv_fpu_round_begin(cpu, riscv_fpu_rm(uop), &swap)) \
+    { \
+      case -1: \
+        return riscv_cpu_raise(cpu, RISCV_EXC_ILLEGAL_INST, uop->inst); \
+  \
+      case RISCV_FRM_RMM: \
+        riscv_fpu_rmm_begin(&env); \
+        fence; \
+        w = (wide); \
+        RISCV_FPU_BARRIER_WIDE(w); \
+        r = riscv_fpu_rmm_end_##s(cpu, &env, w); \
+        break; \
+  \
+      default: \
+        fence; \
+        r = (expr); \
+        RISCV_FPU_BARRIER(r); \
+        riscv_fpu_round_end(swap); \
+        break; \
+    } \
+  } while (0)
+
+#define FPU_FENCE3(a, b, c) \
+  do { \
+    RISCV_FPU_BARRIER(a); \
+    RISCV_FPU_BARRIER(b); \
+    RISCV_FPU_BARRIER(c); \
+  } while (0)
+
+/*
+ * The result is a type, s its suffix, the sources rs1, rs2 and rs3 are a, b
+ * and c, of type stype with suffix t. wide widens only the sources expr
+ * uses, converting another one could raise NV for nothing.
+ */
+#define FPU_ARITH_HANDLER(name, type, s, stype, t, expr, wide) \
+  UOP_HANDLER(name) \
+  { \
+    stype a, b, c; \
+    type r; \
+  \
+    FPU_CHECK(); \
+  \
+    a = riscv_fpu_get_##t(cpu, uop->rs1); \
+    b = riscv_fpu_get_##t(cpu, uop->rs2); \
+    c = riscv_fpu_get_##t(cpu, riscv_fpu_rs3(uop)); \
+    FPU_ROUND(r, s, expr, wide, FPU_FENCE3(a, b, c)); \
+  \
+    riscv_fpu_set_##s(cpu, uop->rd, r); \
+    return 0; \
+  }
+
+FPU_ARITH_HANDLER(fadd_s, float, s, float, s, a + b, (long double) a + b)
+FPU_ARITH_HANDLER(fsub_s, float, s, float, s, a - b, (long double) a - b)
+FPU_ARITH_HANDLER(fmul_s, float, s, float, s, a * b, (long double) a * b)
+FPU_ARITH_HANDLER(fdiv_s, float, s, float, s, a / b, (long double) a / b)
+FPU_ARITH_HANDLER(fsqrt_s, float, s, float, s, sqrtf(a), sqrtl(a))
+FPU_ARITH_HANDLER(fmadd_s, float, s, float, s, fmaf(a, b, c), fmal(a, b, c))
+FPU_ARITH_HANDLER(fmsub_s, float, s, float, s, fmaf(a, b, -c), fmal(a, b, -c))
+FPU_ARITH_HANDLER(fnmsub_s, float, s, float, s, fmaf(-a, b, c), fmal(-a, b, c))
+FPU_ARITH_HANDLER(fnmadd_s, float, s, float, s, fmaf(-a, b, -c), fmal(-a, b, -c))
+FPU_ARITH_HANDLER(fcvt_s_d, float, s, double, d, (float) a, (long double) a)
+FPU_ARITH_HANDLER(fadd_d, double, d, double, d, a + b, (long double) a + b)
+FPU_ARITH_HANDLER(fsub_d, double, d, double, d, a - b, (long double) a - b)
+FPU_ARITH_HANDLER(fmul_d, double, d, double, d, a * b, (long double) a * b)
+FPU_ARITH_HANDLER(fdiv_d, double, d, double, d, a / b, (long double) a / b)
+FPU_ARITH_HANDLER(fsqrt_d, double, d, double, d, sqrt(a), sqrtl(a))
+FPU_ARITH_HANDLER(fmadd_d, double, d, double, d, fma(a, b, c), fmal(a, b, c))
+FPU_ARITH_HANDLER(fmsub_d, double, d, double, d, fma(a, b, -c), fmal(a, b, -c))
+FPU_ARITH_HANDLER(fnmsub_d, double, d, double, d, fma(-a, b, c), fmal(-a, b, c))
+FPU_ARITH_HANDLER(fnmadd_d, double, d, double, d, fma(-a, b, -c), fmal(-a, b, -c))
+FPU_ARITH_HANDLER(fcvt_d_s, double, d, float, s, (double) a, (long double) a)
+
+// FCVT from an integer register, the source is laundered for the compiler instead
+#define FPU_FROM_INT_HANDLER(name, type, s, itype) \
+  UOP_HANDLER(name) \
+  { \
+    itype x = (itype) cpu->registers[uop->rs1]; \
+    type r; \
+  \
+    FPU_CHECK(); \
+    FPU_ROUND(r, s, (type) x, (long double) x, __asm__ volatile ("" : "+r" (x))); \
+  \
+    riscv_fpu_set_##s(cpu, uop->rd, r); \
+    return 0; \
+  }
+
+FPU_FROM_INT_HANDLER(fcvt_s_w, float, s, int32_t)
+FPU_FROM_INT_HANDLER(fcvt_s_wu, float, s, uint32_t)
+FPU_FROM_INT_HANDLER(fcvt_s_l, float, s, int64_t)
+FPU_FROM_INT_HANDLER(fcvt_s_lu, float, s, uint64_t)
+FPU_FROM_INT_HANDLER(fcvt_d_w, double, d, int32_t)
+FPU_FROM_INT_HANDLER(fcvt_d_wu, double, d, uint32_t)
+FPU_FROM_INT_HANDLER(fcvt_d_l, double, d, int64_t)
+FPU_FROM_INT_HANDLER(fcvt_d_lu, double, d, uint64_t)
+
+// FCVT to an integer register, saturating as the host does not (see riscv_fpu_to_int)
+#define FPU_TO_INT_HANDLER(name, s, kind) \
+  UOP_HANDLER(name) \
+  { \
+    uint64_t value; \
+  \
+    FPU_CHECK(); \
+  \
+    if (riscv_fpu_to_int(cpu, riscv_fpu_get_##s(cpu, uop->rs1), riscv_fpu_rm(uop), kind, &value) != 0) \
+      return riscv_cpu_raise(cpu, RISCV_EXC_ILLEGAL_INST, uop->inst); \
+  \
+    cpu->registers[uop->rd] = value; \
+    return 0; \
+  }
+
+FPU_TO_INT_HANDLER(fcvt_w_s, s, RISCV_FPU_W)
+FPU_TO_INT_HANDLER(fcvt_wu_s, s, RISCV_FPU_WU)
+FPU_TO_INT_HANDLER(fcvt_l_s, s, RISCV_FPU_L)
+FPU_TO_INT_HANDLER(fcvt_lu_s, s, RISCV_FPU_LU)
+FPU_TO_INT_HANDLER(fcvt_w_d, d, RISCV_FPU_W)
+FPU_TO_INT_HANDLER(fcvt_wu_d, d, RISCV_FPU_WU)
+FPU_TO_INT_HANDLER(fcvt_l_d, d, RISCV_FPU_L)
+FPU_TO_INT_HANDLER(fcvt_lu_d, d, RISCV_FPU_LU)
+
+/*
+ * The rest never round and are done on the encodings: x and y are the
+ * sources rs1 and rs2, a single unboxed, sign the sign bit and box what a
+ * result is stored with.
+ */
+#define FPU_BITS_s(reg) riscv_fpu_unbox(cpu, reg)
+#define FPU_BITS_d(reg) cpu->fregs[reg]
+#define FPU_SIGN_s 0x80000000U
+#define FPU_SIGN_d 0x8000000000000000UL
+#define FPU_BOX_s RISCV_FPU_BOX
+#define FPU_BOX_d 0UL
+#define FPU_NAN_s RISCV_FPU_NAN_S
+#define FPU_NAN_d RISCV_FPU_NAN_D
+
+#define FPU_SGNJ_HANDLER(name, s, expr) \
+  UOP_HANDLER(name) \
+  { \
+    uint64_t x, y; \
+  \
+    FPU_CHECK(); \
+  \
+    x = FPU_BITS_##s(uop->rs1); \
+    y = FPU_BITS_##s(uop->rs2); \
+    riscv_fpu_set_bits(cpu, uop->rd, FPU_BOX_##s | (((x & ~FPU_SIGN_##s) | ((expr) & FPU_SIGN_##s)))); \
+    return 0; \
+  }
+
+FPU_SGNJ_HANDLER(fsgnj_s, s, y)
+FPU_SGNJ_HANDLER(fsgnjn_s, s, ~y)
+FPU_SGNJ_HANDLER(fsgnjx_s, s, x ^ y)
+FPU_SGNJ_HANDLER(fsgnj_d, d, y)
+FPU_SGNJ_HANDLER(fsgnjn_d, d, ~y)
+FPU_SGNJ_HANDLER(fsgnjx_d, d, x ^ y)
+
+/*
+ * FMIN and FMAX return the other operand if one is a NaN, the canonical NaN
+ * if both are, and order -0 below +0, which differ in the sign bit only.
+ */
+#define FPU_MINMAX_HANDLER(name, type, s, cmp, zero) \
+  UOP_HANDLER(name) \
+  { \
+    type a, b; \
+    uint64_t x, y, r; \
+  \
+    FPU_CHECK(); \
+  \
+    a = riscv_fpu_get_##s(cpu, uop->rs1); \
+    b = riscv_fpu_get_##s(cpu, uop->rs2); \
+    x = FPU_BITS_##s(uop->rs1); \
+    y = FPU_BITS_##s(uop->rs2); \
+  \
+    if (riscv_fpu_snan_##s(x) || riscv_fpu_snan_##s(y)) \
+      riscv_fpu_raise(cpu, RISCV_FFLAGS_NV); \
+  \
+    if (riscv_fpu_nan_##s(x)) \
+      r = riscv_fpu_nan_##s(y) ? FPU_NAN_##s : y; \
+    else if (riscv_fpu_nan_##s(y)) \
+      r = x; \
+    else if (a == b) \
+      r = x zero y; \
+    else \
+      r = (a cmp b) ? x : y; \
+  \
+    riscv_fpu_set_bits(cpu, uop->rd, FPU_BOX_##s | r); \
+    return 0; \
+  }
+
+FPU_MINMAX_HANDLER(fmin_s, float, s, <, |)
+FPU_MINMAX_HANDLER(fmax_s, float, s, >, &)
+FPU_MINMAX_HANDLER(fmin_d, double, d, <, |)
+FPU_MINMAX_HANDLER(fmax_d, double, d, >, &)
+
+// FEQ is quiet, raising NV only for a signaling NaN, FLT and FLE raise it for any NaN
+#define FPU_CMP_HANDLER(name, type, s, cmp, nan) \
+  UOP_HANDLER(name) \
+  { \
+    uint64_t x, y; \
+  \
+    FPU_CHECK(); \
+  \
+    x = FPU_BITS_##s(uop->rs1); \
+    y = FPU_BITS_##s(uop->rs2); \
+  \
+    if (riscv_fpu_nan_##s(x) || riscv_fpu_nan_##s(y)) \
+    { \
+      if (nan(x) || nan(y)) \
+        riscv_fpu_raise(cpu, RISCV_FFLAGS_NV); \
+      cpu->registers[uop->rd] = 0; \
+      return 0; \
+    } \
+  \
+    cpu->registers[uop->rd] = riscv_fpu_get_##s(cpu, uop->rs1) cmp riscv_fpu_get_##s(cpu, uop->rs2); \
+    return 0; \
+  }
+
+FPU_CMP_HANDLER(feq_s, float, s, ==, riscv_fpu_snan_s)
+FPU_CMP_HANDLER(flt_s, float, s, <, riscv_fpu_nan_s)
+FPU_CMP_HANDLER(fle_s, float, s, <=, riscv_fpu_nan_s)
+FPU_CMP_HANDLER(feq_d, double, d, ==, riscv_fpu_snan_d)
+FPU_CMP_HANDLER(flt_d, double, d, <, riscv_fpu_nan_d)
+FPU_CMP_HANDLER(fle_d, double, d, <=, riscv_fpu_nan_d)
+
+UOP_HANDLER(fclass_s)
+{
+  FPU_CHECK();
+
+  cpu->registers[uop->rd] = riscv_fpu_class(riscv_fpu_unbox(cpu, uop->rs1), 8, 23);
+  return 0;
+}
+
+UOP_HANDLER(fclass_d)
+{
+  FPU_CHECK();
+
+  cpu->registers[uop->rd] = riscv_fpu_class(cpu->fregs[uop->rs1], 11, 52);
+  return 0;
+}
+
+// moves copy the bits, a single out of its register as it is, boxed or not
+UOP_HANDLER(fmv_x_w)
+{
+  FPU_CHECK();
+
+  cpu->registers[uop->rd] = (int64_t) (int32_t) cpu->fregs[uop->rs1];
+  return 0;
+}
+
+UOP_HANDLER(fmv_w_x)
+{
+  FPU_CHECK();
+
+  riscv_fpu_set_bits(cpu, uop->rd, RISCV_FPU_BOX | (uint32_t) cpu->registers[uop->rs1]);
+  return 0;
+}
+
+UOP_HANDLER(fmv_x_d)
+{
+  FPU_CHECK();
+
+  cpu->registers[uop->rd] = cpu->fregs[uop->rs1];
+  return 0;
+}
+
+UOP_HANDLER(fmv_d_x)
+{
+  FPU_CHECK();
+
+  riscv_fpu_set_bits(cpu, uop->rd, cpu->registers[uop->rs1]);
+  return 0;
+}
+
+// loads and stores, a single is boxed when loaded and stored as it is
+UOP_HANDLER(flw)
+{
+  uint64_t value;
+
+  FPU_CHECK();
+
+  if (riscv_cpu_load32(cpu, cpu->registers[uop->rs1] + uop->imm, &value))
+    return 1;
+
+  riscv_fpu_set_bits(cpu, uop->rd, RISCV_FPU_BOX | value);
+  return 0;
+}
+
+UOP_HANDLER(fld)
+{
+  uint64_t value;
+
+  FPU_CHECK();
+
+  if (riscv_cpu_load64(cpu, cpu->registers[uop->rs1] + uop->imm, &value))
+    return 1;
+
+  riscv_fpu_set_bits(cpu, uop->rd, value);
+  return 0;
+}
+
+UOP_HANDLER(fsw)
+{
+  FPU_CHECK();
+
+  return riscv_cpu_store32(cpu, cpu->registers[uop->rs1] + uop->imm, cpu->fregs[uop->rs2]) != 0;
+}
+
+UOP_HANDLER(fsd)
+{
+  FPU_CHECK();
+
+  return riscv_cpu_store64(cpu, cpu->registers[uop->rs1] + uop->imm, cpu->fregs[uop->rs2]) != 0;
+}
+
+/*
+ * Fused pairs, see riscv_decode_fuse. Only the second instruction of a pair
+ * can trap, by then the first one has retired: its result is written and
+ * the pc moved on to the second before the trap is taken.
+ */
+
+// the immediate of the I-type second instruction, inst holds its word
+#define FUSED_IMM(uop) ((uint64_t) (int64_t) ((int32_t) (uop)->inst >> 20))
+
+// li of a 32-bit constant, the sum was folded at decode
+UOP_HANDLER(lui_addi)
+{
+  cpu->registers[uop->rd] = uop->imm;
+  return 0;
+}
+
+// zero-extension and bit-field extraction, rs2 holds the right shift amount
+UOP_HANDLER(slli_srli)
+{
+  cpu->registers[uop->rd] = (cpu->registers[uop->rs1] << uop->imm) >> uop->rs2;
+  return 0;
+}
+
+// AUIPC into rs1, then a load of rd relative to it
+#define FUSED_LOAD_HANDLER(name, load, type) \
+  UOP_HANDLER(auipc_##name) \
+  { \
+    uint64_t base = cpu->pc + uop->imm, value; \
+    \
+    cpu->registers[uop->rs1] = base; \
+    if (load(cpu, base + FUSED_IMM(uop), &value)) \
+    { \
+      cpu->pc += 4; \
+      return 1; \
+    } \
+    \
+    cpu->registers[uop->rd] = (uint64_t) (type) value; \
+    return 0; \
+  }
+
+FUSED_LOAD_HANDLER(lb, riscv_cpu_load8, int8_t)
+FUSED_LOAD_HANDLER(lh, riscv_cpu_load16, int16_t)
+FUSED_LOAD_HANDLER(lw, riscv_cpu_load32, int32_t)
+FUSED_LOAD_HANDLER(ld, riscv_cpu_load64, uint64_t)
+FUSED_LOAD_HANDLER(lbu, riscv_cpu_load8, uint8_t)
+FUSED_LOAD_HANDLER(lhu, riscv_cpu_load16, uint16_t)
+FUSED_LOAD_HANDLER(lwu, riscv_cpu_load32, uint32_t)
+
+// a far call or tail call, the link is written after rs1 in case they are the same register
+UOP_HANDLER(auipc_jalr)
+{
+  uint64_t base = cpu->pc + uop->imm;
+
+  cpu->registers[uop->rs1] = base;
+  cpu->registers[uop->rd] = cpu->pc + uop->len;
+  cpu->pc = (base + FUSED_IMM(uop)) & ~(uint64_t) 1;
+  return 1;
+}
+
+#define RISCV_UOP_HANDLER(name) [RISCV_UOP_##name] = riscv_uop_##name,
+
+static const riscv_uop_handler riscv_uop_handlers[RISCV_UOP_COUNT] = {
+  RISCV_UOPS(RISCV_UOP_HANDLER)
+};
+
+#ifdef RISCV_THREADED
+/*
+ * Threaded-code interpreter, the counterpart of the handler call loop in
+ * riscv_cpu_exec_uops. Each micro-op gets its own label with the handler
+ * inlined and ends in its own indirect jump to the next one, so the host
+ * predicts each of these jumps separately instead of sharing one call site
+ * between every micro-op. Returns how many micro-ops were executed.
+ */
+uint64_t riscv_uop_exec_threaded(struct riscv_cpu * const restrict cpu, const struct riscv_uop * uop,
+                                 const struct riscv_uop * const end)
+{
+#define RISCV_UOP_LABEL(name) [RISCV_UOP_##name] = &&uop_##name,
+
+  static const void * const labels[RISCV_UOP_COUNT] = {
+    RISCV_UOPS(RISCV_UOP_LABEL)
+  };
+  const struct riscv_uop * const start = uop;
+
+  if (uop == end)
+    return 0;
+
+  cpu->registers[x0] = 0;
+  goto *labels[uop->op];
+
+#define RISCV_UOP_DISPATCH(name) \
+  uop_##name: \
+    RISCV_PROFILE_UOP(cpu, uop); \
+    RISCV_TRACE_BEGIN(cpu, uop); \
+    if (riscv_uop_##name(cpu, uop)) \
+    { \
+      RISCV_TRACE_END(cpu); \
+      uop++; \
+      goto done; \
+    } \
+    RISCV_TRACE_END(cpu); \
+    cpu->pc += uop->len; \
+    cpu->registers[x0] = 0; \
+    if (++uop == end) \
+      goto done; \
+    goto *labels[uop->op];
+
+  RISCV_UOPS(RISCV_UOP_DISPATCH)
+
+done:
+  cpu->registers[x0] = 0;
+
+  return uop - start;
+}
+#endif
+
+// OP-FP, funct7 holds the operation in its upper five bits and the format, S or D, in the lower two
+static void riscv_decode_fp(uint32_t inst, struct riscv_uop * const restrict uop)
+{
+  static const uint8_t to_int[2][4] = {
+    { RISCV_UOP_fcvt_w_s, RISCV_UOP_fcvt_wu_s, RISCV_UOP_fcvt_l_s, RISCV_UOP_fcvt_lu_s },
+    { RISCV_UOP_fcvt_w_d, RISCV_UOP_fcvt_wu_d, RISCV_UOP_fcvt_l_d, RISCV_UOP_fcvt_lu_d }
+  };
+  static const uint8_t from_int[2][4] = {
+    { RISCV_UOP_fcvt_s_w, RISCV_UOP_fcvt_s_wu, RISCV_UOP_fcvt_s_l, RISCV_UOP_fcvt_s_lu },
+    { RISCV_UOP_fcvt_d_w, RISCV_UOP_fcvt_d_wu, RISCV_UOP_fcvt_d_l, RISCV_UOP_fcvt_d_lu }
+  };
+  uint32_t funct3 = (inst >> 12) & 0x7;
+  uint32_t fmt = (inst >> 25) & 0x3;
+
+  if (fmt > 1)
+    return;
+
+#define FP_OP(name) (fmt ? RISCV_UOP_##name##_d : RISCV_UOP_##name##_s)
+
+  switch (inst >> 27)
+  {
+    case 0x00: uop->op = FP_OP(fadd); break;
+    case 0x01: uop->op = FP_OP(fsub); break;
+    case 0x02: uop->op = FP_OP(fmul); break;
+    case 0x03: uop->op = FP_OP(fdiv); break;
+
+    case 0x0b:
+      if (uop->rs2 == 0)
+        uop->op = FP_OP(fsqrt);
+      break;
+
+    case 0x04:
+      switch (funct3)
+      {
+        case 0x0: uop->op = FP_OP(fsgnj); break;
+        case 0x1: uop->op = FP_OP(fsgnjn); break;
+        case 0x2: uop->op = FP_OP(fsgnjx); break;
+      }
+      break;
+
+    case 0x05:
+      switch (funct3)
+      {
+        case 0x0: uop->op = FP_OP(fmin); break;
+        case 0x1: uop->op = FP_OP(fmax); break;
+      }
+      break;
+
+    // FCVT.S.D and FCVT.D.S, rs2 is the source format
+    case 0x08:
+      if (uop->rs2 == !fmt)
+        uop->op = fmt ? RISCV_UOP_fcvt_d_s : RISCV_UOP_fcvt_s_d;
+      break;
+
+    case 0x14:
+      switch (funct3)
+      {
+        case 0x0: uop->op = FP_OP(fle); break;
+        case 0x1: uop->op = FP_OP(flt); break;
+        case 0x2: uop->op = FP_OP(feq); break;
+      }
+      break;
+
+    // rs2 selects W, WU, L or LU
+    case 0x18:
+      if (uop->rs2 < 4)
+        uop->op = to_int[fmt][uop->rs2];
+      break;
+
+    case 0x1a:
+      if (uop->rs2 < 4)
+        uop->op = from_int[fmt][uop->rs2];
+      break;
+
+    case 0x1c:
+      if (uop->rs2 != 0)
+        break;
+      if (funct3 == 0x0)
+        uop->op = fmt ? RISCV_UOP_fmv_x_d : RISCV_UOP_fmv_x_w;
+      else if (funct3 == 0x1)
+        uop->op = FP_OP(fclass);
+      break;
+
+    case 0x1e:
+      if (uop->rs2 == 0 && funct3 == 0x0)
+        uop->op = fmt ? RISCV_UOP_fmv_d_x : RISCV_UOP_fmv_w_x;
+      break;
+  }
+
+#undef FP_OP
+}
+
+// fill in everything but the handler, returns 1 if the instruction ends a basic block
+static int riscv_decode_op(uint32_t inst, struct riscv_uop * const restrict uop)
+{
+  uint32_t opcode = inst & 0x7f;
+  uint32_t funct3 = (inst >> 12) & 0x7;
+  uint32_t funct7 = (inst >> 25) & 0x7f;
+
+  uop->inst = inst;
+  uop->rd = riscv_inst_rd(inst);
+  uop->rs1 = riscv_inst_rs1(inst);
+  uop->rs2 = riscv_inst_rs2(inst);
+  uop->imm = 0;
+  uop->op = RISCV_UOP_unimpl;
+
+  switch (opcode)
+  {
+    case 0x03:
+      uop->imm = riscv_insti_imm(inst);
+      switch (funct3)
+      {
+        case 0x0: uop->op = RISCV_UOP_lb; break;
+        case 0x1: uop->op = RISCV_UOP_lh; break;
+        case 0x2: uop->op = RISCV_UOP_lw; break;
+        case 0x3: uop->op = RISCV_UOP_ld; break;
+        case 0x4: uop->op = RISCV_UOP_lbu; break;
+        case 0x5: uop->op = RISCV_UOP_lhu; break;
+        case 0x6: uop->op = RISCV_UOP_lwu; break;
+      }
+      break;
+
+    case 0x07:
+      uop->imm = riscv_insti_imm(inst);
+      switch (funct3)
+      {
+        case 0x2: uop->op = RISCV_UOP_flw; break;
+        case 0x3: uop->op = RISCV_UOP_fld; break;
+      }
+      break;
+
+    case 0x0f:
+      switch (funct3)
+      {
+        case 0x0: uop->op = RISCV_UOP_fence; break;
+        case 0x1: uop->op = RISCV_UOP_fence_i; return 1;
+      }
+      break;
+
+    case 0x13:
+      uop->imm = riscv_insti_imm(inst);
+      switch (funct3)
+      {
+        case 0x0: uop->op = RISCV_UOP_addi; break;
+        case 0x2: uop->op = RISCV_UOP_slti; break;
+        case 0x3: uop->op = RISCV_UOP_sltiu; break;
+        case 0x4: uop->op = RISCV_UOP_xori; break;
+        case 0x6: uop->op = RISCV_UOP_ori; break;
+        case 0x7: uop->op = RISCV_UOP_andi; break;
+
+        case 0x1:
+          if ((uop->imm >> 6) == 0x00)        // SLLI
+            uop->op = RISCV_UOP_slli;
+          uop->imm &= 0x3f;
+          break;
+
+        case 0x5:
+          if ((uop->imm >> 6) == 0x00)        // SRLI
+            uop->op = RISCV_UOP_srli;
+          else if ((uop->imm >> 6) == 0x10)   // SRAI
+            uop->op = RISCV_UOP_srai;
+          uop->imm &= 0x3f;
+          break;
+      }
+      break;
+
+    case 0x17:
+      uop->imm = riscv_instu_imm(inst);
+      uop->op = RISCV_UOP_auipc;
+      break;
+
+    case 0x1b:
+      uop->imm = riscv_insti_imm(inst);
+      switch (funct3)
+      {
+        case 0x0: uop->op = RISCV_UOP_addiw; break;
+
+        case 0x1:
+          if ((uop->imm >> 5) == 0x00)        // SLLIW
+            uop->op = RISCV_UOP_slliw;
+          uop->imm &= 0x1f;
+          break;
+
+        case 0x5:
+          if ((uop->imm >> 5) == 0x00)        // SRLIW
+            uop->op = RISCV_UOP_srliw;
+          else if ((uop->imm >> 5) == 0x20)   // SRAIW
+            uop->op = RISCV_UOP_sraiw;
+          uop->imm &= 0x1f;
+          break;
+      }
+      break;
+
+    case 0x23:
+      uop->imm = riscv_insts_imm(inst);
+      switch (funct3)
+      {
+        case 0x0: uop->op = RISCV_UOP_sb; break;
+        case 0x1: uop->op = RISCV_UOP_sh; break;
+        case 0x2: uop->op = RISCV_UOP_sw; break;
+        case 0x3: uop->op = RISCV_UOP_sd; break;
+      }
+      break;
+
+    case 0x27:
+      uop->imm = riscv_insts_imm(inst);
+      switch (funct3)
+      {
+        case 0x2: uop->op = RISCV_UOP_fsw; break;
+        case 0x3: uop->op = RISCV_UOP_fsd; break;
+      }
+      break;
+
+    case 0x2f:
+      if (funct3 == 0x2)
+      {
+        switch (funct7 >> 2)
+        {
+          case 0x00: uop->op = RISCV_UOP_amoadd_w; break;
+          case 0x01: uop->op = RISCV_UOP_amoswap_w; break;
+          case 0x02: if (uop->rs2 == 0) uop->op = RISCV_UOP_lr_w; break;
+          case 0x03: uop->op = RISCV_UOP_sc_w; break;
+          case 0x04: uop->op = RISCV_UOP_amoxor_w; break;
+          case 0x08: uop->op = RISCV_UOP_amoor_w; break;
+          case 0x0c: uop->op = RISCV_UOP_amoand_w; break;
+          case 0x10: uop->op = RISCV_UOP_amomin_w; break;
+          case 0x14: uop->op = RISCV_UOP_amomax_w; break;
+          case 0x18: uop->op = RISCV_UOP_amominu_w; break;
+          case 0x1c: uop->op = RISCV_UOP_amomaxu_w; break;
+        }
+      }
+      else if (funct3 == 0x3)
+      {
+        switch (funct7 >> 2)
+        {
+          case 0x00: uop->op = RISCV_UOP_amoadd_d; break;
+          case 0x01: uop->op = RISCV_UOP_amoswap_d; break;
+          case 0x02: if (uop->rs2 == 0) uop->op = RISCV_UOP_lr_d; break;
+          case 0x03: uop->op = RISCV_UOP_sc_d; break;
+          case 0x04: uop->op = RISCV_UOP_amoxor_d; break;
+          case 0x08: uop->op = RISCV_UOP_amoor_d; break;
+          case 0x0c: uop->op = RISCV_UOP_amoand_d; break;
+          case 0x10: uop->op = RISCV_UOP_amomin_d; break;
+          case 0x14: uop->op = RISCV_UOP_amomax_d; break;
+          case 0x18: uop->op = RISCV_UOP_amominu_d; break;
+          case 0x1c: uop->op = RISCV_UOP_amomaxu_d; break;
+        }
+      }
+      break;
+
+    case 0x33:
+      switch (funct7)
+      {
+        case 0x00:
+          switch (funct3)
+          {
+            case 0x0: uop->op = RISCV_UOP_add; break;
+            case 0x1: uop->op = RISCV_UOP_sll; break;
+            case 0x2: uop->op = RISCV_UOP_slt; break;
+            case 0x3: uop->op = RISCV_UOP_sltu; break;
+            case 0x4: uop->op = RISCV_UOP_xor; break;
+            case 0x5: uop->op = RISCV_UOP_srl; break;
+            case 0x6: uop->op = RISCV_UOP_or; break;
+            case 0x7: uop->op = RISCV_UOP_and; break;
+          }
+          break;
+
+        case 0x20:
+          switch (funct3)
+          {
+            case 0x0: uop->op = RISCV_UOP_sub; break;
+            case 0x5: uop->op = RISCV_UOP_sra; break;
+          }
+          break;
+
+        case 0x01:
+          switch (funct3)
+          {
+            case 0x0: uop->op = RISCV_UOP_mul; break;
+            case 0x1: uop->op = RISCV_UOP_mulh; break;
+            case 0x2: uop->op = RISCV_UOP_mulhsu; break;
+            case 0x3: uop->op = RISCV_UOP_mulhu; break;
+            case 0x4: uop->op = RISCV_UOP_div; break;
+            case 0x5: uop->op = RISCV_UOP_divu; break;
+            case 0x6: uop->op = RISCV_UOP_rem; break;
+            case 0x7: uop->op = RISCV_UOP_remu; break;
+          }
+          break;
+      }
+      break;
+
+    case 0x37:
+      uop->imm = riscv_instu_imm(inst);
+      uop->op = RISCV_UOP_lui;
+      break;
+
+    case 0x3b:
+      switch (funct7)
+      {
+        case 0x00:
+          switch (funct3)
+          {
+            case 0x0: uop->op = RISCV_UOP_addw; break;
+            case 0x1: uop->op = RISCV_UOP_sllw; break;
+            case 0x5: uop->op = RISCV_UOP_srlw; break;
+          }
+          break;
+
+        case 0x20:
+          switch (funct3)
+          {
+            case 0x0: uop->op = RISCV_UOP_subw; break;
+            case 0x5: uop->op = RISCV_UOP_sraw; break;
+          }
+          break;
+
+        case 0x01:
+          switch (funct3)
+          {
+            case 0x0: uop->op = RISCV_UOP_mulw; break;
+            case 0x4: uop->op = RISCV_UOP_divw; break;
+            case 0x5: uop->op = RISCV_UOP_divuw; break;
+            case 0x6: uop->op = RISCV_UOP_remw; break;
+            case 0x7: uop->op = RISCV_UOP_remuw; break;
+          }
+          break;
+      }
+      break;
+
+    // fused multiply-adds, the format is in the low bits of funct7
+    case 0x43:
+      if ((funct7 & 0x3) < 2)
+        uop->op = (funct7 & 0x3) ? RISCV_UOP_fmadd_d : RISCV_UOP_fmadd_s;
+      break;
+
+    case 0x47:
+      if ((funct7 & 0x3) < 2)
+        uop->op = (funct7 & 0x3) ? RISCV_UOP_fmsub_d : RISCV_UOP_fmsub_s;
+      break;
+
+    case 0x4b:
+      if ((funct7 & 0x3) < 2)
+        uop->op = (funct7 & 0x3) ? RISCV_UOP_fnmsub_d : RISCV_UOP_fnmsub_s;
+      break;
+
+    case 0x4f:
+      if ((funct7 & 0x3) < 2)
+        uop->op = (funct7 & 0x3) ? RISCV_UOP_fnmadd_d : RISCV_UOP_fnmadd_s;
+      break;
+
+    case 0x53:
+      riscv_decode_fp(inst, uop);
+      break;
+
+    case 0x63:
+      uop->imm = riscv_instb_imm(inst);
+      switch (funct3)
+      {
+        case 0x0: uop->op = RISCV_UOP_beq; break;
+        case 0x1: uop->op = RISCV_UOP_bne; break;
+        case 0x4: uop->op = RISCV_UOP_blt; break;
+        case 0x5: uop->op = RISCV_UOP_bge; break;
+        case 0x6: uop->op = RISCV_UOP_bltu; break;
+        case 0x7: uop->op = RISCV_UOP_bgeu; break;
+      }
+      return 1;
+
+    case 0x67:
+      uop->imm = riscv_insti_imm(inst);
+      if (funct3 == 0x0)
+        uop->op = RISCV_UOP_jalr;
+      return 1;
+
+    case 0x6f:
+      uop->imm = riscv_instj_imm(inst);
+      uop->op = RISCV_UOP_jal;
+      return 1;
+
+    case 0x73:
+      uop->imm = (inst >> 20) & 0xfff;
+      switch (funct3)
+      {
+        case 0x0:
+          if (inst == 0x00000073)
+            uop->op = RISCV_UOP_ecall;
+          else if (inst == 0x00100073)
+            uop->op = RISCV_UOP_ebreak;
+          else if (inst == 0x30200073)
+            uop->op = RISCV_UOP_mret;
+          else if (inst == 0x10200073)
+            uop->op = RISCV_UOP_sret;
+          else if (inst == 0x10500073)
+            uop->op = RISCV_UOP_wfi;
+          else if (funct7 == 0x09 && uop->rd == 0)
+            uop->op = RISCV_UOP_sfence_vma;
+          break;
+
+        case 0x1: uop->op = RISCV_UOP_csrrw; break;
+        case 0x2: uop->op = RISCV_UOP_csrrs; break;
+        case 0x3: uop->op = RISCV_UOP_csrrc; break;
+        case 0x5: uop->op = RISCV_UOP_csrrwi; break;
+        case 0x6: uop->op = RISCV_UOP_csrrsi; break;
+        case 0x7: uop->op = RISCV_UOP_csrrci; break;
+      }
+
+      // a csr read that writes nothing does not change what follows, the block goes on
+      return !((funct3 & 0x2) && uop->rs1 == 0);
+  }
+
+  return uop->op == RISCV_UOP_unimpl;
+}
+
+/*
+ * RVC. Every compressed instruction is expanded into the 32-bit instruction
+ * it stands for, so one decoder and one set of handlers serve both.
+ */
+
+// bits hi..lo of a compressed instruction
+#define C_BITS(c, hi, lo) (((c) >> (lo)) & ((1U << ((hi) - (lo) + 1)) - 1))
+// the 3-bit register fields name x8-x15
+#define C_REG(c, lo) (C_BITS(c, (lo) + 2, lo) + 8)
+// a 6-bit signed immediate from bit 12 and bits 6..2
+#define C_IMM6(c) ((int32_t) ((C_BITS(c, 12, 12) << 5 | C_BITS(c, 6, 2)) << 26) >> 26)
+
+static inline uint32_t riscv_rvc_i(uint32_t opcode, uint32_t funct3, uint32_t rd, uint32_t rs1, int32_t imm)
+{
+  return ((uint32_t) imm & 0xfff) << 20 | rs1 << 15 | funct3 << 12 | rd << 7 | opcode;
+}
+
+static inline uint32_t riscv_rvc_r(uint32_t opcode, uint32_t funct3, uint32_t funct7, uint32_t rd,
+                                   uint32_t rs1, uint32_t rs2)
+{
+  return funct7 << 25 | rs2 << 20 | rs1 << 15 | funct3 << 12 | rd << 7 | opcode;
+}
+
+static inline uint32_t riscv_rvc_s(uint32_t opcode, uint32_t funct3, uint32_t rs1, uint32_t rs2, uint32_t imm)
+{
+  return (imm >> 5) << 25 | rs2 << 20 | rs1 << 15 | funct3 << 12 | (imm & 0x1f) << 7 | opcode;
+}
+
+static inline uint32_t riscv_rvc_b(uint32_t funct3, uint32_t rs1, int32_t offset)
+{
+  uint32_t imm = offset;
+
+  return ((imm >> 12) & 0x1) << 31 | ((imm >> 5) & 0x3f) << 25 | rs1 << 15 | funct3 << 12
+    | ((imm >> 1) & 0xf) << 8 | ((imm >> 11) & 0x1) << 7 | 0x63;
+}
+
+static inline uint32_t riscv_rvc_j(uint32_t rd, int32_t offset)
+{
+  uint32_t imm = offset;
+
+  return ((imm >> 20) & 0x1) << 31 | ((imm >> 1) & 0x3ff) << 21 | ((imm >> 11) & 0x1) << 20
+    | ((imm >> 12) & 0xff) << 12 | rd << 7 | 0x6f;
+}
+
+// the 32-bit equivalent of a compressed instruction, 0 (never valid) if it is reserved
+static uint32_t riscv_rvc_expand(uint32_t c)
+{
+  uint32_t rd = C_BITS(c, 11, 7), rs2 = C_BITS(c, 6, 2), imm;
+  int32_t offset;
+
+  switch (C_BITS(c, 1, 0) << 3 | C_BITS(c, 15, 13))
+  {
+    // quadrant 0
+    case 000:
+      // C.ADDI4SPN, a zero immediate (and the all-zero instruction) is reserved
+      imm = C_BITS(c, 12, 11) << 4 | C_BITS(c, 10, 7) << 6 | C_BITS(c, 6, 6) << 2 | C_BITS(c, 5, 5) << 3;
+      if (imm == 0)
+        return 0;
+      return riscv_rvc_i(0x13, 0x0, C_REG(c, 2), 2, imm);
+
+    case 001:
+      // C.FLD
+      imm = C_BITS(c, 12, 10) << 3 | C_BITS(c, 6, 5) << 6;
+      return riscv_rvc_i(0x07, 0x3, C_REG(c, 2), C_REG(c, 7), imm);
+
+    case 002:
+      // C.LW
+      imm = C_BITS(c, 12, 10) << 3 | C_BITS(c, 6, 6) << 2 | C_BITS(c, 5, 5) << 6;
+      return riscv_rvc_i(0x03, 0x2, C_REG(c, 2), C_REG(c, 7), imm);
+
+    case 003:
+      // C.LD
+      imm = C_BITS(c, 12, 10) << 3 | C_BITS(c, 6, 5) << 6;
+      return riscv_rvc_i(0x03, 0x3, C_REG(c, 2), C_REG(c, 7), imm);
+
+    case 005:
+      // C.FSD
+      imm = C_BITS(c, 12, 10) << 3 | C_BITS(c, 6, 5) << 6;
+      return riscv_rvc_s(0x27, 0x3, C_REG(c, 7), C_REG(c, 2), imm);
+
+    case 006:
+      // C.SW
+      imm = C_BITS(c, 12, 10) << 3 | C_BITS(c, 6, 6) << 2 | C_BITS(c, 5, 5) << 6;
+      return riscv_rvc_s(0x23, 0x2, C_REG(c, 7), C_REG(c, 2), imm);
+
+    case 007:
+      // C.SD
+      imm = C_BITS(c, 12, 10) << 3 | C_BITS(c, 6, 5) << 6;
+      return riscv_rvc_s(0x23, 0x3, C_REG(c, 7), C_REG(c, 2), imm);
+
+    // quadrant 1
+    case 010:
+      // C.ADDI, C.NOP
+      return riscv_rvc_i(0x13, 0x0, rd, rd, C_IMM6(c));
+
+    case 011:
+      // C.ADDIW
+      if (rd == 0)
+        return 0;
+      return riscv_rvc_i(0x1b, 0x0, rd, rd, C_IMM6(c));
+
+    case 012:
+      // C.LI
+      return riscv_rvc_i(0x13, 0x0, rd, 0, C_IMM6(c));
+
+    case 013:
+      if (rd == 2)
+      {
+        // C.ADDI16SP
+        offset = (int32_t) ((C_BITS(c, 12, 12) << 9 | C_BITS(c, 6, 6) << 4 | C_BITS(c, 5, 5) << 6
+                             | C_BITS(c, 4, 3) << 7 | C_BITS(c, 2, 2) << 5) << 22) >> 22;
+        if (offset == 0)
+          return 0;
+        return riscv_rvc_i(0x13, 0x0, 2, 2, offset);
+      }
+
+      // C.LUI
+      if (C_IMM6(c) == 0)
+        return 0;
+      return ((uint32_t) C_IMM6(c) << 12) | rd << 7 | 0x37;
+
+    case 014:
+      rd = C_REG(c, 7);
+      switch (C_BITS(c, 11, 10))
+      {
+        case 0x0:
+          // C.SRLI
+          return riscv_rvc_i(0x13, 0x5, rd, rd, C_BITS(c, 12, 12) << 5 | rs2);
+        case 0x1:
+          // C.SRAI
+          return riscv_rvc_i(0x13, 0x5, rd, rd, 0x400 | C_BITS(c, 12, 12) << 5 | rs2);
+        case 0x2:
+          // C.ANDI
+          return riscv_rvc_i(0x13, 0x7, rd, rd, C_IMM6(c));
+      }
+
+      rs2 = C_REG(c, 2);
+      switch (C_BITS(c, 12, 12) << 2 | C_BITS(c, 6, 5))
+      {
+        case 0x0: return riscv_rvc_r(0x33, 0x0, 0x20, rd, rd, rs2);       // C.SUB
+        case 0x1: return riscv_rvc_r(0x33, 0x4, 0x00, rd, rd, rs2);       // C.XOR
+        case 0x2: return riscv_rvc_r(0x33, 0x6, 0x00, rd, rd, rs2);       // C.OR
+        case 0x3: return riscv_rvc_r(0x33, 0x7, 0x00, rd, rd, rs2);       // C.AND
+        case 0x4: return riscv_rvc_r(0x3b, 0x0, 0x20, rd, rd, rs2);       // C.SUBW
+        case 0x5: return riscv_rvc_r(0x3b, 0x0, 0x00, rd, rd, rs2);       // C.ADDW
+      }
+      return 0;
+
+    case 015:
+      // C.J
+      offset = (int32_t) ((C_BITS(c, 12, 12) << 11 | C_BITS(c, 11, 11) << 4 | C_BITS(c, 10, 9) << 8
+                           | C_BITS(c, 8, 8) << 10 | C_BITS(c, 7, 7) << 6 | C_BITS(c, 6, 6) << 7
+                           | C_BITS(c, 5, 3) << 1 | C_BITS(c, 2, 2) << 5) << 20) >> 20;
+      return riscv_rvc_j(0, offset);
+
+    case 016:
+    case 017:
+      // C.BEQZ, C.BNEZ
+      offset = (int32_t) ((C_BITS(c, 12, 12) << 8 | C_BITS(c, 11, 10) << 3 | C_BITS(c, 6, 5) << 6
+                           | C_BITS(c, 4, 3) << 1 | C_BITS(c, 2, 2) << 5) << 23) >> 23;
+      return riscv_rvc_b(C_BITS(c, 13, 13), C_REG(c, 7), offset);
+
+    // quadrant 2
+    case 020:
+      // C.SLLI
+      return riscv_rvc_i(0x13, 0x1, rd, rd, C_BITS(c, 12, 12) << 5 | rs2);
+
+    case 021:
+      // C.FLDSP
+      imm = C_BITS(c, 12, 12) << 5 | C_BITS(c, 6, 5) << 3 | C_BITS(c, 4, 2) << 6;
+      return riscv_rvc_i(0x07, 0x3, rd, 2, imm);
+
+    case 022:
+      // C.LWSP
+      if (rd == 0)
+        return 0;
+      imm = C_BITS(c, 12, 12) << 5 | C_BITS(c, 6, 4) << 2 | C_BITS(c, 3, 2) << 6;
+      return riscv_rvc_i(0x03, 0x2, rd, 2, imm);
+
+    case 023:
+      // C.LDSP
+      if (rd == 0)
+        return 0;
+      imm = C_BITS(c, 12, 12) << 5 | C_BITS(c, 6, 5) << 3 | C_BITS(c, 4, 2) << 6;
+      return riscv_rvc_i(0x03, 0x3, rd, 2, imm);
+
+    case 024:
+      if (C_BITS(c, 12, 12) == 0)
+      {
+        // C.JR, C.MV
+        if (rs2 != 0)
+          return riscv_rvc_r(0x33, 0x0, 0x00, rd, 0, rs2);
+        if (rd == 0)
+          return 0;
+        return riscv_rvc_i(0x67, 0x0, 0, rd, 0);
+      }
+
+      // C.EBREAK, C.JALR, C.ADD
+      if (rs2 != 0)
+        return riscv_rvc_r(0x33, 0x0, 0x00, rd, rd, rs2);
+      if (rd == 0)
+        return 0x00100073;
+      return riscv_rvc_i(0x67, 0x0, 1, rd, 0);
+
+    case 025:
+      // C.FSDSP
+      imm = C_BITS(c, 12, 10) << 3 | C_BITS(c, 9, 7) << 6;
+      return riscv_rvc_s(0x27, 0x3, 2, rs2, imm);
+
+    case 026:
+      // C.SWSP
+      imm = C_BITS(c, 12, 9) << 2 | C_BITS(c, 8, 7) << 6;
+      return riscv_rvc_s(0x23, 0x2, 2, rs2, imm);
+
+    case 027:
+      // C.SDSP
+      imm = C_BITS(c, 12, 10) << 3 | C_BITS(c, 9, 7) << 6;
+      return riscv_rvc_s(0x23, 0x3, 2, rs2, imm);
+  }
+
+  return 0;
+}
+
+/*
+ * Decode an instruction into a micro-op, a compressed one from the low 16
+ * bits of inst. Blocks cache the micro-op, so the expansion is done once.
+ * Returns 1 if the instruction ends a basic block, 0 otherwise.
+ */
+int riscv_decode(uint32_t inst, struct riscv_uop * const restrict uop)
+{
+  int end;
+
+  if (riscv_inst_len(inst) == 4)
+  {
+    end = riscv_decode_op(inst, uop);
+    uop->len = 4;
+  }
+  else
+  {
+    end = riscv_decode_op(riscv_rvc_expand(inst & 0xffff), uop);
+    uop->len = 2;
+
+    // an illegal instruction reports its own encoding in mtval
+    if (uop->op == RISCV_UOP_unimpl)
+      uop->inst = inst & 0xffff;
+  }
+
+  uop->handler = riscv_uop_handlers[uop->op];
+
+  return end;
+}
+
+// a micro-op that raises the given exception when executed
+void riscv_decode_exception(uint64_t cause, uint64_t value, struct riscv_uop * const restrict uop)
+{
+  uop->op = RISCV_UOP_exception;
+  uop->handler = riscv_uop_exception;
+  uop->imm = value;
+  uop->inst = (uint32_t) cause;
+  uop->rd = uop->rs1 = uop->rs2 = 0;
+  uop->len = 0;
+}
+
+/*
+ * Macro-op fusion: fold the micro-op of the next instruction into uop if the
+ * two are one of the idioms compilers emit as a pair,
+ *
+ *   lui rd, hi; addi(w) rd, rd, lo          a 32-bit constant
+ *   slli rd, rs, a; srli rd, rd, b          zero-extension, bit fields
+ *   auipc r, hi; l{b,h,w,d}[u] rd, lo(r)    a pc-relative global
+ *   auipc r, hi; jalr rd, lo(r)             a far call
+ *
+ * where the second instruction reads what the first wrote. uop then runs
+ * both. Returns 1 if the pair was fused, 0 if uop was left as it was.
+ */
+int riscv_decode_fuse(struct riscv_uop * const restrict uop, const struct riscv_uop * const restrict next)
+{
+  uint8_t op;
+
+  if (uop->rd == 0 || next->rs1 != uop->rd)
+    return 0;
+
+  switch (uop->op)
+  {
+    case RISCV_UOP_lui:
+      if (next->rd != uop->rd)
+        return 0;
+
+      if (next->op == RISCV_UOP_addi)
+        uop->imm += next->imm;
+      else if (next->op == RISCV_UOP_addiw)
+        uop->imm = (int64_t) (int32_t) ((uint32_t) uop->imm + (uint32_t) next->imm);
+      else
+        return 0;
+
+      op = RISCV_UOP_lui_addi;
+      break;
+
+    case RISCV_UOP_slli:
+      if (next->op != RISCV_UOP_srli || next->rd != uop->rd)
+        return 0;
+
+      uop->rs2 = next->imm;
+      op = RISCV_UOP_slli_srli;
+      break;
+
+    case RISCV_UOP_auipc:
+      if (next->op >= RISCV_UOP_lb && next->op <= RISCV_UOP_lwu)
+        op = next->op - RISCV_UOP_lb + RISCV_UOP_auipc_lb;
+      else if (next->op == RISCV_UOP_jalr)
+        op = RISCV_UOP_auipc_jalr;
+      else
+        return 0;
+
+      // the AUIPC's register moves to rs1, the rest is the second instruction's
+      uop->rs1 = uop->rd;
+      uop->rd = next->rd;
+      uop->inst = next->inst;
+      break;
+
+    default:
+      return 0;
+  }
+
+  uop->op = op;
+  uop->handler = riscv_uop_handlers[op];
+  uop->len += next->len;
+
+  return 1;
+}
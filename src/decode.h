@@ -0,0 +1,100 @@
+/*
+  Copyright (c) 2024, Arka Mondal. All rights reserved.
+  Use of this source code is governed by a BSD-style license that
+  can be found in the LICENSE file.
+*/
+
+#ifndef _RISCVEMU_DECODE_H
+#define _RISCVEMU_DECODE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct riscv_cpu;
+struct riscv_uop;
+
+#if defined(RISCV_THREADED) && !defined(__GNUC__)
+#error "threaded dispatch needs labels as values, build with THREADED=0"
+#endif
+
+/*
+ * Every micro-op, X(name) for each. The list defines the riscv_uop_op
+ * numbering, the handler table and the labels of the threaded interpreter.
+ * The pairs riscv_decode_fuse turns into one micro-op come last.
+ */
+#define RISCV_UOPS(X) \
+  X(unimpl) X(exception) \
+  X(addi) X(slti) X(sltiu) X(xori) X(ori) X(andi) X(slli) X(srli) X(srai) \
+  X(addiw) X(slliw) X(srliw) X(sraiw) \
+  X(add) X(sub) X(sll) X(slt) X(sltu) X(xor) X(srl) X(sra) X(or) X(and) \
+  X(addw) X(subw) X(sllw) X(srlw) X(sraw) \
+  X(mul) X(mulh) X(mulhsu) X(mulhu) X(div) X(divu) X(rem) X(remu) \
+  X(mulw) X(divw) X(divuw) X(remw) X(remuw) \
+  X(lb) X(lh) X(lw) X(ld) X(lbu) X(lhu) X(lwu) \
+  X(sb) X(sh) X(sw) X(sd) \
+  X(lr_w) X(sc_w) X(amoswap_w) X(amoadd_w) X(amoxor_w) X(amoand_w) X(amoor_w) \
+  X(amomin_w) X(amomax_w) X(amominu_w) X(amomaxu_w) \
+  X(lr_d) X(sc_d) X(amoswap_d) X(amoadd_d) X(amoxor_d) X(amoand_d) X(amoor_d) \
+  X(amomin_d) X(amomax_d) X(amominu_d) X(amomaxu_d) \
+  X(lui) X(auipc) \
+  X(jal) X(jalr) X(beq) X(bne) X(blt) X(bge) X(bltu) X(bgeu) \
+  X(fence) X(fence_i) X(ecall) X(ebreak) X(mret) X(sret) X(wfi) X(sfence_vma) \
+  X(csrrw) X(csrrs) X(csrrc) X(csrrwi) X(csrrsi) X(csrrci) \
+  X(flw) X(fsw) X(fadd_s) X(fsub_s) X(fmul_s) X(fdiv_s) X(fsqrt_s) \
+  X(fmadd_s) X(fmsub_s) X(fnmsub_s) X(fnmadd_s) X(fsgnj_s) X(fsgnjn_s) X(fsgnjx_s) \
+  X(fmin_s) X(fmax_s) X(feq_s) X(flt_s) X(fle_s) X(fclass_s) X(fmv_x_w) X(fmv_w_x) \
+  X(fcvt_w_s) X(fcvt_wu_s) X(fcvt_l_s) X(fcvt_lu_s) X(fcvt_s_w) X(fcvt_s_wu) X(fcvt_s_l) X(fcvt_s_lu) \
+  X(fld) X(fsd) X(fadd_d) X(fsub_d) X(fmul_d) X(fdiv_d) X(fsqrt_d) \
+  X(fmadd_d) X(fmsub_d) X(fnmsub_d) X(fnmadd_d) X(fsgnj_d) X(fsgnjn_d) X(fsgnjx_d) \
+  X(fmin_d) X(fmax_d) X(feq_d) X(flt_d) X(fle_d) X(fclass_d) X(fmv_x_d) X(fmv_d_x) \
+  X(fcvt_w_d) X(fcvt_wu_d) X(fcvt_l_d) X(fcvt_lu_d) X(fcvt_d_w) X(fcvt_d_wu) X(fcvt_d_l) X(fcvt_d_lu) \
+  X(fcvt_s_d) X(fcvt_d_s) \
+  X(lui_addi) X(slli_srli) \
+  X(auipc_lb) X(auipc_lh) X(auipc_lw) X(auipc_ld) X(auipc_lbu) X(auipc_lhu) X(auipc_lwu) \
+  X(auipc_jalr)
+
+#define RISCV_UOP_ENUM(name) RISCV_UOP_##name,
+
+enum riscv_uop_op {
+  RISCV_UOPS(RISCV_UOP_ENUM)
+  RISCV_UOP_COUNT
+};
+
+// returns non-zero when the handler has taken care of the program counter
+typedef int (*riscv_uop_handler)(struct riscv_cpu * const restrict,
+                                  const struct riscv_uop * const restrict);
+
+// a decoded instruction, ready to be executed without looking at the encoding again
+struct riscv_uop {
+  riscv_uop_handler handler;
+  uint64_t imm;             // sign-extended immediate (or shift amount)
+  uint32_t inst;            // instruction word, a compressed one expanded
+  uint8_t op;               // enum riscv_uop_op, selects handler
+  uint8_t rd;
+  uint8_t rs1;
+  uint8_t rs2;
+  uint8_t len;              // 2 for a compressed instruction, 4 otherwise, both for a fused pair
+};
+
+// a fused pair stands for two instructions, everything else for one
+static inline uint32_t riscv_uop_fused(uint8_t op)
+{
+  return op >= RISCV_UOP_lui_addi;
+}
+
+// the low two bits of an instruction's first parcel tell its length
+static inline uint64_t riscv_inst_len(uint32_t inst)
+{
+  return ((inst & 0x3) == 0x3) ? 4 : 2;
+}
+
+int riscv_decode(uint32_t, struct riscv_uop * const restrict);
+void riscv_decode_exception(uint64_t, uint64_t, struct riscv_uop * const restrict);
+int riscv_decode_fuse(struct riscv_uop * const restrict, const struct riscv_uop * const restrict);
+
+#ifdef RISCV_THREADED
+uint64_t riscv_uop_exec_threaded(struct riscv_cpu * const restrict, const struct riscv_uop *,
+                                 const struct riscv_uop * const);
+#endif
+
+#endif /* _RISCVEMU_DECODE_H */
@@ -5,92 +5,89 @@
 */
 
 #include <stdlib.h>
+#include <sys/mman.h>
 #include "cpu.h"
 #include "dram.h"
 
-static uint64_t dram_load8(const struct dram * const restrict dram, uint64_t addr)
+/*
+ * Reserve size bytes of guest memory. Nothing is committed up front
+ * (MAP_NORESERVE), host pages are only used once the guest touches them.
+ * With DRAM_BACKING_THP the mapping is aligned to a huge page and marked for
+ * transparent huge pages; DRAM_BACKING_HUGETLB takes explicit huge pages
+ * from the hugetlbfs pool and fails if the kernel cannot provide them.
+ */
+static int dram_map(struct dram * const restrict dram, uint64_t size, enum dram_backing backing)
 {
-  return (uint64_t) dram->mem[addr - DRAM_BASE];
-}
+  uint8_t * mem;
+  uint64_t map_size, head;
 
-static uint64_t dram_load16(const struct dram * const restrict dram, uint64_t addr)
-{
-  return (uint64_t) dram->mem[addr - DRAM_BASE]
-      |  (uint64_t) dram->mem[addr - DRAM_BASE + 1] << 8;
-}
+  switch (backing)
+  {
+    case DRAM_BACKING_HUGETLB:
+      map_size = (size + DRAM_HUGE_PAGE_SIZE - 1) & ~(DRAM_HUGE_PAGE_SIZE - 1);
+      mem = mmap(NULL, map_size, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_HUGETLB, -1, 0);
+      if (mem == MAP_FAILED)
+        return -1;
 
-static uint64_t dram_load32(const struct dram * const restrict dram, uint64_t addr)
-{
-  return (uint64_t) dram->mem[addr - DRAM_BASE]
-      |  (uint64_t) dram->mem[addr - DRAM_BASE + 1] << 8
-      |  (uint64_t) dram->mem[addr - DRAM_BASE + 2] << 16
-      |  (uint64_t) dram->mem[addr - DRAM_BASE + 3] << 24;
-}
+      dram->flags = DRAM_MEM_OWNED | DRAM_MEM_HUGETLB;
+      break;
 
-static uint64_t dram_load64(const struct dram * const restrict dram, uint64_t addr)
-{
-  return (uint64_t) dram->mem[addr - DRAM_BASE]
-      |  (uint64_t) dram->mem[addr - DRAM_BASE + 1] << 8
-      |  (uint64_t) dram->mem[addr - DRAM_BASE + 2] << 16
-      |  (uint64_t) dram->mem[addr - DRAM_BASE + 3] << 24
-      |  (uint64_t) dram->mem[addr - DRAM_BASE + 4] << 32
-      |  (uint64_t) dram->mem[addr - DRAM_BASE + 5] << 40
-      |  (uint64_t) dram->mem[addr - DRAM_BASE + 6] << 48
-      |  (uint64_t) dram->mem[addr - DRAM_BASE + 7] << 56;
-}
+    case DRAM_BACKING_THP:
+      // over-allocate so that the guest memory can start on a huge page
+      map_size = size + DRAM_HUGE_PAGE_SIZE;
+      mem = mmap(NULL, map_size, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+      if (mem == MAP_FAILED)
+        return -1;
 
-static void dram_store8(struct dram * const restrict dram, uint64_t addr, uint64_t value)
-{
-  dram->mem[addr - DRAM_BASE] = value & 0xff;
-}
+      head = (DRAM_HUGE_PAGE_SIZE - ((uintptr_t) mem & (DRAM_HUGE_PAGE_SIZE - 1)))
+              & (DRAM_HUGE_PAGE_SIZE - 1);
+      if (head != 0)
+        munmap(mem, head);
+      munmap(mem + head + size, map_size - head - size);
 
-static void dram_store16(struct dram * const restrict dram, uint64_t addr, uint64_t value)
-{
-  dram->mem[addr - DRAM_BASE] = value & 0xff;
-  dram->mem[addr - DRAM_BASE + 1] = (value >> 16) & 0xff;
-}
+      mem += head;
+      map_size = size;
+      madvise(mem, map_size, MADV_HUGEPAGE);
 
-static void dram_store32(struct dram * const restrict dram, uint64_t addr, uint64_t value)
-{
-  dram->mem[addr - DRAM_BASE] = value & 0xff;
-  dram->mem[addr - DRAM_BASE + 1] = (value >> 8) & 0xff;
-  dram->mem[addr - DRAM_BASE + 2] = (value >> 16) & 0xff;
-  dram->mem[addr - DRAM_BASE + 3] = (value >> 24) & 0xff;
-}
+      dram->flags = DRAM_MEM_OWNED | DRAM_MEM_MAPPED | DRAM_MEM_THP;
+      break;
 
-static void dram_store64(struct dram * const restrict dram, uint64_t addr, uint64_t value)
-{
-  dram->mem[addr - DRAM_BASE] = value & 0xff;
-  dram->mem[addr - DRAM_BASE + 1] = (value >> 8) & 0xff;
-  dram->mem[addr - DRAM_BASE + 2] = (value >> 16) & 0xff;
-  dram->mem[addr - DRAM_BASE + 3] = (value >> 24) & 0xff;
-  dram->mem[addr - DRAM_BASE + 4] = (value >> 32) & 0xff;
-  dram->mem[addr - DRAM_BASE + 5] = (value >> 40) & 0xff;
-  dram->mem[addr - DRAM_BASE + 6] = (value >> 48) & 0xff;
-  dram->mem[addr - DRAM_BASE + 7] = (value >> 56) & 0xff;
+    default:
+      map_size = size;
+      mem = mmap(NULL, map_size, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+      if (mem == MAP_FAILED)
+        return -1;
+
+      dram->flags = DRAM_MEM_OWNED | DRAM_MEM_MAPPED;
+      break;
+  }
+
+  dram->mem = mem;
+  dram->map_size = map_size;
+
+  return 0;
 }
 
-int dram_init(struct dram * const restrict dram, void * mem_addr)
+// use mem_addr as guest memory if given, otherwise reserve size bytes
+int dram_init(struct dram * const restrict dram, void * mem_addr, uint64_t size,
+              enum dram_backing backing)
 {
-  void * mem;
-
-  if (dram == NULL)
+  if (dram == NULL || size < 8)
     return -1;
 
-  if (mem_addr == NULL)
-  {
-    mem = malloc(DRAM_SIZE);
-    if (mem == NULL)
-      return -1;
+  dram->size = size;
+  dram->dirty = NULL;
+  dram->dirty_words = NULL;
 
-    dram->flags = 0x1;
-  }
-  else
-  {
-    mem = mem_addr;
-  }
+  if (mem_addr == NULL)
+    return dram_map(dram, size, backing);
 
-  dram->mem = mem;
+  dram->mem = mem_addr;
+  dram->map_size = size;
+  dram->flags = 0;
 
   return 0;
 }
@@ -98,10 +95,9 @@ int dram_init(struct dram * const restrict dram, void * mem_addr)
 uint64_t dram_load(const struct dram * const restrict dram, uint64_t addr, uint64_t size)
 {
   uint64_t data;
-  extern struct riscv_cpu * this_cpu;
+  int status;
 
-  if ((dram == NULL) || (dram->mem == NULL) || (addr < DRAM_BASE)
-      || ((8 * (DRAM_SIZE + DRAM_BASE - addr)) < size))        // DRAM_SIZE - (addr - DRAM_BASE)
+  if ((dram == NULL) || (dram->mem == NULL))
   {
     this_cpu->panic = 0x1;
     return (uint64_t) -1;
@@ -110,20 +106,25 @@ uint64_t dram_load(const struct dram * const restrict dram, uint64_t addr, uint6
   switch (size)
   {
     case 8:
-      data = dram_load8(dram, addr);
+      status = dram_load8(dram, addr, &data);
       break;
     case 16:
-      data = dram_load16(dram, addr);
+      status = dram_load16(dram, addr, &data);
       break;
     case 32:
-      data = dram_load32(dram, addr);
+      status = dram_load32(dram, addr, &data);
       break;
     case 64:
-      data = dram_load64(dram, addr);
+      status = dram_load64(dram, addr, &data);
       break;
     default:
-      this_cpu->panic = 0x1;
-      data = (uint64_t) -1;
+      status = -1;
+  }
+
+  if (status != 0)
+  {
+    this_cpu->panic = 0x1;
+    data = (uint64_t) -1;
   }
 
   return data;
@@ -134,25 +135,22 @@ int dram_store(struct dram * const restrict dram, uint64_t addr,
 {
   int status;
 
-  if ((dram == NULL) || (dram->mem == NULL) || (addr < DRAM_BASE)
-      || ((8 * (DRAM_SIZE + DRAM_BASE - addr)) < size))        // DRAM_SIZE - (addr - DRAM_BASE)
+  if ((dram == NULL) || (dram->mem == NULL))
     return -1;
 
-  status = 0;
-
   switch (size)
   {
     case 8:
-      dram_store8(dram, addr, value);
+      status = dram_store8(dram, addr, value);
       break;
     case 16:
-      dram_store16(dram, addr, value);
+      status = dram_store16(dram, addr, value);
       break;
     case 32:
-      dram_store32(dram, addr, value);
+      status = dram_store32(dram, addr, value);
       break;
     case 64:
-      dram_store64(dram, addr, value);
+      status = dram_store64(dram, addr, value);
       break;
     default:
       status = -1;
@@ -167,11 +165,96 @@ int dram_deinit(struct dram * const restrict dram)
   if (dram == NULL)
     return -1;
 
-  if (dram->flags & 0x1)
-    free(dram->mem);
+  if (dram->flags & DRAM_MEM_OWNED)
+    munmap(dram->mem, dram->map_size);
+
+  free(dram->dirty);
+  free(dram->dirty_words);
+  dram->dirty = NULL;
+  dram->dirty_words = NULL;
 
   dram->mem = NULL;
+  dram->size = 0;
+  dram->map_size = 0;
   dram->flags = 0;
 
   return 0;
 }
+
+/*
+ * Start tracking the pages written to guest memory, or forget the pages
+ * recorded so far if tracking is already on. Stores through TLB entries
+ * created before this are not seen, the caller flushes the harts' TLBs.
+ */
+int dram_track(struct dram * const restrict dram)
+{
+  uint64_t pages, words;
+
+  if (dram == NULL)
+    return -1;
+
+  pages = (dram->size + (1UL << DRAM_PAGE_SHIFT) - 1) >> DRAM_PAGE_SHIFT;
+  words = (pages + 63) / 64;
+
+  if (dram->dirty == NULL)
+  {
+    dram->dirty = calloc(words, sizeof(uint64_t));
+    dram->dirty_words = calloc((words + 63) / 64, sizeof(uint64_t));
+    if (dram->dirty == NULL || dram->dirty_words == NULL)
+    {
+      free(dram->dirty);
+      free(dram->dirty_words);
+      dram->dirty = NULL;
+      dram->dirty_words = NULL;
+      return -1;
+    }
+
+    return 0;
+  }
+
+  memset(dram->dirty, 0x0, words * sizeof(uint64_t));
+  memset(dram->dirty_words, 0x0, (words + 63) / 64 * sizeof(uint64_t));
+
+  return 0;
+}
+
+/*
+ * Call visit(arg, offset) with the offset of every page written since
+ * tracking started or the last drain, in address order, and forget them.
+ * The work is proportional to the number of dirty pages, not to the size of
+ * guest memory. Returns the number of pages, or -1 if visit failed, in which
+ * case the pages not visited yet stay dirty.
+ */
+int64_t dram_drain_dirty(struct dram * const restrict dram, int (*visit)(void *, uint64_t), void * arg)
+{
+  uint64_t words, summary, bits, w, page;
+  int64_t count = 0;
+  size_t i;
+
+  if (dram == NULL || dram->dirty == NULL)
+    return -1;
+
+  words = (((dram->size + (1UL << DRAM_PAGE_SHIFT) - 1) >> DRAM_PAGE_SHIFT) + 63) / 64;
+
+  for (i = 0; i < (words + 63) / 64; i++)
+  {
+    for (summary = dram->dirty_words[i]; summary != 0; summary &= summary - 1)
+    {
+      w = i * 64 + __builtin_ctzl(summary);
+
+      for (bits = dram->dirty[w]; bits != 0; bits &= bits - 1)
+      {
+        page = w * 64 + __builtin_ctzl(bits);
+        if (visit(arg, page << DRAM_PAGE_SHIFT) != 0)
+          return -1;
+
+        dram->dirty[w] &= ~(1UL << (page & 63));
+        count++;
+      }
+
+      dram->dirty_words[i] &= ~(1UL << (w & 63));
+    }
+  }
+
+  return count;
+}
@@ -9,18 +9,210 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <string.h>
 
-#define DRAM_SIZE 1048576
+#define DRAM_DEFAULT_SIZE (128UL << 20)
 #define DRAM_BASE 0x80000000
+#define DRAM_HUGE_PAGE_SIZE (2UL << 20)
+#define DRAM_PAGE_SHIFT 12                // granularity of the dirty page tracking
+
+// how dram->mem was obtained, decides what dram_deinit has to undo
+#define DRAM_MEM_OWNED    0x1         // allocated by dram_init, unmapped by dram_deinit
+#define DRAM_MEM_MAPPED   0x2         // private anonymous mapping of regular pages
+#define DRAM_MEM_THP      0x4         // transparent huge pages requested with madvise
+#define DRAM_MEM_HUGETLB  0x8         // explicit huge pages (MAP_HUGETLB)
+
+// page backing requested from dram_init
+enum dram_backing {
+  DRAM_BACKING_DEFAULT,
+  DRAM_BACKING_THP,
+  DRAM_BACKING_HUGETLB
+};
 
 struct dram {
   uint8_t * mem;
+  uint64_t size;                      // guest visible size
+  uint64_t map_size;                  // size of the host mapping
   uint8_t flags;
+
+  /*
+   * Pages written since dram_track, one bit per page, NULL when not tracking.
+   * A bit of dirty_words is set when the matching 64-bit word of dirty is
+   * non-zero, so that the dirty pages can be found without scanning the
+   * whole bitmap.
+   */
+  uint64_t * dirty;
+  uint64_t * dirty_words;
 };
 
-int dram_init(struct dram * const restrict, void *);
+int dram_init(struct dram * const restrict, void *, uint64_t, enum dram_backing);
 int dram_deinit(struct dram * const restrict);
+int dram_track(struct dram * const restrict);
+int64_t dram_drain_dirty(struct dram * const restrict, int (*)(void *, uint64_t), void *);
 uint64_t dram_load(const struct dram * const restrict, uint64_t, uint64_t);
 int dram_store(struct dram * const restrict, uint64_t, uint64_t, uint64_t);
 
+/*
+ * Width-specialized accessors. Each one does a single bounds check (an
+ * address below DRAM_BASE wraps around and fails it as well) and then
+ * a single host load or store; the guest is little-endian, so only
+ * big-endian hosts pay for a byte swap.
+ */
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define DRAM_LE16(x) __builtin_bswap16(x)
+#define DRAM_LE32(x) __builtin_bswap32(x)
+#define DRAM_LE64(x) __builtin_bswap64(x)
+#else
+#define DRAM_LE16(x) (x)
+#define DRAM_LE32(x) (x)
+#define DRAM_LE64(x) (x)
+#endif
+
+#define DRAM_IN_RANGE(addr, width) ((addr) - DRAM_BASE <= dram->size - (width))
+
+static inline void dram_mark_page(struct dram * const restrict dram, uint64_t page)
+{
+  uint64_t bit = 1UL << (page & 63);
+
+  if (__atomic_load_n(&dram->dirty[page >> 6], __ATOMIC_RELAXED) & bit)
+    return;
+
+  __atomic_fetch_or(&dram->dirty[page >> 6], bit, __ATOMIC_RELAXED);
+  __atomic_fetch_or(&dram->dirty_words[page >> 12], 1UL << ((page >> 6) & 63), __ATOMIC_RELAXED);
+}
+
+/*
+ * Record a write of size bytes at offset in guest memory. Host code writing
+ * guest memory without a store TLB entry calls this, and so does the MMU
+ * when it creates such an entry, so the fast store paths do not pay for it.
+ */
+static inline void dram_mark_dirty(struct dram * const restrict dram, uint64_t offset, uint64_t size)
+{
+  uint64_t page;
+
+  if (dram->dirty == NULL || size == 0)
+    return;
+
+  // the bitmap covers guest memory only, whatever lies beyond it is no page of it
+  if (offset >= dram->size)
+    return;
+
+  if (size > dram->size - offset)
+    size = dram->size - offset;
+
+  for (page = offset >> DRAM_PAGE_SHIFT; page <= (offset + size - 1) >> DRAM_PAGE_SHIFT; page++)
+    dram_mark_page(dram, page);
+}
+
+// record a device write of size bytes at guest physical address addr, see dram_ptr
+static inline void dram_mark_dma(struct dram * const restrict dram, uint64_t addr, uint64_t size)
+{
+  dram_mark_dirty(dram, addr - DRAM_BASE, size);
+}
+
+// host address of [addr, addr + size) for device DMA, NULL unless all of it is guest memory
+static inline uint8_t * dram_ptr(const struct dram * const restrict dram, uint64_t addr, uint64_t size)
+{
+  if (addr - DRAM_BASE > dram->size || size > dram->size - (addr - DRAM_BASE))
+    return NULL;
+
+  return dram->mem + (addr - DRAM_BASE);
+}
+
+static inline int dram_load8(const struct dram * const restrict dram, uint64_t addr,
+                              uint64_t * const restrict value)
+{
+  if (!DRAM_IN_RANGE(addr, 1))
+    return -1;
+
+  *value = dram->mem[addr - DRAM_BASE];
+  return 0;
+}
+
+static inline int dram_load16(const struct dram * const restrict dram, uint64_t addr,
+                              uint64_t * const restrict value)
+{
+  uint16_t data;
+
+  if (!DRAM_IN_RANGE(addr, 2))
+    return -1;
+
+  memcpy(&data, dram->mem + (addr - DRAM_BASE), sizeof(data));
+  *value = DRAM_LE16(data);
+  return 0;
+}
+
+static inline int dram_load32(const struct dram * const restrict dram, uint64_t addr,
+                              uint64_t * const restrict value)
+{
+  uint32_t data;
+
+  if (!DRAM_IN_RANGE(addr, 4))
+    return -1;
+
+  memcpy(&data, dram->mem + (addr - DRAM_BASE), sizeof(data));
+  *value = DRAM_LE32(data);
+  return 0;
+}
+
+static inline int dram_load64(const struct dram * const restrict dram, uint64_t addr,
+                              uint64_t * const restrict value)
+{
+  uint64_t data;
+
+  if (!DRAM_IN_RANGE(addr, 8))
+    return -1;
+
+  memcpy(&data, dram->mem + (addr - DRAM_BASE), sizeof(data));
+  *value = DRAM_LE64(data);
+  return 0;
+}
+
+static inline int dram_store8(struct dram * const restrict dram, uint64_t addr, uint64_t value)
+{
+  if (!DRAM_IN_RANGE(addr, 1))
+    return -1;
+
+  dram->mem[addr - DRAM_BASE] = (uint8_t) value;
+  dram_mark_dirty(dram, addr - DRAM_BASE, 1);
+  return 0;
+}
+
+static inline int dram_store16(struct dram * const restrict dram, uint64_t addr, uint64_t value)
+{
+  uint16_t data = DRAM_LE16((uint16_t) value);
+
+  if (!DRAM_IN_RANGE(addr, 2))
+    return -1;
+
+  memcpy(dram->mem + (addr - DRAM_BASE), &data, sizeof(data));
+  dram_mark_dirty(dram, addr - DRAM_BASE, 2);
+  return 0;
+}
+
+static inline int dram_store32(struct dram * const restrict dram, uint64_t addr, uint64_t value)
+{
+  uint32_t data = DRAM_LE32((uint32_t) value);
+
+  if (!DRAM_IN_RANGE(addr, 4))
+    return -1;
+
+  memcpy(dram->mem + (addr - DRAM_BASE), &data, sizeof(data));
+  dram_mark_dirty(dram, addr - DRAM_BASE, 4);
+  return 0;
+}
+
+static inline int dram_store64(struct dram * const restrict dram, uint64_t addr, uint64_t value)
+{
+  uint64_t data = DRAM_LE64(value);
+
+  if (!DRAM_IN_RANGE(addr, 8))
+    return -1;
+
+  memcpy(dram->mem + (addr - DRAM_BASE), &data, sizeof(data));
+  dram_mark_dirty(dram, addr - DRAM_BASE, 8);
+  return 0;
+}
+
 #endif /* _RISCVEMU_DRAM_H */
@@ -0,0 +1,71 @@
+/*
+  Copyright (c) 2024, Arka Mondal. All rights reserved.
+  Use of this source code is governed by a BSD-style license that
+  can be found in the LICENSE file.
+*/
+
+#include <string.h>
+#include "event.h"
+
+int riscv_event_queue_init(struct riscv_event_queue * const restrict queue)
+{
+  if (queue == NULL)
+    return -1;
+
+  memset(queue, 0x0, sizeof(struct riscv_event_queue));
+  queue->next = RISCV_EVENT_NONE;
+
+  return 0;
+}
+
+/*
+ * Add an event source to a hart. It is due right away, so it gets to look
+ * at its device at the next block boundary.
+ */
+int riscv_event_add(struct riscv_event_queue * const restrict queue, riscv_event_update update,
+                    void * opaque)
+{
+  struct riscv_event * event;
+
+  if (queue == NULL || update == NULL || queue->count == RISCV_EVENT_MAX)
+    return -1;
+
+  // the sorted order puts a due event in front
+  memmove(&queue->events[1], &queue->events[0], queue->count * sizeof(struct riscv_event));
+
+  event = &queue->events[0];
+  event->deadline = 0;
+  event->update = update;
+  event->opaque = opaque;
+
+  queue->count++;
+  queue->next = 0;
+
+  return 0;
+}
+
+/*
+ * Update the sources that are due at now, or every source if all is set
+ * (some device state changed behind the queue's back), and sort them again.
+ */
+void riscv_event_run(struct riscv_event_queue * const restrict queue, struct riscv_cpu * const restrict cpu,
+                     uint64_t now, int all)
+{
+  struct riscv_event event;
+  size_t i, j;
+
+  for (i = 0; i < queue->count && (all || queue->events[i].deadline <= now); i++)
+    queue->events[i].deadline = queue->events[i].update(cpu, queue->events[i].opaque, now);
+
+  // a handful of sources at most, insertion sort it is
+  for (i = 1; i < queue->count; i++)
+  {
+    event = queue->events[i];
+    for (j = i; j > 0 && queue->events[j - 1].deadline > event.deadline; j--)
+      queue->events[j] = queue->events[j - 1];
+
+    queue->events[j] = event;
+  }
+
+  queue->next = (queue->count != 0) ? queue->events[0].deadline : RISCV_EVENT_NONE;
+}
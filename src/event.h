@@ -0,0 +1,47 @@
+/*
+  Copyright (c) 2024, Arka Mondal. All rights reserved.
+  Use of this source code is governed by a BSD-style license that
+  can be found in the LICENSE file.
+*/
+
+#ifndef _RISCVEMU_EVENT_H
+#define _RISCVEMU_EVENT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define RISCV_EVENT_MAX 8                 // event sources per hart
+#define RISCV_EVENT_NONE UINT64_MAX       // deadline of a source with nothing to do
+
+struct riscv_cpu;
+
+/*
+ * An event source looks at the state of its device at time now, updates
+ * the hart (raises or clears its interrupts) and returns when it wants to
+ * be looked at again, RISCV_EVENT_NONE if not until something changes.
+ */
+typedef uint64_t (*riscv_event_update)(struct riscv_cpu * const restrict, void *, uint64_t);
+
+struct riscv_event {
+  uint64_t deadline;                      // in ticks of the hart's clock
+  riscv_event_update update;
+  void * opaque;
+};
+
+/*
+ * The timed work of a hart, sorted by deadline. Only the hart itself touches
+ * its queue; the run loop compares the clock with next at block boundaries,
+ * so the sources cost nothing in between.
+ */
+struct riscv_event_queue {
+  struct riscv_event events[RISCV_EVENT_MAX];
+  size_t count;
+  uint64_t next;                          // deadline of the first event
+};
+
+int riscv_event_queue_init(struct riscv_event_queue * const restrict);
+int riscv_event_add(struct riscv_event_queue * const restrict, riscv_event_update, void *);
+void riscv_event_run(struct riscv_event_queue * const restrict, struct riscv_cpu * const restrict,
+                     uint64_t, int);
+
+#endif /* _RISCVEMU_EVENT_H */
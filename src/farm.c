@@ -0,0 +1,458 @@
+/*
+  Copyright (c) 2024, Arka Mondal. All rights reserved.
+  Use of this source code is governed by a BSD-style license that
+  can be found in the LICENSE file.
+*/
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "cpu.h"
+#include "csr.h"
+#include "bus.h"
+#include "dram.h"
+#include "loader.h"
+#include "snapshot.h"
+#include "util.h"
+
+#define FARM_MEM_SIZE (16UL << 20)
+#define FARM_BATCH (1UL << 20)        // instructions between checks of the limit
+#define FARM_MAX_WORKERS 256
+
+/*
+ * Runs one guest image against many inputs in a single process, one
+ * independent machine per input, on a pool of worker threads. The image is
+ * opened once and every guest maps it privately (see loader_map), so the
+ * pages a guest only reads are the same host page cache pages for all of
+ * them and the pages it writes are copied on demand.
+ *
+ * A guest starts like a single hart run by the emulator, with its input
+ * copied to the top of its memory: a0 holds the job number, a1 the guest
+ * address of the input and a2 its length, and the stack grows down from
+ * below the input.
+ *
+ * With -S a worker boots one machine for all its jobs instead. The guest
+ * runs up to its first ecall from M-mode, which ends its boot, and the
+ * machine is snapshotted right after it. Every job restores that state and
+ * resumes the guest with a0-a2 set as above, the stack is the one it booted
+ * on, in the lower half of memory; the upper half is kept for the inputs.
+ * A restore copies back only the pages the previous job wrote.
+ */
+
+enum farm_outcome {
+  FARM_EXIT,                          // ecall from M-mode, status in a0
+  FARM_TRAP,                          // any other unhandled trap
+  FARM_LIMIT,                         // ran out of instructions
+  FARM_ERROR                          // the machine could not be set up
+};
+
+static const char * const farm_outcome_names[] = {
+  [FARM_EXIT] = "exit",
+  [FARM_TRAP] = "trap",
+  [FARM_LIMIT] = "limit",
+  [FARM_ERROR] = "error"
+};
+
+struct farm_job {
+  const char * input;                 // path of the input file, NULL for none
+  enum farm_outcome outcome;
+  uint64_t status;                    // a0 on exit, the cause on a trap
+  uint64_t instret;
+  double seconds;
+};
+
+struct farm {
+  const struct loader_image * image;
+  uint64_t mem_size;
+  uint64_t limit;                     // instructions per guest, 0 for no limit
+  int snapshot;                       // -S, jobs start from the booted guest
+  struct farm_job * jobs;
+  size_t njobs;
+  size_t next;                        // next job to hand out, taken atomically
+};
+
+static inline double farm_seconds(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// copy the input file to the top of guest memory, its guest address goes to addr
+static int farm_load_input(const char * path, struct dram * const restrict dram,
+                           uint64_t * addr, uint64_t * length)
+{
+  struct stat st;
+  uint64_t offset;
+  ssize_t n;
+  int fd;
+
+  *addr = DRAM_BASE + dram->size;
+  *length = 0;
+
+  if (path == NULL)
+    return 0;
+
+  fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return -1;
+
+  if (fstat(fd, &st) != 0 || (uint64_t) st.st_size > dram->size / 2)
+  {
+    close(fd);
+    return -1;
+  }
+
+  offset = (dram->size - st.st_size) & ~0xfUL;
+
+  for (*length = 0; *length < (uint64_t) st.st_size; *length += n)
+  {
+    n = pread(fd, dram->mem + offset + *length, st.st_size - *length, *length);
+    if (n <= 0)
+    {
+      close(fd);
+      return -1;
+    }
+  }
+
+  close(fd);
+  *addr = DRAM_BASE + offset;
+
+  // a job may run on a snapshot, whose restore has to take the input away again
+  dram_mark_dirty(dram, offset, *length);
+
+  return 0;
+}
+
+// a private machine for the guest: its memory with the image mapped and its hart
+static int farm_machine_init(const struct farm * const restrict farm, struct dram * const restrict mem,
+                             struct bus * const restrict bus, struct riscv_cpu * const restrict cpu)
+{
+  if (dram_init(mem, NULL, farm->mem_size, DRAM_BACKING_DEFAULT) != 0)
+    return -1;
+
+  if (loader_map(farm->image, mem) != 0 || bus_init(bus, mem) != 0)
+  {
+    dram_deinit(mem);
+    return -1;
+  }
+
+  if (riscv_cpu_init(cpu, bus) != 0)
+  {
+    bus_deinit(bus);
+    dram_deinit(mem);
+    return -1;
+  }
+
+  cpu->pc = farm->image->entry;
+
+  return 0;
+}
+
+static void farm_machine_deinit(struct dram * const restrict mem, struct bus * const restrict bus,
+                                struct riscv_cpu * const restrict cpu)
+{
+  riscv_cpu_deinit(cpu);
+  bus_deinit(bus);
+  dram_deinit(mem);
+}
+
+// run the guest until it ends or has run the limit since instret was start
+static int farm_run(const struct farm * const restrict farm, struct riscv_cpu * const restrict cpu,
+                    uint64_t start)
+{
+  uint64_t budget;
+  int status;
+
+  do
+  {
+    budget = FARM_BATCH;
+    if (farm->limit != 0 && farm->limit - (cpu->instret - start) < budget)
+      budget = farm->limit - (cpu->instret - start);
+
+    status = riscv_cpu_run(cpu, budget);
+  }
+  while ((status == RISCV_RUN_BUDGET || status == RISCV_RUN_WFI)
+         && (farm->limit == 0 || cpu->instret - start < farm->limit));
+
+  return status;
+}
+
+// how the job ended, from the status of its last run
+static void farm_finish(struct farm_job * const restrict job, const struct riscv_cpu * const restrict cpu,
+                        int status)
+{
+  if (status == RISCV_RUN_TRAP && cpu->trap_cause == RISCV_EXC_ECALL_M)
+  {
+    job->outcome = FARM_EXIT;
+    job->status = cpu->registers[x10];
+  }
+  else if (status == RISCV_RUN_TRAP)
+  {
+    job->outcome = FARM_TRAP;
+    job->status = cpu->trap_cause;
+  }
+  else if (status != RISCV_RUN_HALT)
+  {
+    job->outcome = FARM_LIMIT;
+  }
+}
+
+static void farm_run_job(struct farm * const restrict farm, size_t index,
+                         struct riscv_cpu * const restrict cpu)
+{
+  struct farm_job * const job = &farm->jobs[index];
+  struct dram mem;
+  struct bus bus;
+  uint64_t addr, length;
+  double start = farm_seconds();
+
+  job->outcome = FARM_ERROR;
+
+  if (farm_machine_init(farm, &mem, &bus, cpu) != 0)
+    return;
+
+  if (farm_load_input(job->input, &mem, &addr, &length) != 0)
+  {
+    farm_machine_deinit(&mem, &bus, cpu);
+    return;
+  }
+
+  cpu->registers[x10] = index;
+  cpu->registers[x11] = addr;
+  cpu->registers[x12] = length;
+  cpu->registers[x2] = addr & ~0xfUL;
+
+  farm_finish(job, cpu, farm_run(farm, cpu, 0));
+
+  job->instret = cpu->instret;
+  job->seconds = farm_seconds() - start;
+
+  farm_machine_deinit(&mem, &bus, cpu);
+}
+
+// boot the guest up to its first ecall and snapshot it just after that, see -S
+static int farm_boot(struct farm * const restrict farm, struct dram * const restrict mem,
+                     struct bus * const restrict bus, struct riscv_cpu * const * cpu,
+                     struct riscv_snapshot * const restrict snap)
+{
+  if (farm_machine_init(farm, mem, bus, *cpu) != 0)
+    return -1;
+
+  (*cpu)->registers[x2] = DRAM_BASE + mem->size / 2;
+
+  if (farm_run(farm, *cpu, 0) != RISCV_RUN_TRAP || (*cpu)->trap_cause != RISCV_EXC_ECALL_M)
+  {
+    fprintf(stderr, "the guest did not end its boot with an ecall\n");
+    farm_machine_deinit(mem, bus, *cpu);
+    return -1;
+  }
+
+  (*cpu)->pc += 4;
+  (*cpu)->trap = 0;
+
+  if (riscv_snapshot_take(snap, bus, cpu, 1) != 0)
+  {
+    farm_machine_deinit(mem, bus, *cpu);
+    return -1;
+  }
+
+  return 0;
+}
+
+// worker thread of -S, runs the jobs it takes on its one booted machine
+static void farm_work_snapshot(struct farm * const restrict farm, struct riscv_cpu * const cpu)
+{
+  struct riscv_snapshot snap;
+  struct farm_job * job;
+  struct dram mem;
+  struct bus bus;
+  uint64_t addr, length, boot;
+  double start;
+  size_t index;
+  int booted;
+
+  booted = (farm_boot(farm, &mem, &bus, &cpu, &snap) == 0);
+  boot = cpu->instret;
+
+  while ((index = __atomic_fetch_add(&farm->next, 1, __ATOMIC_RELAXED)) < farm->njobs)
+  {
+    job = &farm->jobs[index];
+    job->outcome = FARM_ERROR;
+    start = farm_seconds();
+
+    if (!booted || riscv_snapshot_restore(&snap) != 0
+        || farm_load_input(job->input, &mem, &addr, &length) != 0)
+      continue;
+
+    cpu->registers[x10] = index;
+    cpu->registers[x11] = addr;
+    cpu->registers[x12] = length;
+
+    farm_finish(job, cpu, farm_run(farm, cpu, boot));
+
+    job->instret = cpu->instret - boot;
+    job->seconds = farm_seconds() - start;
+  }
+
+  if (booted)
+  {
+    riscv_snapshot_release(&snap);
+    farm_machine_deinit(&mem, &bus, cpu);
+  }
+}
+
+// worker thread, takes jobs until there are none left
+static void * farm_worker(void * arg)
+{
+  struct farm * const farm = arg;
+  struct riscv_cpu * cpu;
+  size_t index;
+
+  cpu = malloc(sizeof(struct riscv_cpu));
+  if (cpu == NULL)
+    return NULL;
+
+  if (farm->snapshot)
+  {
+    farm_work_snapshot(farm, cpu);
+  }
+  else
+  {
+    while ((index = __atomic_fetch_add(&farm->next, 1, __ATOMIC_RELAXED)) < farm->njobs)
+      farm_run_job(farm, index, cpu);
+  }
+
+  free(cpu);
+
+  return NULL;
+}
+
+/*
+ * Print one CSV line per job, in job order: the input, how the guest ended,
+ * its exit status (or trap cause), its instruction count and run time.
+ */
+int main(int argc, char * argv[])
+{
+  struct farm farm;
+  struct loader_image image;
+  pthread_t workers[FARM_MAX_WORKERS];
+  uint64_t nworkers = sysconf(_SC_NPROCESSORS_ONLN), count = 0;
+  uint64_t instret = 0;
+  double start, seconds;
+  size_t i;
+  int opt, status = EXIT_SUCCESS;
+
+  memset(&farm, 0x0, sizeof(farm));
+  farm.mem_size = FARM_MEM_SIZE;
+
+  while ((opt = getopt(argc, argv, "m:j:l:N:S")) != -1)
+  {
+    switch (opt)
+    {
+      case 'm':
+        if (parse_size(optarg, &farm.mem_size) != 0)
+          goto usage;
+        break;
+
+      case 'j':
+        if (parse_size(optarg, &nworkers) != 0 || nworkers == 0 || nworkers > FARM_MAX_WORKERS)
+          goto usage;
+        break;
+
+      case 'l':
+        if (parse_size(optarg, &farm.limit) != 0)
+          goto usage;
+        break;
+
+      case 'S':
+        farm.snapshot = 1;
+        break;
+
+      case 'N':
+        if (parse_size(optarg, &count) != 0 || count == 0)
+          goto usage;
+        break;
+
+      default:
+        goto usage;
+    }
+  }
+
+  if (optind >= argc || (count != 0 && optind != argc - 1))
+    goto usage;
+
+  if (nworkers > FARM_MAX_WORKERS)
+    nworkers = FARM_MAX_WORKERS;
+
+  if (loader_open(&image, argv[optind]) != 0)
+  {
+    fprintf(stderr, "%s: cannot load image\n", argv[optind]);
+    return EXIT_FAILURE;
+  }
+
+  // one job per input file, or count jobs without input
+  farm.image = &image;
+  farm.njobs = (count != 0) ? count : (argc - optind - 1 != 0) ? (size_t) (argc - optind - 1) : 1;
+  farm.jobs = calloc(farm.njobs, sizeof(struct farm_job));
+  if (farm.jobs == NULL)
+  {
+    fprintf(stderr, "cannot allocate %zu jobs\n", farm.njobs);
+    return EXIT_FAILURE;
+  }
+
+  for (i = 0; count == 0 && i < farm.njobs && optind + 1 + i < (size_t) argc; i++)
+    farm.jobs[i].input = argv[optind + 1 + i];
+
+  if (nworkers > farm.njobs)
+    nworkers = farm.njobs;
+
+  start = farm_seconds();
+
+  for (i = 0; i < nworkers; i++)
+  {
+    if (pthread_create(&workers[i], NULL, farm_worker, &farm) != 0)
+    {
+      fprintf(stderr, "cannot start worker %zu\n", i);
+      return EXIT_FAILURE;
+    }
+  }
+
+  for (i = 0; i < nworkers; i++)
+    pthread_join(workers[i], NULL);
+
+  seconds = farm_seconds() - start;
+
+  printf("job,input,outcome,status,instructions,seconds\n");
+
+  for (i = 0; i < farm.njobs; i++)
+  {
+    printf("%zu,%s,%s,%lu,%lu,%.6f\n", i, (farm.jobs[i].input != NULL) ? farm.jobs[i].input : "",
+           farm_outcome_names[farm.jobs[i].outcome], farm.jobs[i].status, farm.jobs[i].instret,
+           farm.jobs[i].seconds);
+
+    if (farm.jobs[i].outcome == FARM_ERROR)
+      status = EXIT_FAILURE;
+
+    instret += farm.jobs[i].instret;
+  }
+
+  fprintf(stderr, "%zu guests on %lu workers in %.3f s, %.0f guests/s, %.2f MIPS\n", farm.njobs,
+          nworkers, seconds, farm.njobs / seconds, instret / seconds / 1e6);
+
+  loader_close(&image);
+  free(farm.jobs);
+
+  return status;
+
+usage:
+  fprintf(stderr, "usage: %s [-m size] [-j workers] [-l instructions] [-S] <image> [input...]\n"
+          "       %s [options] -N count <image>\n", argv[0], argv[0]);
+  return EXIT_FAILURE;
+}
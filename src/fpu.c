@@ -0,0 +1,400 @@
+/*
+  Copyright (c) 2024, Arka Mondal. All rights reserved.
+  Use of this source code is governed by a BSD-style license that
+  can be found in the LICENSE file.
+*/
+
+#include <float.h>
+#include <math.h>
+#include "fpu.h"
+
+// RMM is worked out in long double, which needs a bit past the halfway point of a double
+#if LDBL_MANT_DIG < DBL_MANT_DIG + 1
+#error "long double is too narrow to round to nearest, ties away, in software"
+#endif
+
+#if defined(__SSE2__)
+#include <xmmintrin.h>
+
+/*
+ * The guest's arithmetic runs on the host's SSE unit. Its rounding control
+ * holds frm while a hart runs, and its sticky exception flags collect the
+ * guest's fflags, which are only read out when fcsr is looked at.
+ */
+#define MXCSR_FLAGS 0x3fU             // IE DE ZE OE UE PE
+#define MXCSR_MASKS 0x1f80U           // every exception masked
+#define MXCSR_RC_SHIFT 13
+
+static inline uint32_t riscv_fpu_host_get(void)
+{
+  return _mm_getcsr();
+}
+
+static inline void riscv_fpu_host_set(uint32_t csr)
+{
+  _mm_setcsr(csr);
+}
+
+// host rounding control for a valid rounding mode, RMM has none and is done in software
+static inline uint32_t riscv_fpu_host_mode(uint32_t rm)
+{
+  static const uint8_t modes[] = {
+    [RISCV_FRM_RNE] = 0x0, [RISCV_FRM_RTZ] = 0x3, [RISCV_FRM_RDN] = 0x1,
+    [RISCV_FRM_RUP] = 0x2, [RISCV_FRM_RMM] = 0x0
+  };
+
+  return MXCSR_MASKS | (uint32_t) modes[rm] << MXCSR_RC_SHIFT;
+}
+
+// the host's flags in fflags order, DE (a denormal operand) has no counterpart
+static inline uint64_t riscv_fpu_host_flags(uint32_t csr)
+{
+  return ((csr & 0x01) ? RISCV_FFLAGS_NV : 0) | ((csr & 0x04) ? RISCV_FFLAGS_DZ : 0)
+    | ((csr & 0x08) ? RISCV_FFLAGS_OF : 0) | ((csr & 0x10) ? RISCV_FFLAGS_UF : 0)
+    | ((csr & 0x20) ? RISCV_FFLAGS_NX : 0);
+}
+
+static inline uint32_t riscv_fpu_host_clear(uint32_t csr)
+{
+  return csr & ~MXCSR_FLAGS;
+}
+#else
+#include <fenv.h>
+
+// the same on hosts without SSE, through the portable floating-point environment
+static inline uint32_t riscv_fpu_host_get(void)
+{
+  return (uint32_t) fegetround() << 16 | (uint32_t) fetestexcept(FE_ALL_EXCEPT);
+}
+
+static inline void riscv_fpu_host_set(uint32_t csr)
+{
+  fesetround(csr >> 16);
+  feclearexcept(FE_ALL_EXCEPT);
+  if (csr & FE_ALL_EXCEPT)
+    feraiseexcept(csr & FE_ALL_EXCEPT);
+}
+
+static inline uint32_t riscv_fpu_host_mode(uint32_t rm)
+{
+  static const int modes[] = {
+    [RISCV_FRM_RNE] = FE_TONEAREST, [RISCV_FRM_RTZ] = FE_TOWARDZERO, [RISCV_FRM_RDN] = FE_DOWNWARD,
+    [RISCV_FRM_RUP] = FE_UPWARD, [RISCV_FRM_RMM] = FE_TONEAREST
+  };
+
+  return (uint32_t) modes[rm] << 16;
+}
+
+static inline uint64_t riscv_fpu_host_flags(uint32_t csr)
+{
+  return ((csr & FE_INVALID) ? RISCV_FFLAGS_NV : 0) | ((csr & FE_DIVBYZERO) ? RISCV_FFLAGS_DZ : 0)
+    | ((csr & FE_OVERFLOW) ? RISCV_FFLAGS_OF : 0) | ((csr & FE_UNDERFLOW) ? RISCV_FFLAGS_UF : 0)
+    | ((csr & FE_INEXACT) ? RISCV_FFLAGS_NX : 0);
+}
+
+static inline uint32_t riscv_fpu_host_clear(uint32_t csr)
+{
+  return csr & ~(uint32_t) FE_ALL_EXCEPT;
+}
+#endif
+
+static inline uint32_t riscv_fpu_frm(const struct riscv_cpu * const restrict cpu)
+{
+  return (cpu->csrs[CSR_FCSR] >> RISCV_FCSR_FRM_SHIFT) & 0x7;
+}
+
+// the host's mode while the hart runs, frm or RNE while frm holds RMM or a reserved mode
+static inline uint32_t riscv_fpu_host_dyn(const struct riscv_cpu * const restrict cpu)
+{
+  uint32_t frm = riscv_fpu_frm(cpu);
+
+  return riscv_fpu_host_mode((frm < RISCV_FRM_RMM) ? frm : RISCV_FRM_RNE);
+}
+
+/*
+ * Switch the host's floating-point unit over to the hart, returning the
+ * host's own state for riscv_fpu_leave. fpu_modes gets the rounding modes
+ * that need no switch: the dynamic one while frm is a mode the host has,
+ * and whatever the host rounds the same as frm. RMM is never one of them.
+ */
+uint32_t riscv_fpu_enter(struct riscv_cpu * const restrict cpu)
+{
+  uint32_t host = riscv_fpu_host_get();
+  uint32_t rm;
+
+  cpu->fpu_modes = (riscv_fpu_frm(cpu) < RISCV_FRM_RMM) ? 1U << RISCV_FRM_DYN : 0;
+  for (rm = RISCV_FRM_RNE; rm < RISCV_FRM_RMM; rm++)
+    if (riscv_fpu_host_mode(rm) == riscv_fpu_host_dyn(cpu))
+      cpu->fpu_modes |= 1U << rm;
+
+  riscv_fpu_host_set(riscv_fpu_host_dyn(cpu));
+
+  return host;
+}
+
+void riscv_fpu_leave(struct riscv_cpu * const restrict cpu, uint32_t host)
+{
+  riscv_fpu_sync(cpu);
+  riscv_fpu_host_set(host);
+}
+
+// fold what the host accrued into fflags, before fcsr is read or written
+void riscv_fpu_sync(struct riscv_cpu * const restrict cpu)
+{
+  uint32_t csr = riscv_fpu_host_get();
+  uint64_t flags = riscv_fpu_host_flags(csr);
+
+  if (flags == 0)
+    return;
+
+  cpu->csrs[CSR_FCSR] |= flags;
+  cpu->csrs[CSR_MSTATUS] |= MSTATUS_FS | MSTATUS_SD;
+  riscv_fpu_host_set(riscv_fpu_host_clear(csr));
+}
+
+// a write to fcsr, frm or fflags, after riscv_fpu_sync
+void riscv_fpu_write_fcsr(struct riscv_cpu * const restrict cpu, uint64_t value)
+{
+  cpu->csrs[CSR_FCSR] = value & RISCV_FCSR_MASK;
+  cpu->csrs[CSR_MSTATUS] |= MSTATUS_FS | MSTATUS_SD;
+  riscv_fpu_enter(cpu);
+}
+
+/*
+ * Run an instruction with a rounding mode other than the host's: switch to
+ * it, leaving in swap what riscv_fpu_round_end needs to switch back. Both
+ * flip the mode bits only, the flags the instruction raises stay. Returns
+ * the mode, RMM without a switch (see riscv_fpu_rmm_begin), or -1 if the
+ * mode is reserved, the instruction is illegal then.
+ */
+int riscv_fpu_round_begin(struct riscv_cpu * const restrict cpu, uint32_t rm, uint32_t * swap)
+{
+  if (rm == RISCV_FRM_DYN)
+    rm = riscv_fpu_frm(cpu);
+
+  if (rm > RISCV_FRM_RMM)
+    return -1;
+
+  *swap = 0;
+  if (rm != RISCV_FRM_RMM)
+  {
+    *swap = riscv_fpu_host_mode(rm) ^ riscv_fpu_host_dyn(cpu);
+    riscv_fpu_host_set(riscv_fpu_host_get() ^ *swap);
+  }
+
+  return (int) rm;
+}
+
+void riscv_fpu_round_end(uint32_t swap)
+{
+  riscv_fpu_host_set(riscv_fpu_host_get() ^ swap);
+}
+
+/*
+ * RMM, which no host rounds in. The instruction is worked out in long
+ * double towards zero between riscv_fpu_rmm_begin and riscv_fpu_rmm_end_*,
+ * which rounds the result to the format in software. long double holds the
+ * halfway point between two singles or doubles, so the truncated result
+ * reaches it exactly when the true one does, ties included; the host's
+ * inexact flag tells whether anything was cut off on the way.
+ */
+void riscv_fpu_rmm_begin(fenv_t * const restrict env)
+{
+  feholdexcept(env);
+  fesetround(FE_TOWARDZERO);
+}
+
+// x >= 0 rounded to a multiple of ulp, a power of two, ties away from zero
+static long double riscv_fpu_rmm_round(long double x, long double ulp, int * inexact)
+{
+  long double n = x / ulp, t = truncl(n);
+
+  *inexact = (n != t);
+
+  return ((n - t >= 0.5L) ? t + 1.0L : t) * ulp;
+}
+
+/*
+ * w, truncated, rounded to a format with mant bits of mantissa, 2^emin as
+ * its smallest normal and max as its largest value. flags gets what the
+ * instruction raises: NV and DZ as the host saw them, the rest from the
+ * rounding here, with tininess detected after rounding.
+ */
+static long double riscv_fpu_rmm(long double w, int mant, int emin, long double max, uint64_t * flags)
+{
+  long double x = fabsl(w), r;
+  int cut = fetestexcept(FE_INEXACT) != 0;
+  int exp, inexact, tiny = 0;
+
+  *flags = (fetestexcept(FE_INVALID) ? RISCV_FFLAGS_NV : 0) | (fetestexcept(FE_DIVBYZERO) ? RISCV_FFLAGS_DZ : 0);
+
+  if (x == 0.0L || !isfinite(x))
+    return w;
+
+  frexpl(x, &exp);                          // 2^(exp - 1) <= x < 2^exp
+
+  r = riscv_fpu_rmm_round(x, ldexpl(1.0L, exp - mant), &inexact);
+  if (exp - 1 < emin)
+  {
+    tiny = r < ldexpl(1.0L, emin);
+    r = riscv_fpu_rmm_round(x, ldexpl(1.0L, emin + 1 - mant), &inexact);
+  }
+
+  if (r > max)
+  {
+    *flags |= RISCV_FFLAGS_OF | RISCV_FFLAGS_NX;
+    r = INFINITY;
+  }
+  else if (inexact || cut)
+  {
+    *flags |= RISCV_FFLAGS_NX | (tiny ? RISCV_FFLAGS_UF : 0);
+  }
+
+  return copysignl(r, w);
+}
+
+// put the hart's environment back and take the flags, the result converts exactly
+float riscv_fpu_rmm_end_s(struct riscv_cpu * const restrict cpu, fenv_t * const restrict env, long double w)
+{
+  uint64_t flags;
+  long double r = riscv_fpu_rmm(w, FLT_MANT_DIG, FLT_MIN_EXP - 1, FLT_MAX, &flags);
+
+  fesetenv(env);
+  if (flags != 0)
+    riscv_fpu_raise(cpu, flags);
+
+  return (float) r;
+}
+
+double riscv_fpu_rmm_end_d(struct riscv_cpu * const restrict cpu, fenv_t * const restrict env, long double w)
+{
+  uint64_t flags;
+  long double r = riscv_fpu_rmm(w, DBL_MANT_DIG, DBL_MIN_EXP - 1, DBL_MAX, &flags);
+
+  fesetenv(env);
+  if (flags != 0)
+    riscv_fpu_raise(cpu, flags);
+
+  return (double) r;
+}
+
+/*
+ * x rounded to an integral value in the given mode, for |x| < 2^52. On the
+ * encoding and with exact arithmetic only: the host's trunc and floor may
+ * raise inexact, the conversion is to tell that itself.
+ */
+static double riscv_fpu_round(double x, uint32_t rm)
+{
+  uint64_t bits = riscv_fpu_bits_d(x);
+  int64_t exp = (int64_t) ((bits >> 52) & 0x7ff) - 1023;
+  double t, frac, sign = (x < 0.0) ? -1.0 : 1.0;
+
+  // truncate, clearing the fraction bits
+  if (exp < 0)
+    bits &= 0x8000000000000000UL;
+  else
+    bits &= ~((1UL << (52 - exp)) - 1);
+
+  memcpy(&t, &bits, sizeof(t));
+  frac = x - t;
+
+  switch (rm)
+  {
+    case RISCV_FRM_RTZ:
+      return t;
+    case RISCV_FRM_RDN:
+      return (frac < 0.0) ? t - 1.0 : t;
+    case RISCV_FRM_RUP:
+      return (frac > 0.0) ? t + 1.0 : t;
+    case RISCV_FRM_RMM:
+      return (fabs(frac) >= 0.5) ? t + sign : t;
+  }
+
+  // ties to even
+  if (fabs(frac) > 0.5 || (fabs(frac) == 0.5 && ((int64_t) t & 0x1)))
+    return t + sign;
+
+  return t;
+}
+
+/*
+ * FCVT.{W,WU,L,LU}.{S,D}, a single widened to double first, which is exact.
+ * Done in software for the saturation the host does not do: an out of range
+ * value or a NaN gives the nearest representable result (the largest for a
+ * NaN) and raises NV instead of NX. Returns -1 if the rounding mode is
+ * reserved.
+ */
+int riscv_fpu_to_int(struct riscv_cpu * const restrict cpu, double x, uint32_t rm,
+                     enum riscv_fpu_int kind, uint64_t * value)
+{
+  static const double low[] = {
+    [RISCV_FPU_W] = -2147483648.0, [RISCV_FPU_WU] = 0.0,
+    [RISCV_FPU_L] = -9223372036854775808.0, [RISCV_FPU_LU] = 0.0
+  };
+  // one past the largest value, every bound is a power of two and exact
+  static const double high[] = {
+    [RISCV_FPU_W] = 2147483648.0, [RISCV_FPU_WU] = 4294967296.0,
+    [RISCV_FPU_L] = 9223372036854775808.0, [RISCV_FPU_LU] = 18446744073709551616.0
+  };
+  static const uint64_t saturated_low[] = {
+    [RISCV_FPU_W] = 0xffffffff80000000UL, [RISCV_FPU_WU] = 0,
+    [RISCV_FPU_L] = 0x8000000000000000UL, [RISCV_FPU_LU] = 0
+  };
+  // WU results are sign-extended like every other 32-bit result
+  static const uint64_t saturated_high[] = {
+    [RISCV_FPU_W] = 0x7fffffffUL, [RISCV_FPU_WU] = 0xffffffffffffffffUL,
+    [RISCV_FPU_L] = 0x7fffffffffffffffUL, [RISCV_FPU_LU] = 0xffffffffffffffffUL
+  };
+  double r;
+
+  if (rm == RISCV_FRM_DYN)
+    rm = riscv_fpu_frm(cpu);
+
+  if (rm > RISCV_FRM_RMM)
+    return -1;
+
+  if (x != x)
+  {
+    riscv_fpu_raise(cpu, RISCV_FFLAGS_NV);
+    *value = saturated_high[kind];
+    return 0;
+  }
+
+  // large values, and infinities, are integral already
+  r = (fabs(x) < 4503599627370496.0) ? riscv_fpu_round(x, rm) : x;
+
+  if (r < low[kind])
+  {
+    riscv_fpu_raise(cpu, RISCV_FFLAGS_NV);
+    *value = saturated_low[kind];
+    return 0;
+  }
+
+  if (r >= high[kind])
+  {
+    riscv_fpu_raise(cpu, RISCV_FFLAGS_NV);
+    *value = saturated_high[kind];
+    return 0;
+  }
+
+  if (r != x)
+    riscv_fpu_raise(cpu, RISCV_FFLAGS_NX);
+
+  switch (kind)
+  {
+    case RISCV_FPU_W:
+      *value = (uint64_t) (int64_t) r;
+      break;
+    case RISCV_FPU_WU:
+      *value = (uint64_t) (int64_t) (int32_t) (uint32_t) r;
+      break;
+    case RISCV_FPU_L:
+      *value = (uint64_t) (int64_t) r;
+      break;
+    case RISCV_FPU_LU:
+      *value = (uint64_t) r;
+      break;
+  }
+
+  return 0;
+}
@@ -0,0 +1,206 @@
+/*
+  Copyright (c) 2024, Arka Mondal. All rights reserved.
+  Use of this source code is governed by a BSD-style license that
+  can be found in the LICENSE file.
+*/
+
+#ifndef _RISCVEMU_FPU_H
+#define _RISCVEMU_FPU_H
+
+#include <fenv.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include "cpu.h"
+#include "csr.h"
+#include "decode.h"
+
+// rounding modes, the rm field of an instruction and fcsr.frm
+#define RISCV_FRM_RNE 0           // to nearest, ties to even
+#define RISCV_FRM_RTZ 1           // towards zero
+#define RISCV_FRM_RDN 2           // down
+#define RISCV_FRM_RUP 3           // up
+#define RISCV_FRM_RMM 4           // to nearest, ties away from zero
+#define RISCV_FRM_DYN 7           // the instruction uses frm
+
+// accrued exception flags, fcsr.fflags
+#define RISCV_FFLAGS_NX 0x01      // inexact
+#define RISCV_FFLAGS_UF 0x02      // underflow
+#define RISCV_FFLAGS_OF 0x04      // overflow
+#define RISCV_FFLAGS_DZ 0x08      // divide by zero
+#define RISCV_FFLAGS_NV 0x10      // invalid
+
+#define RISCV_FCSR_FFLAGS 0x1fUL
+#define RISCV_FCSR_FRM_SHIFT 5
+#define RISCV_FCSR_MASK 0xffUL
+
+// canonical NaNs, and the upper half of a register holding a single
+#define RISCV_FPU_NAN_S 0x7fc00000U
+#define RISCV_FPU_NAN_D 0x7ff8000000000000UL
+#define RISCV_FPU_BOX 0xffffffff00000000UL
+
+// integer results of FCVT.{W,WU,L,LU}.{S,D}
+enum riscv_fpu_int {
+  RISCV_FPU_W,
+  RISCV_FPU_WU,
+  RISCV_FPU_L,
+  RISCV_FPU_LU
+};
+
+/*
+ * Keeps the compiler from moving the computation of a value across a change
+ * of the host's rounding mode, which it does not know arithmetic depends on.
+ */
+#if defined(__SSE2__)
+#define RISCV_FPU_BARRIER(x) __asm__ volatile ("" : "+x" (x))
+#else
+#define RISCV_FPU_BARRIER(x) __asm__ volatile ("" : "+m" (x))
+#endif
+
+// the same for a long double, which need not live in a vector register
+#define RISCV_FPU_BARRIER_WIDE(x) __asm__ volatile ("" : "+m" (x))
+
+uint32_t riscv_fpu_enter(struct riscv_cpu * const restrict);
+void riscv_fpu_leave(struct riscv_cpu * const restrict, uint32_t);
+void riscv_fpu_sync(struct riscv_cpu * const restrict);
+void riscv_fpu_write_fcsr(struct riscv_cpu * const restrict, uint64_t);
+int riscv_fpu_round_begin(struct riscv_cpu * const restrict, uint32_t, uint32_t *);
+void riscv_fpu_round_end(uint32_t);
+void riscv_fpu_rmm_begin(fenv_t * const restrict);
+float riscv_fpu_rmm_end_s(struct riscv_cpu * const restrict, fenv_t * const restrict, long double);
+double riscv_fpu_rmm_end_d(struct riscv_cpu * const restrict, fenv_t * const restrict, long double);
+int riscv_fpu_to_int(struct riscv_cpu * const restrict, double, uint32_t, enum riscv_fpu_int, uint64_t *);
+
+// FP instructions and fcsr are illegal while mstatus.FS is Off
+static inline int riscv_fpu_off(const struct riscv_cpu * const restrict cpu)
+{
+  return (cpu->csrs[CSR_MSTATUS] & MSTATUS_FS) == 0;
+}
+
+// rounding mode and third source of an instruction, the host is in the mode if its bit is in fpu_modes
+static inline uint32_t riscv_fpu_rm(const struct riscv_uop * const restrict uop)
+{
+  return (uop->inst >> 12) & 0x7;
+}
+
+static inline uint32_t riscv_fpu_rs3(const struct riscv_uop * const restrict uop)
+{
+  return uop->inst >> 27;
+}
+
+// raise flags the host does not, like those of conversions done in software
+static inline void riscv_fpu_raise(struct riscv_cpu * const restrict cpu, uint64_t flags)
+{
+  cpu->csrs[CSR_FCSR] |= flags;
+  cpu->csrs[CSR_MSTATUS] |= MSTATUS_FS | MSTATUS_SD;
+}
+
+// a single, or the canonical NaN if the register does not hold a properly boxed one
+static inline uint32_t riscv_fpu_unbox(const struct riscv_cpu * const restrict cpu, uint32_t reg)
+{
+  uint64_t bits = cpu->fregs[reg];
+
+  return ((bits & RISCV_FPU_BOX) == RISCV_FPU_BOX) ? (uint32_t) bits : RISCV_FPU_NAN_S;
+}
+
+static inline float riscv_fpu_get_s(const struct riscv_cpu * const restrict cpu, uint32_t reg)
+{
+  uint32_t value = riscv_fpu_unbox(cpu, reg);
+  float f;
+
+  memcpy(&f, &value, sizeof(f));
+  return f;
+}
+
+static inline double riscv_fpu_get_d(const struct riscv_cpu * const restrict cpu, uint32_t reg)
+{
+  double d;
+
+  memcpy(&d, &cpu->fregs[reg], sizeof(d));
+  return d;
+}
+
+// writing any FP state makes mstatus.FS Dirty
+static inline void riscv_fpu_set_bits(struct riscv_cpu * const restrict cpu, uint32_t reg, uint64_t bits)
+{
+  cpu->fregs[reg] = bits;
+  cpu->csrs[CSR_MSTATUS] |= MSTATUS_FS | MSTATUS_SD;
+}
+
+static inline uint32_t riscv_fpu_bits_s(float f)
+{
+  uint32_t bits;
+
+  memcpy(&bits, &f, sizeof(bits));
+  return bits;
+}
+
+static inline uint64_t riscv_fpu_bits_d(double d)
+{
+  uint64_t bits;
+
+  memcpy(&bits, &d, sizeof(bits));
+  return bits;
+}
+
+// results of arithmetic, a NaN is always the canonical one
+static inline void riscv_fpu_set_s(struct riscv_cpu * const restrict cpu, uint32_t reg, float f)
+{
+  riscv_fpu_set_bits(cpu, reg, RISCV_FPU_BOX | ((f != f) ? RISCV_FPU_NAN_S : riscv_fpu_bits_s(f)));
+}
+
+static inline void riscv_fpu_set_d(struct riscv_cpu * const restrict cpu, uint32_t reg, double d)
+{
+  riscv_fpu_set_bits(cpu, reg, (d != d) ? RISCV_FPU_NAN_D : riscv_fpu_bits_d(d));
+}
+
+// NaNs told apart by their encoding, comparing them would raise flags on the host
+static inline int riscv_fpu_nan_s(uint32_t bits)
+{
+  return (bits & 0x7fffffffU) > 0x7f800000U;
+}
+
+static inline int riscv_fpu_snan_s(uint32_t bits)
+{
+  return riscv_fpu_nan_s(bits) && !(bits & 0x00400000U);
+}
+
+static inline int riscv_fpu_nan_d(uint64_t bits)
+{
+  return (bits & 0x7fffffffffffffffUL) > 0x7ff0000000000000UL;
+}
+
+static inline int riscv_fpu_snan_d(uint64_t bits)
+{
+  return riscv_fpu_nan_d(bits) && !(bits & 0x0008000000000000UL);
+}
+
+/*
+ * FCLASS of a value with the given exponent and mantissa widths: one bit set
+ * for -inf, -normal, -subnormal, -0, +0, +subnormal, +normal, +inf, sNaN or
+ * qNaN, in that order.
+ */
+static inline uint64_t riscv_fpu_class(uint64_t bits, uint32_t exponent, uint32_t mantissa)
+{
+  uint64_t sign = (bits >> (exponent + mantissa)) & 0x1;
+  uint64_t exp = (bits >> mantissa) & ((1UL << exponent) - 1);
+  uint64_t frac = bits & ((1UL << mantissa) - 1);
+
+  if (exp == (1UL << exponent) - 1)
+  {
+    if (frac == 0)
+      return sign ? 1UL << 0 : 1UL << 7;
+    return (frac >> (mantissa - 1)) ? 1UL << 9 : 1UL << 8;
+  }
+
+  if (exp == 0)
+  {
+    if (frac == 0)
+      return sign ? 1UL << 3 : 1UL << 4;
+    return sign ? 1UL << 2 : 1UL << 5;
+  }
+
+  return sign ? 1UL << 1 : 1UL << 6;
+}
+
+#endif /* _RISCVEMU_FPU_H */
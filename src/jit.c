@@ -0,0 +1,1620 @@
+/*
+  Copyright (c) 2024, Arka Mondal. All rights reserved.
+  Use of this source code is governed by a BSD-style license that
+  can be found in the LICENSE file.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "cpu.h"
+#include "block.h"
+#include "decode.h"
+#include "jit.h"
+#include "mmu.h"
+
+/*
+ * x86-64 backend. A compiled block runs with
+ *
+ *   rbp   the struct riscv_cpu
+ *   r15   the remaining instruction budget
+ *   rbx, r12-r14, rsi, rdi, r8, r9   guest registers allocated to the block
+ *   rax, rcx, rdx, r10, r11          scratch
+ *   [rsp]                            a scratch slot of 8 bytes
+ *   [rsp + 8]                        the clock of the hart once the budget is used up
+ *
+ * Guest registers are loaded into their host registers when the block is
+ * entered and written back before anything that leaves the block or calls
+ * into C. Every exit to a known pc ends in a jump that starts out pointing
+ * at the exit trampoline and is patched to the next compiled block the first
+ * time it is taken with that block available, so hot loops never leave
+ * generated code until the budget runs out.
+ */
+
+enum { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15 };
+
+enum { CC_B = 0x2, CC_AE = 0x3, CC_E = 0x4, CC_NE = 0x5, CC_A = 0x7, CC_L = 0xc, CC_GE = 0xd };
+
+// "op r/m, reg" opcodes, the "op reg, r/m" form is op + 2 and the immediate form uses op >> 3
+enum { ALU_ADD = 0x01, ALU_OR = 0x09, ALU_AND = 0x21, ALU_SUB = 0x29, ALU_XOR = 0x31, ALU_CMP = 0x39 };
+
+enum { SHIFT_SHL = 4, SHIFT_SHR = 5, SHIFT_SAR = 7 };
+
+// where a rel32 points to
+enum { JIT_HOT, JIT_COLD, JIT_ABS };
+
+#define JIT_MAX_FIXUPS (RISCV_BLOCK_MAX * 8 + 16)
+
+#define GUEST(g) ((int32_t) (offsetof(struct riscv_cpu, registers) + 8 * (g)))
+#define CPU(field) ((int32_t) offsetof(struct riscv_cpu, field))
+
+// host registers guest registers are allocated to, the callee-saved ones first
+static const uint8_t riscv_jit_pool[] = { RBX, R12, R13, R14, RSI, RDI, R8, R9 };
+
+#define JIT_CALLER_SAVED ((1U << RSI) | (1U << RDI) | (1U << R8) | (1U << R9))
+
+_Static_assert(sizeof(struct riscv_tlb_entry) == 16, "TLB entries are indexed with a shift");
+_Static_assert(sizeof(struct riscv_jit_entry) == 32, "the indirect trampoline scales by 32");
+
+struct jit_buf {
+  uint8_t * p;
+  size_t len;
+};
+
+struct jit_fixup {
+  uint8_t cold;                       // the rel32 lives in the cold buffer
+  uint8_t target;                     // JIT_HOT, JIT_COLD or JIT_ABS
+  uint32_t pos;
+  uintptr_t to;                       // offset in the target buffer, or an address
+};
+
+/*
+ * Compilation state of one block. The straight-line fast path goes to the
+ * hot buffer, slow paths and exits that are rarely taken to the cold one,
+ * which is appended after the hot code once the block is done.
+ */
+struct jit_ctx {
+  struct riscv_jit * jit;
+  const struct riscv_block * block;
+  struct jit_buf hot;
+  struct jit_buf cold;
+  struct jit_fixup fixups[JIT_MAX_FIXUPS];
+  size_t nfixups;
+  size_t nuops;                       // next free slot in jit->uops
+  int8_t host[32];                    // host register of each guest register, -1 if none
+  uint32_t mapped;                    // host registers holding a guest register
+  uint32_t dirty;                     // guest registers whose memory copy is stale
+};
+
+struct riscv_jit_return {
+  uint64_t budget;                    // rax
+  uint8_t * link;                     // rdx, rel32 of the exit taken if it can be chained
+};
+
+typedef struct riscv_jit_return (*riscv_jit_enter)(struct riscv_cpu *, const uint8_t *, uint64_t);
+
+/*
+ * Instruction encoding
+ */
+
+static inline void emit8(struct jit_buf * b, uint8_t value)
+{
+  b->p[b->len++] = value;
+}
+
+static inline void emit32(struct jit_buf * b, uint32_t value)
+{
+  memcpy(b->p + b->len, &value, sizeof(value));
+  b->len += sizeof(value);
+}
+
+static inline void emit64(struct jit_buf * b, uint64_t value)
+{
+  memcpy(b->p + b->len, &value, sizeof(value));
+  b->len += sizeof(value);
+}
+
+static void x86_rex(struct jit_buf * b, int w, int reg, int index, int base)
+{
+  uint8_t rex = 0x40 | (w << 3) | ((reg & 8) >> 1) | ((index & 8) >> 2) | ((base & 8) >> 3);
+
+  if (rex != 0x40)
+    emit8(b, rex);
+}
+
+static void x86_opcode(struct jit_buf * b, uint32_t op)
+{
+  if (op > 0xff)
+    emit8(b, op >> 8);
+
+  emit8(b, op & 0xff);
+}
+
+// op with a register operand in the r/m field
+static void x86_rr(struct jit_buf * b, int w, uint32_t op, int reg, int rm)
+{
+  x86_rex(b, w, reg, 0, rm);
+  x86_opcode(b, op);
+  emit8(b, 0xc0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+// op with a [base + index + disp] operand, index < 0 for none
+static void x86_rm(struct jit_buf * b, int w, uint32_t op, int reg, int base, int index, int32_t disp)
+{
+  int mod = (disp == 0 && (base & 7) != RBP) ? 0 : (disp >= -128 && disp <= 127) ? 1 : 2;
+
+  x86_rex(b, w, reg, (index < 0) ? 0 : index, base);
+  x86_opcode(b, op);
+
+  if (index < 0 && (base & 7) != RSP)
+  {
+    emit8(b, (mod << 6) | ((reg & 7) << 3) | (base & 7));
+  }
+  else
+  {
+    emit8(b, (mod << 6) | ((reg & 7) << 3) | RSP);
+    emit8(b, (((index < 0) ? RSP : index) & 7) << 3 | (base & 7));
+  }
+
+  if (mod == 1)
+    emit8(b, (uint8_t) disp);
+  else if (mod == 2)
+    emit32(b, (uint32_t) disp);
+}
+
+static void x86_mov(struct jit_buf * b, int dst, int src)
+{
+  if (dst != src)
+    x86_rr(b, 1, 0x89, src, dst);
+}
+
+static void x86_load(struct jit_buf * b, int dst, int base, int32_t disp)
+{
+  x86_rm(b, 1, 0x8b, dst, base, -1, disp);
+}
+
+static void x86_store(struct jit_buf * b, int base, int32_t disp, int src)
+{
+  x86_rm(b, 1, 0x89, src, base, -1, disp);
+}
+
+// may clobber the flags (a zero is loaded with xor)
+static void x86_mov_imm(struct jit_buf * b, int dst, uint64_t imm)
+{
+  if (imm == 0)
+  {
+    x86_rr(b, 0, 0x31, dst, dst);
+  }
+  else if (imm <= UINT32_MAX)
+  {
+    x86_rex(b, 0, 0, 0, dst);
+    emit8(b, 0xb8 + (dst & 7));
+    emit32(b, (uint32_t) imm);
+  }
+  else if ((int64_t) imm == (int32_t) imm)
+  {
+    x86_rr(b, 1, 0xc7, 0, dst);
+    emit32(b, (uint32_t) imm);
+  }
+  else
+  {
+    x86_rex(b, 1, 0, 0, dst);
+    emit8(b, 0xb8 + (dst & 7));
+    emit64(b, imm);
+  }
+}
+
+static void x86_alu(struct jit_buf * b, int w, int op, int dst, int src)
+{
+  x86_rr(b, w, op, src, dst);
+}
+
+static void x86_alu_imm(struct jit_buf * b, int w, int op, int dst, int32_t imm)
+{
+  if (imm >= -128 && imm <= 127)
+  {
+    x86_rr(b, w, 0x83, op >> 3, dst);
+    emit8(b, (uint8_t) imm);
+  }
+  else
+  {
+    x86_rr(b, w, 0x81, op >> 3, dst);
+    emit32(b, (uint32_t) imm);
+  }
+}
+
+static void x86_shift_imm(struct jit_buf * b, int w, int op, int dst, uint8_t count)
+{
+  x86_rr(b, w, 0xc1, op, dst);
+  emit8(b, count);
+}
+
+static void x86_shift_cl(struct jit_buf * b, int w, int op, int dst)
+{
+  x86_rr(b, w, 0xd3, op, dst);
+}
+
+static void x86_movsxd(struct jit_buf * b, int dst, int src)
+{
+  x86_rr(b, 1, 0x63, dst, src);
+}
+
+// rax = condition ? 1 : 0
+static void x86_setcc(struct jit_buf * b, int cc)
+{
+  x86_rr(b, 0, 0x0f90 | cc, 0, RAX);
+  x86_rr(b, 0, 0x0fb6, RAX, RAX);
+}
+
+static void x86_call(struct jit_buf * b, const void * function)
+{
+  x86_mov_imm(b, RAX, (uintptr_t) function);
+  x86_rr(b, 0, 0xff, 2, RAX);
+}
+
+/*
+ * Jumps. Their rel32 is filled in once the block has been laid out.
+ */
+
+static struct jit_fixup * jit_rel32(struct jit_ctx * ctx, struct jit_buf * b, int target, uintptr_t to)
+{
+  struct jit_fixup * fixup = &ctx->fixups[ctx->nfixups++];
+
+  fixup->cold = (b == &ctx->cold);
+  fixup->target = target;
+  fixup->pos = b->len;
+  fixup->to = to;
+  emit32(b, 0);
+
+  return fixup;
+}
+
+static struct jit_fixup * jit_jmp(struct jit_ctx * ctx, struct jit_buf * b, int target, uintptr_t to)
+{
+  emit8(b, 0xe9);
+  return jit_rel32(ctx, b, target, to);
+}
+
+static struct jit_fixup * jit_jcc(struct jit_ctx * ctx, struct jit_buf * b, int cc, int target, uintptr_t to)
+{
+  emit8(b, 0x0f);
+  emit8(b, 0x80 | cc);
+  return jit_rel32(ctx, b, target, to);
+}
+
+static uintptr_t jit_epilogue(const struct jit_ctx * ctx)
+{
+  return (uintptr_t) (ctx->jit->code + ctx->jit->epilogue);
+}
+
+/*
+ * Guest register access
+ */
+
+static void jit_get(struct jit_ctx * ctx, struct jit_buf * b, int dst, int g)
+{
+  if (g == 0)
+    x86_mov_imm(b, dst, 0);
+  else if (ctx->host[g] >= 0)
+    x86_mov(b, dst, ctx->host[g]);
+  else
+    x86_load(b, dst, RBP, GUEST(g));
+}
+
+static void jit_set(struct jit_ctx * ctx, struct jit_buf * b, int g, int src)
+{
+  if (g == 0)
+    return;
+
+  if (ctx->host[g] >= 0)
+  {
+    x86_mov(b, ctx->host[g], src);
+    ctx->dirty |= 1U << g;
+  }
+  else
+  {
+    x86_store(b, RBP, GUEST(g), src);
+  }
+}
+
+static void jit_set_imm(struct jit_ctx * ctx, struct jit_buf * b, int g, uint64_t imm)
+{
+  if (g == 0)
+    return;
+
+  if (ctx->host[g] >= 0)
+  {
+    x86_mov_imm(b, ctx->host[g], imm);
+    ctx->dirty |= 1U << g;
+  }
+  else
+  {
+    x86_mov_imm(b, R10, imm);
+    x86_store(b, RBP, GUEST(g), R10);
+  }
+}
+
+// dst op= guest register g
+static void jit_alu_guest(struct jit_ctx * ctx, struct jit_buf * b, int w, int op, int dst, int g)
+{
+  if (g == 0)
+    x86_alu_imm(b, w, op, dst, 0);
+  else if (ctx->host[g] >= 0)
+    x86_alu(b, w, op, dst, ctx->host[g]);
+  else
+    x86_rm(b, w, op + 2, dst, RBP, -1, GUEST(g));
+}
+
+// store the dirty guest registers, leaves the flags alone
+static void jit_writeback(struct jit_ctx * ctx, struct jit_buf * b)
+{
+  int g;
+
+  for (g = 1; g < 32; g++)
+    if (ctx->dirty & (1U << g))
+      x86_store(b, RBP, GUEST(g), ctx->host[g]);
+}
+
+// load the guest registers whose host register is in mask
+static void jit_reload(struct jit_ctx * ctx, struct jit_buf * b, uint32_t mask)
+{
+  int g;
+
+  for (g = 1; g < 32; g++)
+    if (ctx->host[g] >= 0 && (mask & (1U << ctx->host[g])))
+      x86_load(b, ctx->host[g], RBP, GUEST(g));
+}
+
+static void jit_set_pc(struct jit_buf * b, uint64_t pc)
+{
+  x86_mov_imm(b, R10, pc);
+  x86_store(b, RBP, CPU(pc), R10);
+}
+
+/*
+ * Block exits
+ */
+
+// leave with cpu->pc already set, giving back the budget of the instructions not run
+static void jit_exit(struct jit_ctx * ctx, struct jit_buf * b, uint64_t refund)
+{
+  if (refund != 0)
+    x86_alu_imm(b, 1, ALU_ADD, R15, (int32_t) refund);
+
+  x86_rr(b, 0, 0x31, RDX, RDX);
+  jit_jmp(ctx, b, JIT_ABS, jit_epilogue(ctx));
+}
+
+// compare the kick byte of the hart with 0
+static void jit_cmp_kick(struct jit_buf * b)
+{
+  x86_rm(b, 0, 0x80, 7, RBP, -1, CPU(kick));       // cmp byte [rbp + kick], 0
+  emit8(b, 0);
+}
+
+// compare the clock of the hart with its next event, clobbers rax
+static void jit_cmp_time(struct jit_buf * b)
+{
+  x86_load(b, RAX, RSP, 8);
+  x86_alu(b, 1, ALU_SUB, RAX, R15);
+  x86_rm(b, 1, ALU_CMP + 2, RAX, RBP, -1, CPU(events.next));
+}
+
+/*
+ * Leave for a known pc. The leading jump falls through until the dispatcher
+ * patches it to the compiled block at pc; rdx tells it where the jump is.
+ * A hart that was kicked or whose next event is due goes back to the
+ * dispatcher before that, chained blocks would run on until the budget is
+ * gone otherwise.
+ */
+static void jit_exit_chain(struct jit_ctx * ctx, uint64_t pc)
+{
+  struct jit_buf * b = &ctx->hot;
+  size_t site;
+
+  jit_cmp_kick(b);
+  jit_jcc(ctx, b, CC_NE, JIT_COLD, ctx->cold.len);
+  jit_cmp_time(b);
+  jit_jcc(ctx, b, CC_AE, JIT_COLD, ctx->cold.len);
+  jit_set_pc(&ctx->cold, pc);
+  jit_exit(ctx, &ctx->cold, 0);
+
+  emit8(b, 0xe9);
+  site = b->len;
+  emit32(b, 0);
+
+  jit_set_pc(b, pc);
+
+  x86_rex(b, 1, RDX, 0, 0);                         // lea rdx, [rip + site]
+  emit8(b, 0x8d);
+  emit8(b, ((RDX & 7) << 3) | 0x05);
+  emit32(b, (uint32_t) ((int32_t) site - (int32_t) (b->len + 4)));
+
+  jit_jmp(ctx, b, JIT_ABS, jit_epilogue(ctx));
+}
+
+/*
+ * Run a micro-op through its interpreter handler: write everything back, set
+ * the pc and call it. The result of the handler is left in eax, the flags
+ * are clobbered.
+ */
+static void jit_call_handler(struct jit_ctx * ctx, struct jit_buf * b, const struct riscv_uop * uop,
+                             uint64_t pc)
+{
+  struct riscv_jit * const jit = ctx->jit;
+  struct riscv_uop * copy = &jit->uops[ctx->nuops++];
+
+  *copy = *uop;
+
+  jit_writeback(ctx, b);
+  jit_set_pc(b, pc);
+  x86_mov(b, RDI, RBP);
+  x86_mov_imm(b, RSI, (uintptr_t) copy);
+  x86_call(b, (const void *) uop->handler);
+
+  // handlers may write x0, the interpreter clears it before every micro-op
+  x86_rm(b, 1, 0xc7, 0, RBP, -1, GUEST(x0));
+  emit32(b, 0);
+}
+
+// load the generation of the code cache into dst
+static void jit_generation(struct jit_buf * b, int dst)
+{
+  x86_load(b, dst, RBP, CPU(bcache));
+  x86_load(b, dst, dst, (int32_t) (offsetof(struct riscv_block_cache, jit) + offsetof(struct riscv_jit, generation)));
+}
+
+static void jit_fallback(struct jit_ctx * ctx, const struct riscv_uop * uop, uint64_t pc,
+                         uint64_t refund, int last)
+{
+  struct jit_buf * b = &ctx->hot;
+
+  // the handler may throw compiled code away, this block included (an AMO to a code page)
+  if (!last)
+  {
+    jit_generation(b, RDX);
+    x86_store(b, RSP, 0, RDX);
+  }
+
+  jit_call_handler(ctx, b, uop, pc);
+  ctx->dirty = 0;
+
+  // non-zero: the handler has set the pc or raised an exception
+  x86_rr(b, 0, 0x85, RAX, RAX);
+  jit_jcc(ctx, b, CC_NE, JIT_COLD, ctx->cold.len);
+  jit_exit(ctx, &ctx->cold, refund);
+
+  if (!last)
+  {
+    jit_generation(b, RDX);
+    x86_rm(b, 1, ALU_CMP + 2, RDX, RSP, -1, 0);
+    jit_jcc(ctx, b, CC_NE, JIT_COLD, ctx->cold.len);
+    jit_set_pc(&ctx->cold, pc + uop->len);
+    jit_exit(ctx, &ctx->cold, refund);
+  }
+
+  jit_reload(ctx, b, JIT_CALLER_SAVED | ((uop->rd != 0 && ctx->host[uop->rd] >= 0) ? 1U << ctx->host[uop->rd] : 0));
+
+  // instructions ending a block may have changed what the next one means, take the slow way
+  if (last)
+  {
+    jit_set_pc(b, pc + uop->len);
+    jit_exit(ctx, b, 0);
+  }
+}
+
+/*
+ * Memory access. The TLB is probed inline exactly like the riscv_cpu_load*
+ * and riscv_cpu_store* accessors do; on a miss the cold path calls the MMU
+ * slow path.
+ */
+
+// rax holds the address, leaves the host address of the page in rdx or jumps to the cold path
+static void jit_tlb(struct jit_ctx * ctx, uint64_t size, int32_t array)
+{
+  struct jit_buf * b = &ctx->hot;
+
+  x86_rr(b, 0, 0x89, RAX, RDX);                     // mov edx, eax
+  x86_shift_imm(b, 0, SHIFT_SHR, RDX, RISCV_PAGE_SHIFT - 4);
+  x86_alu_imm(b, 0, ALU_AND, RDX, (RISCV_TLB_SIZE - 1) << 4);
+  x86_rm(b, 1, ALU_ADD + 2, RDX, RBP, -1, CPU(dtlb));
+  x86_mov(b, R10, RAX);
+  x86_alu_imm(b, 1, ALU_AND, R10, (int32_t) ~(RISCV_PAGE_SIZE - 1 - (size - 1)));
+  x86_rm(b, 1, ALU_CMP + 2, R10, RDX, -1, array);
+  jit_jcc(ctx, b, CC_NE, JIT_COLD, ctx->cold.len);
+  x86_load(b, RDX, RDX, array + (int32_t) offsetof(struct riscv_tlb_entry, addend));
+}
+
+static const struct {
+  uint32_t op;
+  uint8_t w;
+} riscv_jit_loads[] = {
+  { 0x0fbe, 1 },                      // lb, movsx r64, byte
+  { 0x0fbf, 1 },                      // lh, movsx r64, word
+  { 0x63, 1 },                        // lw, movsxd
+  { 0x8b, 1 },                        // ld
+  { 0x0fb6, 0 },                      // lbu, movzx r32, byte
+  { 0x0fb7, 0 },                      // lhu, movzx r32, word
+  { 0x8b, 0 }                         // lwu, mov r32
+};
+
+static void jit_load(struct jit_ctx * ctx, const struct riscv_uop * uop, uint64_t pc, uint64_t refund)
+{
+  struct jit_buf * b = &ctx->hot;
+  struct jit_buf * cold = &ctx->cold;
+  uint32_t funct3 = (uop->inst >> 12) & 0x7;
+  uint64_t size = 1UL << (funct3 & 0x3);
+  int dst = (ctx->host[uop->rd] >= 0) ? ctx->host[uop->rd] : RCX;
+  struct jit_fixup * failed;
+  size_t back;
+
+  jit_get(ctx, b, RAX, uop->rs1);
+  if (uop->imm != 0)
+    x86_alu_imm(b, 1, ALU_ADD, RAX, (int32_t) uop->imm);
+
+  jit_tlb(ctx, size, (int32_t) offsetof(struct riscv_tlb, load));
+  x86_rm(b, riscv_jit_loads[funct3].w, riscv_jit_loads[funct3].op, dst, RDX, RAX, 0);
+  back = b->len;
+
+  // riscv_mmu_load(cpu, addr, size, rsp)
+  jit_writeback(ctx, cold);
+  jit_set_pc(cold, pc);
+  x86_mov(cold, RDI, RBP);
+  x86_mov(cold, RSI, RAX);
+  x86_mov_imm(cold, RDX, size);
+  x86_mov(cold, RCX, RSP);
+  x86_call(cold, (const void *) riscv_mmu_load);
+  x86_rr(cold, 0, 0x85, RAX, RAX);
+  failed = jit_jcc(ctx, cold, CC_NE, JIT_COLD, 0);
+  jit_reload(ctx, cold, JIT_CALLER_SAVED);
+  x86_rm(cold, riscv_jit_loads[funct3].w, riscv_jit_loads[funct3].op, dst, RSP, -1, 0);
+  jit_jmp(ctx, cold, JIT_HOT, back);
+  failed->to = cold->len;
+  jit_exit(ctx, cold, refund);
+
+  jit_set(ctx, b, uop->rd, dst);
+}
+
+/*
+ * Slow path of a compiled store, taken on a TLB miss, which every store to
+ * a page of decoded code is. Returns non-zero if the block has to be left,
+ * because the store raised an exception (pc is the store) or threw compiled
+ * code away (pc is the next instruction, len bytes on).
+ */
+static int riscv_jit_store(struct riscv_cpu * const restrict cpu, uint64_t addr, uint64_t value,
+                           uint64_t size, uint64_t len)
+{
+  const uint64_t generation = cpu->bcache->jit.generation;
+
+  if (riscv_mmu_store(cpu, addr, size, value) != 0)
+    return 1;
+
+  if (cpu->bcache->jit.generation == generation)
+    return 0;
+
+  cpu->pc += len;
+  return 1;
+}
+
+static void jit_store(struct jit_ctx * ctx, const struct riscv_uop * uop, uint64_t pc, uint64_t refund)
+{
+  struct jit_buf * b = &ctx->hot;
+  struct jit_buf * cold = &ctx->cold;
+  uint32_t funct3 = (uop->inst >> 12) & 0x7;
+  uint64_t size = 1UL << funct3;
+  struct jit_fixup * failed;
+  size_t back;
+
+  jit_get(ctx, b, RAX, uop->rs1);
+  if (uop->imm != 0)
+    x86_alu_imm(b, 1, ALU_ADD, RAX, (int32_t) uop->imm);
+  jit_get(ctx, b, RCX, uop->rs2);
+
+  jit_tlb(ctx, size, (int32_t) offsetof(struct riscv_tlb, store));
+  if (size == 2)
+    emit8(b, 0x66);
+  x86_rm(b, size == 8, (size == 1) ? 0x88 : 0x89, RCX, RDX, RAX, 0);
+  back = b->len;
+
+  // riscv_jit_store(cpu, addr, value, size, len)
+  jit_writeback(ctx, cold);
+  jit_set_pc(cold, pc);
+  x86_mov(cold, RDI, RBP);
+  x86_mov(cold, RSI, RAX);
+  x86_mov(cold, RDX, RCX);
+  x86_mov_imm(cold, RCX, size);
+  x86_mov_imm(cold, R8, uop->len);
+  x86_call(cold, (const void *) riscv_jit_store);
+  x86_rr(cold, 0, 0x85, RAX, RAX);
+  failed = jit_jcc(ctx, cold, CC_NE, JIT_COLD, 0);
+  jit_reload(ctx, cold, JIT_CALLER_SAVED);
+  jit_jmp(ctx, cold, JIT_HOT, back);
+  failed->to = cold->len;
+  jit_exit(ctx, cold, refund);
+}
+
+/*
+ * Integer computation
+ */
+
+static int jit_op_imm(struct jit_ctx * ctx, const struct riscv_uop * uop)
+{
+  struct jit_buf * b = &ctx->hot;
+  uint32_t funct3 = (uop->inst >> 12) & 0x7;
+  int32_t imm = (int32_t) uop->imm;
+  int dst = (ctx->host[uop->rd] >= 0) ? ctx->host[uop->rd] : RAX;
+  int arith = (uop->inst >> 30) & 0x1;
+
+  switch (funct3)
+  {
+    case 0x2:
+    case 0x3:
+      jit_get(ctx, b, RAX, uop->rs1);
+      x86_alu_imm(b, 1, ALU_CMP, RAX, imm);
+      x86_setcc(b, (funct3 == 0x2) ? CC_L : CC_B);
+      jit_set(ctx, b, uop->rd, RAX);
+      return 0;
+  }
+
+  jit_get(ctx, b, dst, uop->rs1);
+
+  switch (funct3)
+  {
+    case 0x0:
+      if (imm != 0)
+        x86_alu_imm(b, 1, ALU_ADD, dst, imm);
+      break;
+    case 0x4:
+      x86_alu_imm(b, 1, ALU_XOR, dst, imm);
+      break;
+    case 0x6:
+      x86_alu_imm(b, 1, ALU_OR, dst, imm);
+      break;
+    case 0x7:
+      x86_alu_imm(b, 1, ALU_AND, dst, imm);
+      break;
+    case 0x1:
+      x86_shift_imm(b, 1, SHIFT_SHL, dst, imm);
+      break;
+    case 0x5:
+      x86_shift_imm(b, 1, arith ? SHIFT_SAR : SHIFT_SHR, dst, imm);
+      break;
+  }
+
+  jit_set(ctx, b, uop->rd, dst);
+  return 0;
+}
+
+static int jit_op_imm32(struct jit_ctx * ctx, const struct riscv_uop * uop)
+{
+  struct jit_buf * b = &ctx->hot;
+  uint32_t funct3 = (uop->inst >> 12) & 0x7;
+  int dst = (ctx->host[uop->rd] >= 0) ? ctx->host[uop->rd] : RAX;
+  int arith = (uop->inst >> 30) & 0x1;
+
+  jit_get(ctx, b, dst, uop->rs1);
+
+  switch (funct3)
+  {
+    case 0x0:
+      x86_alu_imm(b, 0, ALU_ADD, dst, (int32_t) uop->imm);
+      break;
+    case 0x1:
+      x86_shift_imm(b, 0, SHIFT_SHL, dst, uop->imm);
+      break;
+    case 0x5:
+      x86_shift_imm(b, 0, arith ? SHIFT_SAR : SHIFT_SHR, dst, uop->imm);
+      break;
+  }
+
+  x86_movsxd(b, dst, dst);
+  jit_set(ctx, b, uop->rd, dst);
+  return 0;
+}
+
+// OP and OP-32, w selects the 64-bit forms
+static int jit_op(struct jit_ctx * ctx, const struct riscv_uop * uop, int w)
+{
+  struct jit_buf * b = &ctx->hot;
+  uint32_t funct3 = (uop->inst >> 12) & 0x7;
+  int alt = (uop->inst >> 30) & 0x1;
+  int dst = (ctx->host[uop->rd] >= 0 && uop->rd != uop->rs2) ? ctx->host[uop->rd] : RAX;
+
+  switch (funct3)
+  {
+    case 0x1:
+    case 0x5:
+      jit_get(ctx, b, RCX, uop->rs2);
+      dst = (ctx->host[uop->rd] >= 0) ? ctx->host[uop->rd] : RAX;
+      jit_get(ctx, b, dst, uop->rs1);
+      x86_shift_cl(b, w, (funct3 == 0x1) ? SHIFT_SHL : alt ? SHIFT_SAR : SHIFT_SHR, dst);
+      break;
+
+    case 0x2:
+    case 0x3:
+      jit_get(ctx, b, RAX, uop->rs1);
+      jit_alu_guest(ctx, b, 1, ALU_CMP, RAX, uop->rs2);
+      x86_setcc(b, (funct3 == 0x2) ? CC_L : CC_B);
+      jit_set(ctx, b, uop->rd, RAX);
+      return 0;
+
+    default:
+      jit_get(ctx, b, dst, uop->rs1);
+      jit_alu_guest(ctx, b, w, (funct3 == 0x0) ? (alt ? ALU_SUB : ALU_ADD)
+                                : (funct3 == 0x4) ? ALU_XOR : (funct3 == 0x6) ? ALU_OR : ALU_AND,
+                    dst, uop->rs2);
+      break;
+  }
+
+  if (!w)
+    x86_movsxd(b, dst, dst);
+
+  jit_set(ctx, b, uop->rd, dst);
+  return 0;
+}
+
+/*
+ * M extension products on the host multiplier: imul for the low half, the
+ * one-operand mul and imul for the high halves, which leave the product in
+ * rdx:rax. Divisions are left to their handlers.
+ */
+static int jit_mul(struct jit_ctx * ctx, const struct riscv_uop * uop)
+{
+  struct jit_buf * b = &ctx->hot;
+
+  jit_get(ctx, b, RAX, uop->rs1);
+  jit_get(ctx, b, RCX, uop->rs2);
+
+  switch (uop->op)
+  {
+    case RISCV_UOP_mul:
+    case RISCV_UOP_mulw:
+      x86_rr(b, uop->op == RISCV_UOP_mul, 0x0faf, RAX, RCX);     // imul rax, rcx
+      if (uop->op == RISCV_UOP_mulw)
+        x86_movsxd(b, RAX, RAX);
+      jit_set(ctx, b, uop->rd, RAX);
+      return 0;
+
+    case RISCV_UOP_mulhsu:
+      // the unsigned high half, less rs2 if rs1 is negative
+      x86_mov(b, R10, RAX);
+      x86_shift_imm(b, 1, SHIFT_SAR, R10, 63);
+      x86_alu(b, 1, ALU_AND, R10, RCX);
+      x86_rr(b, 1, 0xf7, 4, RCX);                                  // mul rcx
+      x86_alu(b, 1, ALU_SUB, RDX, R10);
+      break;
+
+    default:
+      x86_rr(b, 1, 0xf7, (uop->op == RISCV_UOP_mulh) ? 5 : 4, RCX);  // imul rcx / mul rcx
+      break;
+  }
+
+  jit_set(ctx, b, uop->rd, RDX);
+  return 0;
+}
+
+/*
+ * Control transfer, always the last micro-op of a block
+ */
+
+static const uint8_t riscv_jit_branch_cc[] = {
+  [0x0] = CC_E, [0x1] = CC_NE, [0x4] = CC_L, [0x5] = CC_GE, [0x6] = CC_B, [0x7] = CC_AE
+};
+
+static void jit_branch(struct jit_ctx * ctx, const struct riscv_uop * uop, uint64_t pc)
+{
+  struct jit_buf * b = &ctx->hot;
+  struct jit_fixup * taken;
+
+  jit_get(ctx, b, RAX, uop->rs1);
+  jit_alu_guest(ctx, b, 1, ALU_CMP, RAX, uop->rs2);
+  jit_writeback(ctx, b);
+  ctx->dirty = 0;
+
+  taken = jit_jcc(ctx, b, riscv_jit_branch_cc[(uop->inst >> 12) & 0x7], JIT_HOT, 0);
+  jit_exit_chain(ctx, pc + uop->len);
+  taken->to = b->len;
+  jit_exit_chain(ctx, pc + uop->imm);
+}
+
+static void jit_jalr(struct jit_ctx * ctx, const struct riscv_uop * uop, uint64_t pc)
+{
+  struct jit_buf * b = &ctx->hot;
+
+  jit_get(ctx, b, RAX, uop->rs1);
+  if (uop->imm != 0)
+    x86_alu_imm(b, 1, ALU_ADD, RAX, (int32_t) uop->imm);
+  x86_alu_imm(b, 1, ALU_AND, RAX, -2);
+
+  jit_set_imm(ctx, b, uop->rd, pc + uop->len);
+  jit_writeback(ctx, b);
+  x86_store(b, RBP, CPU(pc), RAX);
+  jit_jmp(ctx, b, JIT_ABS, (uintptr_t) (ctx->jit->code + ctx->jit->indirect));
+}
+
+/*
+ * Fused pairs, see riscv_decode_fuse
+ */
+
+static void jit_slli_srli(struct jit_ctx * ctx, const struct riscv_uop * uop)
+{
+  struct jit_buf * b = &ctx->hot;
+  int dst = (ctx->host[uop->rd] >= 0) ? ctx->host[uop->rd] : RAX;
+
+  jit_get(ctx, b, dst, uop->rs1);
+  x86_shift_imm(b, 1, SHIFT_SHL, dst, uop->imm);
+  x86_shift_imm(b, 1, SHIFT_SHR, dst, uop->rs2);
+  jit_set(ctx, b, uop->rd, dst);
+}
+
+// the AUIPC, then the load as it would be compiled on its own, with the load's pc if it traps
+static void jit_auipc_load(struct jit_ctx * ctx, const struct riscv_uop * uop, uint64_t pc,
+                           uint64_t refund)
+{
+  struct riscv_uop load = *uop;
+
+  load.imm = (uint64_t) ((int64_t) (int32_t) uop->inst >> 20);
+  jit_set_imm(ctx, &ctx->hot, uop->rs1, pc + uop->imm);
+  jit_load(ctx, &load, pc + 4, refund);
+}
+
+/*
+ * Register allocation: the guest registers used most in the block get a
+ * host register, provided they are used more than once.
+ */
+static void jit_allocate(struct jit_ctx * ctx)
+{
+  const struct riscv_block * block = ctx->block;
+  unsigned int uses[32] = { 0 };
+  const struct riscv_uop * uop;
+  uint32_t i, opcode, best, g, r;
+
+  for (i = 0; i < block->count; i++)
+  {
+    uop = &block->uops[i];
+    opcode = uop->inst & 0x7f;
+
+    switch (opcode)
+    {
+      case 0x33: case 0x3b:
+        uses[uop->rs2]++;
+        /* fall through */
+      case 0x03: case 0x13: case 0x1b: case 0x67:
+        uses[uop->rs1]++;
+        /* fall through */
+      case 0x37: case 0x17: case 0x6f:
+        uses[uop->rd]++;
+        break;
+
+      case 0x23: case 0x63:
+        uses[uop->rs1]++;
+        uses[uop->rs2]++;
+        break;
+    }
+  }
+
+  uses[0] = 0;
+  memset(ctx->host, -1, sizeof(ctx->host));
+  ctx->mapped = 0;
+  ctx->dirty = 0;
+
+  for (r = 0; r < sizeof(riscv_jit_pool); r++)
+  {
+    for (best = 0, g = 1; g < 32; g++)
+      if (ctx->host[g] < 0 && uses[g] > uses[best])
+        best = g;
+
+    if (best == 0 || uses[best] < 2)
+      break;
+
+    ctx->host[best] = riscv_jit_pool[r];
+    ctx->mapped |= 1U << riscv_jit_pool[r];
+  }
+}
+
+/*
+ * Emit one micro-op. Returns 1 if it ended the block. Anything not handled
+ * here is run by its interpreter handler.
+ */
+static int jit_uop(struct jit_ctx * ctx, const struct riscv_uop * uop, uint64_t pc,
+                   uint64_t refund, int last)
+{
+  switch (uop->op)
+  {
+    case RISCV_UOP_lb: case RISCV_UOP_lh: case RISCV_UOP_lw: case RISCV_UOP_ld:
+    case RISCV_UOP_lbu: case RISCV_UOP_lhu: case RISCV_UOP_lwu:
+      jit_load(ctx, uop, pc, refund);
+      return 0;
+
+    case RISCV_UOP_sb: case RISCV_UOP_sh: case RISCV_UOP_sw: case RISCV_UOP_sd:
+      jit_store(ctx, uop, pc, refund);
+      return 0;
+
+    case RISCV_UOP_addi: case RISCV_UOP_slti: case RISCV_UOP_sltiu: case RISCV_UOP_xori:
+    case RISCV_UOP_ori: case RISCV_UOP_andi: case RISCV_UOP_slli: case RISCV_UOP_srli:
+    case RISCV_UOP_srai:
+      return jit_op_imm(ctx, uop);
+
+    case RISCV_UOP_addiw: case RISCV_UOP_slliw: case RISCV_UOP_srliw: case RISCV_UOP_sraiw:
+      return jit_op_imm32(ctx, uop);
+
+    case RISCV_UOP_add: case RISCV_UOP_sub: case RISCV_UOP_sll: case RISCV_UOP_slt:
+    case RISCV_UOP_sltu: case RISCV_UOP_xor: case RISCV_UOP_srl: case RISCV_UOP_sra:
+    case RISCV_UOP_or: case RISCV_UOP_and:
+      return jit_op(ctx, uop, 1);
+
+    case RISCV_UOP_addw: case RISCV_UOP_subw: case RISCV_UOP_sllw: case RISCV_UOP_srlw:
+    case RISCV_UOP_sraw:
+      return jit_op(ctx, uop, 0);
+
+    case RISCV_UOP_mul: case RISCV_UOP_mulh: case RISCV_UOP_mulhsu: case RISCV_UOP_mulhu:
+    case RISCV_UOP_mulw:
+      return jit_mul(ctx, uop);
+
+    case RISCV_UOP_lui:
+      jit_set_imm(ctx, &ctx->hot, uop->rd, uop->imm);
+      return 0;
+
+    case RISCV_UOP_auipc:
+      jit_set_imm(ctx, &ctx->hot, uop->rd, pc + uop->imm);
+      return 0;
+
+    case RISCV_UOP_beq: case RISCV_UOP_bne: case RISCV_UOP_blt: case RISCV_UOP_bge:
+    case RISCV_UOP_bltu: case RISCV_UOP_bgeu:
+      jit_branch(ctx, uop, pc);
+      return 1;
+
+    case RISCV_UOP_jal:
+      jit_set_imm(ctx, &ctx->hot, uop->rd, pc + uop->len);
+      jit_writeback(ctx, &ctx->hot);
+      ctx->dirty = 0;
+      jit_exit_chain(ctx, pc + uop->imm);
+      return 1;
+
+    case RISCV_UOP_jalr:
+      jit_jalr(ctx, uop, pc);
+      return 1;
+
+    case RISCV_UOP_lui_addi:
+      jit_set_imm(ctx, &ctx->hot, uop->rd, uop->imm);
+      return 0;
+
+    case RISCV_UOP_slli_srli:
+      jit_slli_srli(ctx, uop);
+      return 0;
+
+    case RISCV_UOP_auipc_lb: case RISCV_UOP_auipc_lh: case RISCV_UOP_auipc_lw: case RISCV_UOP_auipc_ld:
+    case RISCV_UOP_auipc_lbu: case RISCV_UOP_auipc_lhu: case RISCV_UOP_auipc_lwu:
+      jit_auipc_load(ctx, uop, pc, refund);
+      return 0;
+
+    case RISCV_UOP_auipc_jalr:
+      // the target is known, so unlike a lone JALR the exit can be chained
+      jit_set_imm(ctx, &ctx->hot, uop->rs1, pc + uop->imm);
+      jit_set_imm(ctx, &ctx->hot, uop->rd, pc + uop->len);
+      jit_writeback(ctx, &ctx->hot);
+      ctx->dirty = 0;
+      jit_exit_chain(ctx, (pc + uop->imm + (uint64_t) ((int64_t) (int32_t) uop->inst >> 20)) & ~(uint64_t) 1);
+      return 1;
+  }
+
+  jit_fallback(ctx, uop, pc, refund, last);
+  return last;
+}
+
+// the block must not be in the map yet, the slot of stale code can be taken again
+static void jit_insert(struct riscv_jit * const restrict jit, const struct riscv_jit_entry * const restrict entry)
+{
+  size_t i = (entry->pc >> 1) & (RISCV_JIT_MAP_SIZE - 1);
+
+  while (jit->map[i].pc != UINT64_MAX && jit->map[i].pc != RISCV_JIT_STALE)
+    i = (i + 1) & (RISCV_JIT_MAP_SIZE - 1);
+
+  if (jit->map[i].pc == UINT64_MAX)
+    jit->nentries++;
+
+  jit->map[i] = *entry;
+}
+
+/*
+ * Compile a decoded block to hot, which has room for 2 * RISCV_JIT_BLOCK_CODE
+ * bytes, with the micro-ops for interpreter fallbacks kept from *nuops on,
+ * which is moved past them. Returns the size of the code, 0 if there was no
+ * memory to compile it, and the offset of its stale exit in *stale.
+ */
+static size_t jit_compile(struct riscv_jit * const restrict jit, const struct riscv_block * const restrict block,
+                          uint8_t * hot, size_t * nuops, uint16_t * stale)
+{
+  struct jit_ctx * ctx;
+  struct jit_fixup * fixup;
+  uint8_t * site, * target;
+  uint64_t pc, left;
+  uint32_t i;
+  int32_t rel;
+  size_t j, size, stale_exit;
+  int ended;
+
+  ctx = malloc(sizeof(struct jit_ctx));
+  if (ctx == NULL)
+    return 0;
+
+  ctx->jit = jit;
+  ctx->block = block;
+  ctx->hot.p = hot;
+  ctx->hot.len = 0;
+  ctx->cold.p = hot + RISCV_JIT_BLOCK_CODE;         // scratch space, moved behind the hot code
+  ctx->cold.len = 0;
+  ctx->nfixups = 0;
+  ctx->nuops = *nuops;
+
+  jit_allocate(ctx);
+
+  // a 5-byte nop, riscv_jit_drop_page turns it into a jump to the stale exit
+  emit8(&ctx->hot, 0x0f); emit8(&ctx->hot, 0x1f); emit8(&ctx->hot, 0x44);
+  emit8(&ctx->hot, 0x00); emit8(&ctx->hot, 0x00);
+
+  // not enough budget left for the whole block, let the interpreter finish it
+  x86_alu_imm(&ctx->hot, 1, ALU_SUB, R15, (int32_t) block->insts);
+  jit_jcc(ctx, &ctx->hot, CC_B, JIT_COLD, ctx->cold.len);
+  x86_alu_imm(&ctx->cold, 1, ALU_ADD, R15, (int32_t) block->insts);
+  jit_set_pc(&ctx->cold, block->pc);
+  jit_exit(ctx, &ctx->cold, 0);
+
+  // the stale exit: on to whatever is compiled for the pc now, if anything
+  stale_exit = ctx->cold.len;
+  x86_mov_imm(&ctx->cold, RAX, block->pc);
+  x86_store(&ctx->cold, RBP, CPU(pc), RAX);
+  jit_jmp(ctx, &ctx->cold, JIT_ABS, (uintptr_t) (jit->code + jit->indirect));
+
+  jit_reload(ctx, &ctx->hot, ctx->mapped);
+
+  // the refund is in instructions, a fused pair is two
+  for (ended = 0, pc = block->pc, left = block->insts, i = 0; i < block->count && !ended;
+       pc += block->uops[i++].len)
+  {
+    left -= 1 + riscv_uop_fused(block->uops[i].op);
+    ended = jit_uop(ctx, &block->uops[i], pc, left, i == block->count - 1);
+  }
+
+  // the block was cut short (size limit or end of page), go on with the next one
+  if (!ended)
+  {
+    jit_writeback(ctx, &ctx->hot);
+    jit_exit_chain(ctx, pc);
+  }
+
+  memmove(hot + ctx->hot.len, ctx->cold.p, ctx->cold.len);
+  ctx->cold.p = hot + ctx->hot.len;
+
+  for (j = 0; j < ctx->nfixups; j++)
+  {
+    fixup = &ctx->fixups[j];
+    site = (fixup->cold ? ctx->cold.p : ctx->hot.p) + fixup->pos;
+
+    if (fixup->target == JIT_HOT)
+      target = ctx->hot.p + fixup->to;
+    else if (fixup->target == JIT_COLD)
+      target = ctx->cold.p + fixup->to;
+    else
+      target = (uint8_t *) fixup->to;
+
+    rel = (int32_t) (target - (site + 4));
+    memcpy(site, &rel, sizeof(rel));
+  }
+
+  size = (ctx->hot.len + ctx->cold.len + 15) & ~(size_t) 15;
+  *nuops = ctx->nuops;
+  *stale = (uint16_t) (ctx->hot.len + stale_exit);
+
+  free(ctx);
+
+  return size;
+}
+
+static inline void jit_update_ready(struct riscv_jit * const restrict jit)
+{
+  __atomic_store_n(&jit->ready, jit->ndone != 0 || jit->full, __ATOMIC_RELEASE);
+}
+
+/*
+ * The compiler thread: takes the promoted blocks off the queue one at a
+ * time and compiles them at the end of the code cache, without the lock. A
+ * flush or a write to the page of the block in the meantime makes the
+ * result stale, it is dropped then and the space it took is reused.
+ */
+static void * jit_compiler(void * arg)
+{
+  struct riscv_jit * const jit = arg;
+  struct riscv_block * block;
+  uint8_t * hot;
+  size_t size, nuops;
+  uint16_t stale;
+
+  block = malloc(sizeof(struct riscv_block));
+  if (block == NULL)
+    return NULL;
+
+  pthread_mutex_lock(&jit->lock);
+
+  for (;;)
+  {
+    while (!jit->stop && jit->queued == 0)
+      pthread_cond_wait(&jit->work, &jit->lock);
+
+    if (jit->stop)
+      break;
+
+    memcpy(block, &jit->queue[jit->head], sizeof(struct riscv_block));
+    jit->head = (jit->head + 1) % RISCV_JIT_QUEUE;
+    jit->queued--;
+
+    // dropped by riscv_jit_drop_page
+    if (block->count == 0)
+      continue;
+
+    if (jit->used + 2 * RISCV_JIT_BLOCK_CODE > RISCV_JIT_CODE_SIZE
+        || jit->nuops + RISCV_BLOCK_MAX > RISCV_JIT_UOPS)
+    {
+      jit->full = 1;
+      jit_update_ready(jit);
+      continue;
+    }
+
+    hot = jit->code + jit->used;
+    nuops = jit->nuops;
+    jit->compiling = block;
+    jit->stale = 0;
+
+    pthread_mutex_unlock(&jit->lock);
+    size = jit_compile(jit, block, hot, &nuops, &stale);
+    pthread_mutex_lock(&jit->lock);
+
+    jit->compiling = NULL;
+
+    if (size != 0 && !jit->stale)
+    {
+      jit->used += size;
+      jit->nuops = nuops;
+      jit->done[jit->ndone].pc = block->pc;
+      jit->done[jit->ndone].mode = block->mode;
+      jit->done[jit->ndone].code = hot;
+      jit->done[jit->ndone].page[0] = block->page[0];
+      jit->done[jit->ndone].page[1] = block->page[1];
+      jit->done[jit->ndone].stale = stale;
+      jit->done[jit->ndone].epoch = block->epoch;
+      jit->ndone++;
+      jit_update_ready(jit);
+    }
+  }
+
+  pthread_mutex_unlock(&jit->lock);
+  free(block);
+
+  return NULL;
+}
+
+/*
+ * Promote a block that has become hot: queue it for the compiler thread and
+ * return right away. With the queue full the block stays interpreted and
+ * starts counting its runs again.
+ */
+void riscv_jit_promote(struct riscv_jit * const restrict jit, struct riscv_block * const restrict block)
+{
+  if (jit->code == NULL || block->count == 0)
+    return;
+
+  pthread_mutex_lock(&jit->lock);
+
+  // a slot for every block queued, being compiled or waiting to be installed
+  if (jit->queued + (jit->compiling != NULL) + jit->ndone < RISCV_JIT_QUEUE)
+  {
+    memcpy(&jit->queue[(jit->head + jit->queued) % RISCV_JIT_QUEUE], block, sizeof(struct riscv_block));
+    jit->queued++;
+    pthread_cond_signal(&jit->work);
+  }
+  else
+  {
+    block->hits = 0;
+  }
+
+  pthread_mutex_unlock(&jit->lock);
+}
+
+/*
+ * Make what the compiler thread finished available to the hart, the blocks
+ * still in the block cache run from host code from now on. Once the code
+ * cache or its map fills up, everything compiled so far is thrown away and
+ * every block has to become hot again to be compiled anew.
+ */
+void riscv_jit_install(struct riscv_block_cache * const restrict cache)
+{
+  struct riscv_jit * const jit = &cache->jit;
+  struct riscv_jit_entry * entry;
+  struct riscv_block * block;
+  size_t i;
+  int full;
+
+  pthread_mutex_lock(&jit->lock);
+
+  for (i = 0; i < jit->ndone; i++)
+  {
+    entry = &jit->done[i];
+
+    // the block may have been promoted twice, from two translations of it
+    if (riscv_jit_lookup(jit, entry->pc, entry->mode, entry->page) == NULL)
+      jit_insert(jit, entry);
+
+    block = riscv_block_lookup(cache, entry->pc, entry->mode);
+    if (block != NULL && block->code == NULL && block->epoch == cache->epoch)
+      riscv_block_link(cache, block);
+  }
+
+  jit->ndone = 0;
+  full = jit->full || jit->nentries >= RISCV_JIT_MAP_SIZE / 2;
+  jit_update_ready(jit);
+
+  pthread_mutex_unlock(&jit->lock);
+
+  if (full)
+  {
+    riscv_jit_flush(jit);
+
+    for (i = 0; i < RISCV_BLOCK_CACHE_SIZE; i++)
+    {
+      cache->blocks[i].code = NULL;
+      cache->blocks[i].hits = 0;
+    }
+  }
+}
+
+// the block at pc in the translation context compiled from the DRAM pages, NULL if there is none
+struct riscv_jit_entry * riscv_jit_lookup(struct riscv_jit * const restrict jit, uint64_t pc, uint8_t mode,
+                                          const uint32_t * page)
+{
+  struct riscv_jit_entry * entry;
+  size_t i = (pc >> 1) & (RISCV_JIT_MAP_SIZE - 1);
+
+  if (jit->code == NULL)
+    return NULL;
+
+  for (; jit->map[i].pc != UINT64_MAX; i = (i + 1) & (RISCV_JIT_MAP_SIZE - 1))
+  {
+    entry = &jit->map[i];
+    if (entry->pc == pc && entry->mode == mode && entry->page[0] == page[0] && entry->page[1] == page[1])
+      return entry;
+  }
+
+  return NULL;
+}
+
+// the block at pc whose pages were found current in the epoch, what pc fetches from right now
+static const uint8_t * jit_current(const struct riscv_jit * const restrict jit, uint64_t pc, uint8_t mode,
+                                   uint32_t epoch)
+{
+  size_t i = (pc >> 1) & (RISCV_JIT_MAP_SIZE - 1);
+
+  for (; jit->map[i].pc != UINT64_MAX; i = (i + 1) & (RISCV_JIT_MAP_SIZE - 1))
+  {
+    if (jit->map[i].pc == pc && jit->map[i].mode == mode && jit->map[i].epoch == epoch)
+      return jit->map[i].code;
+  }
+
+  return NULL;
+}
+
+/*
+ * Run compiled code starting at code with the given budget and return what
+ * is left of it. cpu->pc is where execution stopped. If the block was left
+ * through a patchable exit, it is chained to its successor when that has
+ * been compiled in the meantime.
+ */
+uint64_t riscv_jit_exec(struct riscv_jit * const restrict jit, struct riscv_cpu * const restrict cpu,
+                        const uint8_t * code, uint64_t budget)
+{
+  const uint64_t generation = jit->generation;
+  struct riscv_jit_return ret;
+  const uint8_t * target;
+  int32_t rel;
+
+  ret = ((riscv_jit_enter) (void *) jit->code)(cpu, code, budget);
+
+  if (ret.link != NULL && !cpu->trap && jit->generation == generation && jit->nlinks < RISCV_JIT_LINKS)
+  {
+    target = jit_current(jit, cpu->pc, cpu->fetch_mode, cpu->bcache->epoch);
+    if (target != NULL)
+    {
+      rel = (int32_t) (target - (ret.link + 4));
+      memcpy(ret.link, &rel, sizeof(rel));
+      jit->links[jit->nlinks++] = ret.link;
+    }
+  }
+
+  return ret.budget;
+}
+
+static inline int jit_on_page(const uint32_t * block_page, uint64_t page)
+{
+  return block_page[0] == page || block_page[1] == page;
+}
+
+/*
+ * Throw away the compiled blocks from the DRAM page, which is about to be
+ * written, and the ones from it that are still on their way. The entry of
+ * the code is patched to jump to its stale exit, since other blocks may be
+ * chained to it, and its map slot is kept as a tombstone that the block
+ * compiled anew can take.
+ */
+void riscv_jit_drop_page(struct riscv_jit * const restrict jit, uint64_t page)
+{
+  struct riscv_jit_entry * entry;
+  uint8_t * code;
+  int32_t rel;
+  size_t i, n;
+  int dropped = 0;
+
+  if (jit->code == NULL)
+    return;
+
+  for (i = 0; i < RISCV_JIT_MAP_SIZE; i++)
+  {
+    entry = &jit->map[i];
+    if (entry->pc == UINT64_MAX || entry->pc == RISCV_JIT_STALE || !jit_on_page(entry->page, page))
+      continue;
+
+    code = (uint8_t *) entry->code;
+    rel = (int32_t) entry->stale - 5;
+    code[0] = 0xe9;
+    memcpy(code + 1, &rel, sizeof(rel));
+
+    entry->pc = RISCV_JIT_STALE;
+    dropped = 1;
+  }
+
+  pthread_mutex_lock(&jit->lock);
+
+  for (i = 0; i < jit->queued; i++)
+  {
+    if (jit_on_page(jit->queue[(jit->head + i) % RISCV_JIT_QUEUE].page, page))
+      jit->queue[(jit->head + i) % RISCV_JIT_QUEUE].count = 0;
+  }
+
+  if (jit->compiling != NULL && jit_on_page(jit->compiling->page, page))
+    jit->stale = 1;
+
+  for (i = 0, n = 0; i < jit->ndone; i++)
+  {
+    if (!jit_on_page(jit->done[i].page, page))
+      jit->done[n++] = jit->done[i];
+  }
+
+  jit->ndone = n;
+  jit_update_ready(jit);
+
+  if (dropped)
+    jit->generation++;
+
+  pthread_mutex_unlock(&jit->lock);
+}
+
+/*
+ * Point every chained exit back at the dispatcher, which chains it again
+ * once its successor has been found current after a change of translations.
+ */
+void riscv_jit_unchain(struct riscv_jit * const restrict jit)
+{
+  const int32_t rel = 0;
+  size_t i;
+
+  for (i = 0; i < jit->nlinks; i++)
+    memcpy(jit->links[i], &rel, sizeof(rel));
+
+  jit->nlinks = 0;
+}
+
+// drop all compiled code and every promoted block not installed yet, the trampolines stay
+void riscv_jit_flush(struct riscv_jit * const restrict jit)
+{
+  if (jit->code == NULL)
+    return;
+
+  pthread_mutex_lock(&jit->lock);
+
+  jit->generation++;
+  jit->queued = 0;
+  jit->ndone = 0;
+  jit->stale = 1;
+  jit->full = 0;
+  jit_update_ready(jit);
+  jit->used = jit->base;
+  jit->nuops = 0;
+
+  pthread_mutex_unlock(&jit->lock);
+
+  jit->nlinks = 0;
+
+  if (jit->nentries == 0)
+    return;
+
+  jit->nentries = 0;
+  memset(jit->map, 0xff, sizeof(jit->map));
+}
+
+/*
+ * The entry trampoline, riscv_jit_enter(cpu, code, budget), saves the
+ * callee-saved registers and jumps to the block; the exit trampoline
+ * restores them and returns the budget left in rax and the exit to chain in
+ * rdx. The indirect trampoline continues a jump to the pc in rax (already
+ * stored in cpu->pc) in compiled code if its first map slot has it, found
+ * current in this epoch of the block cache, and the hart has not been
+ * kicked or reached its next event.
+ */
+static void jit_trampolines(struct riscv_jit * const restrict jit)
+{
+  static const uint8_t pushes[] = { 0x55, 0x53, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57 };
+  static const uint8_t pops[] = { 0x41, 0x5f, 0x41, 0x5e, 0x41, 0x5d, 0x41, 0x5c, 0x5b, 0x5d, 0xc3 };
+  const int32_t map = (int32_t) (offsetof(struct riscv_block_cache, jit) + offsetof(struct riscv_jit, map));
+  struct jit_buf buf = { jit->code, 0 };
+  struct jit_buf * b = &buf;
+  size_t miss[5], i;
+  int32_t rel;
+
+  memcpy(b->p + b->len, pushes, sizeof(pushes));
+  b->len += sizeof(pushes);
+  x86_alu_imm(b, 1, ALU_SUB, RSP, 24);              // keeps the stack aligned for calls
+  x86_mov(b, RBP, RDI);
+  x86_mov(b, R15, RDX);
+  x86_rm(b, 1, ALU_ADD + 2, RDX, RBP, -1, CPU(instret));
+  x86_rm(b, 1, ALU_ADD + 2, RDX, RBP, -1, CPU(time_skip));
+  x86_store(b, RSP, 8, RDX);
+  x86_rr(b, 0, 0xff, 4, RSI);                       // jmp rsi
+
+  jit->epilogue = b->len;
+  x86_mov(b, RAX, R15);
+  x86_alu_imm(b, 1, ALU_ADD, RSP, 24);
+  memcpy(b->p + b->len, pops, sizeof(pops));
+  b->len += sizeof(pops);
+
+  jit->indirect = b->len;
+  x86_mov(b, R10, RAX);
+  jit_cmp_kick(b);
+  emit8(b, 0x75);                                   // jne miss
+  miss[2] = b->len;
+  emit8(b, 0);
+  jit_cmp_time(b);
+  emit8(b, 0x73);                                   // jae miss
+  miss[3] = b->len;
+  emit8(b, 0);
+  x86_mov(b, RAX, R10);
+
+  x86_load(b, RDX, RBP, CPU(bcache));
+  x86_rr(b, 0, 0x89, RAX, RCX);                     // mov ecx, eax
+  x86_shift_imm(b, 0, SHIFT_SHR, RCX, 1);
+  x86_alu_imm(b, 0, ALU_AND, RCX, RISCV_JIT_MAP_SIZE - 1);
+  x86_shift_imm(b, 0, SHIFT_SHL, RCX, 5);
+  emit8(b, 0x48); emit8(b, 0x8d); emit8(b, 0x94); emit8(b, 0x0a);   // lea rdx, [rdx + rcx + map]
+  emit32(b, (uint32_t) map);
+  x86_rm(b, 1, ALU_CMP + 2, RAX, RDX, -1, 0);       // cmp rax, [rdx]
+  emit8(b, 0x75);                                   // jne miss
+  miss[0] = b->len;
+  emit8(b, 0);
+  x86_rm(b, 0, 0x0fb6, RCX, RDX, -1, (int32_t) offsetof(struct riscv_jit_entry, mode));
+  x86_rm(b, 0, 0x3a, RCX, RBP, -1, CPU(fetch_mode)); // cmp cl, [rbp + fetch_mode]
+  emit8(b, 0x75);                                   // jne miss
+  miss[1] = b->len;
+  emit8(b, 0);
+  x86_load(b, RCX, RBP, CPU(bcache));
+  x86_rm(b, 0, 0x8b, RCX, RCX, -1, (int32_t) offsetof(struct riscv_block_cache, epoch));
+  x86_rm(b, 0, ALU_CMP + 2, RCX, RDX, -1, (int32_t) offsetof(struct riscv_jit_entry, epoch));
+  emit8(b, 0x75);                                   // jne miss
+  miss[4] = b->len;
+  emit8(b, 0);
+  x86_rm(b, 0, 0xff, 4, RDX, -1, (int32_t) offsetof(struct riscv_jit_entry, code));   // jmp [rdx + code]
+
+  for (i = 0; i < 5; i++)
+    b->p[miss[i]] = (uint8_t) (b->len - (miss[i] + 1));
+  x86_rr(b, 0, 0x31, RDX, RDX);
+  emit8(b, 0xe9);
+  rel = (int32_t) (jit->epilogue - (b->len + 4));
+  emit32(b, (uint32_t) rel);
+
+  jit->base = jit->used = (b->len + 15) & ~(size_t) 15;
+}
+
+int riscv_jit_init(struct riscv_jit * const restrict jit)
+{
+  if (jit == NULL)
+    return -1;
+
+  jit->code = mmap(NULL, RISCV_JIT_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (jit->code == MAP_FAILED)
+  {
+    jit->code = NULL;
+    return -1;
+  }
+
+  jit->uops = malloc(RISCV_JIT_UOPS * sizeof(struct riscv_uop));
+  if (jit->uops == NULL)
+    goto fail_code;
+
+  jit->queue = malloc(RISCV_JIT_QUEUE * sizeof(struct riscv_block));
+  if (jit->queue == NULL)
+    goto fail_uops;
+
+  jit->links = malloc(RISCV_JIT_LINKS * sizeof(uint8_t *));
+  if (jit->links == NULL)
+    goto fail_queue;
+
+  jit->generation = 0;
+  jit->nuops = 0;
+  jit->nlinks = 0;
+  jit->nentries = 0;
+  memset(jit->map, 0xff, sizeof(jit->map));
+  jit->threshold = RISCV_JIT_THRESHOLD;
+  jit->head = jit->queued = jit->ndone = 0;
+  jit->compiling = NULL;
+  jit->stale = jit->full = jit->ready = jit->stop = 0;
+
+  jit_trampolines(jit);
+
+  if (pthread_mutex_init(&jit->lock, NULL) != 0)
+    goto fail_links;
+
+  if (pthread_cond_init(&jit->work, NULL) != 0)
+    goto fail_lock;
+
+  if (pthread_create(&jit->compiler, NULL, jit_compiler, jit) != 0)
+    goto fail_cond;
+
+  return 0;
+
+fail_cond:
+  pthread_cond_destroy(&jit->work);
+fail_lock:
+  pthread_mutex_destroy(&jit->lock);
+fail_links:
+  free(jit->links);
+  jit->links = NULL;
+fail_queue:
+  free(jit->queue);
+  jit->queue = NULL;
+fail_uops:
+  free(jit->uops);
+  jit->uops = NULL;
+fail_code:
+  munmap(jit->code, RISCV_JIT_CODE_SIZE);
+  jit->code = NULL;
+
+  return -1;
+}
+
+// stops the compiler thread, a block it is working on is dropped
+int riscv_jit_deinit(struct riscv_jit * const restrict jit)
+{
+  if (jit == NULL)
+    return -1;
+
+  if (jit->code != NULL)
+  {
+    pthread_mutex_lock(&jit->lock);
+    jit->stop = 1;
+    pthread_cond_signal(&jit->work);
+    pthread_mutex_unlock(&jit->lock);
+
+    pthread_join(jit->compiler, NULL);
+    pthread_cond_destroy(&jit->work);
+    pthread_mutex_destroy(&jit->lock);
+
+    munmap(jit->code, RISCV_JIT_CODE_SIZE);
+  }
+
+  free(jit->links);
+  free(jit->queue);
+  free(jit->uops);
+  jit->code = NULL;
+  jit->links = NULL;
+  jit->queue = NULL;
+  jit->uops = NULL;
+
+  return 0;
+}
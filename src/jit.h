@@ -0,0 +1,110 @@
+/*
+  Copyright (c) 2024, Arka Mondal. All rights reserved.
+  Use of this source code is governed by a BSD-style license that
+  can be found in the LICENSE file.
+*/
+
+#ifndef _RISCVEMU_JIT_H
+#define _RISCVEMU_JIT_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(RISCV_JIT) && !defined(__x86_64__)
+#error "the JIT backend only generates x86-64 code, build with JIT=0"
+#endif
+
+#define RISCV_JIT_CODE_SIZE (32UL << 20)      // code cache of a hart
+#define RISCV_JIT_BLOCK_CODE (16UL << 10)     // upper bound on the code of one block
+#define RISCV_JIT_MAP_SIZE 4096               // compiled blocks, power of 2
+#define RISCV_JIT_UOPS 16384                  // micro-ops kept for interpreter fallbacks
+#define RISCV_JIT_THRESHOLD 32                // runs of a block before it gets compiled, by default
+#define RISCV_JIT_QUEUE 64                    // blocks promoted and not installed yet
+#define RISCV_JIT_LINKS 16384                 // chained exits that can be undone
+
+struct riscv_cpu;
+struct riscv_uop;
+struct riscv_block;
+struct riscv_block_cache;
+
+#define RISCV_JIT_STALE (UINT64_MAX - 2)      // map slot of code thrown away, no pc is odd
+
+struct riscv_jit_entry {
+  uint64_t pc;                        // UINT64_MAX if the slot is empty
+  const uint8_t * code;
+  uint32_t page[2];                   // DRAM pages of the block, see struct riscv_block
+  uint16_t stale;                     // offset of the exit the code is patched to once stale
+  uint8_t mode;
+  uint32_t epoch;                     // of the block cache the pages were last found current in
+};
+
+/*
+ * Per-hart translation of hot blocks to host code. Blocks are looked up by
+ * guest pc and translation context, just like the block cache, and by the
+ * DRAM pages they were compiled from. They are thrown away all at once
+ * whenever the block cache is flushed or the code cache fills up, or one
+ * page at a time when guest code is overwritten. A change of translations
+ * only unchains them: the indirect trampoline and chaining take a block
+ * once its pages have been found current in the epoch of the block cache.
+ *
+ * Execution is tiered: a block is interpreted until it has run threshold
+ * times, then promoted. The hart queues a copy of it for a compiler thread
+ * of its own and goes on interpreting it, the compiled code is installed
+ * the next time the hart looks. The lock guards the queue and the results,
+ * and used, nuops, generation and stale, which the compiler uses too.
+ * Everything else, the map in particular, belongs to the hart alone.
+ */
+struct riscv_jit {
+  uint8_t * code;                     // executable code cache, trampolines first
+  size_t epilogue;                    // offset of the exit trampoline
+  size_t indirect;                    // offset of the indirect jump trampoline
+  size_t base;                        // start of the block code
+  size_t used;
+  uint64_t generation;                // incremented whenever compiled code is thrown away
+
+  struct riscv_uop * uops;            // micro-ops the compiled code hands to the interpreter
+  size_t nuops;
+
+  uint8_t ** links;                   // exits chained to another block, see riscv_jit_unchain
+  size_t nlinks;
+
+  size_t nentries;
+  struct riscv_jit_entry map[RISCV_JIT_MAP_SIZE];
+
+  uint32_t threshold;                 // runs of a block before it is promoted
+
+  pthread_t compiler;
+  pthread_mutex_t lock;
+  pthread_cond_t work;                // signaled when a block is queued or the thread is to stop
+  struct riscv_block * queue;         // copies of the promoted blocks, a ring
+  size_t head;
+  size_t queued;
+  const struct riscv_block * compiling;  // taken off the queue by the compiler, NULL if none
+  int stale;                          // what the compiler is working on is not to be installed
+  struct riscv_jit_entry done[RISCV_JIT_QUEUE];   // compiled, waiting to be installed
+  size_t ndone;
+  int full;                           // no room for the next block, the hart has to flush
+  int ready;                          // something for riscv_jit_install, read without the lock
+  int stop;
+};
+
+int riscv_jit_init(struct riscv_jit * const restrict);
+int riscv_jit_deinit(struct riscv_jit * const restrict);
+void riscv_jit_flush(struct riscv_jit * const restrict);
+void riscv_jit_drop_page(struct riscv_jit * const restrict, uint64_t);
+void riscv_jit_unchain(struct riscv_jit * const restrict);
+struct riscv_jit_entry * riscv_jit_lookup(struct riscv_jit * const restrict, uint64_t, uint8_t,
+                                          const uint32_t *);
+void riscv_jit_promote(struct riscv_jit * const restrict, struct riscv_block * const restrict);
+void riscv_jit_install(struct riscv_block_cache * const restrict);
+uint64_t riscv_jit_exec(struct riscv_jit * const restrict, struct riscv_cpu * const restrict,
+                        const uint8_t *, uint64_t);
+
+// whether riscv_jit_install has anything to do, cheap enough to ask before every block
+static inline int riscv_jit_ready(const struct riscv_jit * const restrict jit)
+{
+  return __atomic_load_n(&jit->ready, __ATOMIC_ACQUIRE);
+}
+
+#endif /* _RISCVEMU_JIT_H */
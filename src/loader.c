@@ -0,0 +1,191 @@
+/*
+  Copyright (c) 2024, Arka Mondal. All rights reserved.
+  Use of this source code is governed by a BSD-style license that
+  can be found in the LICENSE file.
+*/
+
+#include <elf.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "dram.h"
+#include "loader.h"
+
+#ifndef EM_RISCV
+#define EM_RISCV 243
+#endif
+
+// read exactly len bytes at offset
+static int loader_read(int fd, void * dst, uint64_t len, uint64_t offset)
+{
+  ssize_t n;
+
+  while (len != 0)
+  {
+    n = pread(fd, dst, len, offset);
+    if (n <= 0)
+      return -1;
+
+    dst = (uint8_t *) dst + n;
+    len -= n;
+    offset += n;
+  }
+
+  return 0;
+}
+
+static int loader_parse_elf(struct loader_image * const restrict image, const Elf64_Ehdr * ehdr)
+{
+  Elf64_Phdr phdr;
+  size_t i;
+
+  if (ehdr->e_ident[EI_CLASS] != ELFCLASS64 || ehdr->e_ident[EI_DATA] != ELFDATA2LSB
+      || ehdr->e_machine != EM_RISCV || ehdr->e_phentsize != sizeof(Elf64_Phdr))
+    return -1;
+
+  image->entry = ehdr->e_entry;
+
+  for (i = 0; i < ehdr->e_phnum; i++)
+  {
+    if (loader_read(image->fd, &phdr, sizeof(phdr), ehdr->e_phoff + i * sizeof(phdr)) != 0)
+      return -1;
+
+    if (phdr.p_type != PT_LOAD || phdr.p_memsz == 0)
+      continue;
+
+    if (image->nsegments == LOADER_MAX_SEGMENTS || phdr.p_filesz > phdr.p_memsz)
+      return -1;
+
+    image->segments[image->nsegments].addr = phdr.p_paddr;
+    image->segments[image->nsegments].offset = phdr.p_offset;
+    image->segments[image->nsegments].filesz = phdr.p_filesz;
+    image->segments[image->nsegments].memsz = phdr.p_memsz;
+    image->nsegments++;
+  }
+
+  return 0;
+}
+
+/*
+ * Open a guest image and work out where its pieces go. ELF files contribute
+ * their PT_LOAD segments at their physical addresses, anything else is a raw
+ * image placed at DRAM_BASE. Nothing but the headers is read here.
+ */
+int loader_open(struct loader_image * const restrict image, const char * path)
+{
+  Elf64_Ehdr ehdr;
+  struct stat st;
+
+  if (image == NULL || path == NULL)
+    return -1;
+
+  memset(image, 0x0, sizeof(struct loader_image));
+
+  image->fd = open(path, O_RDONLY);
+  if (image->fd < 0)
+    return -1;
+
+  if (fstat(image->fd, &st) != 0)
+    goto fail;
+
+  if (st.st_size >= (off_t) sizeof(ehdr)
+      && loader_read(image->fd, &ehdr, sizeof(ehdr), 0) == 0
+      && memcmp(ehdr.e_ident, ELFMAG, SELFMAG) == 0)
+  {
+    if (loader_parse_elf(image, &ehdr) != 0)
+      goto fail;
+  }
+  else
+  {
+    image->entry = DRAM_BASE;
+    image->segments[0].addr = DRAM_BASE;
+    image->segments[0].offset = 0;
+    image->segments[0].filesz = st.st_size;
+    image->segments[0].memsz = st.st_size;
+    image->nsegments = 1;
+  }
+
+  return 0;
+
+fail:
+  close(image->fd);
+  image->fd = -1;
+  return -1;
+}
+
+/*
+ * Place the image into freshly initialized guest memory. When dram owns a
+ * regular-page anonymous mapping, every page a segment covers completely is
+ * replaced by a private copy-on-write mapping of the file, so it is only read
+ * when the guest touches it. The partial pages at either end of a segment are
+ * copied, since the rest of those pages must not show unrelated bytes of the
+ * file. The zero-filled tail of a segment is the anonymous memory that is
+ * already there. Any other kind of guest memory gets a plain copy.
+ */
+int loader_map(const struct loader_image * const restrict image, struct dram * const restrict dram)
+{
+  const struct loader_segment * seg;
+  uint64_t page, size, start, end, head, tail;
+  uint8_t * base;
+  size_t i;
+
+  if (image == NULL || dram == NULL || dram->mem == NULL)
+    return -1;
+
+  base = dram->mem;
+  size = dram->size;
+  page = (uint64_t) sysconf(_SC_PAGESIZE);
+
+  for (i = 0; i < image->nsegments; i++)
+  {
+    seg = &image->segments[i];
+
+    if (seg->addr < DRAM_BASE || seg->addr - DRAM_BASE > size
+        || seg->memsz > size - (seg->addr - DRAM_BASE))
+      return -1;
+
+    start = seg->addr - DRAM_BASE;
+    end = start + seg->filesz;
+
+    // the file can only be mapped if its offsets line up with the guest pages
+    head = tail = end;
+    if ((dram->flags & DRAM_MEM_MAPPED) && (start & (page - 1)) == (seg->offset & (page - 1)))
+    {
+      head = (start + page - 1) & ~(page - 1);
+      tail = end & ~(page - 1);
+    }
+
+    if (head < tail)
+    {
+      if (mmap(base + head, tail - head, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+                image->fd, seg->offset + (head - start)) == MAP_FAILED)
+        return -1;
+    }
+    else
+    {
+      head = tail = end;
+    }
+
+    if (loader_read(image->fd, base + start, head - start, seg->offset) != 0
+        || loader_read(image->fd, base + tail, end - tail, seg->offset + (tail - start)) != 0)
+      return -1;
+  }
+
+  return 0;
+}
+
+int loader_close(struct loader_image * const restrict image)
+{
+  if (image == NULL)
+    return -1;
+
+  if (image->fd >= 0)
+    close(image->fd);
+
+  image->fd = -1;
+  image->nsegments = 0;
+
+  return 0;
+}
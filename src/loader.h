@@ -0,0 +1,35 @@
+/*
+  Copyright (c) 2024, Arka Mondal. All rights reserved.
+  Use of this source code is governed by a BSD-style license that
+  can be found in the LICENSE file.
+*/
+
+#ifndef _RISCVEMU_LOADER_H
+#define _RISCVEMU_LOADER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "dram.h"
+
+#define LOADER_MAX_SEGMENTS 16
+
+// a piece of the image file that has to appear in guest memory
+struct loader_segment {
+  uint64_t addr;              // guest physical address
+  uint64_t offset;            // file offset
+  uint64_t filesz;            // bytes backed by the file, the rest up to memsz is zero
+  uint64_t memsz;
+};
+
+struct loader_image {
+  int fd;
+  uint64_t entry;
+  size_t nsegments;
+  struct loader_segment segments[LOADER_MAX_SEGMENTS];
+};
+
+int loader_open(struct loader_image * const restrict, const char *);
+int loader_map(const struct loader_image * const restrict, struct dram * const restrict);
+int loader_close(struct loader_image * const restrict);
+
+#endif /* _RISCVEMU_LOADER_H */
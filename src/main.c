@@ -4,34 +4,688 @@
   can be found in the LICENSE file.
 */
 
+#include <pthread.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "checkpoint.h"
+#include "clint.h"
 #include "cpu.h"
+#include "csr.h"
 #include "bus.h"
 #include "dram.h"
+#include "loader.h"
+#include "plic.h"
+#include "sched.h"
+#include "uart.h"
+#include "util.h"
+#include "virtio_blk.h"
+
+#define RUN_BATCH (1UL << 24)         // instructions per riscv_cpu_run call
+#define MAX_HARTS 64
+#define HART_STACK_SIZE (64UL << 10)   // initial stacks are carved from the top of DRAM
+
+struct machine;
+
+// a hart and the host thread running it
+struct hart {
+  struct riscv_cpu cpu;
+  struct machine * machine;
+  pthread_t thread;
+  int status;                         // last riscv_cpu_run result
+};
+
+struct machine {
+  struct hart * harts;
+  size_t nharts;
+  struct hart * stopped;              // first hart to stop on its own, ends the run
+  pthread_mutex_t lock;
+  pthread_cond_t done;                // signaled once stopped is set
+  pthread_cond_t wakeup;              // harts in WFI wait here for a kick
+  struct riscv_sched * sched;         // the harts share a worker pool, NULL for a thread each
+  struct riscv_sched_task * tasks;
+};
+
+#ifdef RISCV_PROFILE
+/*
+ * Write the profile of the run: the report of all harts together to
+ * report_path (stderr if NULL) and, if folded_path is given, the pc samples
+ * of each hart as folded stacks rooted at "hartN".
+ */
+static int write_profile(const struct machine * const restrict machine, const char * report_path,
+                         const char * folded_path)
+{
+  struct riscv_profile * total;
+  char root[32];
+  FILE * out;
+  size_t i;
+
+  total = malloc(sizeof(struct riscv_profile));
+  if (total == NULL)
+    return -1;
+
+  riscv_profile_init(total);
+  for (i = 0; i < machine->nharts; i++)
+    riscv_profile_merge(total, machine->harts[i].cpu.profile);
+
+  out = (report_path != NULL) ? fopen(report_path, "w") : stderr;
+  if (out == NULL)
+  {
+    fprintf(stderr, "%s: cannot write the profile\n", report_path);
+    free(total);
+    return -1;
+  }
+
+  riscv_profile_report(total, out);
+  if (out != stderr)
+    fclose(out);
+
+  free(total);
+
+  if (folded_path == NULL)
+    return 0;
+
+  out = fopen(folded_path, "w");
+  if (out == NULL)
+  {
+    fprintf(stderr, "%s: cannot write the profile\n", folded_path);
+    return -1;
+  }
+
+  for (i = 0; i < machine->nharts; i++)
+  {
+    snprintf(root, sizeof(root), "hart%zu", i);
+    riscv_profile_folded(machine->harts[i].cpu.profile, root, out);
+  }
+
+  fclose(out);
+
+  return 0;
+}
+
+#define PROFILE_OPTIONS "p:F:"
+#define PROFILE_USAGE " [-p report] [-F folded]"
+#else
+#define PROFILE_OPTIONS ""
+#define PROFILE_USAGE ""
+#endif
+
+#ifdef RISCV_TRACE
+#define TRACE_OPTIONS "t:"
+#define TRACE_USAGE " [-t trace]"
+#else
+#define TRACE_OPTIONS ""
+#define TRACE_USAGE ""
+#endif
+
+#ifdef RISCV_JIT
+#define JIT_OPTIONS "J:"
+#define JIT_USAGE " [-J threshold]"
+#else
+#define JIT_OPTIONS ""
+#define JIT_USAGE ""
+#endif
+
+static void dump_registers(const struct riscv_cpu * const restrict cpu)
+{
+  int i;
+
+  for (i = 0; i < 32; i++)
+    fprintf(stderr, "x%-2d %016lx%c", i, cpu->registers[i], (i % 4 == 3) ? '\n' : ' ');
+
+  fprintf(stderr, "pc  %016lx\n", cpu->pc);
+}
+
+// stop every hart at its next block boundary, the ones asleep in WFI included
+static void halt_harts(struct machine * const restrict machine)
+{
+  size_t i;
+
+  for (i = 0; i < machine->nharts; i++)
+    __atomic_store_n(&machine->harts[i].cpu.halt, 1, __ATOMIC_RELAXED);
+
+  pthread_mutex_lock(&machine->lock);
+  pthread_cond_broadcast(&machine->wakeup);
+  pthread_mutex_unlock(&machine->lock);
+}
+
+/*
+ * A hart left riscv_cpu_run for good. The first hart to stop on its own
+ * (exit ecall, unhandled trap or panic) halts all the others and returns 1.
+ * A hart that was only asked to halt, by that hart or to take a checkpoint,
+ * changes nothing.
+ */
+static int hart_stop(struct hart * const restrict hart)
+{
+  struct machine * const machine = hart->machine;
+  struct hart * expected = NULL;
+
+  if ((hart->status == RISCV_RUN_HALT && !hart->cpu.panic)
+      || !__atomic_compare_exchange_n(&machine->stopped, &expected, hart, 0,
+                                      __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    return 0;
+
+  halt_harts(machine);
+
+  pthread_mutex_lock(&machine->lock);
+  pthread_cond_broadcast(&machine->done);
+  pthread_mutex_unlock(&machine->lock);
+
+  return 1;
+}
+
+/*
+ * A hart in WFI with no event to wait for sleeps until it is kicked, by a
+ * device, another hart or a pending interrupt, or halted.
+ */
+static void hart_wait(struct hart * const restrict hart)
+{
+  struct machine * const machine = hart->machine;
+
+  pthread_mutex_lock(&machine->lock);
+
+  while (__atomic_load_n(&hart->cpu.kick, __ATOMIC_ACQUIRE) == 0
+         && !__atomic_load_n(&hart->cpu.halt, __ATOMIC_RELAXED))
+    pthread_cond_wait(&machine->wakeup, &machine->lock);
+
+  pthread_mutex_unlock(&machine->lock);
+}
+
+// wake hook of a hart on a thread of its own
+static void hart_wake(struct riscv_cpu * cpu)
+{
+  struct machine * const machine = ((struct hart *) cpu->host)->machine;
+
+  pthread_mutex_lock(&machine->lock);
+  pthread_cond_broadcast(&machine->wakeup);
+  pthread_mutex_unlock(&machine->lock);
+}
+
+// wake hook of a hart on the worker pool
+static void hart_wake_task(struct riscv_cpu * cpu)
+{
+  struct hart * const hart = cpu->host;
+  struct machine * const machine = hart->machine;
+
+  riscv_sched_wake(machine->sched, &machine->tasks[hart - machine->harts]);
+}
+
+// thread body of a hart
+static void * hart_main(void * arg)
+{
+  struct hart * const hart = arg;
+
+  for (;;)
+  {
+    hart->status = riscv_cpu_run(&hart->cpu, RUN_BATCH);
+
+    if (hart->status == RISCV_RUN_WFI)
+      hart_wait(hart);
+    else if (hart->status != RISCV_RUN_BUDGET)
+      break;
+  }
+
+  hart_stop(hart);
+
+  return NULL;
+}
+
+// the scheduler is done with a hart, the halted ones have to leave WFI to notice
+static void hart_done(struct riscv_sched * sched, struct riscv_sched_task * task)
+{
+  struct hart * const hart = task->opaque;
+  size_t i;
+
+  hart->status = task->status;
+
+  if (hart_stop(hart))
+  {
+    for (i = 0; i < sched->ntasks; i++)
+      riscv_sched_wake(sched, &sched->tasks[i]);
+  }
+}
+
+static int start_harts(struct machine * const restrict machine)
+{
+  size_t i;
+
+  for (i = 0; i < machine->nharts; i++)
+  {
+    __atomic_store_n(&machine->harts[i].cpu.halt, 0, __ATOMIC_RELAXED);
+
+    if (pthread_create(&machine->harts[i].thread, NULL, hart_main, &machine->harts[i]) != 0)
+    {
+      fprintf(stderr, "cannot start hart %zu\n", i);
+
+      // the harts already running must not outlive the machine
+      halt_harts(machine);
+      while (i-- > 0)
+        pthread_join(machine->harts[i].thread, NULL);
+
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+static void join_harts(struct machine * const restrict machine)
+{
+  size_t i;
+
+  for (i = 0; i < machine->nharts; i++)
+    pthread_join(machine->harts[i].thread, NULL);
+}
+
+// run_machine for harts on a worker pool
+static int run_scheduled(struct machine * const restrict machine,
+                         struct riscv_checkpoint * const restrict ckpt, uint64_t interval)
+{
+  struct timespec deadline;
+  int live;
+
+  for (;;)
+  {
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += interval;
+
+    live = riscv_sched_run(machine->sched, (ckpt != NULL) ? &deadline : NULL);
+    if (live <= 0)
+      return live;
+
+    if (machine->stopped == NULL && riscv_checkpoint_write(ckpt) != 0)
+    {
+      fprintf(stderr, "cannot write checkpoint %lu\n", ckpt->seq);
+      return -1;
+    }
+  }
+}
+
+/*
+ * Run the machine until a hart stops it. With a checkpoint, the harts are
+ * paused every interval seconds while the pages they wrote are appended.
+ */
+static int run_machine(struct machine * const restrict machine,
+                       struct riscv_checkpoint * const restrict ckpt, uint64_t interval)
+{
+  struct timespec deadline;
+  int status;
+
+  if (machine->sched != NULL)
+    return run_scheduled(machine, ckpt, interval);
+
+  for (;;)
+  {
+    if (start_harts(machine) != 0)
+      return -1;
+
+    if (ckpt == NULL)
+      break;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += interval;
+
+    pthread_mutex_lock(&machine->lock);
+    status = 0;
+    while (__atomic_load_n(&machine->stopped, __ATOMIC_ACQUIRE) == NULL && status == 0)
+      status = pthread_cond_timedwait(&machine->done, &machine->lock, &deadline);
+    pthread_mutex_unlock(&machine->lock);
+
+    if (__atomic_load_n(&machine->stopped, __ATOMIC_ACQUIRE) != NULL)
+      break;
+
+    halt_harts(machine);
+    join_harts(machine);
+
+    // a hart may have stopped on its own while the others were halted
+    if (machine->stopped != NULL)
+      return 0;
+
+    if (riscv_checkpoint_write(ckpt) != 0)
+    {
+      fprintf(stderr, "cannot write checkpoint %lu\n", ckpt->seq);
+      return -1;
+    }
+  }
+
+  join_harts(machine);
+
+  return 0;
+}
 
 int main(int argc, char * argv[])
 {
-  struct riscv_cpu cpu1;
+  struct machine machine;
+  struct riscv_checkpoint ckpt;
+  struct riscv_cpu ** cpus;
+  struct riscv_cpu * cpu;
   struct bus bus;
+  struct clint clint;
+  struct plic plic;
+  struct uart uart;
+  struct virtio_blk blk;
   struct dram mem;
+  struct loader_image image;
+  uint64_t mem_size = DRAM_DEFAULT_SIZE;
+  enum dram_backing backing = DRAM_BACKING_DEFAULT;
+  uint64_t nharts = 1;
+  uint64_t interval = 5;
+  uint64_t nworkers = 0;
+  struct riscv_sched sched;
+  const char * checkpoint_path = NULL, * resume_path = NULL, * disk_path = NULL;
+  size_t i;
+  int opt, status, disk_flags = 0;
+#ifdef RISCV_PROFILE
+  const char * report_path = NULL, * folded_path = NULL;
+#endif
+#ifdef RISCV_TRACE
+  struct riscv_trace_writer trace;
+  const char * trace_path = NULL;
+#endif
+#ifdef RISCV_JIT
+  uint64_t jit_threshold = RISCV_JIT_THRESHOLD;
+#endif
+
+  while ((opt = getopt(argc, argv, "m:H:n:w:C:I:R:d:D:" PROFILE_OPTIONS TRACE_OPTIONS JIT_OPTIONS)) != -1)
+  {
+    switch (opt)
+    {
+#ifdef RISCV_JIT
+      // runs of a block before it is compiled, lower for long runs, higher for short ones
+      case 'J':
+        if (parse_size(optarg, &jit_threshold) != 0 || jit_threshold == 0 || jit_threshold > UINT32_MAX)
+          goto usage;
+        break;
+#endif
+
+#ifdef RISCV_TRACE
+      case 't':
+        trace_path = optarg;
+        break;
+#endif
+
+#ifdef RISCV_PROFILE
+      case 'p':
+        report_path = optarg;
+        break;
+
+      case 'F':
+        folded_path = optarg;
+        break;
+#endif
+
+      case 'n':
+        if (parse_size(optarg, &nharts) != 0 || nharts == 0 || nharts > MAX_HARTS)
+          goto usage;
+        break;
+
+      case 'w':
+        if (parse_size(optarg, &nworkers) != 0 || nworkers == 0 || nworkers > RISCV_SCHED_MAX_WORKERS)
+          goto usage;
+        break;
+
+      case 'C':
+        checkpoint_path = optarg;
+        break;
 
-  dram_init(&mem, NULL);
-  bus_init(&bus, &mem);
-  riscv_cpu_init(&cpu1, &bus);
+      case 'I':
+        if (parse_size(optarg, &interval) != 0 || interval == 0)
+          goto usage;
+        break;
 
-  cpu1.registers[x1] = 5;
+      case 'R':
+        resume_path = optarg;
+        break;
 
-  printf("%#lx\n", cpu1.registers[x1]);
+      case 'm':
+        if (parse_size(optarg, &mem_size) != 0)
+          goto usage;
+        break;
 
-  riscv_cpu_exec(&cpu1, 0x3e800093);
-  riscv_cpu_exec(&cpu1, 0x00108133);
+      case 'd':
+        disk_path = optarg;
+        break;
 
-  printf("%#lx\n", cpu1.registers[x1]);
-  printf("%#lx\n", cpu1.registers[x2]);
+      case 'D':
+        if (strcmp(optarg, "writeback") == 0)
+          disk_flags = VIRTIO_BLK_WRITEBACK;
+        else if (strcmp(optarg, "ro") == 0)
+          disk_flags = VIRTIO_BLK_READONLY;
+        else
+          goto usage;
+        break;
 
-  riscv_cpu_deinit(&cpu1);
+      case 'H':
+        if (strcmp(optarg, "thp") == 0)
+          backing = DRAM_BACKING_THP;
+        else if (strcmp(optarg, "hugetlb") == 0)
+          backing = DRAM_BACKING_HUGETLB;
+        else
+          goto usage;
+        break;
+
+      default:
+        goto usage;
+    }
+  }
+
+  // a resumed machine gets its memory from the checkpoint instead of an image
+  if (optind != argc - (resume_path == NULL))
+    goto usage;
+
+  if (dram_init(&mem, NULL, mem_size, backing) != 0)
+  {
+    fprintf(stderr, "cannot reserve %lu bytes of guest memory\n", mem_size);
+    return EXIT_FAILURE;
+  }
+
+  image.entry = DRAM_BASE;
+  if (resume_path == NULL && (loader_open(&image, argv[optind]) != 0 || loader_map(&image, &mem) != 0))
+  {
+    fprintf(stderr, "%s: cannot load image\n", argv[optind]);
+    return EXIT_FAILURE;
+  }
+
+  if (bus_init(&bus, &mem) != 0)
+  {
+    fprintf(stderr, "cannot initialize the bus\n");
+    return EXIT_FAILURE;
+  }
+
+  machine.nharts = nharts;
+  machine.stopped = NULL;
+  machine.sched = NULL;
+  machine.harts = calloc(nharts, sizeof(struct hart));
+  cpus = calloc(nharts, sizeof(struct riscv_cpu *));
+  if (machine.harts == NULL || cpus == NULL)
+  {
+    fprintf(stderr, "cannot allocate %lu harts\n", nharts);
+    return EXIT_FAILURE;
+  }
+
+  pthread_mutex_init(&machine.lock, NULL);
+  pthread_cond_init(&machine.done, NULL);
+  pthread_cond_init(&machine.wakeup, NULL);
+
+  /*
+   * Every hart starts at the entry point with its hart id in a0, the usual
+   * boot convention, and a stack of its own.
+   */
+  for (i = 0; i < nharts; i++)
+  {
+    cpu = &machine.harts[i].cpu;
+    cpus[i] = cpu;
+    machine.harts[i].machine = &machine;
+
+    if (riscv_cpu_init(cpu, &bus) != 0)
+    {
+      fprintf(stderr, "cannot initialize hart %zu\n", i);
+      return EXIT_FAILURE;
+    }
+
+    cpu->pc = image.entry;
+    cpu->csrs[CSR_MHARTID] = i;
+    cpu->registers[x10] = i;
+    cpu->registers[x2] -= i * HART_STACK_SIZE;
+    cpu->host = &machine.harts[i];
+#ifdef RISCV_JIT
+    cpu->bcache->jit.threshold = jit_threshold;
+#endif
+  }
+
+  if (clint_init(&clint, &bus, cpus, nharts) != 0)
+  {
+    fprintf(stderr, "cannot attach the CLINT\n");
+    return EXIT_FAILURE;
+  }
+
+  if (plic_init(&plic, &bus, cpus, nharts) != 0)
+  {
+    fprintf(stderr, "cannot attach the PLIC\n");
+    return EXIT_FAILURE;
+  }
+
+  if (uart_init(&uart, &bus, &plic) != 0)
+  {
+    fprintf(stderr, "cannot attach the UART\n");
+    return EXIT_FAILURE;
+  }
+
+  if (disk_path != NULL && virtio_blk_init(&blk, &bus, &plic, disk_path, disk_flags) != 0)
+  {
+    fprintf(stderr, "%s: cannot attach the disk\n", disk_path);
+    return EXIT_FAILURE;
+  }
+
+  if (resume_path == NULL)
+    loader_close(&image);
+  else if (riscv_checkpoint_load(resume_path, &bus, cpus, nharts) < 0)
+  {
+    fprintf(stderr, "%s: cannot resume from checkpoint\n", resume_path);
+    return EXIT_FAILURE;
+  }
+
+  // more harts than workers are time-sliced, each gets a quantum and yields
+  if (nworkers != 0)
+  {
+    machine.tasks = calloc(nharts, sizeof(struct riscv_sched_task));
+    if (machine.tasks == NULL)
+    {
+      fprintf(stderr, "cannot allocate %lu harts\n", nharts);
+      return EXIT_FAILURE;
+    }
+
+    for (i = 0; i < nharts; i++)
+    {
+      machine.tasks[i].cpu = cpus[i];
+      machine.tasks[i].opaque = &machine.harts[i];
+    }
+
+    if (riscv_sched_init(&sched, nworkers, machine.tasks, nharts) != 0)
+    {
+      fprintf(stderr, "cannot start %lu workers\n", nworkers);
+      return EXIT_FAILURE;
+    }
+
+    sched.done = hart_done;
+    machine.sched = &sched;
+  }
+
+  // devices kicking a hart in WFI have it run again
+  for (i = 0; i < nharts; i++)
+    cpus[i]->wake = (machine.sched != NULL) ? hart_wake_task : hart_wake;
+
+#ifdef RISCV_TRACE
+  // the trace starts from the state the harts run from, resumed or not
+  if (trace_path != NULL)
+  {
+    if (riscv_trace_writer_open(&trace, trace_path, nharts) != 0)
+    {
+      fprintf(stderr, "%s: cannot write trace\n", trace_path);
+      return EXIT_FAILURE;
+    }
+
+    for (i = 0; i < nharts; i++)
+      cpus[i]->trace = trace.traces[i];
+  }
+#endif
+
+  if (checkpoint_path != NULL && riscv_checkpoint_open(&ckpt, checkpoint_path, &bus, cpus, nharts) != 0)
+  {
+    fprintf(stderr, "%s: cannot write checkpoint\n", checkpoint_path);
+    return EXIT_FAILURE;
+  }
+
+  if (run_machine(&machine, (checkpoint_path != NULL) ? &ckpt : NULL, interval) != 0)
+    return EXIT_FAILURE;
+
+  // the console output goes out before anything said about how the run ended
+  uart_deinit(&uart);
+
+  if (checkpoint_path != NULL)
+    riscv_checkpoint_close(&ckpt);
+
+#ifdef RISCV_TRACE
+  if (trace_path != NULL && riscv_trace_writer_close(&trace) != 0)
+    fprintf(stderr, "%s: trace is incomplete\n", trace_path);
+#endif
+
+  /*
+   * The guest ends the run with an ecall, passing its exit status in a0.
+   * Anything else is unexpected and dumps the hart state.
+   */
+  cpu = &machine.stopped->cpu;
+  status = machine.stopped->status;
+
+  if (status == RISCV_RUN_TRAP && cpu->trap_cause == RISCV_EXC_ECALL_M)
+  {
+    status = (int) cpu->registers[x10];
+  }
+  else
+  {
+    if (status == RISCV_RUN_TRAP)
+      fprintf(stderr, "hart %lu trapped: cause %lu (%#lx) after %lu instructions\n",
+              cpu->csrs[CSR_MHARTID], cpu->trap_cause, cpu->trap_value, cpu->instret);
+    else
+      fprintf(stderr, "hart %lu halted after %lu instructions\n",
+              cpu->csrs[CSR_MHARTID], cpu->instret);
+
+    dump_registers(cpu);
+    status = EXIT_FAILURE;
+  }
+
+#ifdef RISCV_PROFILE
+  write_profile(&machine, report_path, folded_path);
+#endif
+
+  for (i = 0; i < nharts; i++)
+    riscv_cpu_deinit(&machine.harts[i].cpu);
+
+  if (machine.sched != NULL)
+  {
+    riscv_sched_deinit(machine.sched);
+    free(machine.tasks);
+  }
+
+  free(machine.harts);
+  free(cpus);
+  pthread_mutex_destroy(&machine.lock);
+  pthread_cond_destroy(&machine.done);
+  pthread_cond_destroy(&machine.wakeup);
+  if (disk_path != NULL)
+    virtio_blk_deinit(&blk);
+  plic_deinit(&plic);
+  clint_deinit(&clint);
   bus_deinit(&bus);
   dram_deinit(&mem);
 
-  return 0;
+  return status;
+
+usage:
+  fprintf(stderr, "usage: %s [-m size] [-H thp|hugetlb] [-n harts] [-w workers] [-C checkpoint [-I seconds]]"
+          " [-d disk [-D writeback|ro]]" PROFILE_USAGE TRACE_USAGE JIT_USAGE " <image>\n"
+          "       %s [options] -R checkpoint\n", argv[0], argv[0]);
+  return EXIT_FAILURE;
 }
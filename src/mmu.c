@@ -0,0 +1,502 @@
+/*
+  Copyright (c) 2024, Arka Mondal. All rights reserved.
+  Use of this source code is governed by a BSD-style license that
+  can be found in the LICENSE file.
+*/
+
+#include <string.h>
+#include "cpu.h"
+#include "csr.h"
+#include "decode.h"
+#include "mmu.h"
+
+// page table entry bits
+#define PTE_V (1UL << 0)
+#define PTE_R (1UL << 1)
+#define PTE_W (1UL << 2)
+#define PTE_X (1UL << 3)
+#define PTE_U (1UL << 4)
+#define PTE_A (1UL << 6)
+#define PTE_D (1UL << 7)
+#define PTE_PPN_SHIFT 10
+#define PTE_PPN_MASK ((1UL << 44) - 1)
+
+static const uint64_t riscv_mmu_page_fault[] = {
+  [RISCV_ACCESS_FETCH] = RISCV_EXC_INST_PAGE_FAULT,
+  [RISCV_ACCESS_LOAD] = RISCV_EXC_LOAD_PAGE_FAULT,
+  [RISCV_ACCESS_STORE] = RISCV_EXC_STORE_PAGE_FAULT
+};
+
+static const uint64_t riscv_mmu_access_fault[] = {
+  [RISCV_ACCESS_FETCH] = RISCV_EXC_INST_ACCESS,
+  [RISCV_ACCESS_LOAD] = RISCV_EXC_LOAD_ACCESS,
+  [RISCV_ACCESS_STORE] = RISCV_EXC_STORE_ACCESS
+};
+
+static inline enum riscv_tlb_mode riscv_mmu_tlb_mode(unsigned int priv)
+{
+  switch (priv)
+  {
+    case RISCV_PRIV_U:
+      return RISCV_TLB_USER;
+    case RISCV_PRIV_S:
+      return RISCV_TLB_SUPERVISOR;
+    default:
+      return RISCV_TLB_MACHINE;
+  }
+}
+
+// privilege mode used to translate the access, loads and stores honour MPRV
+static inline unsigned int riscv_mmu_priv(const struct riscv_cpu * const restrict cpu,
+                                          enum riscv_access access)
+{
+  uint64_t mstatus = cpu->csrs[CSR_MSTATUS];
+
+  if (access != RISCV_ACCESS_FETCH && cpu->priv == RISCV_PRIV_M && (mstatus & MSTATUS_MPRV))
+    return (mstatus & MSTATUS_MPP) >> MSTATUS_MPP_SHIFT;
+
+  return cpu->priv;
+}
+
+// drop every cached translation
+void riscv_mmu_flush(struct riscv_cpu * const restrict cpu)
+{
+  memset(cpu->tlb, 0xff, sizeof(cpu->tlb));
+}
+
+// drop the cached translations of the page holding vaddr (SFENCE.VMA with rs1)
+void riscv_mmu_flush_page(struct riscv_cpu * const restrict cpu, uint64_t vaddr)
+{
+  uint64_t tag = vaddr & ~(RISCV_PAGE_SIZE - 1);
+  size_t index = RISCV_TLB_INDEX(vaddr);
+  int mode;
+
+  for (mode = 0; mode < RISCV_TLB_MODES; mode++)
+  {
+    if (cpu->tlb[mode].fetch[index].tag == tag)
+      cpu->tlb[mode].fetch[index].tag = RISCV_TLB_EMPTY;
+    if (cpu->tlb[mode].load[index].tag == tag)
+      cpu->tlb[mode].load[index].tag = RISCV_TLB_EMPTY;
+    if (cpu->tlb[mode].store[index].tag == tag)
+      cpu->tlb[mode].store[index].tag = RISCV_TLB_EMPTY;
+  }
+}
+
+/*
+ * Keep stores to the DRAM page off the fast path: drop the store entries
+ * of every translation context that map it, so that the next store to it
+ * goes through riscv_mmu_store. Called once decoded code lives there.
+ */
+void riscv_mmu_protect(struct riscv_cpu * const restrict cpu, uint64_t page)
+{
+  const uintptr_t host = (uintptr_t) (cpu->bus->dram->mem + (page << RISCV_PAGE_SHIFT));
+  struct riscv_tlb_entry * entry;
+  size_t i;
+  int mode;
+
+  for (mode = 0; mode < RISCV_TLB_MODES; mode++)
+  {
+    for (i = 0; i < RISCV_TLB_SIZE; i++)
+    {
+      entry = &cpu->tlb[mode].store[i];
+      if (entry->tag != RISCV_TLB_EMPTY && entry->addend + entry->tag == host)
+        entry->tag = RISCV_TLB_EMPTY;
+    }
+  }
+}
+
+// pick the TLB sets after a change of privilege mode or of mstatus.MPRV/MPP
+void riscv_mmu_update_mode(struct riscv_cpu * const restrict cpu)
+{
+  cpu->fetch_mode = riscv_mmu_tlb_mode(cpu->priv);
+  cpu->itlb = &cpu->tlb[cpu->fetch_mode];
+  cpu->dtlb = &cpu->tlb[riscv_mmu_tlb_mode(riscv_mmu_priv(cpu, RISCV_ACCESS_LOAD))];
+}
+
+/*
+ * Translate vaddr for the given access with a Sv39/Sv48 page table walk.
+ * Accessed and dirty bits are updated in the page table as needed. Returns
+ * 0 on success, otherwise the exception the access raises.
+ */
+int riscv_mmu_translate(struct riscv_cpu * const restrict cpu, uint64_t vaddr,
+                        enum riscv_access access, uint64_t * paddr)
+{
+  uint64_t satp = cpu->csrs[CSR_SATP];
+  uint64_t mstatus = cpu->csrs[CSR_MSTATUS];
+  uint64_t mode = satp >> SATP_MODE_SHIFT;
+  unsigned int priv = riscv_mmu_priv(cpu, access);
+  uint64_t table, pte_addr, pte, ppn, offset_mask;
+  int levels, level, va_bits;
+
+  if (priv == RISCV_PRIV_M || mode == SATP_MODE_BARE)
+  {
+    *paddr = vaddr;
+    return 0;
+  }
+
+  levels = (mode == SATP_MODE_SV39) ? 3 : 4;
+  va_bits = RISCV_PAGE_SHIFT + 9 * levels;
+
+  // the upper bits must all be copies of the top bit of the virtual address
+  if ((uint64_t) (((int64_t) (vaddr << (64 - va_bits))) >> (64 - va_bits)) != vaddr)
+    return riscv_mmu_page_fault[access];
+
+  table = (satp & SATP_PPN_MASK) << RISCV_PAGE_SHIFT;
+
+  for (level = levels - 1; ; level--)
+  {
+    pte_addr = table + ((vaddr >> (RISCV_PAGE_SHIFT + 9 * level)) & 0x1ff) * 8;
+    if (bus_load64(cpu->bus, pte_addr, &pte) != 0)
+      return riscv_mmu_access_fault[access];
+
+    if (!(pte & PTE_V) || (!(pte & PTE_R) && (pte & PTE_W)))
+      return riscv_mmu_page_fault[access];
+
+    if (pte & (PTE_R | PTE_X))
+      break;                                    // leaf
+
+    if (level == 0)
+      return riscv_mmu_page_fault[access];
+
+    table = ((pte >> PTE_PPN_SHIFT) & PTE_PPN_MASK) << RISCV_PAGE_SHIFT;
+  }
+
+  // permission checks
+  if (priv == RISCV_PRIV_U && !(pte & PTE_U))
+    return riscv_mmu_page_fault[access];
+
+  if (priv == RISCV_PRIV_S && (pte & PTE_U)
+      && (access == RISCV_ACCESS_FETCH || !(mstatus & MSTATUS_SUM)))
+    return riscv_mmu_page_fault[access];
+
+  switch (access)
+  {
+    case RISCV_ACCESS_FETCH:
+      if (!(pte & PTE_X))
+        return riscv_mmu_page_fault[access];
+      break;
+    case RISCV_ACCESS_LOAD:
+      if (!(pte & PTE_R) && !((mstatus & MSTATUS_MXR) && (pte & PTE_X)))
+        return riscv_mmu_page_fault[access];
+      break;
+    case RISCV_ACCESS_STORE:
+      if (!(pte & PTE_W))
+        return riscv_mmu_page_fault[access];
+      break;
+  }
+
+  // superpages must be aligned
+  ppn = (pte >> PTE_PPN_SHIFT) & PTE_PPN_MASK;
+  if (ppn & ((1UL << (9 * level)) - 1))
+    return riscv_mmu_page_fault[access];
+
+  if (!(pte & PTE_A) || (access == RISCV_ACCESS_STORE && !(pte & PTE_D)))
+  {
+    pte |= PTE_A | ((access == RISCV_ACCESS_STORE) ? PTE_D : 0);
+    if (bus_store64(cpu->bus, pte_addr, pte) != 0)
+      return riscv_mmu_access_fault[access];
+  }
+
+  offset_mask = (1UL << (RISCV_PAGE_SHIFT + 9 * level)) - 1;
+  *paddr = ((ppn << RISCV_PAGE_SHIFT) & ~offset_mask) | (vaddr & offset_mask);
+
+  return 0;
+}
+
+/*
+ * Cache the translation of the page holding vaddr if that page is guest
+ * DRAM. Returns the entry, or NULL if the page has to go through the bus.
+ */
+static const struct riscv_tlb_entry * riscv_mmu_fill(struct riscv_cpu * const restrict cpu,
+                                                      struct riscv_tlb_entry * const restrict entries,
+                                                      uint64_t vaddr, uint64_t paddr)
+{
+  const struct dram * const dram = cpu->bus->dram;
+  struct riscv_tlb_entry * entry;
+  uint64_t offset = (paddr & ~(RISCV_PAGE_SIZE - 1)) - DRAM_BASE;
+
+  if (offset >= dram->size || dram->size - offset < RISCV_PAGE_SIZE)
+    return NULL;
+
+  entry = &entries[RISCV_TLB_INDEX(vaddr)];
+  entry->tag = vaddr & ~(RISCV_PAGE_SIZE - 1);
+  entry->addend = (uintptr_t) (dram->mem + offset) - entry->tag;
+
+  return entry;
+}
+
+static int riscv_mmu_bus_load(struct bus * const restrict bus, uint64_t paddr, uint64_t size,
+                              uint64_t * value)
+{
+  switch (size)
+  {
+    case 1:
+      return bus_load8(bus, paddr, value);
+    case 2:
+      return bus_load16(bus, paddr, value);
+    case 4:
+      return bus_load32(bus, paddr, value);
+    default:
+      return bus_load64(bus, paddr, value);
+  }
+}
+
+static int riscv_mmu_bus_store(struct bus * const restrict bus, uint64_t paddr, uint64_t size,
+                                uint64_t value)
+{
+  switch (size)
+  {
+    case 1:
+      return bus_store8(bus, paddr, value);
+    case 2:
+      return bus_store16(bus, paddr, value);
+    case 4:
+      return bus_store32(bus, paddr, value);
+    default:
+      return bus_store64(bus, paddr, value);
+  }
+}
+
+// fetch the 16-bit parcel at vaddr, returns 0 or the exception the fetch raises
+static int riscv_mmu_fetch_parcel(struct riscv_cpu * const restrict cpu, uint64_t vaddr, uint64_t * parcel)
+{
+  const struct riscv_tlb_entry * entry = &cpu->itlb->fetch[RISCV_TLB_INDEX(vaddr)];
+  uint64_t paddr;
+  uint16_t data;
+  int cause;
+
+  if (entry->tag != RISCV_TLB_TAG(vaddr, 2))
+  {
+    cause = riscv_mmu_translate(cpu, vaddr, RISCV_ACCESS_FETCH, &paddr);
+    if (cause != 0)
+      return cause;
+
+    entry = riscv_mmu_fill(cpu, cpu->itlb->fetch, vaddr, paddr);
+    if (entry == NULL)
+      return bus_load16(cpu->bus, paddr, parcel) ? RISCV_EXC_INST_ACCESS : 0;
+  }
+
+  memcpy(&data, (void *) (entry->addend + vaddr), sizeof(data));
+  *parcel = DRAM_LE16(data);
+
+  return 0;
+}
+
+/*
+ * Fetch the instruction at vaddr, a compressed one in the low 16 bits of
+ * inst. Returns 0 on success, otherwise the exception the fetch raises with
+ * the address that faulted in inst; it is not raised here, since the block
+ * translator decides when the fault is delivered. A 32-bit instruction in
+ * the last two bytes of a page takes its upper half from the next one, which
+ * is only touched once the first half says it is needed.
+ */
+int riscv_mmu_fetch(struct riscv_cpu * const restrict cpu, uint64_t vaddr, uint64_t * inst)
+{
+  const struct riscv_tlb_entry * entry = &cpu->itlb->fetch[RISCV_TLB_INDEX(vaddr)];
+  uint64_t low, high;
+  uint32_t data;
+  int cause;
+
+  if (entry->tag == RISCV_TLB_TAG(vaddr, 2) && (vaddr & (RISCV_PAGE_SIZE - 1)) <= RISCV_PAGE_SIZE - 4)
+  {
+    memcpy(&data, (void *) (entry->addend + vaddr), sizeof(data));
+    *inst = DRAM_LE32(data);
+    return 0;
+  }
+
+  cause = riscv_mmu_fetch_parcel(cpu, vaddr, &low);
+  if (cause != 0)
+  {
+    *inst = vaddr;
+    return cause;
+  }
+
+  if (riscv_inst_len(low) == 2)
+  {
+    *inst = low;
+    return 0;
+  }
+
+  cause = riscv_mmu_fetch_parcel(cpu, vaddr + 2, &high);
+  if (cause != 0)
+  {
+    *inst = vaddr + 2;
+    return cause;
+  }
+
+  *inst = high << 16 | low;
+
+  return 0;
+}
+
+/*
+ * The DRAM page (offset >> RISCV_PAGE_SHIFT) of vaddr, which has just been
+ * fetched from. Returns -1 if it is not guest DRAM.
+ */
+int riscv_mmu_fetch_page(const struct riscv_cpu * const restrict cpu, uint64_t vaddr, uint64_t * page)
+{
+  const struct riscv_tlb_entry * entry = &cpu->itlb->fetch[RISCV_TLB_INDEX(vaddr)];
+
+  if (entry->tag != (vaddr & ~(RISCV_PAGE_SIZE - 1)))
+    return -1;
+
+  *page = (entry->addend + entry->tag - (uintptr_t) cpu->bus->dram->mem) >> RISCV_PAGE_SHIFT;
+  return 0;
+}
+
+// slow path of the riscv_cpu_load* accessors, raises the exception on failure
+int riscv_mmu_load(struct riscv_cpu * const restrict cpu, uint64_t vaddr, uint64_t size,
+                    uint64_t * value)
+{
+  const struct riscv_tlb_entry * entry;
+  uint64_t paddr, data, byte, i;
+  int cause;
+
+  // an access crossing into the next page is split into bytes
+  if ((vaddr & (RISCV_PAGE_SIZE - 1)) + size > RISCV_PAGE_SIZE)
+  {
+    for (data = 0, i = 0; i < size; i++)
+    {
+      if (riscv_mmu_load(cpu, vaddr + i, 1, &byte) != 0)
+        return -1;
+
+      data |= byte << (8 * i);
+    }
+
+    *value = data;
+    return 0;
+  }
+
+  cause = riscv_mmu_translate(cpu, vaddr, RISCV_ACCESS_LOAD, &paddr);
+  if (cause != 0)
+  {
+    riscv_cpu_raise(cpu, cause, vaddr);
+    return -1;
+  }
+
+  entry = riscv_mmu_fill(cpu, cpu->dtlb->load, vaddr, paddr);
+  if (entry == NULL)
+  {
+    if (riscv_mmu_bus_load(cpu->bus, paddr, size, value) != 0)
+    {
+      riscv_cpu_raise(cpu, RISCV_EXC_LOAD_ACCESS, vaddr);
+      return -1;
+    }
+
+    return 0;
+  }
+
+  data = 0;
+  memcpy(&data, (void *) (entry->addend + vaddr), size);
+  *value = DRAM_LE64(data);
+
+  return 0;
+}
+
+// slow path of the riscv_cpu_store* accessors, raises the exception on failure
+int riscv_mmu_store(struct riscv_cpu * const restrict cpu, uint64_t vaddr, uint64_t size,
+                    uint64_t value)
+{
+  const struct riscv_tlb_entry * entry;
+  uint64_t paddr, data, i;
+  int cause;
+
+  // check both pages before writing anything of an access crossing a page
+  if ((vaddr & (RISCV_PAGE_SIZE - 1)) + size > RISCV_PAGE_SIZE)
+  {
+    cause = riscv_mmu_translate(cpu, vaddr + size - 1, RISCV_ACCESS_STORE, &paddr);
+    if (cause != 0)
+    {
+      riscv_cpu_raise(cpu, cause, vaddr + size - 1);
+      return -1;
+    }
+
+    for (i = 0; i < size; i++)
+      if (riscv_mmu_store(cpu, vaddr + i, 1, value >> (8 * i)) != 0)
+        return -1;
+
+    return 0;
+  }
+
+  cause = riscv_mmu_translate(cpu, vaddr, RISCV_ACCESS_STORE, &paddr);
+  if (cause != 0)
+  {
+    riscv_cpu_raise(cpu, cause, vaddr);
+    return -1;
+  }
+
+  entry = riscv_mmu_fill(cpu, cpu->dtlb->store, vaddr, paddr);
+  if (entry == NULL)
+  {
+    // a partial last page of DRAM is never cached, but may still hold code
+    if (paddr - DRAM_BASE < cpu->bus->dram->size)
+      riscv_block_cache_invalidate(cpu->bcache, (paddr - DRAM_BASE) >> RISCV_PAGE_SHIFT);
+
+    if (riscv_mmu_bus_store(cpu->bus, paddr, size, value) != 0)
+    {
+      riscv_cpu_raise(cpu, RISCV_EXC_STORE_ACCESS, vaddr);
+      return -1;
+    }
+
+    return 0;
+  }
+
+  // stores that hit the entry later do not record anything, so mark the page now
+  dram_mark_dirty(cpu->bus->dram, paddr - DRAM_BASE, size);
+
+  // nor do they look for decoded code, which is why a code page had no entry
+  riscv_block_cache_invalidate(cpu->bcache, (paddr - DRAM_BASE) >> RISCV_PAGE_SHIFT);
+
+  data = DRAM_LE64(value);
+  memcpy((void *) (entry->addend + vaddr), &data, size);
+
+  return 0;
+}
+
+/*
+ * Host address of an atomic access to vaddr, or NULL with the exception
+ * raised. LR translates like a load, SC and the AMOs like a store. The access
+ * must be naturally aligned and hit guest DRAM, since it is done with host
+ * atomics on the backing memory.
+ */
+void * riscv_mmu_atomic(struct riscv_cpu * const restrict cpu, uint64_t vaddr, uint64_t size,
+                        enum riscv_access access)
+{
+  struct riscv_tlb_entry * const entries = (access == RISCV_ACCESS_LOAD) ? cpu->dtlb->load
+                                                                          : cpu->dtlb->store;
+  const struct riscv_tlb_entry * entry = &entries[RISCV_TLB_INDEX(vaddr)];
+  uint64_t paddr;
+  int cause;
+
+  if ((vaddr & (size - 1)) != 0)
+  {
+    riscv_cpu_raise(cpu, (access == RISCV_ACCESS_LOAD) ? RISCV_EXC_LOAD_MISALIGNED
+                                                        : RISCV_EXC_STORE_MISALIGNED, vaddr);
+    return NULL;
+  }
+
+  if (entry->tag != RISCV_TLB_TAG(vaddr, size))
+  {
+    cause = riscv_mmu_translate(cpu, vaddr, access, &paddr);
+    if (cause != 0)
+    {
+      riscv_cpu_raise(cpu, cause, vaddr);
+      return NULL;
+    }
+
+    entry = riscv_mmu_fill(cpu, entries, vaddr, paddr);
+    if (entry == NULL)
+    {
+      riscv_cpu_raise(cpu, riscv_mmu_access_fault[access], vaddr);
+      return NULL;
+    }
+
+    if (access != RISCV_ACCESS_LOAD)
+    {
+      dram_mark_dirty(cpu->bus->dram, paddr - DRAM_BASE, size);
+      riscv_block_cache_invalidate(cpu->bcache, (paddr - DRAM_BASE) >> RISCV_PAGE_SHIFT);
+    }
+  }
+
+  return (void *) (entry->addend + vaddr);
+}
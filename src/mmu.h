@@ -0,0 +1,66 @@
+/*
+  Copyright (c) 2024, Arka Mondal. All rights reserved.
+  Use of this source code is governed by a BSD-style license that
+  can be found in the LICENSE file.
+*/
+
+#ifndef _RISCVEMU_MMU_H
+#define _RISCVEMU_MMU_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define RISCV_PAGE_SHIFT 12
+#define RISCV_PAGE_SIZE (1UL << RISCV_PAGE_SHIFT)
+
+#define RISCV_TLB_SIZE 256                // entries per access type, power of 2
+#define RISCV_TLB_INDEX(addr) (((addr) >> RISCV_PAGE_SHIFT) & (RISCV_TLB_SIZE - 1))
+
+// only naturally aligned accesses match the tag of their page
+#define RISCV_TLB_TAG(addr, size) ((addr) & ~(RISCV_PAGE_SIZE - 1 - ((size) - 1)))
+#define RISCV_TLB_EMPTY ((uint64_t) -1)
+
+// translation contexts, each one has its own set of entries
+enum riscv_tlb_mode {
+  RISCV_TLB_USER,
+  RISCV_TLB_SUPERVISOR,
+  RISCV_TLB_MACHINE,
+  RISCV_TLB_MODES
+};
+
+enum riscv_access {
+  RISCV_ACCESS_FETCH,
+  RISCV_ACCESS_LOAD,
+  RISCV_ACCESS_STORE
+};
+
+/*
+ * A cached translation of one virtual page to host memory. Only pages backed
+ * by guest DRAM are cached, everything else always takes the slow path.
+ */
+struct riscv_tlb_entry {
+  uint64_t tag;                       // virtual page address, RISCV_TLB_EMPTY if unused
+  uintptr_t addend;                   // host address - virtual address
+};
+
+// one set per translation context, with separate fetch, load and store entries
+struct riscv_tlb {
+  struct riscv_tlb_entry fetch[RISCV_TLB_SIZE];
+  struct riscv_tlb_entry load[RISCV_TLB_SIZE];
+  struct riscv_tlb_entry store[RISCV_TLB_SIZE];
+};
+
+struct riscv_cpu;
+
+void riscv_mmu_flush(struct riscv_cpu * const restrict);
+void riscv_mmu_flush_page(struct riscv_cpu * const restrict, uint64_t);
+void riscv_mmu_update_mode(struct riscv_cpu * const restrict);
+void riscv_mmu_protect(struct riscv_cpu * const restrict, uint64_t);
+int riscv_mmu_translate(struct riscv_cpu * const restrict, uint64_t, enum riscv_access, uint64_t *);
+int riscv_mmu_fetch(struct riscv_cpu * const restrict, uint64_t, uint64_t *);
+int riscv_mmu_fetch_page(const struct riscv_cpu * const restrict, uint64_t, uint64_t *);
+int riscv_mmu_load(struct riscv_cpu * const restrict, uint64_t, uint64_t, uint64_t *);
+int riscv_mmu_store(struct riscv_cpu * const restrict, uint64_t, uint64_t, uint64_t);
+void * riscv_mmu_atomic(struct riscv_cpu * const restrict, uint64_t, uint64_t, enum riscv_access);
+
+#endif /* _RISCVEMU_MMU_H */
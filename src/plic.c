@@ -0,0 +1,246 @@
+/*
+  Copyright (c) 2024, Arka Mondal. All rights reserved.
+  Use of this source code is governed by a BSD-style license that
+  can be found in the LICENSE file.
+*/
+
+#include <string.h>
+#include "plic.h"
+#include "csr.h"
+
+// the source a context would claim now, 0 if none
+static uint32_t plic_best(const struct plic * const restrict plic, size_t context)
+{
+  const struct plic_state * const state = &plic->state;
+  uint32_t ready = state->pending & state->enable[context] & ~state->claimed;
+  uint32_t src, best = 0, priority = state->threshold[context];
+
+  // ties go to the lowest source
+  for (src = 1; src < PLIC_SOURCES; src++)
+  {
+    if ((ready & (1U << src)) && state->priority[src] > priority)
+    {
+      best = src;
+      priority = state->priority[src];
+    }
+  }
+
+  return best;
+}
+
+// drive the external interrupt lines of every hart from the state, lock held
+static void plic_update(struct plic * const restrict plic)
+{
+  size_t context;
+
+  for (context = 0; context < 2 * plic->nharts; context++)
+    riscv_cpu_interrupt(plic->harts[context / 2], (context & 0x1) ? MIP_SEIP : MIP_MEIP,
+                        plic_best(plic, context) != 0);
+}
+
+/*
+ * Set the level of a device's interrupt line. A raised line is pending until
+ * a hart claims it and comes back after the completion if still raised.
+ */
+void plic_set_irq(struct plic * const restrict plic, uint32_t src, int level)
+{
+  uint32_t bit;
+
+  if (src == 0 || src >= PLIC_SOURCES)
+    return;
+
+  bit = 1U << src;
+
+  pthread_mutex_lock(&plic->lock);
+
+  if (level)
+  {
+    plic->state.level |= bit;
+    if ((plic->state.claimed & bit) == 0)
+      plic->state.pending |= bit;
+  }
+  else
+  {
+    plic->state.level &= ~bit;
+    plic->state.pending &= ~bit;
+  }
+
+  plic_update(plic);
+
+  pthread_mutex_unlock(&plic->lock);
+}
+
+static int plic_load(void * opaque, uint64_t offset, uint64_t size, uint64_t * value)
+{
+  struct plic * const plic = opaque;
+  struct plic_state * const state = &plic->state;
+  uint64_t context;
+  uint32_t src;
+
+  if (size != 4)
+    return -1;
+
+  *value = 0;
+
+  pthread_mutex_lock(&plic->lock);
+
+  if (offset < PLIC_PENDING)
+  {
+    if (offset / 4 < PLIC_SOURCES)
+      *value = state->priority[offset / 4];
+  }
+  else if (offset < PLIC_ENABLE)
+  {
+    if (offset == PLIC_PENDING)
+      *value = state->pending;
+  }
+  else if (offset < PLIC_CONTEXT)
+  {
+    context = (offset - PLIC_ENABLE) / 0x80;
+    if (context < 2 * plic->nharts && (offset & 0x7f) == 0)
+      *value = state->enable[context];
+  }
+  else
+  {
+    context = (offset - PLIC_CONTEXT) / 0x1000;
+    if (context < 2 * plic->nharts && (offset & 0xfff) == 0)
+    {
+      *value = state->threshold[context];
+    }
+    else if (context < 2 * plic->nharts && (offset & 0xfff) == 4)
+    {
+      // claim
+      src = plic_best(plic, context);
+      if (src != 0)
+      {
+        state->pending &= ~(1U << src);
+        state->claimed |= 1U << src;
+        plic_update(plic);
+      }
+
+      *value = src;
+    }
+  }
+
+  pthread_mutex_unlock(&plic->lock);
+
+  return 0;
+}
+
+static int plic_store(void * opaque, uint64_t offset, uint64_t size, uint64_t value)
+{
+  struct plic * const plic = opaque;
+  struct plic_state * const state = &plic->state;
+  uint64_t context;
+
+  if (size != 4)
+    return -1;
+
+  pthread_mutex_lock(&plic->lock);
+
+  if (offset < PLIC_PENDING)
+  {
+    if (offset / 4 < PLIC_SOURCES && offset != 0)
+      state->priority[offset / 4] = value & 0x7;
+  }
+  else if (offset < PLIC_ENABLE)
+  {
+    // pending bits are read-only
+  }
+  else if (offset < PLIC_CONTEXT)
+  {
+    context = (offset - PLIC_ENABLE) / 0x80;
+    if (context < 2 * plic->nharts && (offset & 0x7f) == 0)
+      state->enable[context] = value & ~0x1U;
+  }
+  else
+  {
+    context = (offset - PLIC_CONTEXT) / 0x1000;
+    if (context < 2 * plic->nharts && (offset & 0xfff) == 0)
+    {
+      state->threshold[context] = value & 0x7;
+    }
+    else if (context < 2 * plic->nharts && (offset & 0xfff) == 4 && value != 0 && value < PLIC_SOURCES)
+    {
+      // complete, a line still raised is pending again
+      state->claimed &= ~(1U << value);
+      state->pending |= state->level & (1U << value);
+    }
+  }
+
+  plic_update(plic);
+
+  pthread_mutex_unlock(&plic->lock);
+
+  return 0;
+}
+
+// the interrupt pending bits are part of the harts, they follow the restored state
+static void plic_save(void * opaque, void * state)
+{
+  struct plic * const plic = opaque;
+
+  pthread_mutex_lock(&plic->lock);
+  memcpy(state, &plic->state, sizeof(struct plic_state));
+  pthread_mutex_unlock(&plic->lock);
+}
+
+static void plic_restore(void * opaque, const void * state)
+{
+  struct plic * const plic = opaque;
+
+  pthread_mutex_lock(&plic->lock);
+  memcpy(&plic->state, state, sizeof(struct plic_state));
+  pthread_mutex_unlock(&plic->lock);
+}
+
+/*
+ * Attach a PLIC for the given harts to the bus. Everything starts masked:
+ * zero priorities and enables.
+ */
+int plic_init(struct plic * const restrict plic, struct bus * const restrict bus,
+              struct riscv_cpu * const * harts, size_t nharts)
+{
+  struct bus_device device;
+
+  if (plic == NULL || bus == NULL || harts == NULL || nharts == 0 || 2 * nharts > PLIC_MAX_CONTEXTS)
+    return -1;
+
+  memset(&plic->state, 0x0, sizeof(struct plic_state));
+  plic->harts = harts;
+  plic->nharts = nharts;
+
+  if (pthread_mutex_init(&plic->lock, NULL) != 0)
+    return -1;
+
+  memset(&device, 0x0, sizeof(device));
+  device.name = "plic";
+  device.base = PLIC_BASE;
+  device.size = PLIC_SIZE;
+  device.opaque = plic;
+  device.load = plic_load;
+  device.store = plic_store;
+  device.state_size = sizeof(struct plic_state);
+  device.save = plic_save;
+  device.restore = plic_restore;
+
+  if (bus_register(bus, &device) != 0)
+  {
+    pthread_mutex_destroy(&plic->lock);
+    return -1;
+  }
+
+  return 0;
+}
+
+int plic_deinit(struct plic * const restrict plic)
+{
+  if (plic == NULL)
+    return -1;
+
+  pthread_mutex_destroy(&plic->lock);
+  plic->harts = NULL;
+  plic->nharts = 0;
+
+  return 0;
+}
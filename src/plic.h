@@ -0,0 +1,54 @@
+/*
+  Copyright (c) 2024, Arka Mondal. All rights reserved.
+  Use of this source code is governed by a BSD-style license that
+  can be found in the LICENSE file.
+*/
+
+#ifndef _RISCVEMU_PLIC_H
+#define _RISCVEMU_PLIC_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "cpu.h"
+#include "bus.h"
+
+// SiFive compatible platform-level interrupt controller, where QEMU's virt machine has it
+#define PLIC_BASE 0xc000000UL
+#define PLIC_SIZE 0x4000000UL
+#define PLIC_SOURCES 32                   // interrupt source 0 does not exist
+#define PLIC_MAX_CONTEXTS 128             // two per hart: M-mode, then S-mode
+
+#define PLIC_PRIORITY 0x0
+#define PLIC_PENDING 0x1000
+#define PLIC_ENABLE 0x2000                // 0x80 per context
+#define PLIC_CONTEXT 0x200000             // 0x1000 per context: threshold, then claim/complete
+
+// what a snapshot of the PLIC holds
+struct plic_state {
+  uint32_t priority[PLIC_SOURCES];
+  uint32_t pending;                       // one bit per source
+  uint32_t claimed;                       // claimed and not completed yet
+  uint32_t level;                         // lines held high by their devices
+  uint32_t enable[PLIC_MAX_CONTEXTS];
+  uint32_t threshold[PLIC_MAX_CONTEXTS];
+};
+
+/*
+ * Routes level-triggered device interrupts to the harts. Context 2 * i is
+ * hart i in M-mode (MEIP), context 2 * i + 1 the same hart in S-mode (SEIP).
+ * Devices raise their lines from any thread, so the state is locked.
+ */
+struct plic {
+  struct riscv_cpu * const * harts;
+  size_t nharts;
+  pthread_mutex_t lock;
+  struct plic_state state;
+};
+
+int plic_init(struct plic * const restrict, struct bus * const restrict, struct riscv_cpu * const *,
+              size_t);
+void plic_set_irq(struct plic * const restrict, uint32_t, int);
+int plic_deinit(struct plic * const restrict);
+
+#endif /* _RISCVEMU_PLIC_H */
@@ -0,0 +1,191 @@
+/*
+  Copyright (c) 2024, Arka Mondal. All rights reserved.
+  Use of this source code is governed by a BSD-style license that
+  can be found in the LICENSE file.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include "profile.h"
+
+#define RISCV_UOP_NAME(name) [RISCV_UOP_##name] = #name,
+
+static const char * const riscv_profile_op_names[RISCV_UOP_COUNT] = {
+  RISCV_UOPS(RISCV_UOP_NAME)
+};
+
+static const char riscv_profile_priv_names[] = { 'U', 'S', 'H', 'M' };
+
+int riscv_profile_init(struct riscv_profile * const restrict profile)
+{
+  if (profile == NULL)
+    return -1;
+
+  memset(profile, 0x0, sizeof(struct riscv_profile));
+  memset(profile->pcs, 0xff, sizeof(profile->pcs));
+  profile->countdown = RISCV_PROFILE_PERIOD;
+
+  return 0;
+}
+
+static void riscv_profile_add(struct riscv_profile * const restrict profile, uint64_t pc,
+                              uint8_t priv, uint64_t count)
+{
+  size_t i = (pc >> 2) & (RISCV_PROFILE_PCS - 1);
+  size_t probes;
+
+  for (probes = 0; probes < RISCV_PROFILE_PCS; probes++, i = (i + 1) & (RISCV_PROFILE_PCS - 1))
+  {
+    if (profile->pcs[i].pc == pc && profile->pcs[i].priv == priv)
+    {
+      profile->pcs[i].count += count;
+      return;
+    }
+
+    if (profile->pcs[i].pc == UINT64_MAX)
+    {
+      profile->pcs[i].pc = pc;
+      profile->pcs[i].priv = priv;
+      profile->pcs[i].count = count;
+      return;
+    }
+  }
+
+  profile->dropped += count;
+}
+
+void riscv_profile_sample(struct riscv_profile * const restrict profile, uint64_t pc, uint8_t priv)
+{
+  profile->samples++;
+  riscv_profile_add(profile, pc, priv, 1);
+}
+
+// add the counts of src to dst
+int riscv_profile_merge(struct riscv_profile * const restrict dst,
+                        const struct riscv_profile * const restrict src)
+{
+  size_t i;
+
+  if (dst == NULL || src == NULL)
+    return -1;
+
+  for (i = 0; i < RISCV_UOP_COUNT; i++)
+    dst->ops[i] += src->ops[i];
+
+  for (i = 0; i < RISCV_PROFILE_PCS; i++)
+    if (src->pcs[i].pc != UINT64_MAX)
+      riscv_profile_add(dst, src->pcs[i].pc, src->pcs[i].priv, src->pcs[i].count);
+
+  dst->samples += src->samples;
+  dst->dropped += src->dropped;
+
+  return 0;
+}
+
+static int riscv_profile_compare_ops(const void * a, const void * b)
+{
+  const uint64_t x = *(const uint64_t *) a >> 8, y = *(const uint64_t *) b >> 8;
+
+  return (x < y) - (x > y);
+}
+
+static int riscv_profile_compare_pcs(const void * a, const void * b)
+{
+  const struct riscv_profile_pc * x = a, * y = b;
+
+  if (x->count != y->count)
+    return (x->count < y->count) - (x->count > y->count);
+
+  return (x->pc > y->pc) - (x->pc < y->pc);
+}
+
+// copy of the used pc slots, hottest first
+static struct riscv_profile_pc * riscv_profile_sorted_pcs(const struct riscv_profile * const restrict profile,
+                                                          size_t * count)
+{
+  struct riscv_profile_pc * pcs = malloc(sizeof(profile->pcs));
+  size_t i, n = 0;
+
+  if (pcs == NULL)
+    return NULL;
+
+  for (i = 0; i < RISCV_PROFILE_PCS; i++)
+    if (profile->pcs[i].pc != UINT64_MAX)
+      pcs[n++] = profile->pcs[i];
+
+  qsort(pcs, n, sizeof(struct riscv_profile_pc), riscv_profile_compare_pcs);
+  *count = n;
+
+  return pcs;
+}
+
+/*
+ * Print the micro-ops by execution count and the most sampled pcs, both
+ * with their share of the total.
+ */
+int riscv_profile_report(const struct riscv_profile * const restrict profile, FILE * out)
+{
+  uint64_t ops[RISCV_UOP_COUNT];            // count << 8 | op, sorts by count
+  struct riscv_profile_pc * pcs;
+  uint64_t total = 0, fused = 0;
+  size_t i, n;
+
+  if (profile == NULL || out == NULL)
+    return -1;
+
+  for (i = 0; i < RISCV_UOP_COUNT; i++)
+  {
+    ops[i] = (profile->ops[i] << 8) | i;
+    total += profile->ops[i];
+    fused += riscv_uop_fused(i) ? profile->ops[i] : 0;
+  }
+
+  qsort(ops, RISCV_UOP_COUNT, sizeof(uint64_t), riscv_profile_compare_ops);
+
+  // every fused pair is one micro-op but two instructions, its op names the idiom
+  fprintf(out, "instructions %lu, fused pairs %lu, samples %lu (one per %d instructions), dropped %lu\n\n",
+          total + fused, fused, profile->samples, RISCV_PROFILE_PERIOD, profile->dropped);
+
+  fprintf(out, "%16s %7s  %s\n", "executed", "%", "op");
+  for (i = 0; i < RISCV_UOP_COUNT && (ops[i] >> 8) != 0; i++)
+    fprintf(out, "%16lu %6.2f%%  %s\n", ops[i] >> 8, 100.0 * (ops[i] >> 8) / total,
+            riscv_profile_op_names[ops[i] & 0xff]);
+
+  pcs = riscv_profile_sorted_pcs(profile, &n);
+  if (pcs == NULL)
+    return -1;
+
+  fprintf(out, "\n%16s %7s  %s\n", "samples", "%", "pc");
+  for (i = 0; i < n && i < RISCV_PROFILE_TOP; i++)
+    fprintf(out, "%16lu %6.2f%%  %c %#lx\n", pcs[i].count, 100.0 * pcs[i].count / profile->samples,
+            riscv_profile_priv_names[pcs[i].priv & 0x3], pcs[i].pc);
+
+  free(pcs);
+
+  return 0;
+}
+
+/*
+ * Print the pc samples as folded stacks ("root;mode;pc count" per line), the
+ * input format of flamegraph.pl and compatible viewers.
+ */
+int riscv_profile_folded(const struct riscv_profile * const restrict profile, const char * root, FILE * out)
+{
+  struct riscv_profile_pc * pcs;
+  size_t i, n;
+
+  if (profile == NULL || root == NULL || out == NULL)
+    return -1;
+
+  pcs = riscv_profile_sorted_pcs(profile, &n);
+  if (pcs == NULL)
+    return -1;
+
+  for (i = 0; i < n; i++)
+    fprintf(out, "%s;%c;%#lx %lu\n", root, riscv_profile_priv_names[pcs[i].priv & 0x3],
+            pcs[i].pc, pcs[i].count);
+
+  free(pcs);
+
+  return 0;
+}
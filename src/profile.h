@@ -0,0 +1,64 @@
+/*
+  Copyright (c) 2024, Arka Mondal. All rights reserved.
+  Use of this source code is governed by a BSD-style license that
+  can be found in the LICENSE file.
+*/
+
+#ifndef _RISCVEMU_PROFILE_H
+#define _RISCVEMU_PROFILE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "decode.h"
+
+#define RISCV_PROFILE_PERIOD 1024           // instructions between two pc samples
+#define RISCV_PROFILE_PCS 65536             // distinct sampled pcs, power of 2
+#define RISCV_PROFILE_TOP 32                // hottest pcs in the report
+
+struct riscv_profile_pc {
+  uint64_t pc;                              // UINT64_MAX if the slot is empty
+  uint64_t count;
+  uint8_t priv;
+};
+
+/*
+ * Execution profile of a hart: how often each micro-op ran, and a histogram
+ * of the pc sampled every RISCV_PROFILE_PERIOD instructions at the start of
+ * a block.
+ */
+struct riscv_profile {
+  uint64_t ops[RISCV_UOP_COUNT];
+  uint64_t countdown;                       // instructions left until the next sample
+  uint64_t samples;
+  uint64_t dropped;                         // samples lost to a full table
+  struct riscv_profile_pc pcs[RISCV_PROFILE_PCS];
+};
+
+#ifdef RISCV_PROFILE
+#define RISCV_PROFILE_UOP(cpu, uop) ((cpu)->profile->ops[(uop)->op]++)
+#else
+#define RISCV_PROFILE_UOP(cpu, uop) ((void) 0)
+#endif
+
+int riscv_profile_init(struct riscv_profile * const restrict);
+void riscv_profile_sample(struct riscv_profile * const restrict, uint64_t, uint8_t);
+int riscv_profile_merge(struct riscv_profile * const restrict, const struct riscv_profile * const restrict);
+int riscv_profile_report(const struct riscv_profile * const restrict, FILE *);
+int riscv_profile_folded(const struct riscv_profile * const restrict, const char *, FILE *);
+
+// account for count instructions run from the block at pc
+static inline void riscv_profile_block(struct riscv_profile * const restrict profile, uint64_t pc,
+                                       uint8_t priv, uint64_t count)
+{
+  if (count < profile->countdown)
+  {
+    profile->countdown -= count;
+    return;
+  }
+
+  profile->countdown = RISCV_PROFILE_PERIOD;
+  riscv_profile_sample(profile, pc, priv);
+}
+
+#endif /* _RISCVEMU_PROFILE_H */
@@ -0,0 +1,373 @@
+/*
+  Copyright (c) 2024, Arka Mondal. All rights reserved.
+  Use of this source code is governed by a BSD-style license that
+  can be found in the LICENSE file.
+*/
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cpu.h"
+#include "sched.h"
+
+/*
+ * The deque operations follow "Correct and Efficient Work-Stealing for Weak
+ * Memory Models" (Le, Pop, Cohen, Zappa Nardelli). A worker takes its own
+ * tasks from the top, like the thieves do, rather than from the bottom: a
+ * hart that used up its quantum goes to the back, so the harts of a worker
+ * take turns instead of the last one running forever.
+ */
+
+// owner only
+static void sched_push(struct riscv_sched_deque * const restrict deque, struct riscv_sched_task * task)
+{
+  int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED);
+
+  __atomic_store_n(&deque->tasks[bottom & deque->mask], task, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+}
+
+// any thread, NULL if empty or lost to another thief
+static struct riscv_sched_task * sched_steal(struct riscv_sched_deque * const restrict deque)
+{
+  int64_t top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+  int64_t bottom;
+  struct riscv_sched_task * task;
+
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  bottom = __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+
+  if (top >= bottom)
+    return NULL;
+
+  task = __atomic_load_n(&deque->tasks[top & deque->mask], __ATOMIC_RELAXED);
+  if (!__atomic_compare_exchange_n(&deque->top, &top, top + 1, 0,
+                                   __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+    return NULL;
+
+  return task;
+}
+
+// caller holds the lock
+static void sched_inject(struct riscv_sched * const restrict sched, struct riscv_sched_task * task)
+{
+  task->state = RISCV_SCHED_READY;
+  task->wake = 0;
+  sched->inject[sched->ninject++] = task;
+  pthread_cond_signal(&sched->idle);
+}
+
+// a task from any worker, its own deque first, NULL if there is none
+static struct riscv_sched_task * sched_steal_any(struct riscv_sched_worker * const restrict worker)
+{
+  struct riscv_sched * const sched = worker->sched;
+  struct riscv_sched_task * task;
+  size_t i, victim;
+
+  task = sched_steal(&worker->deque);
+  if (task != NULL)
+    return task;
+
+  // xorshift, start at a random victim and go round once
+  worker->seed ^= worker->seed << 13;
+  worker->seed ^= worker->seed >> 7;
+  worker->seed ^= worker->seed << 17;
+
+  for (i = 0; i < sched->nworkers; i++)
+  {
+    victim = (worker->seed + i) % sched->nworkers;
+    task = sched_steal(&sched->workers[victim].deque);
+    if (task != NULL)
+      return task;
+  }
+
+  return NULL;
+}
+
+// a hart in WFI leaves the workers until riscv_sched_wake
+static void sched_park(struct riscv_sched * const restrict sched, struct riscv_sched_task * task)
+{
+  pthread_mutex_lock(&sched->lock);
+
+  if (task->wake)
+  {
+    sched_inject(sched, task);
+  }
+  else
+  {
+    task->state = RISCV_SCHED_PARKED;
+  }
+
+  pthread_mutex_unlock(&sched->lock);
+}
+
+static void sched_finish(struct riscv_sched * const restrict sched, struct riscv_sched_task * task)
+{
+  if (sched->done != NULL)
+    sched->done(sched, task);
+
+  pthread_mutex_lock(&sched->lock);
+
+  task->state = RISCV_SCHED_DONE;
+  __atomic_store_n(&sched->live, sched->live - 1, __ATOMIC_RELAXED);
+
+  if (sched->live == 0)
+  {
+    pthread_cond_broadcast(&sched->idle);
+    pthread_cond_broadcast(&sched->finished);
+  }
+
+  pthread_mutex_unlock(&sched->lock);
+}
+
+/*
+ * Next task for a worker that ran out of its own: a woken one, or one
+ * stolen from another worker. Sleeps while there is none; the pushing side
+ * only signals when it sees sleeping raised, and the last look is taken
+ * with the lock held, so no wake-up is lost. NULL once the run is over.
+ */
+static struct riscv_sched_task * sched_wait(struct riscv_sched_worker * const restrict worker)
+{
+  struct riscv_sched * const sched = worker->sched;
+  struct riscv_sched_task * task = NULL;
+
+  pthread_mutex_lock(&sched->lock);
+  __atomic_fetch_add(&sched->sleeping, 1, __ATOMIC_SEQ_CST);
+
+  while (sched->live != 0 && !sched->stop)
+  {
+    if (sched->ninject != 0)
+    {
+      task = sched->inject[--sched->ninject];
+      break;
+    }
+
+    task = sched_steal_any(worker);
+    if (task != NULL)
+      break;
+
+    pthread_cond_wait(&sched->idle, &sched->lock);
+  }
+
+  __atomic_fetch_sub(&sched->sleeping, 1, __ATOMIC_SEQ_CST);
+  pthread_mutex_unlock(&sched->lock);
+
+  return task;
+}
+
+/*
+ * Worker thread: run the tasks of its own deque one quantum at a time, and
+ * when it runs dry take woken tasks or steal.
+ */
+static void * sched_worker(void * arg)
+{
+  struct riscv_sched_worker * const worker = arg;
+  struct riscv_sched * const sched = worker->sched;
+  struct riscv_sched_task * task;
+
+  while (!__atomic_load_n(&sched->stop, __ATOMIC_RELAXED))
+  {
+    // woken tasks go first, a worker busy with its own could otherwise starve them
+    task = NULL;
+    if (__atomic_load_n(&sched->ninject, __ATOMIC_RELAXED) != 0)
+    {
+      pthread_mutex_lock(&sched->lock);
+      if (sched->ninject != 0)
+        task = sched->inject[--sched->ninject];
+      pthread_mutex_unlock(&sched->lock);
+    }
+
+    if (task == NULL)
+      task = sched_steal_any(worker);
+    if (task == NULL)
+      task = sched_wait(worker);
+    if (task == NULL)
+      break;
+
+    task->status = riscv_cpu_run(task->cpu, sched->quantum);
+
+    switch (task->status)
+    {
+      case RISCV_RUN_BUDGET:
+        sched_push(&worker->deque, task);
+
+        // another worker could take one of them
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&sched->sleeping, __ATOMIC_RELAXED) != 0
+            && worker->deque.bottom - __atomic_load_n(&worker->deque.top, __ATOMIC_RELAXED) > 1)
+        {
+          pthread_mutex_lock(&sched->lock);
+          pthread_cond_signal(&sched->idle);
+          pthread_mutex_unlock(&sched->lock);
+        }
+        break;
+
+      case RISCV_RUN_WFI:
+        sched_park(sched, task);
+        break;
+
+      default:
+        sched_finish(sched, task);
+        break;
+    }
+  }
+
+  return NULL;
+}
+
+/*
+ * Set up a scheduler for ntasks tasks on nworkers workers. The tasks only
+ * need their cpu (and opaque) filled in; they are dealt out round-robin.
+ * quantum, opaque and done can be changed before riscv_sched_run.
+ */
+int riscv_sched_init(struct riscv_sched * const restrict sched, size_t nworkers,
+                     struct riscv_sched_task * tasks, size_t ntasks)
+{
+  struct riscv_sched_worker * worker;
+  uint64_t capacity;
+  size_t i;
+
+  if (sched == NULL || nworkers == 0 || nworkers > RISCV_SCHED_MAX_WORKERS
+      || (tasks == NULL && ntasks != 0))
+    return -1;
+
+  memset(sched, 0x0, sizeof(struct riscv_sched));
+  sched->tasks = tasks;
+  sched->ntasks = ntasks;
+  sched->quantum = RISCV_SCHED_QUANTUM;
+  sched->nworkers = nworkers;
+  sched->live = ntasks;
+
+  for (capacity = 1; capacity < ntasks; capacity *= 2)
+    ;
+
+  sched->workers = aligned_alloc(64, nworkers * sizeof(struct riscv_sched_worker));
+  sched->inject = malloc((ntasks + 1) * sizeof(struct riscv_sched_task *));
+  if (sched->workers == NULL || sched->inject == NULL)
+    goto fail;
+
+  memset(sched->workers, 0x0, nworkers * sizeof(struct riscv_sched_worker));
+
+  for (i = 0; i < nworkers; i++)
+  {
+    worker = &sched->workers[i];
+    worker->sched = sched;
+    worker->seed = 0x9e3779b97f4a7c15UL * (i + 1);
+    worker->deque.mask = capacity - 1;
+    worker->deque.tasks = malloc(capacity * sizeof(struct riscv_sched_task *));
+    if (worker->deque.tasks == NULL)
+      goto fail;
+  }
+
+  for (i = 0; i < ntasks; i++)
+  {
+    tasks[i].state = RISCV_SCHED_READY;
+    tasks[i].wake = 0;
+    sched_push(&sched->workers[i % nworkers].deque, &tasks[i]);
+  }
+
+  pthread_mutex_init(&sched->lock, NULL);
+  pthread_cond_init(&sched->idle, NULL);
+  pthread_cond_init(&sched->finished, NULL);
+
+  return 0;
+
+fail:
+  for (i = 0; sched->workers != NULL && i < nworkers; i++)
+    free(sched->workers[i].deque.tasks);
+
+  free(sched->workers);
+  free(sched->inject);
+  sched->workers = NULL;
+  sched->inject = NULL;
+
+  return -1;
+}
+
+/*
+ * Run the tasks on the workers until all of them are done or, if deadline
+ * is given, until then. In that case the workers stop after their current
+ * quantum and the tasks stay where they are, so that the caller can look at
+ * stopped harts and call again. Returns the number of tasks still live.
+ */
+int riscv_sched_run(struct riscv_sched * const restrict sched, const struct timespec * deadline)
+{
+  size_t i, started;
+  int status = 0;
+
+  if (sched == NULL)
+    return -1;
+
+  sched->stop = 0;
+
+  for (started = 0; started < sched->nworkers; started++)
+  {
+    if (pthread_create(&sched->workers[started].thread, NULL, sched_worker,
+                       &sched->workers[started]) != 0)
+      break;
+  }
+
+  pthread_mutex_lock(&sched->lock);
+
+  while (sched->live != 0 && started != 0 && status != ETIMEDOUT)
+  {
+    if (deadline != NULL)
+      status = pthread_cond_timedwait(&sched->finished, &sched->lock, deadline);
+    else
+      pthread_cond_wait(&sched->finished, &sched->lock);
+  }
+
+  __atomic_store_n(&sched->stop, 1, __ATOMIC_RELAXED);
+  pthread_cond_broadcast(&sched->idle);
+  pthread_mutex_unlock(&sched->lock);
+
+  for (i = 0; i < started; i++)
+    pthread_join(sched->workers[i].thread, NULL);
+
+  if (started == 0)
+    return -1;
+
+  return sched->live;
+}
+
+/*
+ * Make a task runnable again, typically when an interrupt becomes pending
+ * for a hart in WFI. Safe to call from any thread at any time.
+ */
+void riscv_sched_wake(struct riscv_sched * const restrict sched, struct riscv_sched_task * const restrict task)
+{
+  pthread_mutex_lock(&sched->lock);
+
+  if (task->state == RISCV_SCHED_PARKED)
+  {
+    sched_inject(sched, task);
+  }
+  else if (task->state == RISCV_SCHED_READY)
+  {
+    task->wake = 1;
+  }
+
+  pthread_mutex_unlock(&sched->lock);
+}
+
+int riscv_sched_deinit(struct riscv_sched * const restrict sched)
+{
+  size_t i;
+
+  if (sched == NULL)
+    return -1;
+
+  for (i = 0; sched->workers != NULL && i < sched->nworkers; i++)
+    free(sched->workers[i].deque.tasks);
+
+  free(sched->workers);
+  free(sched->inject);
+  pthread_mutex_destroy(&sched->lock);
+  pthread_cond_destroy(&sched->idle);
+  pthread_cond_destroy(&sched->finished);
+  memset(sched, 0x0, sizeof(struct riscv_sched));
+
+  return 0;
+}
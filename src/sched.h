@@ -0,0 +1,82 @@
+/*
+  Copyright (c) 2024, Arka Mondal. All rights reserved.
+  Use of this source code is governed by a BSD-style license that
+  can be found in the LICENSE file.
+*/
+
+#ifndef _RISCVEMU_SCHED_H
+#define _RISCVEMU_SCHED_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include "cpu.h"
+
+#define RISCV_SCHED_QUANTUM (1UL << 18)    // instructions a hart runs before it yields
+#define RISCV_SCHED_MAX_WORKERS 256
+
+// where a task is
+enum riscv_sched_state {
+  RISCV_SCHED_READY,                  // in a deque or the inject queue, or running
+  RISCV_SCHED_PARKED,                 // waiting in WFI, on no queue at all
+  RISCV_SCHED_DONE
+};
+
+// a hart multiplexed onto the workers, provided by the caller
+struct riscv_sched_task {
+  struct riscv_cpu * cpu;
+  void * opaque;
+  int status;                         // last riscv_cpu_run result
+  uint8_t state;
+  uint8_t wake;                       // woken while it was still running
+};
+
+/*
+ * Chase-Lev work-stealing deque. Only the owning worker pushes, at the
+ * bottom; it takes from the top just like the workers stealing from it. It
+ * never has to grow: a task is in at most one deque at a time, so the
+ * capacity is the number of tasks.
+ */
+struct riscv_sched_deque {
+  int64_t top;
+  int64_t bottom;
+  struct riscv_sched_task ** tasks;
+  uint64_t mask;
+};
+
+struct riscv_sched;
+
+struct riscv_sched_worker {
+  struct riscv_sched_deque deque;
+  struct riscv_sched * sched;
+  pthread_t thread;
+  uint64_t seed;                      // picks the victims to steal from
+} __attribute__ ((aligned (64)));
+
+struct riscv_sched {
+  struct riscv_sched_task * tasks;
+  size_t ntasks;
+  uint64_t quantum;
+  void * opaque;
+  void (*done)(struct riscv_sched *, struct riscv_sched_task *);  // a task stopped for good
+
+  struct riscv_sched_worker * workers;
+  size_t nworkers;
+
+  pthread_mutex_t lock;               // protects everything below
+  pthread_cond_t idle;                // workers without work sleep here
+  pthread_cond_t finished;            // live dropped to 0
+  struct riscv_sched_task ** inject;  // tasks woken up or handed in, any worker takes them
+  size_t ninject;
+  size_t live;                        // tasks not done, read without the lock as well
+  size_t sleeping;
+  uint8_t stop;
+};
+
+int riscv_sched_init(struct riscv_sched * const restrict, size_t, struct riscv_sched_task *, size_t);
+int riscv_sched_run(struct riscv_sched * const restrict, const struct timespec *);
+void riscv_sched_wake(struct riscv_sched * const restrict, struct riscv_sched_task * const restrict);
+int riscv_sched_deinit(struct riscv_sched * const restrict);
+
+#endif /* _RISCVEMU_SCHED_H */
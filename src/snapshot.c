@@ -0,0 +1,243 @@
+/*
+  Copyright (c) 2024, Arka Mondal. All rights reserved.
+  Use of this source code is governed by a BSD-style license that
+  can be found in the LICENSE file.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "cpu.h"
+#include "bus.h"
+#include "dram.h"
+#include "mmu.h"
+#include "snapshot.h"
+
+#define SNAPSHOT_PAGE_SIZE (1UL << DRAM_PAGE_SHIFT)
+
+static int snapshot_page_zero(const uint8_t * page, uint64_t size)
+{
+  uint64_t i, word;
+
+  for (i = 0; i < size; i += sizeof(word))
+  {
+    memcpy(&word, page + i, sizeof(word));
+    if (word != 0)
+      return 0;
+  }
+
+  return 1;
+}
+
+/*
+ * Forget the cached translations of a hart: its TLB entries may point at
+ * pages that are not marked dirty any more, and its decoded blocks at code
+ * that changed.
+ */
+static void snapshot_flush(struct riscv_cpu * const restrict cpu)
+{
+  riscv_mmu_flush(cpu);
+  riscv_mmu_update_mode(cpu);
+  riscv_block_cache_flush(cpu->bcache);
+}
+
+/*
+ * Save the state of nharts harts and of bus with its DRAM and devices. The
+ * harts must not run while the snapshot is taken or restored. Guest memory
+ * pages that were never written are skipped, so the copy only takes up host
+ * memory for the pages the guest has used.
+ */
+int riscv_snapshot_take(struct riscv_snapshot * const restrict snap, struct bus * const bus,
+                        struct riscv_cpu * const * harts, size_t nharts)
+{
+  const struct bus_device * device;
+  struct dram * dram;
+  uint64_t offset, size;
+  size_t i, state;
+
+  if (snap == NULL || bus == NULL || bus->dram == NULL || (harts == NULL && nharts != 0))
+    return -1;
+
+  memset(snap, 0x0, sizeof(struct riscv_snapshot));
+  dram = bus->dram;
+
+  if (dram_track(dram) != 0)
+    return -1;
+
+  snap->bus = bus;
+  snap->harts = harts;
+  snap->nharts = nharts;
+  snap->size = dram->size;
+
+  snap->cpus = malloc(nharts * sizeof(struct riscv_cpu));
+  if (snap->cpus == NULL && nharts != 0)
+    goto fail;
+
+  snap->mem = mmap(NULL, dram->size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (snap->mem == MAP_FAILED)
+  {
+    snap->mem = NULL;
+    goto fail;
+  }
+
+  for (offset = 0; offset < dram->size; offset += SNAPSHOT_PAGE_SIZE)
+  {
+    size = (dram->size - offset < SNAPSHOT_PAGE_SIZE) ? dram->size - offset : SNAPSHOT_PAGE_SIZE;
+    if (!snapshot_page_zero(dram->mem + offset, size))
+      memcpy(snap->mem + offset, dram->mem + offset, size);
+  }
+
+  for (i = 0; i < bus->ndevices; i++)
+  {
+    if (bus->devices[i].save != NULL)
+      snap->devices_size += bus->devices[i].state_size;
+  }
+
+  if (snap->devices_size != 0)
+  {
+    snap->devices = malloc(snap->devices_size);
+    if (snap->devices == NULL)
+      goto fail;
+  }
+
+  for (i = 0, state = 0; i < bus->ndevices; i++)
+  {
+    device = &bus->devices[i];
+    if (device->save == NULL)
+      continue;
+
+    device->save(device->opaque, snap->devices + state);
+    state += device->state_size;
+  }
+
+  /*
+   * Stores through the TLB entries cached so far would not mark their page,
+   * so every hart has to fill its TLB again.
+   */
+  for (i = 0; i < nharts; i++)
+  {
+    memcpy(&snap->cpus[i], harts[i], sizeof(struct riscv_cpu));
+    riscv_mmu_flush(harts[i]);
+    riscv_mmu_update_mode(harts[i]);
+  }
+
+  return 0;
+
+fail:
+  riscv_snapshot_release(snap);
+  return -1;
+}
+
+static int snapshot_restore_page(void * arg, uint64_t offset)
+{
+  struct riscv_snapshot * const snap = arg;
+  uint64_t size = snap->size - offset;
+
+  if (size > SNAPSHOT_PAGE_SIZE)
+    size = SNAPSHOT_PAGE_SIZE;
+
+  memcpy(snap->bus->dram->mem + offset, snap->mem + offset, size);
+
+  return 0;
+}
+
+/*
+ * Put the machine back into the state of the snapshot. Only the pages
+ * written since the snapshot or the last restore are copied, so the cost
+ * follows what the guest touched rather than the size of guest memory.
+ */
+int riscv_snapshot_restore(struct riscv_snapshot * const restrict snap)
+{
+  const struct bus_device * device;
+  struct riscv_cpu * cpu;
+  struct riscv_block_cache * bcache;
+  void (*wake)(struct riscv_cpu *);
+  void * host;
+  struct bus * bus;
+  int64_t pages;
+  size_t i, state;
+#ifdef RISCV_PROFILE
+  struct riscv_profile * profile;
+#endif
+#ifdef RISCV_TRACE
+  struct riscv_trace * trace;
+#endif
+
+  if (snap == NULL || snap->bus == NULL || snap->mem == NULL)
+    return -1;
+
+  bus = snap->bus;
+
+  pages = dram_drain_dirty(bus->dram, snapshot_restore_page, snap);
+  if (pages < 0)
+    return -1;
+
+  snap->restored = pages;
+
+  for (i = 0, state = 0; i < bus->ndevices; i++)
+  {
+    device = &bus->devices[i];
+    if (device->save == NULL)
+      continue;
+
+    if (device->restore != NULL)
+      device->restore(device->opaque, snap->devices + state);
+    state += device->state_size;
+  }
+
+  // the host side resources of a hart are not part of its saved state
+  bus->time_floor = 0;
+  for (i = 0; i < snap->nharts; i++)
+  {
+    cpu = snap->harts[i];
+    bcache = cpu->bcache;
+    wake = cpu->wake;
+    host = cpu->host;
+#ifdef RISCV_PROFILE
+    profile = cpu->profile;
+#endif
+#ifdef RISCV_TRACE
+    trace = cpu->trace;
+#endif
+
+    memcpy(cpu, &snap->cpus[i], sizeof(struct riscv_cpu));
+
+    cpu->bus = bus;
+    cpu->bcache = bcache;
+    cpu->wake = wake;
+    cpu->host = host;
+#ifdef RISCV_PROFILE
+    cpu->profile = profile;
+#endif
+#ifdef RISCV_TRACE
+    cpu->trace = trace;
+#endif
+
+    // timers and interrupts follow the restored devices
+    cpu->kick = RISCV_KICK_EVENTS | RISCV_KICK_INTERRUPTS;
+
+    // no hart read later than its own restored clock
+    if (riscv_cpu_time(cpu) > bus->time_floor)
+      bus->time_floor = riscv_cpu_time(cpu);
+
+    snapshot_flush(cpu);
+  }
+
+  return 0;
+}
+
+int riscv_snapshot_release(struct riscv_snapshot * const restrict snap)
+{
+  if (snap == NULL)
+    return -1;
+
+  if (snap->mem != NULL)
+    munmap(snap->mem, snap->size);
+
+  free(snap->cpus);
+  free(snap->devices);
+  memset(snap, 0x0, sizeof(struct riscv_snapshot));
+
+  return 0;
+}
@@ -0,0 +1,41 @@
+/*
+  Copyright (c) 2024, Arka Mondal. All rights reserved.
+  Use of this source code is governed by a BSD-style license that
+  can be found in the LICENSE file.
+*/
+
+#ifndef _RISCVEMU_SNAPSHOT_H
+#define _RISCVEMU_SNAPSHOT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "cpu.h"
+#include "bus.h"
+
+/*
+ * Saved state of a machine: its harts, the devices on its bus and guest
+ * memory. Taking a snapshot turns on the dirty page tracking of the DRAM, a
+ * restore then only copies back the pages written since the snapshot (or
+ * since the previous restore), so it can be repeated cheaply.
+ */
+struct riscv_snapshot {
+  struct bus * bus;
+  struct riscv_cpu * const * harts;   // live harts, restored in place
+  struct riscv_cpu * cpus;            // their saved state
+  size_t nharts;
+
+  uint8_t * mem;                      // copy of guest memory, untouched pages stay unbacked
+  uint64_t size;
+
+  uint8_t * devices;                  // device states, back to back in bus order
+  size_t devices_size;
+
+  uint64_t restored;                  // pages copied back by the last restore
+};
+
+int riscv_snapshot_take(struct riscv_snapshot * const restrict, struct bus * const,
+                        struct riscv_cpu * const *, size_t);
+int riscv_snapshot_restore(struct riscv_snapshot * const restrict);
+int riscv_snapshot_release(struct riscv_snapshot * const restrict);
+
+#endif /* _RISCVEMU_SNAPSHOT_H */
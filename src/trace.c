@@ -0,0 +1,355 @@
+/*
+  Copyright (c) 2024, Arka Mondal. All rights reserved.
+  Use of this source code is governed by a BSD-style license that
+  can be found in the LICENSE file.
+*/
+
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "trace.h"
+
+#define TRACE_RECORD_MAX 25                 // flags, pc delta, instruction word, value delta
+#define TRACE_IDLE_NS 200000                // writer nap when every ring is empty
+
+/*
+ * Encoding of a record: a flags byte, then only what the decoder cannot
+ * work out from the records before it.
+ *
+ *   TRACE_JUMP       the pc is not right after the previous instruction (2 bytes on
+ *                    with RISCV_TRACE_COMPRESSED, else 4): zigzag varint of the difference
+ *   TRACE_NEW_INST   the word is not the one last seen at this pc: 4 bytes
+ *   RISCV_TRACE_WRITE  zigzag varint of the difference to the previous value of rd
+ *
+ * rd itself is not stored, it follows from the instruction word.
+ */
+#define TRACE_JUMP      0x10
+#define TRACE_NEW_INST  0x20
+
+/*
+ * The hart is ahead of the writer by a whole ring. If the writer has given
+ * up after a failed write, nothing will ever free a slot: the records of
+ * the ring are dropped instead, and the run goes on untraced in effect.
+ */
+void riscv_trace_wait(struct riscv_trace * const restrict trace)
+{
+  for (;;)
+  {
+    trace->tail_cache = __atomic_load_n(&trace->tail, __ATOMIC_ACQUIRE);
+    if (trace->head - trace->tail_cache < RISCV_TRACE_RING)
+      return;
+
+    if (__atomic_load_n(&trace->failed, __ATOMIC_ACQUIRE))
+    {
+      trace->tail_cache = trace->head;
+      return;
+    }
+
+    sched_yield();
+  }
+}
+
+static inline uint8_t * trace_put_varint(uint8_t * out, uint64_t value)
+{
+  while (value >= 0x80)
+  {
+    *out++ = (uint8_t) value | 0x80;
+    value >>= 7;
+  }
+
+  *out++ = (uint8_t) value;
+  return out;
+}
+
+static inline int trace_get_varint(const uint8_t ** p, const uint8_t * end, uint64_t * value)
+{
+  uint64_t result = 0;
+  unsigned int shift;
+
+  for (shift = 0; shift < 64 && *p < end; shift += 7)
+  {
+    result |= (uint64_t) (**p & 0x7f) << shift;
+    if (!(*(*p)++ & 0x80))
+    {
+      *value = result;
+      return 0;
+    }
+  }
+
+  return -1;
+}
+
+static inline uint64_t trace_zigzag(uint64_t delta)
+{
+  return (delta << 1) ^ (uint64_t) ((int64_t) delta >> 63);
+}
+
+static inline uint64_t trace_unzigzag(uint64_t value)
+{
+  return (value >> 1) ^ -(value & 1);
+}
+
+// encode record into out, returns the number of bytes (at most TRACE_RECORD_MAX)
+size_t riscv_trace_encode(struct riscv_trace_state * const restrict state,
+                          const struct riscv_trace_record * record, uint8_t * const restrict out)
+{
+  size_t slot = (record->pc >> 1) & (RISCV_TRACE_INSTS - 1);
+  uint8_t * p = out + 1;
+  uint8_t flags = record->flags;
+  uint8_t rd;
+
+  if (record->pc != state->pc)
+  {
+    flags |= TRACE_JUMP;
+    p = trace_put_varint(p, trace_zigzag(record->pc - state->pc));
+  }
+
+  if (state->inst_pc[slot] != record->pc || state->inst[slot] != record->inst)
+  {
+    flags |= TRACE_NEW_INST;
+    memcpy(p, &record->inst, sizeof(record->inst));
+    p += sizeof(record->inst);
+
+    state->inst_pc[slot] = record->pc;
+    state->inst[slot] = record->inst;
+  }
+
+  if (flags & RISCV_TRACE_WRITE)
+  {
+    rd = riscv_trace_rd(record->inst);
+    p = trace_put_varint(p, trace_zigzag(record->value - state->registers[rd]));
+    state->registers[rd] = record->value;
+  }
+
+  state->pc = record->pc + ((flags & RISCV_TRACE_COMPRESSED) ? 2 : 4);
+  out[0] = flags;
+
+  return p - out;
+}
+
+// decode the record at *p, returns -1 if it is cut short
+int riscv_trace_decode(struct riscv_trace_state * const restrict state, const uint8_t ** p,
+                       const uint8_t * end, struct riscv_trace_record * const restrict record)
+{
+  uint64_t value;
+  size_t slot;
+  uint8_t flags;
+
+  if (*p >= end)
+    return -1;
+
+  flags = *(*p)++;
+  record->pc = state->pc;
+
+  if (flags & TRACE_JUMP)
+  {
+    if (trace_get_varint(p, end, &value) != 0)
+      return -1;
+
+    record->pc = state->pc + trace_unzigzag(value);
+  }
+
+  slot = (record->pc >> 1) & (RISCV_TRACE_INSTS - 1);
+
+  if (flags & TRACE_NEW_INST)
+  {
+    if (end - *p < (ptrdiff_t) sizeof(record->inst))
+      return -1;
+
+    memcpy(&record->inst, *p, sizeof(record->inst));
+    *p += sizeof(record->inst);
+
+    state->inst_pc[slot] = record->pc;
+    state->inst[slot] = record->inst;
+  }
+  else
+  {
+    record->inst = state->inst[slot];
+  }
+
+  record->flags = flags & (RISCV_TRACE_WRITE | RISCV_TRACE_TRAP | RISCV_TRACE_COMPRESSED);
+  record->rd = riscv_trace_rd(record->inst);
+  record->value = 0;
+
+  if (flags & RISCV_TRACE_WRITE)
+  {
+    if (trace_get_varint(p, end, &value) != 0)
+      return -1;
+
+    record->value = state->registers[record->rd] + trace_unzigzag(value);
+    state->registers[record->rd] = record->value;
+  }
+
+  state->pc = record->pc + ((flags & RISCV_TRACE_COMPRESSED) ? 2 : 4);
+
+  return 0;
+}
+
+/*
+ * Encode up to RISCV_TRACE_CHUNK records of a ring into a chunk:
+ * hart, record count and byte count as 32-bit words, then the records.
+ * Returns the number of records, or -1 if the write failed.
+ */
+static int64_t trace_write_chunk(struct riscv_trace_writer * const restrict writer,
+                                 struct riscv_trace * const restrict trace)
+{
+  uint64_t head = __atomic_load_n(&trace->head, __ATOMIC_ACQUIRE);
+  uint64_t tail = trace->tail, i, count;
+  uint32_t header[3];
+  size_t size = 0;
+
+  count = head - tail;
+  if (count == 0)
+    return 0;
+
+  if (count > RISCV_TRACE_CHUNK)
+    count = RISCV_TRACE_CHUNK;
+
+  for (i = 0; i < count; i++)
+    size += riscv_trace_encode(&trace->state, &trace->ring[(tail + i) & (RISCV_TRACE_RING - 1)],
+                               writer->buffer + size);
+
+  // the records are copied out, the hart can have the slots back
+  __atomic_store_n(&trace->tail, tail + count, __ATOMIC_RELEASE);
+
+  header[0] = (uint32_t) trace->hart;
+  header[1] = (uint32_t) count;
+  header[2] = (uint32_t) size;
+
+  if (fwrite(header, sizeof(header), 1, writer->file) != 1
+      || fwrite(writer->buffer, 1, size, writer->file) != size)
+    return -1;
+
+  return count;
+}
+
+/*
+ * Writer thread: drain the rings round-robin, nap when they are all empty.
+ * After stop is set it keeps going until they are empty for good, the
+ * harts have stopped by then.
+ */
+static void * trace_writer_main(void * arg)
+{
+  struct riscv_trace_writer * const writer = arg;
+  const struct timespec nap = { .tv_sec = 0, .tv_nsec = TRACE_IDLE_NS };
+  int64_t written, total;
+  uint8_t stop;
+  size_t i;
+
+  for (;;)
+  {
+    stop = __atomic_load_n(&writer->stop, __ATOMIC_ACQUIRE);
+
+    for (i = 0, total = 0; i < writer->ntraces; i++)
+    {
+      written = trace_write_chunk(writer, writer->traces[i]);
+      if (written < 0)
+      {
+        writer->status = -1;
+
+        // no hart may wait for this thread any more
+        for (i = 0; i < writer->ntraces; i++)
+          __atomic_store_n(&writer->traces[i]->failed, 1, __ATOMIC_RELEASE);
+
+        return NULL;
+      }
+
+      total += written;
+    }
+
+    if (total == 0)
+    {
+      if (stop)
+        break;
+
+      nanosleep(&nap, NULL);
+    }
+  }
+
+  return NULL;
+}
+
+/*
+ * Create the trace file at path for ntraces harts and start the writer
+ * thread. writer->traces[i] is then hooked up as the trace of hart i.
+ */
+int riscv_trace_writer_open(struct riscv_trace_writer * const restrict writer, const char * path,
+                            size_t ntraces)
+{
+  uint64_t count = ntraces;
+  size_t i;
+
+  if (writer == NULL || path == NULL)
+    return -1;
+
+  memset(writer, 0x0, sizeof(struct riscv_trace_writer));
+
+  writer->traces = calloc(ntraces, sizeof(struct riscv_trace *));
+  writer->buffer = malloc(RISCV_TRACE_CHUNK * TRACE_RECORD_MAX);
+  if (writer->traces == NULL || writer->buffer == NULL)
+    goto fail;
+
+  writer->ntraces = ntraces;
+
+  for (i = 0; i < ntraces; i++)
+  {
+    writer->traces[i] = calloc(1, sizeof(struct riscv_trace));
+    if (writer->traces[i] == NULL)
+      goto fail;
+
+    writer->traces[i]->hart = i;
+  }
+
+  writer->file = fopen(path, "wb");
+  if (writer->file == NULL)
+    goto fail;
+
+  if (fwrite(RISCV_TRACE_MAGIC, 8, 1, writer->file) != 1
+      || fwrite(&count, sizeof(count), 1, writer->file) != 1)
+    goto fail;
+
+  if (pthread_create(&writer->thread, NULL, trace_writer_main, writer) != 0)
+    goto fail;
+
+  return 0;
+
+fail:
+  if (writer->file != NULL)
+    fclose(writer->file);
+
+  for (i = 0; writer->traces != NULL && i < ntraces; i++)
+    free(writer->traces[i]);
+
+  free(writer->traces);
+  free(writer->buffer);
+  memset(writer, 0x0, sizeof(struct riscv_trace_writer));
+
+  return -1;
+}
+
+// drain what is left once the harts have stopped and close the file
+int riscv_trace_writer_close(struct riscv_trace_writer * const restrict writer)
+{
+  int status;
+  size_t i;
+
+  if (writer == NULL || writer->file == NULL)
+    return -1;
+
+  __atomic_store_n(&writer->stop, 1, __ATOMIC_RELEASE);
+  pthread_join(writer->thread, NULL);
+
+  status = writer->status;
+  if (fclose(writer->file) != 0)
+    status = -1;
+
+  for (i = 0; i < writer->ntraces; i++)
+    free(writer->traces[i]);
+
+  free(writer->traces);
+  free(writer->buffer);
+  memset(writer, 0x0, sizeof(struct riscv_trace_writer));
+
+  return status;
+}
@@ -0,0 +1,152 @@
+/*
+  Copyright (c) 2024, Arka Mondal. All rights reserved.
+  Use of this source code is governed by a BSD-style license that
+  can be found in the LICENSE file.
+*/
+
+#ifndef _RISCVEMU_TRACE_H
+#define _RISCVEMU_TRACE_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define RISCV_TRACE_MAGIC "RVTRACE2"
+#define RISCV_TRACE_RING (1UL << 16)        // records buffered per hart, power of 2
+#define RISCV_TRACE_CHUNK 4096              // records encoded into one chunk at most
+#define RISCV_TRACE_INSTS 4096              // instruction words remembered by pc, power of 2
+
+// flags of a record
+#define RISCV_TRACE_WRITE 0x1               // rd was written, value holds the result
+#define RISCV_TRACE_TRAP  0x2               // the instruction raised an exception
+#define RISCV_TRACE_COMPRESSED 0x4          // a 16-bit instruction, inst is its expansion
+
+// one executed instruction
+struct riscv_trace_record {
+  uint64_t pc;
+  uint64_t value;
+  uint32_t inst;
+  uint8_t rd;
+  uint8_t flags;
+};
+
+/*
+ * What the encoder and the decoder both track for a hart, so that a record
+ * only needs what cannot be predicted from the ones before it.
+ */
+struct riscv_trace_state {
+  uint64_t pc;                              // where the previous record falls through to
+  uint64_t registers[32];                   // last value written to each register
+  uint64_t inst_pc[RISCV_TRACE_INSTS];      // instruction word last seen at a pc, by pc
+  uint32_t inst[RISCV_TRACE_INSTS];
+};
+
+/*
+ * Trace of a hart: a single-producer single-consumer ring. The hart fills
+ * in the record at head and publishes it, the writer thread encodes what
+ * lies between tail and head. The two sides only share the indices.
+ */
+struct riscv_trace {
+  struct riscv_trace_record ring[RISCV_TRACE_RING];
+  uint64_t head __attribute__ ((aligned (64)));   // written by the hart
+  uint64_t tail_cache;                            // the hart's last look at tail
+  uint64_t tail __attribute__ ((aligned (64)));   // written by the writer thread
+  uint8_t failed;                                 // set by the writer once it gave up
+  uint64_t hart;
+  struct riscv_trace_state state;                 // encoder side
+};
+
+struct riscv_trace_writer {
+  FILE * file;
+  struct riscv_trace ** traces;
+  size_t ntraces;
+  uint8_t * buffer;                         // one encoded chunk
+  pthread_t thread;
+  uint8_t stop;
+  int status;                               // -1 once a write failed
+};
+
+#ifdef RISCV_TRACE
+/*
+ * Hooks around a micro-op handler: BEGIN claims the record at head, END
+ * completes it with the result and publishes it. cpu->pc is still the pc of
+ * the instruction when BEGIN runs.
+ */
+#define RISCV_TRACE_BEGIN(cpu, uop) \
+  do { if ((cpu)->trace != NULL) riscv_trace_begin((cpu)->trace, (cpu)->pc, (uop)->inst, (uop)->len); } while (0)
+#define RISCV_TRACE_END(cpu) \
+  do { if ((cpu)->trace != NULL) riscv_trace_end((cpu)->trace, (cpu)->registers, (cpu)->trap); } while (0)
+#else
+#define RISCV_TRACE_BEGIN(cpu, uop) ((void) 0)
+#define RISCV_TRACE_END(cpu) ((void) 0)
+#endif
+
+void riscv_trace_wait(struct riscv_trace * const restrict);
+int riscv_trace_writer_open(struct riscv_trace_writer * const restrict, const char *, size_t);
+int riscv_trace_writer_close(struct riscv_trace_writer * const restrict);
+size_t riscv_trace_encode(struct riscv_trace_state * const restrict, const struct riscv_trace_record *,
+                          uint8_t * const restrict);
+int riscv_trace_decode(struct riscv_trace_state * const restrict, const uint8_t **, const uint8_t *,
+                       struct riscv_trace_record * const restrict);
+
+// destination register of an instruction, 0 if it has none
+static inline uint8_t riscv_trace_rd(uint32_t inst)
+{
+  switch (inst & 0x7f)
+  {
+    case 0x23:                              // stores
+    case 0x27:
+    case 0x63:                              // branches
+    case 0x0f:                              // fences
+      return 0;
+
+    case 0x07:                              // FP loads and multiply-adds write f
+    case 0x43:
+    case 0x47:
+    case 0x4b:
+    case 0x4f:
+      return 0;
+
+    case 0x53:                              // compares, FCVT.int, FMV.X and FCLASS write x
+      if ((inst >> 27) != 0x14 && (inst >> 27) != 0x18 && (inst >> 27) != 0x1c)
+        return 0;
+      break;
+
+    case 0x73:                              // ecall, ebreak, xret, wfi, sfence.vma
+      if (((inst >> 12) & 0x7) == 0)
+        return 0;
+      break;
+  }
+
+  return (inst >> 7) & 0x1f;
+}
+
+static inline void riscv_trace_begin(struct riscv_trace * const restrict trace, uint64_t pc,
+                                     uint32_t inst, uint8_t len)
+{
+  struct riscv_trace_record * record;
+
+  // the ring is full, wait for the writer rather than drop anything while it still writes
+  if (trace->head - trace->tail_cache == RISCV_TRACE_RING)
+    riscv_trace_wait(trace);
+
+  record = &trace->ring[trace->head & (RISCV_TRACE_RING - 1)];
+  record->pc = pc;
+  record->inst = inst;
+  record->rd = riscv_trace_rd(inst);
+  record->flags = (len == 2) ? RISCV_TRACE_COMPRESSED : 0;
+}
+
+static inline void riscv_trace_end(struct riscv_trace * const restrict trace,
+                                   const uint64_t * const restrict registers, uint8_t trap)
+{
+  struct riscv_trace_record * record = &trace->ring[trace->head & (RISCV_TRACE_RING - 1)];
+
+  record->flags |= trap ? RISCV_TRACE_TRAP : (record->rd != 0) ? RISCV_TRACE_WRITE : 0;
+  record->value = registers[record->rd];
+
+  __atomic_store_n(&trace->head, trace->head + 1, __ATOMIC_RELEASE);
+}
+
+#endif /* _RISCVEMU_TRACE_H */
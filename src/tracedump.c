@@ -0,0 +1,128 @@
+/*
+  Copyright (c) 2024, Arka Mondal. All rights reserved.
+  Use of this source code is governed by a BSD-style license that
+  can be found in the LICENSE file.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "trace.h"
+#include "util.h"
+
+#define TRACEDUMP_MAX_HARTS 64
+
+/*
+ * Print a trace written with -t as text, one line per instruction in the
+ * order each hart executed them: the hart, the pc, the instruction word (the
+ * expansion of a compressed one, marked c) and the register it wrote or the
+ * trap it raised. The chunks of different harts
+ * are interleaved in the order the writer thread drained them.
+ */
+int main(int argc, char * argv[])
+{
+  struct riscv_trace_state * states;
+  struct riscv_trace_record record;
+  char magic[8];
+  uint32_t header[3];
+  uint64_t ntraces, hart = UINT64_MAX, count = 0;
+  const uint8_t * p;
+  uint8_t * buffer;
+  size_t size = 0;
+  FILE * file;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "h:")) != -1)
+  {
+    switch (opt)
+    {
+      case 'h':
+        if (parse_size(optarg, &hart) != 0)
+          goto usage;
+        break;
+
+      default:
+        goto usage;
+    }
+  }
+
+  if (optind != argc - 1)
+    goto usage;
+
+  file = fopen(argv[optind], "rb");
+  if (file == NULL || fread(magic, sizeof(magic), 1, file) != 1
+      || memcmp(magic, RISCV_TRACE_MAGIC, sizeof(magic)) != 0
+      || fread(&ntraces, sizeof(ntraces), 1, file) != 1 || ntraces > TRACEDUMP_MAX_HARTS)
+  {
+    fprintf(stderr, "%s: not a trace\n", argv[optind]);
+    return EXIT_FAILURE;
+  }
+
+  states = calloc(ntraces, sizeof(struct riscv_trace_state));
+  buffer = NULL;
+  if (states == NULL)
+  {
+    fprintf(stderr, "cannot allocate %lu harts\n", ntraces);
+    return EXIT_FAILURE;
+  }
+
+  while (fread(header, sizeof(header), 1, file) == 1)
+  {
+    if (header[0] >= ntraces)
+      goto corrupt;
+
+    if (header[2] > size)
+    {
+      free(buffer);
+      size = header[2];
+      buffer = malloc(size);
+      if (buffer == NULL)
+        goto corrupt;
+    }
+
+    if (fread(buffer, 1, header[2], file) != header[2])
+      goto corrupt;
+
+    for (p = buffer; header[1] != 0; header[1]--, count++)
+    {
+      if (riscv_trace_decode(&states[header[0]], &p, buffer + header[2], &record) != 0)
+        goto corrupt;
+
+      if (hart != UINT64_MAX && header[0] != hart)
+        continue;
+
+      printf("%u %016lx %08x", header[0], record.pc, record.inst);
+
+      if (record.flags & RISCV_TRACE_COMPRESSED)
+        printf(" c");
+
+      if (record.flags & RISCV_TRACE_WRITE)
+        printf(" x%u %016lx", record.rd, record.value);
+      else if (record.flags & RISCV_TRACE_TRAP)
+        printf(" trap");
+
+      putchar('\n');
+    }
+  }
+
+  fclose(file);
+  free(buffer);
+  free(states);
+
+  fprintf(stderr, "%lu instructions\n", count);
+
+  return EXIT_SUCCESS;
+
+corrupt:
+  fprintf(stderr, "%s: trace is cut short after %lu instructions\n", argv[optind], count);
+  fclose(file);
+  free(buffer);
+  free(states);
+
+  return EXIT_FAILURE;
+
+usage:
+  fprintf(stderr, "usage: %s [-h hart] <trace>\n", argv[0]);
+  return EXIT_FAILURE;
+}
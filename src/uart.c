@@ -0,0 +1,452 @@
+/*
+  Copyright (c) 2024, Arka Mondal. All rights reserved.
+  Use of this source code is governed by a BSD-style license that
+  can be found in the LICENSE file.
+*/
+
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "uart.h"
+
+// registers, DLL and DLM replace RBR/THR and IER while LCR.DLAB is set
+#define UART_RBR 0
+#define UART_THR 0
+#define UART_IER 1
+#define UART_IIR 2
+#define UART_FCR 2
+#define UART_LCR 3
+#define UART_MCR 4
+#define UART_LSR 5
+#define UART_MSR 6
+#define UART_SCR 7
+
+#define UART_IER_RDI 0x1                  // received data available
+#define UART_IER_THRI 0x2                 // transmitter holding register empty
+#define UART_IER_RLSI 0x4                 // receiver line status
+
+#define UART_IIR_NONE 0x1
+#define UART_IIR_RLSI 0x6
+#define UART_IIR_RDI 0x4
+#define UART_IIR_THRI 0x2
+#define UART_IIR_FIFO 0xc0
+
+#define UART_FCR_ENABLE 0x1
+#define UART_FCR_CLEAR_RX 0x2
+
+#define UART_LCR_DLAB 0x80
+#define UART_MCR_LOOP 0x10
+
+#define UART_LSR_DR 0x1
+#define UART_LSR_OE 0x2
+#define UART_LSR_THRE 0x20
+#define UART_LSR_TEMT 0x40
+
+// write out the host side buffer, lock held
+static void uart_flush(struct uart * const restrict uart)
+{
+  size_t done = 0;
+  ssize_t n;
+
+  while (done < uart->tx_count)
+  {
+    n = write(STDOUT_FILENO, uart->tx + done, uart->tx_count - done);
+    if (n < 0 && errno == EINTR)
+      continue;
+
+    // nowhere to put the output, it is dropped as a real line would drop it
+    if (n <= 0)
+      break;
+
+    done += n;
+  }
+
+  uart->tx_count = 0;
+}
+
+// the highest priority interrupt pending, as IIR identifies it
+static uint8_t uart_pending(const struct uart * const restrict uart)
+{
+  const struct uart_state * const state = &uart->state;
+
+  if ((state->ier & UART_IER_RLSI) && state->overrun)
+    return UART_IIR_RLSI;
+
+  if ((state->ier & UART_IER_RDI) && state->rx_count != 0)
+    return UART_IIR_RDI;
+
+  if ((state->ier & UART_IER_THRI) && state->thre)
+    return UART_IIR_THRI;
+
+  return UART_IIR_NONE;
+}
+
+// guests poll the LSR, only a change of the line goes to the PLIC
+static inline void uart_update(struct uart * const restrict uart)
+{
+  int irq = uart_pending(uart) != UART_IIR_NONE;
+
+  if (irq != uart->irq)
+  {
+    uart->irq = irq;
+    plic_set_irq(uart->plic, UART_IRQ, irq);
+  }
+}
+
+static void uart_receive(struct uart * const restrict uart, uint8_t byte)
+{
+  struct uart_state * const state = &uart->state;
+
+  if (state->rx_count == UART_FIFO_SIZE)
+  {
+    state->overrun = 1;
+    return;
+  }
+
+  state->rx[(state->rx_head + state->rx_count) % UART_FIFO_SIZE] = byte;
+  state->rx_count++;
+}
+
+static void uart_transmit(struct uart * const restrict uart, uint8_t byte)
+{
+  // the byte is gone as soon as it is written, the holding register is empty again
+  uart->state.thre = 1;
+
+  if (uart->state.mcr & UART_MCR_LOOP)
+  {
+    uart_receive(uart, byte);
+    return;
+  }
+
+  uart->tx[uart->tx_count++] = byte;
+  if (byte == '\n' || uart->tx_count == UART_TX_BUFFER)
+    uart_flush(uart);
+}
+
+static int uart_load(void * opaque, uint64_t offset, uint64_t size, uint64_t * value)
+{
+  struct uart * const uart = opaque;
+  struct uart_state * const state = &uart->state;
+  uint8_t iir;
+
+  if (size != 1)
+    return -1;
+
+  pthread_mutex_lock(&uart->lock);
+
+  switch (offset)
+  {
+    case UART_RBR:
+      if (state->lcr & UART_LCR_DLAB)
+      {
+        *value = state->dll;
+        break;
+      }
+
+      *value = 0;
+      if (state->rx_count != 0)
+      {
+        *value = state->rx[state->rx_head];
+        state->rx_head = (state->rx_head + 1) % UART_FIFO_SIZE;
+        state->rx_count--;
+        pthread_cond_signal(&uart->room);
+      }
+      break;
+
+    case UART_IER:
+      *value = (state->lcr & UART_LCR_DLAB) ? state->dlm : state->ier;
+      break;
+
+    case UART_IIR:
+      iir = uart_pending(uart);
+
+      // reading the identification of a THR empty interrupt acknowledges it
+      if (iir == UART_IIR_THRI)
+        state->thre = 0;
+
+      *value = iir | ((state->fcr & UART_FCR_ENABLE) ? UART_IIR_FIFO : 0);
+      break;
+
+    case UART_LCR:
+      *value = state->lcr;
+      break;
+
+    case UART_MCR:
+      *value = state->mcr;
+      break;
+
+    case UART_LSR:
+      *value = UART_LSR_THRE | UART_LSR_TEMT | ((state->rx_count != 0) ? UART_LSR_DR : 0)
+        | (state->overrun ? UART_LSR_OE : 0);
+      state->overrun = 0;
+      break;
+
+    case UART_MSR:
+      // carrier detect, data set ready and clear to send: a terminal is always there
+      *value = 0xb0;
+      break;
+
+    case UART_SCR:
+      *value = state->scr;
+      break;
+
+    default:
+      *value = 0;
+      break;
+  }
+
+  uart_update(uart);
+
+  pthread_mutex_unlock(&uart->lock);
+
+  return 0;
+}
+
+static int uart_store(void * opaque, uint64_t offset, uint64_t size, uint64_t value)
+{
+  struct uart * const uart = opaque;
+  struct uart_state * const state = &uart->state;
+
+  if (size != 1)
+    return -1;
+
+  pthread_mutex_lock(&uart->lock);
+
+  switch (offset)
+  {
+    case UART_THR:
+      if (state->lcr & UART_LCR_DLAB)
+        state->dll = value;
+      else
+        uart_transmit(uart, value);
+      break;
+
+    case UART_IER:
+      if (state->lcr & UART_LCR_DLAB)
+      {
+        state->dlm = value;
+        break;
+      }
+
+      // enabling the THR empty interrupt raises it right away, the register is empty
+      if ((value & UART_IER_THRI) && (state->ier & UART_IER_THRI) == 0)
+        state->thre = 1;
+
+      state->ier = value & 0xf;
+      break;
+
+    case UART_FCR:
+      state->fcr = value & UART_FCR_ENABLE;
+      if (value & UART_FCR_CLEAR_RX)
+      {
+        state->rx_count = 0;
+        pthread_cond_signal(&uart->room);
+      }
+      break;
+
+    case UART_LCR:
+      state->lcr = value;
+      break;
+
+    case UART_MCR:
+      state->mcr = value & 0x1f;
+      break;
+
+    case UART_SCR:
+      state->scr = value;
+      break;
+
+    default:
+      break;
+  }
+
+  uart_update(uart);
+
+  pthread_mutex_unlock(&uart->lock);
+
+  return 0;
+}
+
+/*
+ * Feeds the receive FIFO from stdin and writes out partial lines that have
+ * waited long enough. It reads no more than the FIFO has room for and waits
+ * for the guest to drain it, so no input is lost to an overrun.
+ */
+static void * uart_io(void * arg)
+{
+  struct uart * const uart = arg;
+  struct uart_state * const state = &uart->state;
+  struct pollfd fds[2];
+  struct timespec deadline;
+  uint8_t buffer[UART_FIFO_SIZE];
+  ssize_t n, i;
+  size_t room;
+
+  fds[0].fd = STDIN_FILENO;
+  fds[0].events = POLLIN;
+  fds[1].fd = uart->wake[0];
+  fds[1].events = POLLIN;
+
+  pthread_mutex_lock(&uart->lock);
+
+  while (!uart->stop)
+  {
+    room = UART_FIFO_SIZE - state->rx_count;
+
+    if (uart->eof || room == 0)
+    {
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_nsec += UART_FLUSH_MS * 1000000L;
+      if (deadline.tv_nsec >= 1000000000L)
+      {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+      }
+
+      pthread_cond_timedwait(&uart->room, &uart->lock, &deadline);
+      uart_flush(uart);
+      continue;
+    }
+
+    pthread_mutex_unlock(&uart->lock);
+
+    n = 0;
+    if (poll(fds, 2, UART_FLUSH_MS) > 0 && (fds[0].revents & (POLLIN | POLLHUP | POLLERR | POLLNVAL)))
+    {
+      // a closed stdin is at its end as well, poll would report it at once forever
+      if (fds[0].revents & POLLNVAL)
+        uart->eof = 1;
+      else
+        n = read(STDIN_FILENO, buffer, room);
+
+      if (n == 0 || (n < 0 && errno != EINTR && errno != EAGAIN))
+        uart->eof = 1;
+    }
+
+    pthread_mutex_lock(&uart->lock);
+
+    for (i = 0; i < n; i++)
+      uart_receive(uart, buffer[i]);
+
+    if (n > 0)
+      uart_update(uart);
+
+    uart_flush(uart);
+  }
+
+  pthread_mutex_unlock(&uart->lock);
+
+  return NULL;
+}
+
+static void uart_save(void * opaque, void * state)
+{
+  struct uart * const uart = opaque;
+
+  pthread_mutex_lock(&uart->lock);
+  uart_flush(uart);
+  memcpy(state, &uart->state, sizeof(struct uart_state));
+  pthread_mutex_unlock(&uart->lock);
+}
+
+static void uart_restore(void * opaque, const void * state)
+{
+  struct uart * const uart = opaque;
+
+  pthread_mutex_lock(&uart->lock);
+  memcpy(&uart->state, state, sizeof(struct uart_state));
+  uart->irq = -1;
+  uart_update(uart);
+  pthread_cond_signal(&uart->room);
+  pthread_mutex_unlock(&uart->lock);
+}
+
+// stop the I/O thread and wait for it
+static void uart_stop(struct uart * const restrict uart)
+{
+  pthread_mutex_lock(&uart->lock);
+  uart->stop = 1;
+  pthread_cond_signal(&uart->room);
+  pthread_mutex_unlock(&uart->lock);
+
+  // the thread may be in poll, not waiting on the condition
+  while (write(uart->wake[1], "", 1) < 0 && errno == EINTR)
+    ;
+
+  pthread_join(uart->io, NULL);
+}
+
+/*
+ * Attach the console to the bus and start its I/O thread. Its interrupt
+ * goes through the PLIC.
+ */
+int uart_init(struct uart * const restrict uart, struct bus * const restrict bus,
+              struct plic * const restrict plic)
+{
+  struct bus_device device;
+
+  if (uart == NULL || bus == NULL || plic == NULL)
+    return -1;
+
+  memset(uart, 0x0, sizeof(struct uart));
+  uart->plic = plic;
+
+  if (pipe(uart->wake) != 0)
+    return -1;
+
+  if (pthread_mutex_init(&uart->lock, NULL) != 0)
+    goto fail_pipe;
+
+  if (pthread_cond_init(&uart->room, NULL) != 0)
+    goto fail_lock;
+
+  memset(&device, 0x0, sizeof(device));
+  device.name = "uart";
+  device.base = UART_BASE;
+  device.size = UART_SIZE;
+  device.opaque = uart;
+  device.load = uart_load;
+  device.store = uart_store;
+  device.state_size = sizeof(struct uart_state);
+  device.save = uart_save;
+  device.restore = uart_restore;
+
+  if (pthread_create(&uart->io, NULL, uart_io, uart) != 0)
+    goto fail_cond;
+
+  // the guest only gets to see the device once its I/O thread runs
+  if (bus_register(bus, &device) != 0)
+    goto fail_io;
+
+  return 0;
+
+fail_io:
+  uart_stop(uart);
+fail_cond:
+  pthread_cond_destroy(&uart->room);
+fail_lock:
+  pthread_mutex_destroy(&uart->lock);
+fail_pipe:
+  close(uart->wake[0]);
+  close(uart->wake[1]);
+
+  return -1;
+}
+
+// stops the I/O thread and writes out what the guest left in the buffer
+int uart_deinit(struct uart * const restrict uart)
+{
+  if (uart == NULL)
+    return -1;
+
+  uart_stop(uart);
+  uart_flush(uart);
+  pthread_cond_destroy(&uart->room);
+  pthread_mutex_destroy(&uart->lock);
+  close(uart->wake[0]);
+  close(uart->wake[1]);
+
+  return 0;
+}
@@ -0,0 +1,68 @@
+/*
+  Copyright (c) 2024, Arka Mondal. All rights reserved.
+  Use of this source code is governed by a BSD-style license that
+  can be found in the LICENSE file.
+*/
+
+#ifndef _RISCVEMU_UART_H
+#define _RISCVEMU_UART_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "bus.h"
+#include "plic.h"
+
+// NS16550A compatible UART, where QEMU's virt machine has it
+#define UART_BASE 0x10000000UL
+#define UART_SIZE 0x100UL
+#define UART_IRQ 10
+
+#define UART_FIFO_SIZE 16                 // receive FIFO of a 16550
+#define UART_TX_BUFFER 4096               // host side output, written out when full
+#define UART_FLUSH_MS 20                  // longest an unterminated line waits in it
+
+// what a snapshot of the UART holds, output is written out before it is taken
+struct uart_state {
+  uint8_t ier;
+  uint8_t lcr;
+  uint8_t mcr;
+  uint8_t scr;
+  uint8_t fcr;
+  uint8_t dll;
+  uint8_t dlm;
+  uint8_t overrun;                        // LSR OE, until the LSR is read
+  uint8_t thre;                           // THR empty interrupt pending
+  uint8_t rx[UART_FIFO_SIZE];
+  uint8_t rx_head;
+  uint8_t rx_count;
+};
+
+/*
+ * The console. Transmitted bytes go into a host buffer that is written to
+ * stdout at a newline, when it fills up, or by the I/O thread when a partial
+ * line has waited UART_FLUSH_MS, so the guest costs one write per line and
+ * not one per byte. The transmitter never holds a byte back: THRE and TEMT
+ * are always set.
+ *
+ * The I/O thread also polls stdin and feeds the receive FIFO, never reading
+ * more than fits in it, so the harts never block on the host's input.
+ */
+struct uart {
+  struct plic * plic;
+  pthread_mutex_t lock;
+  pthread_cond_t room;                    // signaled when the guest drains the FIFO
+  struct uart_state state;
+  uint8_t tx[UART_TX_BUFFER];
+  size_t tx_count;
+  int irq;                                // level of the interrupt line
+  pthread_t io;
+  int wake[2];                            // pipe that interrupts the I/O thread's poll
+  int eof;                                // stdin is exhausted
+  int stop;
+};
+
+int uart_init(struct uart * const restrict, struct bus * const restrict, struct plic * const restrict);
+int uart_deinit(struct uart * const restrict);
+
+#endif /* _RISCVEMU_UART_H */
@@ -19,3 +19,38 @@ void hart_panic(const char * restrict format, ...)
 
   exit(EXIT_FAILURE);
 }
+
+// parse a byte count with an optional K, M or G suffix
+int parse_size(const char * str, uint64_t * size)
+{
+  char * end;
+  uint64_t value;
+
+  if (str == NULL || size == NULL)
+    return -1;
+
+  value = strtoull(str, &end, 0);
+  if (end == str)
+    return -1;
+
+  switch (*end)
+  {
+    case 'G': case 'g':
+      value <<= 10;
+      /* fall through */
+    case 'M': case 'm':
+      value <<= 10;
+      /* fall through */
+    case 'K': case 'k':
+      value <<= 10;
+      end++;
+      break;
+  }
+
+  if (*end != '\0')
+    return -1;
+
+  *size = value;
+
+  return 0;
+}
@@ -13,6 +13,9 @@
 #define NORETURN
 #endif
 
+#include <stdint.h>
+
 void hart_panic(const char * restrict format, ...) NORETURN ;
+int parse_size(const char *, uint64_t *);
 
 #endif
@@ -0,0 +1,716 @@
+/*
+  Copyright (c) 2024, Arka Mondal. All rights reserved.
+  Use of this source code is governed by a BSD-style license that
+  can be found in the LICENSE file.
+*/
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "virtio_blk.h"
+
+// virtio-mmio registers
+#define VIRTIO_MMIO_MAGIC 0x000
+#define VIRTIO_MMIO_VERSION 0x004
+#define VIRTIO_MMIO_DEVICE_ID 0x008
+#define VIRTIO_MMIO_VENDOR_ID 0x00c
+#define VIRTIO_MMIO_DEVICE_FEATURES 0x010
+#define VIRTIO_MMIO_DEVICE_FEATURES_SEL 0x014
+#define VIRTIO_MMIO_DRIVER_FEATURES 0x020
+#define VIRTIO_MMIO_DRIVER_FEATURES_SEL 0x024
+#define VIRTIO_MMIO_QUEUE_SEL 0x030
+#define VIRTIO_MMIO_QUEUE_NUM_MAX 0x034
+#define VIRTIO_MMIO_QUEUE_NUM 0x038
+#define VIRTIO_MMIO_QUEUE_READY 0x044
+#define VIRTIO_MMIO_QUEUE_NOTIFY 0x050
+#define VIRTIO_MMIO_INTERRUPT_STATUS 0x060
+#define VIRTIO_MMIO_INTERRUPT_ACK 0x064
+#define VIRTIO_MMIO_STATUS 0x070
+#define VIRTIO_MMIO_QUEUE_DESC_LOW 0x080
+#define VIRTIO_MMIO_QUEUE_DESC_HIGH 0x084
+#define VIRTIO_MMIO_QUEUE_DRIVER_LOW 0x090
+#define VIRTIO_MMIO_QUEUE_DRIVER_HIGH 0x094
+#define VIRTIO_MMIO_QUEUE_DEVICE_LOW 0x0a0
+#define VIRTIO_MMIO_QUEUE_DEVICE_HIGH 0x0a4
+#define VIRTIO_MMIO_CONFIG_GENERATION 0x0fc
+#define VIRTIO_MMIO_CONFIG 0x100
+
+#define VIRTIO_MAGIC 0x74726976           // "virt"
+#define VIRTIO_VENDOR 0x554d4551          // "QEMU", what guests expect to see here
+#define VIRTIO_ID_BLOCK 2
+
+#define VIRTIO_STATUS_FEATURES_OK 0x8
+#define VIRTIO_F_VERSION_1 (1UL << 32)
+#define VIRTIO_BLK_F_RO (1UL << 5)
+#define VIRTIO_BLK_F_FLUSH (1UL << 9)
+
+#define VIRTQ_DESC_F_NEXT 0x1
+#define VIRTQ_DESC_F_WRITE 0x2
+#define VIRTQ_DESC_F_INDIRECT 0x4
+#define VIRTQ_AVAIL_F_NO_INTERRUPT 0x1
+
+#define VIRTIO_BLK_T_IN 0
+#define VIRTIO_BLK_T_OUT 1
+#define VIRTIO_BLK_T_FLUSH 4
+#define VIRTIO_BLK_T_GET_ID 8
+
+#define VIRTIO_BLK_S_OK 0
+#define VIRTIO_BLK_S_IOERR 1
+#define VIRTIO_BLK_S_UNSUPP 2
+
+#define VIRTIO_BLK_ID "riscvemu-blk"
+#define VIRTIO_BLK_ID_SIZE 20
+
+struct virtq_desc {
+  uint64_t addr;
+  uint32_t len;
+  uint16_t flags;
+};
+
+// pages of the image written by a pass, to be synced before it completes
+struct virtio_blk_range {
+  uint64_t start;
+  uint64_t end;
+};
+
+static inline uint16_t virtio_load16(const uint8_t * p)
+{
+  uint16_t data;
+
+  memcpy(&data, p, sizeof(data));
+  return DRAM_LE16(data);
+}
+
+static inline uint32_t virtio_load32(const uint8_t * p)
+{
+  uint32_t data;
+
+  memcpy(&data, p, sizeof(data));
+  return DRAM_LE32(data);
+}
+
+static inline uint64_t virtio_load64(const uint8_t * p)
+{
+  uint64_t data;
+
+  memcpy(&data, p, sizeof(data));
+  return DRAM_LE64(data);
+}
+
+static inline uint64_t virtio_device_features(const struct virtio_blk * const restrict blk)
+{
+  uint64_t features = VIRTIO_F_VERSION_1;
+
+  if (blk->flags & VIRTIO_BLK_READONLY)
+    features |= VIRTIO_BLK_F_RO;
+
+  // without a write cache to flush the driver treats the device as write-through
+  if (blk->flags & VIRTIO_BLK_WRITEBACK)
+    features |= VIRTIO_BLK_F_FLUSH;
+
+  return features;
+}
+
+// the rings of the queue in host memory, -1 unless all of them are in guest memory
+static int virtio_blk_rings(struct virtio_blk * const restrict blk, uint8_t ** desc, uint8_t ** avail,
+                            uint8_t ** used)
+{
+  const struct virtio_blk_state * const state = &blk->state;
+  uint64_t num = state->queue_num;
+
+  if (!state->queue_ready || num == 0 || (state->queue_desc & 0xf) != 0
+      || (state->queue_driver & 0x1) != 0 || (state->queue_device & 0x3) != 0)
+    return -1;
+
+  *desc = dram_ptr(blk->dram, state->queue_desc, 16 * num);
+  *avail = dram_ptr(blk->dram, state->queue_driver, 4 + 2 * num);
+  *used = dram_ptr(blk->dram, state->queue_device, 4 + 8 * num);
+
+  return (*desc == NULL || *avail == NULL || *used == NULL) ? -1 : 0;
+}
+
+// put a served chain on the used ring, the driver sees it at the next publish
+static void virtio_blk_complete(struct virtio_blk * const restrict blk, uint8_t * used, uint16_t head,
+                                uint32_t len)
+{
+  struct virtio_blk_state * const state = &blk->state;
+  uint64_t slot = state->used_idx % state->queue_num;
+  uint32_t elem[2] = { DRAM_LE32((uint32_t) head), DRAM_LE32(len) };
+
+  memcpy(used + 4 + 8 * slot, elem, sizeof(elem));
+  dram_mark_dma(blk->dram, state->queue_device + 4 + 8 * slot, sizeof(elem));
+
+  state->used_idx++;
+}
+
+// make the completions visible and interrupt the driver once for all of them
+static void virtio_blk_publish(struct virtio_blk * const restrict blk, uint8_t * avail, uint8_t * used)
+{
+  struct virtio_blk_state * const state = &blk->state;
+
+  __atomic_store_n((uint16_t *) (used + 2), DRAM_LE16(state->used_idx), __ATOMIC_RELEASE);
+  dram_mark_dma(blk->dram, state->queue_device + 2, sizeof(uint16_t));
+
+  if (virtio_load16(avail) & VIRTQ_AVAIL_F_NO_INTERRUPT)
+    return;
+
+  state->interrupt |= 0x1;
+  plic_set_irq(blk->plic, VIRTIO_BLK_IRQ, 1);
+}
+
+/*
+ * Copy the data descriptors of a request between the image at offset and
+ * guest memory, straight from one mapping to the other. Returns the status
+ * of the request and adds what went into guest memory to written.
+ */
+static uint8_t virtio_blk_transfer(struct virtio_blk * const restrict blk, int type, uint64_t offset,
+                                   const struct virtq_desc * chain, size_t count, uint32_t * written,
+                                   struct virtio_blk_range * const restrict range)
+{
+  uint64_t limit = blk->capacity << VIRTIO_BLK_SECTOR_SHIFT;
+  uint8_t * p;
+  size_t i;
+
+  if (type == VIRTIO_BLK_T_OUT && (blk->flags & VIRTIO_BLK_READONLY))
+    return VIRTIO_BLK_S_IOERR;
+
+  for (i = 0; i < count; i++)
+  {
+    p = dram_ptr(blk->dram, chain[i].addr, chain[i].len);
+    if (p == NULL || offset > limit || chain[i].len > limit - offset)
+      return VIRTIO_BLK_S_IOERR;
+
+    if (type == VIRTIO_BLK_T_IN)
+    {
+      if ((chain[i].flags & VIRTQ_DESC_F_WRITE) == 0)
+        return VIRTIO_BLK_S_IOERR;
+
+      memcpy(p, blk->image + offset, chain[i].len);
+      dram_mark_dma(blk->dram, chain[i].addr, chain[i].len);
+      *written += chain[i].len;
+    }
+    else
+    {
+      if (chain[i].flags & VIRTQ_DESC_F_WRITE)
+        return VIRTIO_BLK_S_IOERR;
+
+      memcpy(blk->image + offset, p, chain[i].len);
+      range->start = (offset < range->start) ? offset : range->start;
+      range->end = (offset + chain[i].len > range->end) ? offset + chain[i].len : range->end;
+    }
+
+    offset += chain[i].len;
+  }
+
+  return VIRTIO_BLK_S_OK;
+}
+
+/*
+ * Serve the request of the descriptor chain at head. Returns 0 and the bytes
+ * written into its buffers in len, or 1 if the request was handed to the
+ * flusher and completes later.
+ */
+static int virtio_blk_request(struct virtio_blk * const restrict blk, const uint8_t * table, uint16_t head,
+                              uint32_t * len, struct virtio_blk_range * const restrict range)
+{
+  struct virtio_blk_state * const state = &blk->state;
+  struct virtq_desc chain[VIRTIO_BLK_QUEUE_SIZE];
+  const uint8_t * desc, * header;
+  uint8_t * status;
+  uint8_t id[VIRTIO_BLK_ID_SIZE];
+  uint64_t sector;
+  uint32_t type;
+  uint16_t index = head;
+  size_t count = 0;
+
+  *len = 0;
+
+  // a chain longer than the queue loops, it and an indirect one are completed untouched
+  for (;;)
+  {
+    if (index >= state->queue_num || count == state->queue_num)
+      return 0;
+
+    desc = table + 16 * index;
+    chain[count].addr = virtio_load64(desc);
+    chain[count].len = virtio_load32(desc + 8);
+    chain[count].flags = virtio_load16(desc + 12);
+
+    if (chain[count].flags & VIRTQ_DESC_F_INDIRECT)
+      return 0;
+
+    count++;
+    if ((chain[count - 1].flags & VIRTQ_DESC_F_NEXT) == 0)
+      break;
+
+    index = virtio_load16(desc + 14);
+  }
+
+  // a header to read, the data buffers and a status byte to write
+  header = dram_ptr(blk->dram, chain[0].addr, 16);
+  status = dram_ptr(blk->dram, chain[count - 1].addr + chain[count - 1].len - 1, 1);
+  if (count < 2 || header == NULL || chain[0].len < 16 || (chain[0].flags & VIRTQ_DESC_F_WRITE)
+      || status == NULL || chain[count - 1].len == 0 || (chain[count - 1].flags & VIRTQ_DESC_F_WRITE) == 0)
+    return 0;
+
+  type = virtio_load32(header);
+  sector = virtio_load64(header + 8);
+
+  switch (type)
+  {
+    case VIRTIO_BLK_T_IN:
+    case VIRTIO_BLK_T_OUT:
+      *status = (sector > blk->capacity) ? VIRTIO_BLK_S_IOERR
+        : virtio_blk_transfer(blk, type, sector << VIRTIO_BLK_SECTOR_SHIFT, &chain[1], count - 2, len, range);
+      break;
+
+    case VIRTIO_BLK_T_FLUSH:
+      if (blk->flags & VIRTIO_BLK_WRITEBACK)
+      {
+        state->flushes[state->nflushes].head = head;
+        state->flushes[state->nflushes].status = chain[count - 1].addr + chain[count - 1].len - 1;
+        state->nflushes++;
+        pthread_cond_signal(&blk->flush);
+        return 1;
+      }
+
+      // the passes sync what they write, there is nothing left to flush
+      *status = VIRTIO_BLK_S_OK;
+      break;
+
+    case VIRTIO_BLK_T_GET_ID:
+      memset(id, 0x0, sizeof(id));
+      memcpy(id, VIRTIO_BLK_ID, sizeof(VIRTIO_BLK_ID) - 1);
+
+      if (count < 3 || (chain[1].flags & VIRTQ_DESC_F_WRITE) == 0
+          || dram_ptr(blk->dram, chain[1].addr, chain[1].len) == NULL)
+      {
+        *status = VIRTIO_BLK_S_IOERR;
+        break;
+      }
+
+      *len = (chain[1].len < sizeof(id)) ? chain[1].len : sizeof(id);
+      memcpy(dram_ptr(blk->dram, chain[1].addr, *len), id, *len);
+      dram_mark_dma(blk->dram, chain[1].addr, *len);
+      *status = VIRTIO_BLK_S_OK;
+      break;
+
+    default:
+      *status = VIRTIO_BLK_S_UNSUPP;
+      break;
+  }
+
+  dram_mark_dma(blk->dram, chain[count - 1].addr + chain[count - 1].len - 1, 1);
+  *len += 1;
+
+  return 0;
+}
+
+/*
+ * Serve everything the driver made available since the last notification,
+ * in one pass. Written image pages are synced before any of the pass's
+ * requests are completed, unless the device is in writeback mode.
+ */
+static void virtio_blk_notify(struct virtio_blk * const restrict blk)
+{
+  struct virtio_blk_state * const state = &blk->state;
+  struct virtio_blk_range range = { UINT64_MAX, 0 };
+  uint8_t * desc, * avail, * used;
+  uint64_t start;
+  uint32_t len;
+  uint16_t idx, head;
+  int completed = 0;
+
+  if (virtio_blk_rings(blk, &desc, &avail, &used) != 0)
+    return;
+
+  idx = DRAM_LE16(__atomic_load_n((uint16_t *) (avail + 2), __ATOMIC_ACQUIRE));
+
+  for (; state->last_avail != idx; state->last_avail++)
+  {
+    head = virtio_load16(avail + 4 + 2 * (state->last_avail % state->queue_num));
+
+    // flushes share the queue with requests, it never holds more than it has entries
+    if (state->nflushes == VIRTIO_BLK_QUEUE_SIZE)
+      break;
+
+    if (virtio_blk_request(blk, desc, head, &len, &range) == 0)
+    {
+      virtio_blk_complete(blk, used, head, len);
+      completed = 1;
+    }
+  }
+
+  if (range.start < range.end && (blk->flags & VIRTIO_BLK_WRITEBACK) == 0)
+  {
+    start = range.start & ~((uint64_t) sysconf(_SC_PAGESIZE) - 1);
+    msync(blk->image + start, range.end - start, MS_SYNC);
+  }
+
+  if (completed)
+    virtio_blk_publish(blk, avail, used);
+}
+
+/*
+ * Completes the guest's flush requests in writeback mode. Each round syncs
+ * the image once for all the flushes queued so far, so a burst of them
+ * costs one fdatasync; flushes queued while it runs wait for the next.
+ */
+static void * virtio_blk_flusher(void * arg)
+{
+  struct virtio_blk * const blk = arg;
+  struct virtio_blk_state * const state = &blk->state;
+  uint8_t * desc, * avail, * used, * status;
+  uint64_t epoch;
+  size_t count, i;
+  uint8_t result;
+
+  pthread_mutex_lock(&blk->lock);
+
+  for (;;)
+  {
+    while (!blk->stop && state->nflushes == 0)
+      pthread_cond_wait(&blk->flush, &blk->lock);
+
+    if (blk->stop)
+      break;
+
+    count = state->nflushes;
+    epoch = blk->epoch;
+    pthread_mutex_unlock(&blk->lock);
+
+    result = (msync(blk->image, blk->image_size, MS_SYNC) == 0 && fdatasync(blk->fd) == 0)
+      ? VIRTIO_BLK_S_OK : VIRTIO_BLK_S_IOERR;
+
+    pthread_mutex_lock(&blk->lock);
+
+    // a reset or restore replaced the queue meanwhile
+    if (epoch != blk->epoch)
+      continue;
+
+    if (virtio_blk_rings(blk, &desc, &avail, &used) == 0)
+    {
+      for (i = 0; i < count; i++)
+      {
+        status = dram_ptr(blk->dram, state->flushes[i].status, 1);
+        *status = result;
+        dram_mark_dma(blk->dram, state->flushes[i].status, 1);
+        virtio_blk_complete(blk, used, state->flushes[i].head, 1);
+      }
+
+      virtio_blk_publish(blk, avail, used);
+    }
+
+    state->nflushes -= count;
+    memmove(&state->flushes[0], &state->flushes[count], state->nflushes * sizeof(struct virtio_blk_flush));
+  }
+
+  pthread_mutex_unlock(&blk->lock);
+
+  return NULL;
+}
+
+// back to the state before the driver found the device, lock held
+static void virtio_blk_reset(struct virtio_blk * const restrict blk)
+{
+  memset(&blk->state, 0x0, sizeof(struct virtio_blk_state));
+  blk->epoch++;
+  plic_set_irq(blk->plic, VIRTIO_BLK_IRQ, 0);
+}
+
+static int virtio_blk_load(void * opaque, uint64_t offset, uint64_t size, uint64_t * value)
+{
+  struct virtio_blk * const blk = opaque;
+  struct virtio_blk_state * const state = &blk->state;
+  uint64_t i;
+
+  // the configuration space is byte addressable, the registers are not
+  if (offset >= VIRTIO_MMIO_CONFIG)
+  {
+    // only the capacity, the optional fields are not offered
+    *value = 0;
+    for (i = 0; i < size && offset - VIRTIO_MMIO_CONFIG + i < 8; i++)
+      *value |= ((blk->capacity >> (8 * (offset - VIRTIO_MMIO_CONFIG + i))) & 0xff) << (8 * i);
+
+    return 0;
+  }
+
+  if (size != 4)
+    return -1;
+
+  pthread_mutex_lock(&blk->lock);
+
+  switch (offset)
+  {
+    case VIRTIO_MMIO_MAGIC:
+      *value = VIRTIO_MAGIC;
+      break;
+
+    case VIRTIO_MMIO_VERSION:
+      *value = 2;
+      break;
+
+    case VIRTIO_MMIO_DEVICE_ID:
+      *value = VIRTIO_ID_BLOCK;
+      break;
+
+    case VIRTIO_MMIO_VENDOR_ID:
+      *value = VIRTIO_VENDOR;
+      break;
+
+    case VIRTIO_MMIO_DEVICE_FEATURES:
+      *value = (state->device_features_sel < 2)
+        ? (uint32_t) (virtio_device_features(blk) >> (32 * state->device_features_sel)) : 0;
+      break;
+
+    case VIRTIO_MMIO_QUEUE_NUM_MAX:
+      *value = (state->queue_sel == 0) ? VIRTIO_BLK_QUEUE_SIZE : 0;
+      break;
+
+    case VIRTIO_MMIO_QUEUE_READY:
+      *value = (state->queue_sel == 0) ? state->queue_ready : 0;
+      break;
+
+    case VIRTIO_MMIO_INTERRUPT_STATUS:
+      *value = state->interrupt;
+      break;
+
+    case VIRTIO_MMIO_STATUS:
+      *value = state->status;
+      break;
+
+    default:
+      *value = 0;
+      break;
+  }
+
+  pthread_mutex_unlock(&blk->lock);
+
+  return 0;
+}
+
+// the low or high half of a 64-bit queue address
+static inline void virtio_set_half(uint64_t * reg, int high, uint64_t value)
+{
+  *reg = high ? (*reg & 0xffffffffUL) | (value << 32) : (*reg & ~0xffffffffUL) | (value & 0xffffffffUL);
+}
+
+static int virtio_blk_store(void * opaque, uint64_t offset, uint64_t size, uint64_t value)
+{
+  struct virtio_blk * const blk = opaque;
+  struct virtio_blk_state * const state = &blk->state;
+  int queue;
+
+  if (offset >= VIRTIO_MMIO_CONFIG)
+    return 0;
+
+  if (size != 4)
+    return -1;
+
+  pthread_mutex_lock(&blk->lock);
+
+  // the queue is only configured while it is not in use
+  queue = (state->queue_sel == 0 && !state->queue_ready);
+
+  switch (offset)
+  {
+    case VIRTIO_MMIO_DEVICE_FEATURES_SEL:
+      state->device_features_sel = value;
+      break;
+
+    case VIRTIO_MMIO_DRIVER_FEATURES:
+      if (state->driver_features_sel < 2)
+        virtio_set_half(&state->driver_features, state->driver_features_sel, value);
+      break;
+
+    case VIRTIO_MMIO_DRIVER_FEATURES_SEL:
+      state->driver_features_sel = value;
+      break;
+
+    case VIRTIO_MMIO_QUEUE_SEL:
+      state->queue_sel = value;
+      break;
+
+    case VIRTIO_MMIO_QUEUE_NUM:
+      if (queue && value != 0 && value <= VIRTIO_BLK_QUEUE_SIZE)
+        state->queue_num = value;
+      break;
+
+    case VIRTIO_MMIO_QUEUE_READY:
+      if (state->queue_sel == 0)
+        state->queue_ready = value & 0x1;
+      break;
+
+    case VIRTIO_MMIO_QUEUE_NOTIFY:
+      if (value == 0)
+        virtio_blk_notify(blk);
+      break;
+
+    case VIRTIO_MMIO_INTERRUPT_ACK:
+      state->interrupt &= ~value;
+      if (state->interrupt == 0)
+        plic_set_irq(blk->plic, VIRTIO_BLK_IRQ, 0);
+      break;
+
+    case VIRTIO_MMIO_STATUS:
+      if (value == 0)
+      {
+        virtio_blk_reset(blk);
+        break;
+      }
+
+      // features the device does not offer, or a legacy driver, are refused
+      if ((value & VIRTIO_STATUS_FEATURES_OK)
+          && ((state->driver_features & ~virtio_device_features(blk)) != 0
+              || (state->driver_features & VIRTIO_F_VERSION_1) == 0))
+        value &= ~VIRTIO_STATUS_FEATURES_OK;
+
+      state->status = value;
+      break;
+
+    case VIRTIO_MMIO_QUEUE_DESC_LOW:
+    case VIRTIO_MMIO_QUEUE_DESC_HIGH:
+      if (queue)
+        virtio_set_half(&state->queue_desc, offset == VIRTIO_MMIO_QUEUE_DESC_HIGH, value);
+      break;
+
+    case VIRTIO_MMIO_QUEUE_DRIVER_LOW:
+    case VIRTIO_MMIO_QUEUE_DRIVER_HIGH:
+      if (queue)
+        virtio_set_half(&state->queue_driver, offset == VIRTIO_MMIO_QUEUE_DRIVER_HIGH, value);
+      break;
+
+    case VIRTIO_MMIO_QUEUE_DEVICE_LOW:
+    case VIRTIO_MMIO_QUEUE_DEVICE_HIGH:
+      if (queue)
+        virtio_set_half(&state->queue_device, offset == VIRTIO_MMIO_QUEUE_DEVICE_HIGH, value);
+      break;
+
+    default:
+      break;
+  }
+
+  pthread_mutex_unlock(&blk->lock);
+
+  return 0;
+}
+
+static void virtio_blk_save(void * opaque, void * state)
+{
+  struct virtio_blk * const blk = opaque;
+
+  pthread_mutex_lock(&blk->lock);
+  memcpy(state, &blk->state, sizeof(struct virtio_blk_state));
+  pthread_mutex_unlock(&blk->lock);
+}
+
+// the flushes queued at the time of the snapshot are done again
+static void virtio_blk_restore(void * opaque, const void * state)
+{
+  struct virtio_blk * const blk = opaque;
+
+  pthread_mutex_lock(&blk->lock);
+  memcpy(&blk->state, state, sizeof(struct virtio_blk_state));
+  blk->epoch++;
+  if (blk->state.nflushes != 0)
+    pthread_cond_signal(&blk->flush);
+  pthread_mutex_unlock(&blk->lock);
+}
+
+/*
+ * Attach a block device on the image at path to the bus, its interrupt goes
+ * through the PLIC. The image is a whole number of sectors, a trailing
+ * partial one is not visible to the guest.
+ */
+int virtio_blk_init(struct virtio_blk * const restrict blk, struct bus * const restrict bus,
+                    struct plic * const restrict plic, const char * path, int flags)
+{
+  struct bus_device device;
+  struct stat st;
+  int readonly = flags & VIRTIO_BLK_READONLY;
+
+  if (blk == NULL || bus == NULL || plic == NULL || path == NULL)
+    return -1;
+
+  memset(blk, 0x0, sizeof(struct virtio_blk));
+  blk->dram = bus->dram;
+  blk->plic = plic;
+  blk->flags = flags;
+
+  blk->fd = open(path, readonly ? O_RDONLY : O_RDWR);
+  if (blk->fd < 0)
+    return -1;
+
+  if (fstat(blk->fd, &st) != 0 || st.st_size < (1 << VIRTIO_BLK_SECTOR_SHIFT))
+    goto fail_fd;
+
+  blk->image_size = st.st_size;
+  blk->capacity = blk->image_size >> VIRTIO_BLK_SECTOR_SHIFT;
+  blk->image = mmap(NULL, blk->image_size, PROT_READ | (readonly ? 0 : PROT_WRITE), MAP_SHARED, blk->fd, 0);
+  if (blk->image == MAP_FAILED)
+    goto fail_fd;
+
+  if (pthread_mutex_init(&blk->lock, NULL) != 0)
+    goto fail_map;
+
+  if (pthread_cond_init(&blk->flush, NULL) != 0)
+    goto fail_lock;
+
+  memset(&device, 0x0, sizeof(device));
+  device.name = "virtio-blk";
+  device.base = VIRTIO_BLK_BASE;
+  device.size = VIRTIO_BLK_SIZE;
+  device.opaque = blk;
+  device.load = virtio_blk_load;
+  device.store = virtio_blk_store;
+  device.state_size = sizeof(struct virtio_blk_state);
+  device.save = virtio_blk_save;
+  device.restore = virtio_blk_restore;
+
+  if (bus_register(bus, &device) != 0)
+    goto fail_cond;
+
+  if ((flags & VIRTIO_BLK_WRITEBACK) && pthread_create(&blk->flusher, NULL, virtio_blk_flusher, blk) != 0)
+    goto fail_cond;
+
+  return 0;
+
+fail_cond:
+  pthread_cond_destroy(&blk->flush);
+fail_lock:
+  pthread_mutex_destroy(&blk->lock);
+fail_map:
+  munmap(blk->image, blk->image_size);
+fail_fd:
+  close(blk->fd);
+
+  return -1;
+}
+
+// what the page cache holds of a writeback image still reaches the file, it is shared
+int virtio_blk_deinit(struct virtio_blk * const restrict blk)
+{
+  if (blk == NULL || blk->image == NULL)
+    return -1;
+
+  if (blk->flags & VIRTIO_BLK_WRITEBACK)
+  {
+    pthread_mutex_lock(&blk->lock);
+    blk->stop = 1;
+    pthread_cond_signal(&blk->flush);
+    pthread_mutex_unlock(&blk->lock);
+
+    pthread_join(blk->flusher, NULL);
+  }
+
+  pthread_cond_destroy(&blk->flush);
+  pthread_mutex_destroy(&blk->lock);
+  munmap(blk->image, blk->image_size);
+  close(blk->fd);
+  blk->image = NULL;
+
+  return 0;
+}
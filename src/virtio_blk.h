@@ -0,0 +1,86 @@
+/*
+  Copyright (c) 2024, Arka Mondal. All rights reserved.
+  Use of this source code is governed by a BSD-style license that
+  can be found in the LICENSE file.
+*/
+
+#ifndef _RISCVEMU_VIRTIO_BLK_H
+#define _RISCVEMU_VIRTIO_BLK_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "bus.h"
+#include "dram.h"
+#include "plic.h"
+
+// first virtio-mmio slot and its interrupt on QEMU's virt machine
+#define VIRTIO_BLK_BASE 0x10001000UL
+#define VIRTIO_BLK_SIZE 0x1000UL
+#define VIRTIO_BLK_IRQ 1
+
+#define VIRTIO_BLK_QUEUE_SIZE 256         // QueueNumMax of the one request queue
+#define VIRTIO_BLK_SECTOR_SHIFT 9
+
+// virtio_blk_init flags
+#define VIRTIO_BLK_READONLY 0x1
+#define VIRTIO_BLK_WRITEBACK 0x2          // writes complete in the page cache, flushes are asynchronous
+
+// a flush request waiting for the flusher thread
+struct virtio_blk_flush {
+  uint16_t head;                          // descriptor chain to complete
+  uint64_t status;                        // guest address of its status byte
+};
+
+// what a snapshot of the device holds, the image itself is not part of it
+struct virtio_blk_state {
+  uint32_t status;
+  uint32_t interrupt;                     // InterruptStatus
+  uint32_t device_features_sel;
+  uint32_t driver_features_sel;
+  uint64_t driver_features;
+  uint32_t queue_sel;
+  uint32_t queue_num;
+  uint32_t queue_ready;
+  uint64_t queue_desc;
+  uint64_t queue_driver;                  // the available ring
+  uint64_t queue_device;                  // the used ring
+  uint16_t last_avail;                    // next available entry to serve
+  uint16_t used_idx;
+  size_t nflushes;
+  struct virtio_blk_flush flushes[VIRTIO_BLK_QUEUE_SIZE];
+};
+
+/*
+ * A virtio-mmio (version 2) block device on a host disk image. The image is
+ * mapped shared, so a request is served with one memcpy per descriptor
+ * between the mapping and guest memory, no bounce buffer in between, and
+ * all the requests available at a notification are served in one pass that
+ * publishes the used ring and interrupts once.
+ *
+ * Writes go to the page cache. Without VIRTIO_BLK_WRITEBACK the pages a pass
+ * wrote are synced before it completes; with it they complete right away
+ * and a flusher thread does msync and fdatasync for the guest's flush
+ * requests, completing them when the data is on disk.
+ */
+struct virtio_blk {
+  struct dram * dram;
+  struct plic * plic;
+  int fd;
+  uint8_t * image;
+  uint64_t image_size;
+  uint64_t capacity;                      // in sectors
+  int flags;
+  pthread_mutex_t lock;
+  struct virtio_blk_state state;
+  pthread_t flusher;
+  pthread_cond_t flush;                   // signaled when a flush request is queued
+  uint64_t epoch;                         // bumped by a reset or restore, stale flushes are dropped
+  int stop;
+};
+
+int virtio_blk_init(struct virtio_blk * const restrict, struct bus * const restrict,
+                    struct plic * const restrict, const char *, int);
+int virtio_blk_deinit(struct virtio_blk * const restrict);
+
+#endif /* _RISCVEMU_VIRTIO_BLK_H */